@@ -11,7 +11,6 @@ Email: tutorcs@163.com
     submission will probably not compile.  */
 
 // TODO (lab devs only):
-//   - Missing functionality: get file size (fstat), set file size (ftruncate)
 //   - Consider making the "file descriptor" be a newtype, as best we can
 //     in C (struct { int n; }) so it can't be confused with OS fds.  Might
 //     be too annoying.
@@ -19,12 +18,18 @@ Email: tutorcs@163.com
 #ifndef SFS_API_H_
 #define SFS_API_H_ 1
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /** Maximum number of characters in a file name, _including_ a terminating NUL.
     Caution: This constant also appears in sfs-disk.h.  */
 #define SFS_FILE_NAME_SIZE_LIMIT 24
 
+/** Most "file descriptors" that can be open at once, if the disk image
+    is mounted with the largest limit allowed; see sfs_mount_options.  */
+#define SFS_OPEN_FILE_LIMIT_MAX 65536
+
 /** An opaque object used by sfs_list to keep track of its position
     within the directory and handle concurrent modifications.  See
     sfs_list for how this is used.  */
@@ -47,6 +52,89 @@ typedef void *sfs_list_cookie;
     Returns 0 on success, or a negative error code.  */
 int sfs_format(const char *diskName, size_t diskSize);
 
+/** Like sfs_format, but divide the disk image into blocks of
+    'blockSize' bytes instead of the default 512.  'blockSize' must be
+    a power of two between 512 and 65536, and 'diskSize' must also be
+    a multiple of it.  Larger blocks make long files faster to read and
+    write sequentially, but waste more space at the end of every file.
+    Images with blocks larger than 512 bytes cannot be mounted by older
+    versions of these routines.  */
+int sfs_format_with_block_size(const char *diskName, size_t diskSize,
+                               size_t blockSize);
+
+/** Settings for sfs_format_with_options.  A field left zero gets the
+    default.  */
+typedef struct sfs_format_options
+{
+    /** Bytes per block, as for sfs_format_with_block_size; default 512. */
+    size_t block_size;
+
+    /** Bytes of disk to set aside for a metadata journal; default 0,
+        meaning no journal.  It is rounded up to whole blocks, plus one
+        for the journal's header, and to some minimum size.
+
+        With a journal, every change to the file system's structure (as
+        opposed to the data in files) is logged before it is made, so
+        that if the program dies part way through an operation,
+        sfs_mount finishes or discards the operation, and no blocks are
+        lost.  Each call that changes the structure returns only once
+        its log entries are on stable storage; calls made from several
+        threads at once share a single flush.  If the log cannot be
+        flushed, such calls return -EIO, although the change has been
+        made in memory.  File data is not journaled.  Because the
+        operating system may write the disk image back at any time, a
+        crash of the whole system in the moment between a change being
+        made and its call returning can still leave that change partly
+        written.  */
+    size_t journal_size;
+
+    /** Nonzero to keep a summary of which parts of the disk image have
+        changed since it was last cleanly unmounted, so that
+        'sfs-fsck --incremental' can check only those; default 0.  The
+        first change to each part of the image after it is mounted
+        costs an extra flush to stable storage.  */
+    int change_summary;
+
+    /** As for sfs_mount_options, since the new image is mounted.  */
+    unsigned int max_open_files;
+
+    /** Nonzero to keep each file of at most 120 bytes in a cell of a
+        block shared with other small files, instead of a block of its
+        own; default 0.  A file that grows past that is moved into blocks
+        of its own, which costs copying what it already holds.  */
+    int packed_files;
+
+    /** Nonzero to leave the blocks that no file has used yet unwritten,
+        instead of putting every block on the free list, so that
+        formatting takes the same time whatever the size of the image,
+        and the image takes up room on the host's disk only as it
+        fills; default 0.  Blocks are set up the first time they are
+        allocated.  */
+    int sparse;
+
+    /** Nonzero to keep a CRC-32C checksum of the data in every block of
+        every file, in a table of its own that takes up about 1% of the
+        image with the default block size; default 0.  Each write
+        updates the checksums of the blocks it touches, and each read,
+        and sfs_borrow, checks those of the blocks it looks at, failing
+        with -EIO if the data has been damaged.  So that a write cannot
+        vouch for damaged data that it happens to share a block with,
+        a write that covers only part of a block checks the block
+        first, if what it leaves alone is part of the file.  Checking
+        costs about as much as copying the data, on processors with
+        instructions for it.  'sfs-fsck --scrub' checks every block.
+        Data in packed blocks is not covered.  */
+    int checksums;
+} sfs_format_options;
+
+/** Like sfs_format, but with the settings in OPTIONS, which may be
+    NULL for the defaults.  Returns -EINVAL if the settings are invalid
+    or the journal would leave no room for files.  Images with a
+    journal, a change summary, packed files, sparse formatting or
+    checksums cannot be mounted by older versions of these routines.  */
+int sfs_format_with_options(const char *diskName, size_t diskSize,
+                            const sfs_format_options *options);
+
 /** Load an existing SFS disk image and set it as the disk image being
     accessed by the other sfs-disk routines.  ("Mount" is the
     traditional name for this operation, see 'man 8 mount'.)  The
@@ -59,6 +147,29 @@ int sfs_format(const char *diskName, size_t diskSize);
     Return 0 on success, or a negative error code.  */
 int sfs_mount(const char *diskName);
 
+/** Settings for sfs_mount_with_options.  A field left zero gets the
+    default.  */
+typedef struct sfs_mount_options
+{
+    /** Most "file descriptors" that can be open at once; default 32,
+        and at most SFS_OPEN_FILE_LIMIT_MAX.  Opening a file past the
+        limit fails with -EMFILE.  The memory for all of them is set
+        aside when the image is mounted, so that opening a file does
+        not have to allocate any.  */
+    unsigned int max_open_files;
+
+    /** Nonzero to ask for the image to be mapped with transparent huge
+        pages, where the system and the file system holding the image
+        support them; default 0.  This cuts the number of page faults
+        and TLB misses on large images.  */
+    int huge_pages;
+} sfs_mount_options;
+
+/** Like sfs_mount, but with the settings in OPTIONS, which may be NULL
+    for the defaults.  Returns -EINVAL if the settings are invalid.  */
+int sfs_mount_with_options(const char *diskName,
+                           const sfs_mount_options *options);
+
 /** Deactivate the currently active disk image.  After you do this,
     you must call sfs_format or sfs_mount before you can use the rest
     of the sfs-disk routines again.
@@ -88,6 +199,42 @@ int sfs_unmount(void);
     sfs-disk routines, not with real system calls.)  */
 int sfs_open(const char *fileName);
 
+/** Flag for sfs_open_with_flags: every write through the descriptor
+    goes at the end of the file, wherever its file position was, as
+    with O_APPEND, and leaves the position at the new end.  Writers
+    on other descriptors for the file are taken into account.  Reads
+    and sfs_pwrite are not affected.  */
+#define SFS_OPEN_APPEND 0x1
+
+/** Flag for sfs_open_with_flags: keep the file compressed on the disk
+    from now on, to save space on files that are seldom changed.  The
+    file is compressed when its last descriptor is closed, if that
+    saves at least a block, and is read in frames of 4096 bytes, each
+    one decoded as it is needed; the last few frames read are kept in
+    memory.  The first write, sfs_ftruncate, sfs_fallocate or
+    sfs_borrow after that decodes the whole file back into ordinary
+    blocks, and so can fail with -ENOSPC or -EIO, as for a clone (see
+    sfs_clone); the file is compressed again at its last close.  A
+    file that is compressed already stays that way, whatever flags it
+    is opened with.  The first file compressed on a disk image changes
+    its version number, so that programs that do not know about
+    compressed files no longer accept it.  */
+#define SFS_OPEN_COMPRESS 0x2
+
+/** Like sfs_open, but with FLAGS, which may be 0 or any of the
+    SFS_OPEN_ flags above, or'ed together.  Returns -EINVAL if FLAGS
+    has any other bits set.  */
+int sfs_open_with_flags(const char *fileName, int flags);
+
+/** Open another "file descriptor" on the file that "file descriptor"
+    FD is open on, with its own file position, starting at the
+    beginning of the file.  This has the same effect as calling
+    sfs_open again with the file's name, but does not need to look the
+    name up.
+
+    Returns the new "file descriptor", or a negative error code.  */
+int sfs_reopen(int fd);
+
 /** Close a "file descriptor" returned by openFile.
     This function cannot fail.  If you call it with an argument that
     isn't a valid "file descriptor", it just doesn't do anything.  */
@@ -105,7 +252,11 @@ void sfs_close(int fd);
 
     If the starting file position for FD is at the end of the file,
     this is not considered an error, but nothing is written to BUF
-    and the return value is zero.  */
+    and the return value is zero.
+
+    On an image with checksums (see sfs_format_options), returns -EIO,
+    without advancing the file position, if any of the data to be read
+    does not match its checksum; some of BUF may have been written.  */
 ssize_t sfs_read(int fd, char *buf, size_t len);
 
 /** Write up to LEN bytes of data from the buffer BUF into the file
@@ -117,9 +268,220 @@ ssize_t sfs_read(int fd, char *buf, size_t len);
     writing _some_ but not _all_ of the bytes.
 
     Return the number of bytes that were actually written, or a
-    negative error code.  */
+    negative error code.  On an image with checksums, that includes
+    -EIO, with nothing written, if the write covers only part of a
+    block whose data does not match its checksum.  */
 ssize_t sfs_write(int fd, const char *buf, size_t len);
 
+/** Like sfs_read, but read from file position POS, and neither use nor
+    change the file position of FD.  Several threads can call this on
+    the same "file descriptor" at once.  If POS is at or past the end
+    of the file, the return value is zero.  */
+ssize_t sfs_pread(int fd, char *buf, size_t len, size_t pos);
+
+/** Like sfs_write, but write at file position POS, and neither use nor
+    change the file position of FD.  If POS is past the end of the
+    file, the file is first extended with zero bytes up to POS.  */
+ssize_t sfs_pwrite(int fd, const char *buf, size_t len, size_t pos);
+
+/** Like sfs_read, but scatter the data into the IOVCNT buffers
+    described by IOV, filling each one before moving on to the next.
+    The whole request is a single operation: the data comes from one
+    contiguous stretch of the file, and the file position advances
+    past all of it.  Returns -EINVAL if IOVCNT is negative or the
+    buffers add up to more than SSIZE_MAX bytes.  */
+ssize_t sfs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Like sfs_write, but gather the data from the IOVCNT buffers
+    described by IOV, in order, as for sfs_readv.  */
+ssize_t sfs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/** What sfs_fstat reports about an open file.  */
+typedef struct sfs_file_stat
+{
+    /** Size of the file, in bytes.  */
+    size_t size;
+    /** Blocks holding the file's data, which for a compressed file
+        (see SFS_OPEN_COMPRESS) is the blocks of compressed data, or 0
+        if it is in a cell of a packed block.  */
+    uint32_t blocks;
+    /** Blocks set aside for the file by sfs_fallocate.  */
+    uint32_t reserved_blocks;
+} sfs_file_stat;
+
+/** Fill in *STAT for the file open on "file descriptor" FD.  Returns
+    0, or -EBADF if FD is not open.  */
+int sfs_fstat(int fd, sfs_file_stat *stat);
+
+/** Make the file open on "file descriptor" FD exactly LEN bytes long.
+    If it is longer, the data past LEN is discarded, and any descriptor
+    whose file position is past LEN is moved back to LEN; if it is
+    shorter, it is extended with zero bytes.  Blocks set aside by
+    sfs_fallocate are kept.  Returns 0 or a negative error code, such
+    as:
+
+    -EBADF     FD is not open.
+    -EBUSY     Data borrowed from the file by sfs_borrow has not been
+               released.
+    -EFBIG     LEN is larger than a file can be.
+    -EIO       The file shared its blocks with a clone (see sfs_clone),
+               and its copy could not be written to stable storage,
+               or it was compressed (see SFS_OPEN_COMPRESS), and could
+               not be decoded.
+    -ENOSPC    There is not enough room on the disk to extend the file,
+               or to copy it, if it shared its blocks with a clone, or
+               to decode it, if it was compressed.  */
+int sfs_ftruncate(int fd, size_t len);
+
+/** Set aside enough blocks for the file open on "file descriptor" FD
+    to grow to LEN bytes, without changing its size, so that writing up
+    to there needs no blocks to be allocated, and cannot run out of
+    space.  The blocks go right after the end of the file if there is
+    room, so that it stays in one piece.  Nothing is set aside if the
+    file already has that much room.  The blocks are only set aside
+    while the file is open: when its last descriptor is closed,
+    whatever has not been written to yet is freed again.  Returns 0, or
+    the same error codes as sfs_ftruncate.  */
+int sfs_fallocate(int fd, size_t len);
+
+/** A stretch of file data inside the disk image itself, as handed out
+    by sfs_borrow.  */
+typedef struct sfs_span
+{
+    const char *data;
+    size_t len;
+} sfs_span;
+
+/** Look at up to LEN bytes of the file open on "file descriptor" FD,
+    starting at file position POS, without copying them.  SPANS is
+    filled in with up to MAX_SPANS pointers into the disk image, and
+    lengths, which together cover the data in order; each span is at
+    most one disk block's worth of data.  The file position of FD is
+    neither used nor changed.
+
+    Returns the number of spans filled in, which is zero if POS is at
+    or past the end of the file, or LEN or MAX_SPANS is zero.  If
+    there were more spans than MAX_SPANS, call again with POS advanced
+    past the ones you got.  Returns a negative error code on failure,
+    including -EIO if the image has checksums and the data in any of
+    the spans does not match.  A compressed file (see SFS_OPEN_COMPRESS)
+    is decoded back into ordinary blocks first, which can fail as
+    sfs_ftruncate can.
+
+    Whenever the return value is positive, you must call sfs_release
+    on FD once you are done with the spans.  Until then, the data they
+    point to will not change: any attempt to write to the file, through
+    any "file descriptor", fails with -EBUSY.  Closing FD releases
+    everything borrowed through it, and makes the spans invalid.  */
+int sfs_borrow(int fd, size_t pos, size_t len, sfs_span *spans,
+               int max_spans);
+
+/** Release the spans handed out by one earlier call to sfs_borrow on
+    "file descriptor" FD.  Returns 0, -EBADF if FD is not open, or
+    -EINVAL if nothing borrowed through FD remains to be released.  */
+int sfs_release(int fd);
+
+/** Make sure that everything written to the file open on "file
+    descriptor" FD has reached stable storage, as sfs_unmount would,
+    but without flushing the rest of the disk image.  Data written
+    through descriptors that have all since been closed is only
+    covered by sfs_sync or sfs_unmount.  Several threads can call this
+    at once, and the file can be read, but not written, meanwhile.
+
+    Returns 0 on success, -EBADF if FD is not open, or -EIO if the data
+    could not be written to stable storage.  */
+int sfs_fsync(int fd);
+
+/** Make sure that the whole of the active disk image has reached
+    stable storage, as sfs_unmount would, but leave it active.
+
+    Returns 0 on success, -ENOMEDIUM if there is no active disk image,
+    or -EIO if it could not be written to stable storage.  */
+int sfs_sync(void);
+
+/** Counts of the work done by the functions in this file, since the
+    program started, for performance work.  Each thread keeps its own
+    counts, which are only added up when they are asked for.  */
+typedef struct sfs_stats
+{
+    /** Steps taken from one block of a file to the next.  */
+    uint64_t chain_hops;
+    /** Bytes of file data copied out by reads, and in by writes
+        (including zeros filling a gap before the data written).  */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    /** Requests for new blocks, how many blocks they got between them,
+        and how many of them failed for lack of space.  */
+    uint64_t allocations;
+    uint64_t blocks_allocated;
+    uint64_t allocation_failures;
+    /** Blocks put back on the free list.  */
+    uint64_t blocks_freed;
+    /** Times a file name was looked up, and the number of name index
+        entries examined while doing so.  */
+    uint64_t lookups;
+    uint64_t lookup_probes;
+    /** Blocks that reads and writes through descriptors used
+        sequentially asked to have read in ahead of time.  */
+    uint64_t readahead_blocks;
+    /** Blocks whose data was found not to match its checksum.  */
+    uint64_t checksum_failures;
+    /** Frames of compressed files (see SFS_OPEN_COMPRESS) decoded, and
+        reads of a frame that found it already decoded in memory.  */
+    uint64_t frames_decoded;
+    uint64_t frame_cache_hits;
+    /** Number of "file descriptors" open now, and the most there can
+        be, or 0 and 0 if no disk image is active.  */
+    unsigned int open_fds;
+    unsigned int fd_limit;
+} sfs_stats;
+
+/** Fill in *STATS.  Returns 0, or -ENOSYS, with *STATS all zero, if
+    sfs-disk.c was built with SFS_NO_STATS defined, which takes the
+    counting out altogether.  */
+int sfs_get_stats(sfs_stats *stats);
+
+/** How scattered the files on the active disk image are.  Files kept
+    in packed blocks (see sfs_format_options) are all in one piece, and
+    are not counted.  */
+typedef struct sfs_frag_stats
+{
+    /** Files with blocks of their own, and how many blocks they have.  */
+    uint32_t files;
+    uint32_t file_blocks;
+    /** Places where the next block of a file is not the block right
+        after the one before, each of which a sequential read has to
+        jump across, and the number of files that have any.  */
+    uint32_t breaks;
+    uint32_t fragmented_files;
+    /** Free blocks, and the number of runs of consecutive blocks that
+        they are in.  */
+    uint32_t free_blocks;
+    uint32_t free_runs;
+} sfs_frag_stats;
+
+/** Fill in *STATS.  Returns 0, or -ENOMEDIUM if there is no active
+    disk image.  */
+int sfs_get_frag_stats(sfs_frag_stats *stats);
+
+/** Defragment and compact the active disk image.  Each file whose
+    blocks are out of order is copied into the lowest-numbered run of
+    free blocks that can hold all of them, and so is each file that is
+    in order, if there is such a run nearer the start of the disk; the
+    old blocks are then freed.  This can be done while files are open,
+    and even while other threads use them; each file is moved while
+    everything else waits.  Files that have data borrowed through
+    sfs_borrow, and files that share their blocks with clones (see
+    sfs_clone), are left where they are.  Compressed files (see
+    SFS_OPEN_COMPRESS) are moved as they are, still compressed.
+
+    If BEFORE or AFTER is not NULL, it is filled in as by
+    sfs_get_frag_stats before or after the work is done.  Returns the
+    number of files moved, -ENOMEDIUM if there is no active disk
+    image, or -EIO if the data could not be written to stable
+    storage.  */
+int sfs_defrag(sfs_frag_stats *before, sfs_frag_stats *after);
+
 /** Return the current file position of "file descriptor" FD.  If FD
     is not a valid "file descriptor", return -EBADF; this is the
     only reason this function might fail.  */
@@ -155,6 +517,29 @@ int sfs_remove(const char *name);
     Returns 0 on success, or a negative error code. */
 int sfs_rename(const char *old_name, const char *new_name);
 
+/** Make a new file named DST_NAME with the same contents as the file
+    named SRC_NAME, which may be open.  No data is copied: the two
+    files share the same blocks on disk until one of them is changed,
+    and the first write, sfs_ftruncate or sfs_fallocate to either one
+    copies it into blocks of its own first.  So a clone costs only a
+    directory entry, but the writes that follow it can fail with -EIO
+    or -ENOSPC, as sfs_ftruncate can, even if they would not make the
+    file any larger.  Files small enough to be kept in packed blocks
+    (see sfs_format_options) are copied straight away.  The first
+    clone on a disk image changes its version number, so that programs
+    that do not know about shared blocks no longer accept it.
+
+    Returns 0 on success, or a negative error code, such as:
+
+    -ENOENT          There is no file named SRC_NAME.
+    -EEXIST          There is already a file named DST_NAME.
+    -ENAMETOOLONG    Either name is too long for SFS.
+    -ENOSPC          There is no room on the disk for another directory
+                     entry, or for the copy of a packed file.
+    -EIO             The disk image could not be marked as having
+                     shared blocks.  */
+int sfs_clone(const char *src_name, const char *dst_name);
+
 /** List the contents of the file system, one name at a time.
     You have to call this function in a loop, like this:
 
@@ -175,10 +560,11 @@ int sfs_rename(const char *old_name, const char *new_name);
     sfs_list eventually returns a nonzero 'status', it will also set
     'cookie' to NULL again.
 
-    Once you start looping over file names, you must keep going until
-    sfs_list returns a nonzero 'status'.  Failure to do this may cause
-    deadlocks.  Deadlocks can also happen if you try to create,
-    delete, or rename files from inside the loop.
+    It is safe to stop looping before sfs_list returns a nonzero
+    'status', and to create, delete, or rename files, from this thread
+    or any other, while the loop is running.  Each call sees a
+    consistent directory, but a file that is created, deleted, or
+    renamed during the loop may or may not be reported.
 
     The return value is zero if and only if a file name was written to
     'filename_out'.  When the loop should stop -- when all the file
@@ -0,0 +1,683 @@
+/** Microbenchmarks for the Shark File System.
+
+    This program calls the functions in sfs-api.h directly, without
+    going through Lua, and measures how fast the common operations are.
+    Each workload is run, for a fixed length of time, on a freshly
+    formatted disk image, once for every combination of image size,
+    number of threads, and I/O size asked for on the command line, and
+    the results are written to standard output as CSV, one row per run.
+
+    The workloads are:
+
+      seq-write    each thread writes its own file from start to end,
+                   over and over
+      seq-read     each thread reads its own file from start to end,
+                   over and over
+      rand-write   each thread writes at random positions in its file
+      rand-read    each thread reads at random positions in its file
+      churn        each thread creates a file, writes one I/O's worth
+                   of data to it, closes it, and removes it
+      list         each thread lists a directory holding --files files
+      aged-read    like seq-read, but the files were built up a little
+                   at a time, interleaved with creating and removing
+                   lots of small files, so that their blocks are
+                   scattered across the disk
+
+    Setting up a workload's files is not timed.  Each thread has a file
+    of its own, of about half the image divided by the number of
+    threads, in the workloads that need one.  */
+
+#include "sfs-api.h"
+
+#include <argp.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** The most values any list option can have.  */
+#define MAX_SWEEP 16
+
+/** The most threads a run can use.  */
+#define MAX_THREADS 64
+
+/** Command line settings.  Each of the lists is swept over.  */
+static const char *disk = "sfs-bench.img";
+static size_t image_sizes[MAX_SWEEP] = {16 << 20};
+static size_t n_image_sizes = 1;
+static size_t thread_counts[MAX_SWEEP] = {1};
+static size_t n_thread_counts = 1;
+static size_t io_sizes[MAX_SWEEP] = {512, 4096, 65536};
+static size_t n_io_sizes = 3;
+static sfs_format_options format_options = {512, 0, 0, 0, 0, 0, 0};
+static double seconds = 1.0;
+static unsigned int list_files = 1000;
+static const char *workload_names = NULL;
+static int keep_image = 0;
+
+/** A run of one workload: the parameters it was given, and what the
+    threads measured.  */
+typedef struct bench_run bench_run;
+
+/** One thread of a run.  */
+typedef struct bench_thread
+{
+    bench_run *run;
+    unsigned int index;
+    pthread_t thread;
+    int fd;
+    size_t file_size;
+    uint64_t random;
+    char *buf;
+    uint64_t ops;
+    uint64_t bytes;
+    int error;
+} bench_thread;
+
+struct bench_run
+{
+    const struct workload *workload;
+    size_t image_size;
+    size_t io_size;
+    size_t n_threads;
+    uint64_t deadline_ns;
+    pthread_barrier_t start;
+    bench_thread threads[MAX_THREADS];
+};
+
+/** A workload.  'setup' is called once per thread, before the clock
+    starts, and 'step' is called over and over until it stops; each
+    call is one operation.  Both return 0 or a negative error code.
+    'uses_io_size' is false for workloads that take no notice of the
+    I/O size, which are run only once per image size and thread
+    count.  */
+typedef struct workload
+{
+    const char *name;
+    int (*setup)(bench_thread *t);
+    int (*step)(bench_thread *t);
+    int uses_io_size;
+} workload;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/** Return the next number from thread T's pseudo-random sequence
+    (xorshift64*).  Each thread has its own so that they do not
+    contend.  */
+static uint64_t next_random(bench_thread *t)
+{
+    t->random ^= t->random >> 12;
+    t->random ^= t->random << 25;
+    t->random ^= t->random >> 27;
+    return t->random * 2685821657736338717u;
+}
+
+/** Open thread T's own file, creating it if necessary.  */
+static int open_own_file(bench_thread *t)
+{
+    char name[SFS_FILE_NAME_SIZE_LIMIT];
+    snprintf(name, sizeof name, "bench%u", t->index);
+    t->fd = sfs_open(name);
+    if (t->fd < 0)
+        return t->fd;
+    t->file_size = t->run->image_size / 2 / t->run->n_threads;
+    t->file_size -= t->file_size % t->run->io_size;
+    return t->file_size ? 0 : -ENOSPC;
+}
+
+/** Write to the file open on T->fd until it is T->file_size bytes
+    long.  */
+static int fill_own_file(bench_thread *t)
+{
+    for (size_t done = 0; done < t->file_size; done += t->run->io_size)
+    {
+        ssize_t n = sfs_write(t->fd, t->buf, t->run->io_size);
+        if (n < 0)
+            return (int)n;
+    }
+    return 0;
+}
+
+/** Move T->fd back to the start of the file if it has reached the
+    end.  */
+static int rewind_at_end(bench_thread *t)
+{
+    ssize_t pos = sfs_getpos(t->fd);
+    if (pos < 0)
+        return (int)pos;
+    if ((size_t)pos + t->run->io_size > t->file_size)
+    {
+        ssize_t r = sfs_seek(t->fd, -pos);
+        if (r < 0)
+            return (int)r;
+    }
+    return 0;
+}
+
+/** A random I/O-size-aligned position in T's file.  */
+static size_t random_pos(bench_thread *t)
+{
+    size_t slots = t->file_size / t->run->io_size;
+    return (size_t)(next_random(t) % slots) * t->run->io_size;
+}
+
+static int setup_seq_write(bench_thread *t)
+{
+    return open_own_file(t);
+}
+
+static int setup_own_file(bench_thread *t)
+{
+    int status = open_own_file(t);
+    if (status == 0)
+        status = fill_own_file(t);
+    return status;
+}
+
+static int step_seq_write(bench_thread *t)
+{
+    int status = rewind_at_end(t);
+    if (status < 0)
+        return status;
+    ssize_t n = sfs_write(t->fd, t->buf, t->run->io_size);
+    if (n < 0)
+        return (int)n;
+    t->bytes += (uint64_t)n;
+    return 0;
+}
+
+static int step_seq_read(bench_thread *t)
+{
+    int status = rewind_at_end(t);
+    if (status < 0)
+        return status;
+    ssize_t n = sfs_read(t->fd, t->buf, t->run->io_size);
+    if (n < 0)
+        return (int)n;
+    t->bytes += (uint64_t)n;
+    return 0;
+}
+
+static int step_rand_write(bench_thread *t)
+{
+    ssize_t n = sfs_pwrite(t->fd, t->buf, t->run->io_size, random_pos(t));
+    if (n < 0)
+        return (int)n;
+    t->bytes += (uint64_t)n;
+    return 0;
+}
+
+static int step_rand_read(bench_thread *t)
+{
+    ssize_t n = sfs_pread(t->fd, t->buf, t->run->io_size, random_pos(t));
+    if (n < 0)
+        return (int)n;
+    t->bytes += (uint64_t)n;
+    return 0;
+}
+
+static int setup_nothing(bench_thread *t)
+{
+    return 0;
+}
+
+static int step_churn(bench_thread *t)
+{
+    char name[SFS_FILE_NAME_SIZE_LIMIT];
+    snprintf(name, sizeof name, "churn%u.%" PRIu64, t->index, t->ops % 1000);
+    int fd = sfs_open(name);
+    if (fd < 0)
+        return fd;
+    ssize_t n = sfs_write(fd, t->buf, t->run->io_size);
+    sfs_close(fd);
+    if (n < 0)
+        return (int)n;
+    t->bytes += (uint64_t)n;
+    return sfs_remove(name);
+}
+
+/** The first thread creates the files that every thread lists; the
+    others wait for it at the start barrier.  */
+static int setup_list(bench_thread *t)
+{
+    if (t->index != 0)
+        return 0;
+    for (unsigned int i = 0; i < list_files; i++)
+    {
+        char name[SFS_FILE_NAME_SIZE_LIMIT];
+        snprintf(name, sizeof name, "list%u", i);
+        int fd = sfs_open(name);
+        if (fd < 0)
+            return fd;
+        sfs_close(fd);
+    }
+    return 0;
+}
+
+static int step_list(bench_thread *t)
+{
+    sfs_list_cookie cookie = NULL;
+    char name[SFS_FILE_NAME_SIZE_LIMIT];
+    int status;
+    while ((status = sfs_list(&cookie, name, sizeof name)) == 0)
+        ;
+    return status < 0 ? status : 0;
+}
+
+/** Build T's file up one I/O at a time, and after each I/O create or
+    remove a few small files of up to two blocks, so that the file's
+    blocks end up interleaved with those of the small files and of the
+    other threads' files.  */
+static int setup_aged(bench_thread *t)
+{
+    int status = open_own_file(t);
+    if (status < 0)
+        return status;
+
+    enum { SMALL_FILES = 64 };
+    unsigned char live[SMALL_FILES] = {0};
+    for (size_t done = 0; done < t->file_size; done += t->run->io_size)
+    {
+        ssize_t n = sfs_write(t->fd, t->buf, t->run->io_size);
+        if (n < 0)
+            return (int)n;
+        for (int i = 0; i < 4; i++)
+        {
+            unsigned int which = (unsigned int)(next_random(t) % SMALL_FILES);
+            char name[SFS_FILE_NAME_SIZE_LIMIT];
+            snprintf(name, sizeof name, "age%u.%u", t->index, which);
+            if (live[which])
+            {
+                status = sfs_remove(name);
+                if (status < 0)
+                    return status;
+                live[which] = 0;
+                continue;
+            }
+            int fd = sfs_open(name);
+            if (fd < 0)
+                return fd;
+            size_t len = 1 + next_random(t) % (2 * format_options.block_size);
+            n = sfs_write(fd, t->buf, len < t->run->io_size ? len : 1);
+            sfs_close(fd);
+            // Running out of space is not a failure here; the small
+            // files just stay smaller.
+            if (n < 0 && n != -ENOSPC)
+                return (int)n;
+            live[which] = 1;
+        }
+    }
+    ssize_t pos = sfs_seek(t->fd, -(ssize_t)t->file_size);
+    return pos < 0 ? (int)pos : 0;
+}
+
+static const workload workloads[] = {
+    {"seq-write", setup_seq_write, step_seq_write, 1},
+    {"seq-read", setup_own_file, step_seq_read, 1},
+    {"rand-write", setup_own_file, step_rand_write, 1},
+    {"rand-read", setup_own_file, step_rand_read, 1},
+    {"churn", setup_nothing, step_churn, 1},
+    {"list", setup_list, step_list, 0},
+    {"aged-read", setup_aged, step_seq_read, 1},
+    {NULL, NULL, NULL, 0},
+};
+
+static void *bench_threadproc(void *arg)
+{
+    bench_thread *t = arg;
+    bench_run *run = t->run;
+
+    t->error = run->workload->setup(t);
+    pthread_barrier_wait(&run->start);
+    if (t->error)
+        return NULL;
+
+    // The deadline is set by the main thread between the two barriers.
+    pthread_barrier_wait(&run->start);
+    while (monotonic_ns() < run->deadline_ns)
+    {
+        t->error = run->workload->step(t);
+        if (t->error)
+            return NULL;
+        t->ops++;
+    }
+    return NULL;
+}
+
+/** Run workload W with the given parameters on a freshly formatted
+    image, and print the result.  Returns 0, or 1 if anything failed,
+    having said what.  */
+static int run_workload(const workload *w, size_t image_size,
+                        size_t n_threads, size_t io_size)
+{
+    static bench_run run;
+    memset(&run, 0, sizeof run);
+    run.workload = w;
+    run.image_size = image_size;
+    run.io_size = io_size;
+    run.n_threads = n_threads;
+
+    // Formatting also mounts the image.
+    int status = sfs_format_with_options(disk, image_size, &format_options);
+    if (status < 0)
+    {
+        fprintf(stderr, "sfs-bench: %s: %s\n", disk, strerror(-status));
+        return 1;
+    }
+
+    // Waits for the threads to set up, and then for the deadline.
+    pthread_barrier_init(&run.start, NULL, (unsigned int)n_threads + 1);
+    size_t started = 0;
+    for (; started < n_threads; started++)
+    {
+        bench_thread *t = &run.threads[started];
+        t->run = &run;
+        t->index = (unsigned int)started;
+        t->fd = -1;
+        t->random = 0x9E3779B97F4A7C15u * (started + 1);
+        t->buf = malloc(io_size);
+        if (t->buf == NULL)
+            break;
+        memset(t->buf, 'a' + (int)(started % 26), io_size);
+        if (pthread_create(&t->thread, NULL, bench_threadproc, t))
+        {
+            free(t->buf);
+            break;
+        }
+    }
+    if (started < n_threads)
+    {
+        // The barrier cannot be released without every thread, so
+        // there is no clean way to carry on.
+        perror("sfs-bench: starting threads");
+        exit(1);
+    }
+
+    pthread_barrier_wait(&run.start);
+    uint64_t start_ns = monotonic_ns();
+    run.deadline_ns = start_ns + (uint64_t)(seconds * 1e9);
+    pthread_barrier_wait(&run.start);
+    for (size_t i = 0; i < n_threads; i++)
+        pthread_join(run.threads[i].thread, NULL);
+    double elapsed = (double)(monotonic_ns() - start_ns) / 1e9;
+    pthread_barrier_destroy(&run.start);
+
+    uint64_t ops = 0, bytes = 0;
+    int failed = 0;
+    for (size_t i = 0; i < n_threads; i++)
+    {
+        bench_thread *t = &run.threads[i];
+        if (t->error && !failed)
+        {
+            fprintf(stderr, "sfs-bench: %s, thread %zu: %s\n", w->name, i,
+                    strerror(-t->error));
+            failed = 1;
+        }
+        ops += t->ops;
+        bytes += t->bytes;
+        if (t->fd >= 0)
+            sfs_close(t->fd);
+        free(t->buf);
+    }
+    status = sfs_unmount();
+    if (status < 0)
+    {
+        fprintf(stderr, "sfs-bench: %s: %s\n", disk, strerror(-status));
+        failed = 1;
+    }
+    if (failed)
+        return 1;
+
+    printf("%s,%zu,%zu,%zu,%zu,%" PRIu64 ",%" PRIu64 ",%.3f,%.1f,%.3f,%.0f\n",
+           w->name, image_size, format_options.block_size, n_threads,
+           w->uses_io_size ? io_size : 0, ops, bytes, elapsed,
+           (double)ops / elapsed, (double)bytes / 1e6 / elapsed,
+           ops ? elapsed * 1e9 * (double)n_threads / (double)ops : 0.0);
+    fflush(stdout);
+    return 0;
+}
+
+/** Whether workload W was asked for.  */
+static int workload_wanted(const workload *w)
+{
+    if (workload_names == NULL)
+        return 1;
+    size_t len = strlen(w->name);
+    for (const char *p = workload_names; *p;)
+    {
+        size_t n = strcspn(p, ",");
+        if (n == len && !strncmp(p, w->name, len))
+            return 1;
+        p += n;
+        if (*p == ',')
+            p++;
+    }
+    return 0;
+}
+
+// Command line parsing functions and data
+
+/** Parse ARG, a size with an optional K, M, or G suffix (powers of
+    1024), into *SIZE.  Returns 0 on success, -1 if it is malformed.  */
+static int parse_size(const char *arg, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || errno)
+        return -1;
+    unsigned int shift = 0;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    if (*end || n == 0 || n > (SIZE_MAX >> shift))
+        return -1;
+    *size = (size_t)n << shift;
+    return 0;
+}
+
+/** Parse ARG, a comma-separated list of sizes, into LIST, setting *N
+    to their number.  Returns 0 on success, -1 if it is malformed.  */
+static int parse_size_list(char *arg, size_t *list, size_t *n)
+{
+    size_t count = 0;
+    for (char *p = strtok(arg, ","); p; p = strtok(NULL, ","))
+    {
+        if (count == MAX_SWEEP || parse_size(p, &list[count]))
+            return -1;
+        count++;
+    }
+    if (count == 0)
+        return -1;
+    *n = count;
+    return 0;
+}
+
+static const struct argp_option command_line_options[] = {
+    {"disk", 'd', "IMAGE", 0,
+     "Disk image to create and use (default: sfs-bench.img)", 0},
+    {"image-size", 's', "SIZE,...", 0, "Image sizes to test (default: 16M)",
+     0},
+    {"threads", 't', "N,...", 0, "Numbers of threads to test (default: 1)",
+     0},
+    {"io-size", 'z', "SIZE,...", 0,
+     "Bytes per read or write (default: 512,4096,65536)", 0},
+    {"block-size", 'b', "SIZE", 0, "Block size to format with (default: 512)",
+     0},
+    {"journal", 'j', "SIZE", 0, "Format with a journal of SIZE bytes", 0},
+    {"packed", 'p', 0, 0, "Format with small files kept in packed blocks", 0},
+    {"sparse", 'e', 0, 0, "Format without writing the unused blocks", 0},
+    {"checksums", 'c', 0, 0, "Format with a checksum of each block's data", 0},
+    {"seconds", 'S', "SECONDS", 0, "How long to run each test (default: 1)",
+     0},
+    {"files", 'f', "N", 0,
+     "Number of files in the directory for 'list' (default: 1000)", 0},
+    {"workload", 'w', "NAME,...", 0,
+     "Workloads to run, out of seq-write, seq-read, rand-write, rand-read,"
+     " churn, list, and aged-read (default: all)",
+     0},
+    {"keep", 'k', 0, 0, "Do not remove the disk image afterward", 0},
+    {0, 0, 0, 0, 0, 0}};
+
+static int command_line_parse_1(int key, char *arg, struct argp_state *state)
+{
+    switch (key)
+    {
+    case 'd':
+        disk = arg;
+        return 0;
+    case 's':
+        if (parse_size_list(arg, image_sizes, &n_image_sizes))
+        {
+            argp_error(state, "invalid image sizes");
+        }
+        return 0;
+    case 't':
+        if (parse_size_list(arg, thread_counts, &n_thread_counts))
+        {
+            argp_error(state, "invalid thread counts");
+        }
+        for (size_t i = 0; i < n_thread_counts; i++)
+        {
+            if (thread_counts[i] > MAX_THREADS)
+            {
+                argp_error(state, "cannot use more than %d threads",
+                           MAX_THREADS);
+            }
+        }
+        return 0;
+    case 'z':
+        if (parse_size_list(arg, io_sizes, &n_io_sizes))
+        {
+            argp_error(state, "invalid I/O sizes");
+        }
+        return 0;
+    case 'b':
+        if (parse_size(arg, &format_options.block_size))
+        {
+            argp_error(state, "invalid block size '%s'", arg);
+        }
+        return 0;
+    case 'j':
+        if (parse_size(arg, &format_options.journal_size))
+        {
+            argp_error(state, "invalid journal size '%s'", arg);
+        }
+        return 0;
+    case 'p':
+        format_options.packed_files = 1;
+        return 0;
+    case 'e':
+        format_options.sparse = 1;
+        return 0;
+    case 'c':
+        format_options.checksums = 1;
+        return 0;
+    case 'S':
+    {
+        char *end;
+        seconds = strtod(arg, &end);
+        if (end == arg || *end || !(seconds > 0 && seconds < 1e6))
+        {
+            argp_error(state, "invalid number of seconds '%s'", arg);
+        }
+        return 0;
+    }
+    case 'f':
+    {
+        char *end;
+        unsigned long n = strtoul(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || n > 1000000)
+        {
+            argp_error(state, "invalid number of files '%s'", arg);
+        }
+        list_files = (unsigned int)n;
+        return 0;
+    }
+    case 'w':
+    {
+        workload_names = arg;
+        size_t n_known = 0;
+        for (const workload *w = workloads; w->name; w++)
+            n_known += (size_t)workload_wanted(w);
+        if (n_known == 0)
+        {
+            argp_error(state, "no such workload '%s'", arg);
+        }
+        return 0;
+    }
+    case 'k':
+        keep_image = 1;
+        return 0;
+    case ARGP_KEY_ARG:
+        argp_error(state, "unexpected argument '%s'", arg);
+        return 0;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+}
+
+static const struct argp command_line_spec = {
+    command_line_options,
+    command_line_parse_1,
+    NULL,
+    "\nMeasure how fast the SFS operations are, without Lua in the way.\n"
+    "Results are written to standard output as CSV.\n"
+    "\n"
+    "Options:",
+    NULL,
+    NULL,
+    NULL};
+
+int main(int argc, char **argv)
+{
+    int err = argp_parse(&command_line_spec, argc, argv, 0, 0, NULL);
+    if (err)
+    {
+        fprintf(stderr, "argp_parse: %s\n", strerror(err));
+        return 1;
+    }
+
+    printf("workload,image_size,block_size,threads,io_size,ops,bytes,"
+           "seconds,ops_per_s,mb_per_s,mean_ns\n");
+    int status = 0;
+    for (const workload *w = workloads; w->name; w++)
+    {
+        if (!workload_wanted(w))
+            continue;
+        for (size_t s = 0; s < n_image_sizes; s++)
+            for (size_t t = 0; t < n_thread_counts; t++)
+                for (size_t z = 0; z < (w->uses_io_size ? n_io_sizes : 1); z++)
+                    status |= run_workload(w, image_sizes[s],
+                                           thread_counts[t], io_sizes[z]);
+    }
+
+    if (!keep_image)
+        unlink(disk);
+    return status;
+}
@@ -0,0 +1,458 @@
+/** A crash test for the metadata journal of the Shark File System.
+
+    This program formats a disk image with a journal, writes a file to
+    it, and then, round after round, starts a child process that
+    mounts the image and has several threads create, append to,
+    overwrite, truncate, clone, remove and rename files, and now and
+    then sync the image, as fast as they can, and kills the child with
+    SIGKILL at a random moment.  After each kill it mounts the image
+    again, which replays the journal, checks that the file written at
+    the start still reads back, unmounts, and runs sfs-fsck on the
+    image.  A round fails if any of that does not succeed; the first
+    failure stops the test.
+
+    Exits with status 0 if every round passed, or 1 otherwise.  */
+
+#include "sfs-api.h"
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/** The most threads the child can use.  */
+#define MAX_THREADS 64
+
+/** The file written before the first round, and what is in it.  */
+#define KEEP_NAME "keep"
+#define KEEP_DATA "written before the first crash"
+
+/** Command line settings.  */
+static const char *disk = "sfs-crashtest.img";
+static const char *fsck = "./sfs-fsck";
+static size_t image_size = 4 << 20;
+static sfs_format_options format_options = {.block_size = 512,
+                                            .journal_size = 64 << 10};
+static unsigned int rounds = 40;
+static unsigned int n_threads = 4;
+static unsigned int max_delay_ms = 30;
+static unsigned int seed = 0;
+static int keep_image = 0;
+static int verbose = 0;
+
+/** Where the child's threads start their random sequences; different
+    in every round.  */
+static unsigned int child_seed;
+
+/** Run by each thread of the child until it is killed.  Each thread
+    works on a dozen files of its own, so that the threads contend for
+    the directory and the free list but not for files.  */
+static void *crash_threadproc(void *arg)
+{
+    unsigned int index = (unsigned int)(size_t)arg;
+    unsigned int random = child_seed * 7919u + index;
+    char buf[9000];
+    memset(buf, 'a' + (int)(index % 26), sizeof buf);
+
+    for (;;)
+    {
+        char name[SFS_FILE_NAME_SIZE_LIMIT];
+        char other[SFS_FILE_NAME_SIZE_LIMIT];
+        snprintf(name, sizeof name, "t%u.%u", index, rand_r(&random) % 12);
+        snprintf(other, sizeof other, "t%u.%u", index, rand_r(&random) % 12);
+        unsigned int op = (unsigned int)rand_r(&random) % 14;
+        if (op < 5)
+        {
+            int fd = sfs_open(name);
+            if (fd < 0)
+                continue;
+            for (int n = rand_r(&random) % 4; n > 0; n--)
+                sfs_write(fd, buf, (size_t)rand_r(&random) % sizeof buf);
+            if (rand_r(&random) % 3 == 0)
+                sfs_pwrite(fd, buf, 100, (size_t)rand_r(&random) % 30000);
+            sfs_close(fd);
+        }
+        else if (op < 8)
+        {
+            sfs_remove(name);
+        }
+        else if (op < 10)
+        {
+            sfs_rename(name, other);
+        }
+        else if (op < 11)
+        {
+            // Small enough to be packed, if the image packs files.
+            sfs_remove(name);
+            int fd = sfs_open(name);
+            if (fd < 0)
+                continue;
+            sfs_write(fd, buf, (size_t)rand_r(&random) % 121);
+            sfs_close(fd);
+        }
+        else if (op < 12)
+        {
+            sfs_sync();
+        }
+        else if (op < 13)
+        {
+            sfs_clone(name, other);
+        }
+        else
+        {
+            int fd = sfs_open(name);
+            if (fd < 0)
+                continue;
+            sfs_ftruncate(fd, (size_t)rand_r(&random) % sizeof buf);
+            sfs_close(fd);
+        }
+    }
+    return NULL;
+}
+
+/** The child of one round: mount the image and run the threads until
+    killed.  Never returns.  */
+static void run_child(void)
+{
+    int err = sfs_mount(disk);
+    if (err)
+    {
+        fprintf(stderr, "child: sfs_mount: %s\n", strerror(-err));
+        _exit(1);
+    }
+    pthread_t threads[MAX_THREADS];
+    for (unsigned int i = 0; i < n_threads; i++)
+        pthread_create(&threads[i], NULL, crash_threadproc,
+                       (void *)(size_t)i);
+    for (;;)
+        pause();
+}
+
+/** Run sfs-fsck on the image.  Returns 0 if it found the image
+    consistent, or -1 otherwise.  Its output is shown only if
+    verbose.  */
+static int run_fsck(void)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        if (!verbose)
+        {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            dup2(null, 2);
+        }
+        execl(fsck, fsck, disk, (char *)NULL);
+        perror(fsck);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+    {
+        perror("waitpid");
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/** Mount the image after a crash, check the file written at the
+    start, and unmount.  Returns 0, or -1 after saying what went
+    wrong.  */
+static int check_after_crash(unsigned int round)
+{
+    int err = sfs_mount(disk);
+    if (err)
+    {
+        printf("round %u: sfs_mount: %s\n", round, strerror(-err));
+        return -1;
+    }
+    char buf[sizeof KEEP_DATA];
+    int fd = sfs_open(KEEP_NAME);
+    ssize_t n = fd < 0 ? fd : sfs_read(fd, buf, sizeof buf);
+    if (fd >= 0)
+        sfs_close(fd);
+    err = sfs_unmount();
+    if (n != (ssize_t)sizeof KEEP_DATA - 1 ||
+        memcmp(buf, KEEP_DATA, sizeof KEEP_DATA - 1) != 0)
+    {
+        printf("round %u: '%s' did not survive the crash\n", round,
+               KEEP_NAME);
+        return -1;
+    }
+    if (err)
+    {
+        printf("round %u: sfs_unmount: %s\n", round, strerror(-err));
+        return -1;
+    }
+    if (run_fsck())
+    {
+        printf("round %u: sfs-fsck found the image inconsistent\n", round);
+        return -1;
+    }
+    return 0;
+}
+
+/** Format the image and write the file that must survive.  Returns 0,
+    or -1 after saying what went wrong.  */
+static int set_up_image(void)
+{
+    int err = sfs_format_with_options(disk, image_size, &format_options);
+    if (err)
+    {
+        printf("sfs_format_with_options: %s\n", strerror(-err));
+        return -1;
+    }
+    int fd = sfs_open(KEEP_NAME);
+    if (fd < 0 ||
+        sfs_write(fd, KEEP_DATA, sizeof KEEP_DATA - 1) !=
+            (ssize_t)sizeof KEEP_DATA - 1)
+    {
+        printf("cannot write '%s'\n", KEEP_NAME);
+        return -1;
+    }
+    sfs_close(fd);
+    err = sfs_unmount();
+    if (err)
+    {
+        printf("sfs_unmount: %s\n", strerror(-err));
+        return -1;
+    }
+    if (run_fsck())
+    {
+        printf("sfs-fsck found the new image inconsistent\n");
+        return -1;
+    }
+    return 0;
+}
+
+/** Run the rounds.  Returns 0 if they all passed, or -1.  */
+static int run_rounds(void)
+{
+    unsigned int random = seed;
+    for (unsigned int round = 1; round <= rounds; round++)
+    {
+        child_seed = seed + round;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            return -1;
+        }
+        if (pid == 0)
+            run_child();
+
+        unsigned int delay_us =
+            1000 + (unsigned int)rand_r(&random) % (max_delay_ms * 1000);
+        usleep(delay_us);
+        kill(pid, SIGKILL);
+        int status;
+        if (waitpid(pid, &status, 0) < 0)
+        {
+            perror("waitpid");
+            return -1;
+        }
+        if (!WIFSIGNALED(status))
+        {
+            printf("round %u: the child exited before it was killed\n",
+                   round);
+            return -1;
+        }
+        if (check_after_crash(round))
+            return -1;
+        if (verbose)
+            printf("round %u: killed after %u us, image consistent\n",
+                   round, delay_us);
+    }
+    return 0;
+}
+
+// Command line parsing functions and data
+
+/** Parse ARG, a size with an optional K, M, or G suffix (powers of
+    1024), into *SIZE.  Returns 0 on success, -1 if it is malformed.  */
+static int parse_size(const char *arg, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || errno)
+        return -1;
+    unsigned int shift = 0;
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    if (*end || n == 0 || n > (SIZE_MAX >> shift))
+        return -1;
+    *size = (size_t)n << shift;
+    return 0;
+}
+
+/** Parse ARG, a whole number from 1 to MAX, into *N.  Returns 0 on
+    success, -1 if it is malformed or out of range.  */
+static int parse_count(const char *arg, unsigned int max, unsigned int *n)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (end == arg || *end || errno || value == 0 || value > max)
+        return -1;
+    *n = (unsigned int)value;
+    return 0;
+}
+
+static const struct argp_option command_line_options[] = {
+    {"disk", 'd', "IMAGE", 0,
+     "Disk image to create and use (default: sfs-crashtest.img)", 0},
+    {"image-size", 's', "SIZE", 0, "Size of the image (default: 4M)", 0},
+    {"block-size", 'b', "SIZE", 0, "Block size to format with (default: 512)",
+     0},
+    {"journal", 'j', "SIZE", 0, "Size of the journal (default: 64K)", 0},
+    {"packed", 'p', 0, 0, "Format with packed_files set", 0},
+    {"sparse", 'e', 0, 0, "Format with sparse set", 0},
+    {"rounds", 'r', "N", 0, "Number of crashes (default: 40)", 0},
+    {"threads", 't', "N", 0, "Threads in the child (default: 4)", 0},
+    {"delay", 'D', "MS", 0,
+     "Kill the child at most MS milliseconds in (default: 30)", 0},
+    {"seed", 'S', "N", 0, "Seed for the random choices (default: the time)",
+     0},
+    {"fsck", 'f', "PROGRAM", 0, "sfs-fsck to check with (default: ./sfs-fsck)",
+     0},
+    {"keep", 'k', 0, 0, "Do not remove the disk image afterward", 0},
+    {"verbose", 'v', 0, 0, "Report every round, and sfs-fsck's output", 0},
+    {0, 0, 0, 0, 0, 0}};
+
+static int command_line_parse_1(int key, char *arg, struct argp_state *state)
+{
+    switch (key)
+    {
+    case 'd':
+        disk = arg;
+        return 0;
+    case 's':
+        if (parse_size(arg, &image_size))
+        {
+            argp_error(state, "invalid image size '%s'", arg);
+        }
+        return 0;
+    case 'b':
+        if (parse_size(arg, &format_options.block_size))
+        {
+            argp_error(state, "invalid block size '%s'", arg);
+        }
+        return 0;
+    case 'j':
+        if (parse_size(arg, &format_options.journal_size))
+        {
+            argp_error(state, "invalid journal size '%s'", arg);
+        }
+        return 0;
+    case 'p':
+        format_options.packed_files = 1;
+        return 0;
+    case 'e':
+        format_options.sparse = 1;
+        return 0;
+    case 'r':
+        if (parse_count(arg, 1000000, &rounds))
+        {
+            argp_error(state, "invalid number of rounds '%s'", arg);
+        }
+        return 0;
+    case 't':
+        if (parse_count(arg, MAX_THREADS, &n_threads))
+        {
+            argp_error(state, "invalid number of threads '%s'", arg);
+        }
+        return 0;
+    case 'D':
+        if (parse_count(arg, 100000, &max_delay_ms))
+        {
+            argp_error(state, "invalid delay '%s'", arg);
+        }
+        return 0;
+    case 'S':
+        if (parse_count(arg, ~0u, &seed))
+        {
+            argp_error(state, "invalid seed '%s'", arg);
+        }
+        return 0;
+    case 'f':
+        fsck = arg;
+        return 0;
+    case 'k':
+        keep_image = 1;
+        return 0;
+    case 'v':
+        verbose = 1;
+        return 0;
+    case ARGP_KEY_ARG:
+        argp_error(state, "unexpected argument '%s'", arg);
+        return 0;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+}
+
+static const struct argp command_line_spec = {
+    command_line_options,
+    command_line_parse_1,
+    NULL,
+    "\nKill a process using an SFS image with a journal at random moments,"
+    "\nand check that the image is consistent after each crash.\n"
+    "\n"
+    "Options:",
+    NULL,
+    NULL,
+    NULL};
+
+int main(int argc, char **argv)
+{
+    int err = argp_parse(&command_line_spec, argc, argv, 0, 0, NULL);
+    if (err)
+    {
+        fprintf(stderr, "argp_parse: %s\n", strerror(err));
+        return 1;
+    }
+    if (seed == 0)
+        seed = (unsigned int)time(NULL);
+
+    printf("seed %u\n", seed);
+    int status = set_up_image() || run_rounds() ? 1 : 0;
+    if (status == 0)
+        printf("%u rounds passed\n", rounds);
+    else
+        printf("rerun with --seed %u to repeat\n", seed);
+
+    if (!keep_image && status == 0)
+        unlink(disk);
+    return status;
+}
@@ -0,0 +1,178 @@
+//
+// SFS CRC - CRC-32C, as fast as the processor allows
+//
+// Checksumming a block is meant to cost about as much as copying it, so
+//   where the processor has an instruction for CRC-32C (SSE 4.2 on
+//   x86-64, the CRC extension on 64-bit ARM), that is used, on eight
+//   bytes at a time.  Each of those instructions has to wait for the
+//   result of the one before, so a long buffer is split into three
+//   stripes that are checksummed side by side, keeping the processor
+//   busy, and the three CRCs are then combined into one.  Combining
+//   does not look at the data again: appending N bytes to a message
+//   multiplies its CRC by x**(8N) modulo the polynomial, and the
+//   factor for the stripe length is kept from one call to the next.
+//   Elsewhere, the data is folded in eight bytes at a time with eight
+//   lookup tables ("slicing-by-8"), which are built the first time
+//   they are needed.
+//
+// The CRCs that are passed in and returned are the usual inverted ones;
+//   the inner loops work on the register, before inversion.  The
+//   polynomials are all bit-reversed, as the CRC is.
+//
+
+#include "sfs-crc.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define HAVE_CRC_INSTRUCTIONS 1
+#define CRC_TARGET __attribute__((target("sse4.2")))
+#define crcStep64(reg, v) ((uint32_t)_mm_crc32_u64((reg), (v)))
+#define crcStep8(reg, b) ((uint32_t)_mm_crc32_u8((reg), (b)))
+#define crcInstructionsAvailable() __builtin_cpu_supports("sse4.2")
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC_INSTRUCTIONS 1
+#define CRC_TARGET
+#define crcStep64(reg, v) __crc32cd((reg), (v))
+#define crcStep8(reg, b) __crc32cb((reg), (b))
+#define crcInstructionsAvailable() 1
+#endif
+
+/** The CRC-32C polynomial, bit-reversed, without its x**32 term.  */
+#define CRC32C_POLY 0x82F63B78u
+
+/** Buffers shorter than this are checksummed in one stripe; below it,
+    combining the stripes would cost more than it saves.  */
+#define STRIPE_MIN 768
+
+/** crcTables[0] holds the register after folding in each byte value on
+    its own, and crcTables[K] the same for a byte followed by K zero
+    bytes, so that eight bytes can be folded in with eight lookups.  */
+static uint32_t crcTables[8][256];
+static pthread_once_t crcTablesOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTables(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t reg = i;
+        for (int k = 0; k < 8; k++)
+            reg = (reg >> 1) ^ (CRC32C_POLY & (0u - (reg & 1)));
+        crcTables[0][i] = reg;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crcTables[t][i] = (crcTables[t - 1][i] >> 8) ^
+                              crcTables[0][crcTables[t - 1][i] & 0xFF];
+}
+
+/** Fold the LEN bytes at P into the CRC register REG, using the lookup
+    tables, and return the new register.  */
+static uint32_t crcSoftware(uint32_t reg, const unsigned char *p, size_t len)
+{
+    pthread_once(&crcTablesOnce, buildCrcTables);
+    while (len >= 8)
+    {
+        // The blocks of an image are little-endian, like this.
+        uint32_t lo, hi;
+        memcpy(&lo, p, sizeof lo);
+        memcpy(&hi, p + 4, sizeof hi);
+        lo ^= reg;
+        reg = crcTables[7][lo & 0xFF] ^ crcTables[6][(lo >> 8) & 0xFF] ^
+              crcTables[5][(lo >> 16) & 0xFF] ^ crcTables[4][lo >> 24] ^
+              crcTables[3][hi & 0xFF] ^ crcTables[2][(hi >> 8) & 0xFF] ^
+              crcTables[1][(hi >> 16) & 0xFF] ^ crcTables[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        reg = (reg >> 8) ^ crcTables[0][(reg ^ *p++) & 0xFF];
+    return reg;
+}
+
+#ifdef HAVE_CRC_INSTRUCTIONS
+/** Return A times B modulo the polynomial.  */
+static uint32_t multiplyModPoly(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1)
+    {
+        if (a & m)
+            product ^= b;
+        b = (b >> 1) ^ (CRC32C_POLY & (0u - (b & 1)));
+    }
+    return product;
+}
+
+/** Return x**(8N) modulo the polynomial, by repeated squaring.  */
+static uint32_t shiftFactor(size_t n)
+{
+    uint32_t power = 1u << 23; // x**8
+    uint32_t factor = 1u << 31; // x**0
+    for (; n != 0; n >>= 1)
+    {
+        if (n & 1)
+            factor = multiplyModPoly(power, factor);
+        power = multiplyModPoly(power, power);
+    }
+    return factor;
+}
+
+/** Fold the LEN bytes at P into the CRC register REG, using the CRC
+    instructions, and return the new register.  */
+CRC_TARGET static uint32_t crcHardware(uint32_t reg, const unsigned char *p,
+                                       size_t len)
+{
+    // A caller checksums block after block of the same size, so the
+    // factor for the last stripe length is usually the one wanted.
+    static _Thread_local size_t factorStripe;
+    static _Thread_local uint32_t factor;
+    if (len >= STRIPE_MIN)
+    {
+        size_t stripe = len / 24 * 8;
+        uint32_t a = reg, b = 0xFFFFFFFF, c = 0xFFFFFFFF;
+        for (size_t i = 0; i < stripe; i += 8)
+        {
+            uint64_t va, vb, vc;
+            memcpy(&va, p + i, sizeof va);
+            memcpy(&vb, p + stripe + i, sizeof vb);
+            memcpy(&vc, p + 2 * stripe + i, sizeof vc);
+            a = crcStep64(a, va);
+            b = crcStep64(b, vb);
+            c = crcStep64(c, vc);
+        }
+        if (factorStripe != stripe)
+        {
+            factor = shiftFactor(stripe);
+            factorStripe = stripe;
+        }
+        uint32_t crc = multiplyModPoly(factor, ~a) ^ ~b;
+        crc = multiplyModPoly(factor, crc) ^ ~c;
+        reg = ~crc;
+        p += 3 * stripe;
+        len -= 3 * stripe;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        reg = crcStep64(reg, v);
+    }
+    while (len-- > 0)
+        reg = crcStep8(reg, *p++);
+    return reg;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+#ifdef HAVE_CRC_INSTRUCTIONS
+    if (crcInstructionsAvailable())
+        return ~crcHardware(~crc, p, len);
+#endif
+    return ~crcSoftware(~crc, p, len);
+}
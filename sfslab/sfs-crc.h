@@ -0,0 +1,17 @@
+/** This file declares the CRC-32C routine shared by sfs-disk.c, which
+    checksums the free extent snapshot and, on images that have them,
+    the data in each file block, and by sfs-fsck, which verifies those
+    checksums.  See sfs-crc.c for how it is computed.  */
+
+#ifndef SFS_CRC_H_
+#define SFS_CRC_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Return CRC, updated for the LEN bytes at DATA, using the CRC-32C
+    (Castagnoli) polynomial.  Start with 0.  Safe to call from any
+    number of threads at once.  */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -14,8 +14,9 @@ Email: tutorcs@163.com
 //   filesystem includes many other features, such as permissions,
 //   access time, nested directories, long file names, etc.
 //
-// The disk is "formatted" into 512-byte blocks.  Each block is linked
-//   to the other blocks, similar to a free list in malloc.
+// The disk is "formatted" into blocks, 512 bytes each unless a larger
+//   block size was chosen at format time.  Each block is linked to the
+//   other blocks, similar to a free list in malloc.
 //
 // The file system relies on the first block being the "superblock".
 //   This special block contains the information about the disk being
@@ -23,33 +24,103 @@ Email: tutorcs@163.com
 //   implementation, there is only one directory, embedded in the
 //   superblock; however, this could be changed by adding support for
 //   a special file type of "directory" and modifying the file lookup
-//   algorithm for opening a file.
+//   algorithm for opening a file.  When a disk image is mounted, an
+//   in-memory hash table from file name to directory slot, and a
+//   bitmap of free slots, are built, so that neither looking up a file
+//   nor creating one needs to scan the directory.
 //
-// A file consists of one or more "disk blocks" which are chunks of 512
-//   bytes.  Each block links to the one before and after it in the file,
-//   which provide 500 bytes of space per allocated block.  The end of
-//   the file is known by both the size of the file and the last block
-//   links to block 0, which is "NULL".  A modern file system might
-//   instead use a B-tree or other structure to manage the allocated
-//   blocks.
+// A file consists of one or more "disk blocks".  Each block links to
+//   the one before and after it in the file, and spends 12 bytes on
+//   those links, which leaves 500 bytes of space per allocated block
+//   with the default block size.  The end of the file is known by both
+//   the size of the file and the last block links to block 0, which is
+//   "NULL".  A modern file system might instead use a B-tree or other
+//   structure to manage the allocated blocks.
+//
+// Free blocks are kept on a doubly linked list in ascending block order.
+//   When a disk image is mounted, an in-memory index of the runs of
+//   consecutive free blocks ("extents") is built from that list, so
+//   that allocation can hand out whole runs at a time and files tend
+//   to end up physically contiguous on disk.  So that threads writing
+//   in parallel do not all contend for the free list, each thread
+//   allocates from one of a handful of caches of free extents, which
+//   are refilled from the free list, and drained back into it, a batch
+//   at a time.  Blocks sitting in a cache are off the on-disk free
+//   list until they are handed back at unmount, so if a process dies
+//   with the image mounted, sfs-fsck will report them as lost, unless
+//   the image has a journal.  On images of version 2 and up, a clean
+//   unmount saves the extent index in the free blocks themselves, so
+//   that the next mount can read it back instead of walking the whole
+//   free list.  On a sparse image (SFS_DISK_SPARSE), the blocks past the
+//   high-water mark have never been written and are on no list; the
+//   index counts them as one extent at the end, and they are set up as
+//   free blocks only when the allocator first takes them.  Files still
+//   end up scattered, once free space is cut up by files coming and
+//   going; sfs_defrag copies each such file into a run that holds all
+//   of it, and frees the old blocks, which merge back into larger
+//   runs.
+//
+// A file can be cloned without copying any of its data: the clone's
+//   directory entry refers to the same chain of blocks, and the files
+//   that share a chain are linked into a ring in memory, which is
+//   rebuilt from the directory at mount.  Since the links in each
+//   block put it in exactly one chain, it is the whole chain that is
+//   shared, and a file is copied into a chain of its own the first
+//   time it is changed.
+//
+// An image may also be formatted with a checksum of the data in every
+//   file block, kept in a table of its own just after the super block.
+//   The table is not journaled: each block's checksum is cleared before
+//   the block is written and set once the write is done, so that a
+//   process dying part way through leaves a checksum that says nothing
+//   rather than one that is wrong.  Reads check the blocks they copy
+//   from, and fail with -EIO if one has been damaged.
+//
+// A file that is mostly read can be kept compressed.  Its data is cut
+//   into frames of a few kilobytes, each compressed on its own by
+//   sfs-lz.c, so that a read only decodes the frames it needs, and the
+//   last few frames decoded are kept in memory, so that reading a frame
+//   a piece at a time decodes it once.  Files are compressed when
+//   their last descriptor is closed, and decoded back into ordinary
+//   blocks as soon as anything is written to them.
+//
+// Every change to the on-disk structures is made by handing a record
+//   describing it to journalApply, in sfs-journal.c.  If the image was
+//   formatted with a journal, the records are logged there first, so
+//   that a process that dies part way through an operation leaves
+//   nothing for sfs-fsck to complain about once the image has been
+//   mounted again.  See the comment at the top of sfs-journal.c.
 //
 // Open files are tracked using a two-level structure.  One level is the
 //   open file descriptor tracking the position in the file for that
 //   descriptor.  It links to a separate table that has a single entry
 //   per file, which provides the current size of the file and the
 //   reference count, so that a file could not be deleted while it is
-//   still open.
+//   still open.  The file entry also remembers the file's last block,
+//   so that appending, whether by a descriptor opened with
+//   SFS_OPEN_APPEND or by writing at the end, does not walk the chain.
+//
+// All of the in-memory state is protected by locks, so the API
+//   functions may be called from any number of threads at once, except
+//   that sfs_format, sfs_mount and sfs_unmount must not race with any
+//   other call.  Threads working on different files, or reading the
+//   same file, do not block each other.  See the comment above
+//   'dirLock' for which lock protects what.
 //
 // @author Brian Railing (bpr@cs.cmu.edu)
 //
 
 #include "sfs-disk.h"
 #include "sfs-api.h"
+#include "sfs-crc.h"
+#include "sfs-lz.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -60,51 +131,530 @@ Email: tutorcs@163.com
 #include <sys/types.h>
 #include <unistd.h>
 
-/** Maximum number of files that can exist.  Since we have not implemented
-    expansion of the root directory, this is equal to the number of directory
-    entries that can fit in a single disk block.  */
-#define FILE_COUNT_LIMIT DIR_ENTRIES_PER_BLOCK
-
-/** Maximum number of open files.  This is intentionally larger
-    than the number of files that can exist; some of the traces
+/** Number of "file descriptors" that can be open at once, unless the
+    disk image is mounted with a different limit.  Some of the traces
     open the same file more than once.  */
-#define OPEN_FILE_LIMIT 32
+#define OPEN_FILE_LIMIT_DEFAULT 32
+
+/** The root directory begins with the entries in the super block and
+    continues into as many directory blocks as are needed, chained from
+    the super block's 'next_rootdir' field.  Directory slot numbers are
+    32 bits, so this is the most slots the directory may have.  */
+#define DIR_SLOT_LIMIT                                                         \
+    (UINT32_MAX / dirEntriesPerBlock * dirEntriesPerBlock)
 
-static_assert(sizeof(sfs_block_file_t) == SFS_BLOCK_SIZE,
-              "SFS_BLOCK_SIZE and sfs_block_file_t are out of sync");
-static_assert(sizeof(sfs_block_dir_t) == SFS_BLOCK_SIZE,
-              "SFS_BLOCK_SIZE and sfs_block_dir_t are out of sync");
-static_assert(sizeof(sfs_filesystem_t) == SFS_BLOCK_SIZE,
-              "SFS_BLOCK_SIZE and sfs_filesystem_t are out of sync");
+// The block size is only known at mount time, so these check that the
+// fixed parts of the block layouts line up with the formulas in
+// sfs-disk.h; initDiskState uses the formulas for the rest.
+static_assert(offsetof(sfs_block_file_t, data) == sizeof(sfs_block_hdr_t),
+              "sfs_block_file_t does not match SFS_BLOCK_DATA_SIZE");
+static_assert(offsetof(sfs_block_dir_t, files) == sizeof(sfs_dir_entry_t),
+              "sfs_block_dir_t does not match SFS_DIR_ENTRIES_PER_BLOCK");
+static_assert(offsetof(sfs_filesystem_t, files) == sizeof(sfs_dir_entry_t),
+              "sfs_filesystem_t does not match SFS_DIR_ENTRIES_PER_BLOCK");
+
+/** A run of consecutively numbered blocks, [start, start + length).  */
+typedef struct sfs_extent_t
+{
+    block_id start;
+    uint32_t length;
+} sfs_extent_t;
+
+/** Number of decoded frames each compressed file keeps in memory.  */
+#define FRAME_CACHE_SLOTS 4
+
+/** Frame numbers are 32 bits, and NO_FRAME is never a valid one.  */
+#define NO_FRAME UINT32_MAX
 
 /** This struct corresponds to what CS:APP calls a "v-node table" entry. */
 typedef struct sfs_mem_file_t
 {
     uint32_t refCount;
-    int fileEntryIdx;
+    uint32_t fileEntryIdx;
     sfs_dir_entry_t *diskFile;
+
+    /** The cell of its packed block that the file is kept in, or
+        NO_CELL if it has a chain of blocks of its own.  Changed only
+        with 'lock' held exclusively.  */
+    uint32_t packCell;
+
+    /** Whether the file is kept compressed (see sfs_compressed_hdr_t),
+        changed only with 'lock' held exclusively, and whether it should
+        be compressed again when its last descriptor is closed, as it is
+        if it was compressed when it was opened, or if any descriptor for
+        it was opened with SFS_OPEN_COMPRESS, which is changed only with
+        'openLock' held exclusively.  */
+    int compressed;
+    int keepCompressed;
+
+    /** The last few frames of the file that reads have decoded, while
+        it is compressed, with the frame number of each, or NO_FRAME for
+        a slot not in use, and the slot to be reused next.  The buffers
+        are allocated as they are first needed.  Protected by
+        'frameLock', which readers take while holding 'lock' shared; a
+        thread holding 'lock' exclusively may use them without it.  */
+    struct
+    {
+        uint32_t frame;
+        char *data;
+    } frames[FRAME_CACHE_SLOTS];
+    uint32_t nextFrameSlot;
+    pthread_mutex_t frameLock;
+
+    /** Cache of the IDs of the blocks in the file, in chain order, so
+        that a file position can be turned into a block without
+        chasing links.  NULL until the first time it is needed.  It
+        covers the start of the chain, as far as anything has needed
+        so far, and is extended from where it ends; see
+        mapBlocksThrough.  It is shared by every descriptor open on the
+        file, and once it covers the whole chain, sfs_write keeps it
+        that way; anything that shortens the chain must cut it short or
+        discard it.  */
+    block_id *blockMap;
+    uint32_t mapLength;   /**< number of valid entries in blockMap */
+    uint32_t mapCapacity; /**< number of allocated entries in blockMap */
+
+    /** ID of the last block of the file, so that appending to it does
+        not have to walk its chain or build its block map, or 0 if it
+        is packed or the block has not been looked for yet.  Changed
+        with 'lock' held exclusively, by anything that changes the end
+        of the chain, or with 'lock' held shared and 'mapLock' as well,
+        to fill it in.  */
+    block_id lastBlock;
+
+    /** Blocks set aside by sfs_fallocate for the file to grow into: a
+        chain of 'reserveCount' blocks, from 'reserveFirst' to
+        'reserveLast', that is not attached to anything, and so is in
+        limbo, until writes use it up, or the file's last descriptor is
+        closed and it is freed.  Changed only with 'lock' held
+        exclusively.  */
+    block_id reserveFirst;
+    block_id reserveLast;
+    uint32_t reserveCount;
+
+    /** Held shared to read the file and exclusively to change its size
+        or its chain of blocks.  */
+    pthread_rwlock_t lock;
+    /** Serializes building 'blockMap', and filling in 'lastBlock', by
+        threads that hold 'lock' only in shared mode.  */
+    pthread_mutex_t mapLock;
+
+    /** Number of sfs_borrow calls, on any descriptor for this file,
+        that have not yet been released.  Writes to the file fail with
+        -EBUSY while it is nonzero, so that borrowed spans keep showing
+        the data they were borrowed with.  */
+    atomic_uint borrowCount;
+
+    /** The blocks that sfs_fsync must flush: those written through this
+        entry since the last sfs_fsync, and the directory block holding
+        the file's entry if its size changed, as a sorted array of
+        maximal runs.  If the array could not be enlarged, 'dirtyAll'
+        is set instead, and sfs_fsync flushes the whole image.  Changed
+        with 'lock' held exclusively, or with 'lock' held shared and
+        'mapLock' as well.  */
+    sfs_extent_t *dirty;
+    uint32_t dirtyCount;
+    uint32_t dirtyCapacity;
+    int dirtyAll;
 } sfs_mem_file_t;
 
 /** This struct corresponds to what CS:APP calls an "open file table" entry.
-    The "descriptor table" is the openFileDescTable array itself. */
+    The "descriptor table" is the openFileDescTable array itself, and
+    an entry in it whose 'fileEntry' is NULL is not open.  */
 typedef struct sfs_mem_filedesc_t
 {
     sfs_mem_file_t *fileEntry;
-    block_id startBlock;
     block_id currBlock;
     size_t currPos;
+
+    /** The SFS_OPEN_* flags the descriptor was opened with.  */
+    int flags;
+
+    /** For readahead: the file position at which the last sfs_read or
+        sfs_write through the descriptor ended, how many of those in a
+        row began where the one before ended, and the file position up
+        to which blocks have been read ahead.  */
+    size_t seqPos;
+    uint32_t seqCount;
+    size_t aheadPos;
+
+    /** Protects 'currBlock' and 'currPos', so that threads sharing a
+        descriptor see each operation happen as a unit.  They are only
+        changed with the file's 'lock' held as well, so a thread holding
+        that exclusively may change them itself.  */
+    pthread_mutex_t lock;
+
+    /** Number of sfs_borrow calls on this descriptor that have not yet
+        been released.  These are included in the file's count.  */
+    atomic_uint borrowCount;
+
+    /** Number of operations in progress on the descriptor (see
+        pinFileDesc), and whether sfs_close is waiting for them to
+        finish so that it can free the descriptor, in which case no more
+        can start.  */
+    atomic_uint pinCount;
+    atomic_int closing;
 } sfs_mem_filedesc_t;
 
+/** A position within an array of iovecs, for copying data to or from
+    the buffers it describes, in order.  */
+typedef struct sfs_iov_cursor_t
+{
+    const struct iovec *iov;
+    size_t offset; /**< offset within *iov */
+} sfs_iov_cursor_t;
+
 static_assert(sizeof SFS_DISK_MAGIC == offsetof(sfs_filesystem_t, n_blocks),
               "'type' field of sfs_filesystem_t does not match SFS_DISK_MAGIC");
+static_assert(UINTPTR_MAX >= UINT64_MAX,
+              "sfs_list cookies need a 64-bit pointer type");
+
+/** Amount of file data in each block, and number of directory entries
+    in each directory block (and the super block), for the block size
+    of the mounted disk image.  */
+static uint32_t blockDataSize;
+static uint32_t dirEntriesPerBlock;
+
+/** Whether the mounted image keeps a checksum of each file block's data
+    (see sfs_block_checksums_t), and how many checksums fit in a block
+    of the table.  */
+static int checksumsEnabled;
+static uint32_t checksumsPerBlock;
+
+/** The open file table has one entry per directory slot, and grows
+    along with the directory.  */
+static sfs_mem_file_t **openFileTable;
+
+/** The last block of each file that is not open, by directory slot, as
+    it was when the file was last closed, or 0 if it is not known, so
+    that opening the file again need not look for it.  It grows along
+    with the directory.  Changed with 'openLock' held exclusively, or,
+    for a file that is not open, with 'dirLock' held exclusively, which
+    keeps the file from being opened in the meantime.  */
+static block_id *fileTails;
+
+/** The directory slots of files that share one chain of blocks (see
+    SFS_DISK_SHARED) are linked into a ring: 'shareRing' holds, for
+    each slot, the next slot in its ring, and a slot whose file shares
+    nothing is a ring of its own.  The rings are built from the
+    directory when the image is mounted, so nothing about them is kept
+    on disk.  A file whose ring has other slots in it is copied into a
+    chain of its own before anything changes its data or its chain;
+    see unshareFile.  It grows along with the directory.  Changed only
+    with 'shareLock' held; a file's own slot is only ever changed from
+    shared to not shared while the file is open, so it may be read
+    without the lock.  So that it can grow while other threads are
+    reading it like that, it is kept in segments that never move once
+    they are allocated: segment K has RING_SEGMENT_BASE << K slots,
+    starting at slot RING_SEGMENT_BASE * (2**K - 1); see ringNext.  */
+#define RING_SEGMENT_BASE 64
+#define RING_SEGMENTS 27
+static atomic_uint *shareRing[RING_SEGMENTS];
+
+/** Return the entry of 'shareRing' for directory slot SLOT.  */
+static atomic_uint *ringNext(uint32_t slot)
+{
+    uint64_t n = (uint64_t)slot / RING_SEGMENT_BASE + 1;
+    unsigned int k = 63 - (unsigned int)__builtin_clzll(n);
+    uint64_t start = RING_SEGMENT_BASE * (((uint64_t)1 << k) - 1);
+    return &shareRing[k][slot - start];
+}
+
+/** The descriptor table has 'openFileLimit' entries, and is allocated
+    when the disk image is mounted, together with a pool of as many
+    open file table entries, since no more files than that can be open.
+    The unused pool entries are kept on a stack, and the unused "file
+    descriptors" in 'freeFds', a bitmap with one bit per descriptor,
+    set if it is free; no descriptor below 64 * 'freeFdHint' is free.
+    Opening a file always takes the lowest free descriptor, as open(2)
+    does, so that one just closed is not handed out again at once, and
+    neither opening nor closing files allocates memory.  */
+static uint32_t openFileLimit;
+static sfs_mem_filedesc_t *openFileDescTable;
+static uint64_t *freeFds;
+static uint32_t freeFdHint;
+static uint32_t freeFdCount;
+static sfs_mem_file_t *fileEntryPool;
+static sfs_mem_file_t **freeFileEntries;
+static uint32_t freeFileEntryCount;
+
+/** In-memory index of the free list, as a sorted array of maximal
+    extents, built when the disk image is formatted or mounted.  The
+    on-disk free list is kept in ascending block order, so each extent
+    is also a contiguous stretch of the free list.  The array is sized
+    for the worst case (every other block free), so freeing blocks
+    never has to allocate memory.  */
+static sfs_extent_t *freeExtents;
+static uint32_t freeExtentCount;
+static uint32_t freeBlockCount;
+
+/** The high-water mark of a sparse image (see SFS_DISK_SPARSE): the
+    first of the blocks at the end that have never been written, which
+    are counted in the last free extent but are not on the on-disk free
+    list.  The number of blocks in the image if there are none, as
+    always for other versions.  Protected by 'allocLock'.  */
+static block_id highWater;
+
+/** Number of block allocation caches.  Threads are spread across them
+    round-robin.  */
+#define ALLOC_CACHE_COUNT 8
+
+/** Number of blocks a cache is refilled with at a time.  Requests for
+    more blocks than this bypass the caches.  */
+#define ALLOC_CACHE_BATCH 64
+
+/** Maximum number of separate extents one cache can hold.  */
+#define ALLOC_CACHE_EXTENTS 4
+
+/** A cache of free extents that have been taken off the free list for
+    the use of the threads assigned to it.  The extents are kept sorted
+    and maximal, like 'freeExtents', and the blocks in them keep their
+    free-block headers, linked in ascending order, so that they can be
+    put back on the free list without being touched.  */
+typedef struct sfs_alloc_cache_t
+{
+    pthread_mutex_t lock;
+    sfs_extent_t extents[ALLOC_CACHE_EXTENTS];
+    uint32_t extentCount;
+    uint32_t blockCount;
+} sfs_alloc_cache_t;
+
+static sfs_alloc_cache_t allocCaches[ALLOC_CACHE_COUNT];
+
+/** Largest group of journal records that sfs-disk.c puts together.  */
+#define JOURNAL_GROUP 16
+
+/** Number of blocks read ahead of a descriptor once it has been used
+    sequentially twice in a row, and the most that it can grow to,
+    doubling each time, while the descriptor stays sequential.  */
+#define READAHEAD_MIN 8
+#define READAHEAD_MAX 256
+
+/** Directory slots are numbered from zero, in the order sfs_list
+    visits them.  NO_SLOT is never a valid slot number.  */
+#define NO_SLOT UINT32_MAX
+
+/** One bucket of the name index.  'slot' is one more than the slot
+    number of the directory entry it refers to, so that a zeroed bucket
+    is empty.  'hash' is the full hash of the entry's name, so that
+    most mismatches can be rejected, and the index can be rehashed,
+    without looking at the directory itself.  */
+typedef struct sfs_name_bucket_t
+{
+    uint32_t hash;
+    uint32_t slot;
+} sfs_name_bucket_t;
+
+/** In-memory index of the root directory, built when the disk image is
+    formatted or mounted and updated whenever a name is created,
+    removed, or renamed.  'nameIndex' is an open-addressing hash table
+    with linear probing, from file name to directory slot, that is
+    always at most half full.  'freeSlots' is a bitmap with one bit per
+    directory slot, set if the slot is not in use; no slot below
+    64 * 'freeSlotHint' is free.  'dirBlocks' holds the block ID of
+    each block of the directory, in chain order, with the super block
+    as block 0; slot N is entry N % dirEntriesPerBlock of directory
+    block N / dirEntriesPerBlock.  */
+static sfs_name_bucket_t *nameIndex;
+static uint32_t nameIndexMask;
+static uint64_t *freeSlots;
+static uint32_t freeSlotHint;
+static uint32_t dirSlotCount;
+static block_id *dirBlocks;
+static uint32_t dirBlockCount;
+
+/** Cell numbers in packed blocks are never as big as NO_CELL.  */
+#define NO_CELL UINT32_MAX
+
+/** Packed blocks (see sfs_block_pack_t), which are only used if
+    'packingEnabled' is set.  'packStack' holds every packed block that
+    has a free cell, and new files take a cell in the block on top.
+    It has room for all 'packBlockCount' packed blocks, so that putting
+    a block back on it never has to allocate memory.  A packed block
+    with no files in it stays where it is, in limbo, until the log has
+    started over (see sfs-disk.h for why), which reclaimPackBlocks
+    makes sure of; it is called by sfs_sync, at unmount, and when the
+    disk is full.  */
+static int packingEnabled;
+static uint32_t cellsPerBlock;
+static block_id *packStack;
+static uint32_t packStackCount;
+static uint32_t packStackCapacity;
+static uint32_t packBlockCount;
+
+/** Locks.  Whenever more than one is held, they must be acquired in the
+    order they are listed here.
+
+    'dirLock' protects the directory entries (apart from each file's
+    size, which belongs to the file), the name index, the free-slot
+    bitmap and 'dirBlocks'.  It is held shared to look names up and to
+    list the directory, and exclusively to create, remove, or rename
+    files.
+
+    'openLock' protects both open file tables, their free stacks, the
+    reference counts of their entries, and 'fileTails'.  It is held
+    shared to look a descriptor up and pin it for an operation (see
+    pinFileDesc), which keeps the descriptor and its file from being
+    freed underneath the operation, and exclusively to open or close a
+    descriptor.  'unpinLock' is only used to wait for the operations
+    in progress on a descriptor that is being closed.
+
+    Then come each descriptor's 'lock', each file's 'lock',
+    'frameLock' and 'mapLock'; see their declarations.
+
+    'descLock' is held while a descriptor is attached to a file or
+    detached from it, which then also takes 'openLock' exclusively, and
+    while a thread that holds a file's lock exclusively goes through the
+    descriptor table to update the descriptors for that file.
+
+    'shareLock' protects 'shareRing'.  It is held while the journal
+    records that change which files share a chain are carried out, so
+    that they are logged in the same order as the rings change.
+
+    'packLock' protects the packed block stack and the owners of the
+    cells of packed blocks.  The data in a cell belongs to its file.
+
+    Each allocation cache's 'lock' protects it.  A thread normally holds
+    only its own cache's lock; a thread that needs more than one locks
+    them in index order, except that it may try-lock other caches
+    while holding its own.
+
+    'allocLock' protects the free list and the free extent index.  It
+    is only ever held inside allocateBlocks and freeBlocks, and the
+    functions they call, apart from brief looks at the free extents by
+    sfs_defrag and sfs_get_frag_stats.
+
+    'journalLock', in sfs-journal.c, comes after all of these, and
+    'summaryLock', in sfs-summary.c, after that.  'statsLock' comes
+    last of all.  The lock that sfs-support.c takes to change the
+    version number of the image is only held while it does so.
 
-static sfs_mem_file_t *openFileTable[FILE_COUNT_LIMIT];
-static sfs_mem_filedesc_t *openFileDescTable[OPEN_FILE_LIMIT];
+    The two reader/writer locks prefer writers, so that a steady stream
+    of reads cannot keep a file from being opened or closed.  */
+static pthread_rwlock_t dirLock =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_rwlock_t openLock =
+    PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_mutex_t unpinLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unpinned = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t descLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t shareLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t packLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The counters reported by sfs_get_stats.  */
+enum
+{
+    STAT_CHAIN_HOPS,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_ALLOCATIONS,
+    STAT_BLOCKS_ALLOCATED,
+    STAT_ALLOCATION_FAILURES,
+    STAT_BLOCKS_FREED,
+    STAT_LOOKUPS,
+    STAT_LOOKUP_PROBES,
+    STAT_READAHEAD_BLOCKS,
+    STAT_CHECKSUM_FAILURES,
+    STAT_FRAMES_DECODED,
+    STAT_FRAME_CACHE_HITS,
+    STAT_COUNT
+};
+
+#ifndef SFS_NO_STATS
+/** Each thread counts into a block of its own, so that counting costs
+    an uncontended load and store, and sfs_get_stats adds the blocks
+    up.  Only the owning thread writes to a block, but the counters are
+    atomic so that they can be read while it does.  */
+typedef struct sfs_thread_stats_t
+{
+    atomic_uint_fast64_t counts[STAT_COUNT];
+    struct sfs_thread_stats_t *prev;
+    struct sfs_thread_stats_t *next;
+} sfs_thread_stats_t;
+
+/** The blocks of the live threads that have counted anything, the
+    totals of those that have exited, and a block shared, with atomic
+    additions, by threads that could not have one of their own.
+    'statsLock' protects the list of blocks and 'retiredStats'.  */
+static sfs_thread_stats_t *threadStatsList;
+static uint64_t retiredStats[STAT_COUNT];
+static sfs_thread_stats_t sharedStats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t statsKey;
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+static _Thread_local sfs_thread_stats_t *threadStats;
+#endif
 
 //
 // Internal subroutines
 //
 
+#ifndef SFS_NO_STATS
+/** Destructor for a thread's counter block: fold it into the totals of
+    exited threads.  */
+static void retireThreadStats(void *p)
+{
+    sfs_thread_stats_t *s = p;
+    pthread_mutex_lock(&statsLock);
+    for (int i = 0; i < STAT_COUNT; i++)
+        retiredStats[i] += atomic_load_explicit(&s->counts[i],
+                                                memory_order_relaxed);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        threadStatsList = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    pthread_mutex_unlock(&statsLock);
+    free(s);
+}
+
+static void createStatsKey(void)
+{
+    pthread_key_create(&statsKey, retireThreadStats);
+}
+
+/** Give the calling thread a counter block of its own, or failing
+    that, the shared one.  */
+static sfs_thread_stats_t *newThreadStats(void)
+{
+    pthread_once(&statsKeyOnce, createStatsKey);
+    sfs_thread_stats_t *s = calloc(1, sizeof *s);
+    if (s == NULL || pthread_setspecific(statsKey, s) != 0)
+    {
+        free(s);
+        return &sharedStats;
+    }
+    pthread_mutex_lock(&statsLock);
+    s->next = threadStatsList;
+    if (threadStatsList)
+        threadStatsList->prev = s;
+    threadStatsList = s;
+    pthread_mutex_unlock(&statsLock);
+    return s;
+}
+
+/** Add N to counter WHICH, for sfs_get_stats.  */
+static inline void countStat(int which, uint64_t n)
+{
+    sfs_thread_stats_t *s = threadStats;
+    if (s == NULL)
+        s = threadStats = newThreadStats();
+    atomic_uint_fast64_t *c = &s->counts[which];
+    if (s == &sharedStats)
+        atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+    else
+        atomic_store_explicit(
+            c, atomic_load_explicit(c, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+#else
+// N is still evaluated, so that counts kept only for this are not
+// warned about as unused; the compiler drops them.
+#define countStat(which, n) ((void)(n))
+#endif
+
 /** Round up the size_t value SIZE to the nearest multiple of N.
     Special case: for all nonzero k, roundUp(k*N, N) returns k*N,
     but roundUp(0, N) returns N.  */
@@ -121,444 +671,4592 @@ static size_t sizeMin(size_t a, size_t b)
     return a < b ? a : b;
 }
 
-/** Allocate N_BLOCKS free blocks from the free list.  Set each newly
-    allocated block's type to TYPE, and chain them all together.
-    Return the block ID of the first block in the chain.
+/** Return the index of the block, counting from zero at the start of
+    the file, that holds the byte just before file position POS.  This
+    is the block a file descriptor's 'currBlock' refers to when its
+    position is POS; position 0 is special-cased to the first block.  */
+static uint32_t blockIndexOf(size_t pos)
+{
+    return pos == 0 ? 0 : (uint32_t)((pos - 1) / blockDataSize);
+}
 
-    If N_BLOCKS blocks are not currently available for allocation,
-    leaves the free list unchanged and returns 0.  Also returns 0
-    if N_BLOCKS is zero.  */
-static block_id allocateBlocks(uint32_t n_blocks, const char *type)
+/** Return the block of the checksum table that holds the checksum of
+    block ID.  Only meaningful if 'checksumsEnabled'.  */
+static block_id checksumBlockOf(block_id id)
 {
-    sfs_filesystem_t *super = accessSuperBlock();
-    if (super->freelist == 0 || n_blocks == 0)
+    return 1 + id / checksumsPerBlock;
+}
+
+/** Return a pointer to the checksum of block ID, in the table.  Only
+    meaningful if 'checksumsEnabled'.  */
+static uint32_t *checksumSlot(block_id id)
+{
+    sfs_block_checksums_t *b =
+        (sfs_block_checksums_t *)(void *)accessBlock(checksumBlockOf(id));
+    return &b->crc[id % checksumsPerBlock];
+}
+
+/** Return the data area of block ID, which is part of a file, whether
+    it holds the file's data as it is or compressed.  */
+static char *chainData(block_id id)
+{
+    sfs_block_hdr_t *b = accessBlock(id);
+    assert(memcmp(b->type, SFS_BLOCK_TYPE_FILE, 4) == 0 ||
+           memcmp(b->type, SFS_BLOCK_TYPE_COMPRESSED, 4) == 0);
+    return ((sfs_block_file_t *)(void *)b)->data;
+}
+
+/** Return the checksum of the data area of block ID, as it is kept in
+    the table.  */
+static uint32_t blockChecksum(block_id id)
+{
+    return crc32c(0, chainData(id), blockDataSize);
+}
+
+/** Check the data in block ID of a file against its checksum, if the
+    image keeps checksums and the block's is known.  Returns 0, or -EIO
+    if they differ.  */
+static int checkBlock(block_id id)
+{
+    if (!checksumsEnabled)
+        return 0;
+    uint32_t want = *checksumSlot(id);
+    if (want == 0 || want == blockChecksum(id))
+        return 0;
+    countStat(STAT_CHECKSUM_FAILURES, 1);
+    return -EIO;
+}
+
+/** Flush the part of the checksum table that covers the blocks [START,
+    START + N), if the image keeps checksums.  Returns 0 or -EIO.  */
+static int syncChecksums(block_id start, uint32_t n)
+{
+    if (!checksumsEnabled || n == 0)
         return 0;
+    block_id first = checksumBlockOf(start);
+    return syncBlocks(first, checksumBlockOf(start + n - 1) - first + 1);
+}
+
+/** One past the last block of free extent number IDX.  */
+static block_id extentEnd(uint32_t idx)
+{
+    return freeExtents[idx].start + freeExtents[idx].length;
+}
 
-    block_id first_alloc_id = super->freelist;
-    sfs_block_hdr_t *first_alloc_blk = accessFreeBlock(first_alloc_id);
+/** Return ID, a free block, if it is on the on-disk free list, or 0 if
+    it is past the high-water mark.  */
+static block_id listedBlock(block_id id)
+{
+    return id < highWater ? id : 0;
+}
 
-    block_id last_alloc_id = first_alloc_id;
-    sfs_block_hdr_t *last_alloc_blk = first_alloc_blk;
+/** Remove the first TAKE blocks of free extent number IDX from the
+    free list, and return the ID of the first of them.  Because the
+    free list is kept in ascending order, the blocks being removed
+    are a contiguous stretch of it, and only the blocks on either
+    side of that stretch need to be relinked.  Any of them that are
+    past the high-water mark are first put on the end of the list, so
+    that they are free blocks like the rest.  The headers of the
+    removed blocks are left for the caller to overwrite.  */
+static block_id takeFromExtent(uint32_t idx, uint32_t take)
+{
+    sfs_extent_t *e = &freeExtents[idx];
+    assert(take >= 1 && take <= e->length);
 
-    for (uint32_t i = 1; i < n_blocks; i++)
+    block_id start = e->start;
+    block_id pred = idx > 0 ? extentEnd(idx - 1) - 1 : 0;
+    sfs_journal_rec_t recs[2];
+    uint32_t n = 0;
+    if (start + take > highWater)
     {
-        if (last_alloc_blk->next_block == 0)
-            return 0; // not enough free blocks available
-        last_alloc_id = last_alloc_blk->next_block;
-        last_alloc_blk = accessFreeBlock(last_alloc_id);
+        assert(start <= highWater && idx + 1 == freeExtentCount);
+        block_id tail = start < highWater ? highWater - 1 : pred;
+        recs[n] = (sfs_journal_rec_t){.kind = SFS_JREC_CHAIN,
+                                      .block = highWater,
+                                      .count = start + take - highWater,
+                                      .prev = tail};
+        memcpy(recs[n].type, SFS_BLOCK_TYPE_FREE, sizeof recs[n].type);
+        n++;
+        highWater = start + take;
     }
 
-    // At this point we know that we have n_blocks free blocks available.
-    // 'first_alloc_blk' points to the first block being allocated and
-    // 'last_alloc_blk' points to the last block being allocated (*not*
-    // one beyond).
-    block_id next_free_id = last_alloc_blk->next_block;
-    if (next_free_id != 0)
+    block_id succ;
+    if (take < e->length)
+    {
+        e->start += take;
+        e->length -= take;
+        succ = e->start;
+    }
+    else
     {
-        sfs_block_hdr_t *next_free_blk = accessFreeBlock(next_free_id);
-        next_free_blk->prev_block = 0;
-        last_alloc_blk->next_block = 0;
+        succ = idx + 1 < freeExtentCount ? freeExtents[idx + 1].start : 0;
+        memmove(e, e + 1, (freeExtentCount - idx - 1) * sizeof *e);
+        freeExtentCount--;
     }
-    super->freelist = next_free_id;
 
-    for (sfs_block_hdr_t *b = first_alloc_blk; b;
-         b = accessFreeBlock(b->next_block))
-        setBlockType(b, type);
+    recs[n++] = (sfs_journal_rec_t){.kind = SFS_JREC_TAKE,
+                                    .block = start,
+                                    .count = take,
+                                    .prev = pred,
+                                    .next = listedBlock(succ)};
+    journalApply(recs, n);
 
-    return first_alloc_id;
+    freeBlockCount -= take;
+    return start;
 }
 
-/** Deallocate all of the blocks in the allocation chain starting at
-    'first_block'; that is, move them to the free list and change their type
-    to SFS_BLOCK_TYPE_FREE.  'first_block' does not have to be the very
-    first block in an allocation chain.  */
-static void freeBlocks(block_id first_block)
+/** Return the run of blocks [START, START + LENGTH) to the free list.
+    Their type must already have been set to SFS_BLOCK_TYPE_FREE, and
+    each block but the last must already link to its successor by ID,
+    as is the case for any run of consecutive blocks in a chain.  The
+    run is merged with the free extents on either side of it, if they
+    are adjacent.  */
+static void releaseRun(block_id start, uint32_t length)
 {
-    sfs_filesystem_t *superBlock = accessSuperBlock();
-    sfs_block_hdr_t *b = accessBlock(first_block);
-    if (b->prev_block != 0)
+    // Find the first extent that begins after 'start'.
+    uint32_t lo = 0, hi = freeExtentCount;
+    while (lo < hi)
     {
-        sfs_block_hdr_t *p = accessBlock(b->prev_block);
-        p->next_block = 0;
-        b->prev_block = 0;
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (freeExtents[mid].start < start)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    uint32_t idx = lo;
+    assert(idx == 0 || extentEnd(idx - 1) <= start);
+    assert(idx == freeExtentCount || start + length <= freeExtents[idx].start);
 
-    for (;;)
+    block_id last = start + length - 1;
+    block_id pred = idx > 0 ? extentEnd(idx - 1) - 1 : 0;
+    block_id succ = idx < freeExtentCount ? freeExtents[idx].start : 0;
+
+    assert(accessFreeBlock(start) && accessFreeBlock(last));
+    sfs_journal_rec_t rec = {.kind = SFS_JREC_RELEASE,
+                             .block = start,
+                             .count = length,
+                             .prev = pred,
+                             .next = listedBlock(succ)};
+    journalApply(&rec, 1);
+
+    int mergePrev = idx > 0 && extentEnd(idx - 1) == start;
+    int mergeNext = idx < freeExtentCount && succ == last + 1;
+    if (mergePrev && mergeNext)
     {
-        assert(memcmp(b->type, SFS_BLOCK_TYPE_FREE, sizeof b->type) != 0);
-        setBlockType(b, SFS_BLOCK_TYPE_FREE);
-        if (b->next_block == 0)
-            break;
-        b = accessBlock(b->next_block);
+        freeExtents[idx - 1].length += length + freeExtents[idx].length;
+        memmove(&freeExtents[idx], &freeExtents[idx + 1],
+                (freeExtentCount - idx - 1) * sizeof *freeExtents);
+        freeExtentCount--;
+    }
+    else if (mergePrev)
+    {
+        freeExtents[idx - 1].length += length;
+    }
+    else if (mergeNext)
+    {
+        freeExtents[idx].start = start;
+        freeExtents[idx].length += length;
     }
-    b->next_block = superBlock->freelist;
-    superBlock->freelist = first_block;
+    else
+    {
+        memmove(&freeExtents[idx + 1], &freeExtents[idx],
+                (freeExtentCount - idx) * sizeof *freeExtents);
+        freeExtents[idx].start = start;
+        freeExtents[idx].length = length;
+        freeExtentCount++;
+    }
+    freeBlockCount += length;
 }
 
-/** Allocate an open-file-table entry and "file descriptor" referring
-    to an existing file on disk whose directory entry is at index
-    'entryIndex'.  */
-static int addOpenFileEntry(int entryIndex)
+/** Choose which of the COUNT sorted extents in EXT to allocate
+    N_BLOCKS blocks from.  If GOAL is nonzero and is the first block of
+    one of the extents, that one; otherwise the first that can hold all
+    N_BLOCKS; otherwise COUNT, meaning that the blocks will have to come
+    from several extents, starting with the first.  */
+static uint32_t pickExtent(const sfs_extent_t *ext, uint32_t count,
+                           uint32_t n_blocks, block_id goal)
 {
-    sfs_mem_filedesc_t *memDescFile = NULL;
-    int fd = -1;
-    for (int idx = 0; idx < OPEN_FILE_LIMIT; idx++)
+    if (goal != 0)
     {
-        if (openFileDescTable[idx] == NULL)
+        uint32_t lo = 0, hi = count;
+        while (lo < hi)
         {
-            memDescFile = malloc(sizeof(sfs_mem_filedesc_t));
-            if (memDescFile == NULL)
-            {
-                return -ENOMEM;
-            }
-            fd = idx;
-            break;
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ext[mid].start < goal)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
+        if (lo < count && ext[lo].start == goal)
+            return lo;
     }
-    if (memDescFile == NULL)
+    uint32_t idx;
+    for (idx = 0; idx < count; idx++)
+        if (ext[idx].length >= n_blocks)
+            break;
+    return idx;
+}
+
+/** Set the type of each of the blocks [START, START + N) to TYPE and
+    chain them onto the end of the chain whose first and last blocks
+    are *FIRST and *LAST (both zero if the chain is empty).  */
+static void chainRun(block_id start, uint32_t n, const char *type,
+                     block_id *first, block_id *last)
+{
+    sfs_journal_rec_t rec = {.kind = SFS_JREC_CHAIN,
+                             .block = start,
+                             .count = n,
+                             .prev = *last};
+    memcpy(rec.type, type, sizeof rec.type);
+    // Whatever the blocks held before, their checksums no longer say
+    // anything about them.
+    if (checksumsEnabled && (memcmp(type, SFS_BLOCK_TYPE_FILE, 4) == 0 ||
+                             memcmp(type, SFS_BLOCK_TYPE_COMPRESSED, 4) == 0))
+        for (uint32_t i = 0; i < n; i++)
+            *checksumSlot(start + i) = 0;
+    journalApply(&rec, 1);
+    if (*last == 0)
+        *first = start;
+    *last = start + n - 1;
+}
+
+/** Take N_BLOCKS blocks off the free list, set their type to TYPE, and
+    chain them together, as described for allocateBlocks.  The caller
+    must hold 'allocLock' and must have checked that there are enough
+    free blocks.  */
+static block_id takeFreeBlocks(uint32_t n_blocks, const char *type,
+                               block_id goal)
+{
+    assert(n_blocks <= freeBlockCount);
+    uint32_t idx = pickExtent(freeExtents, freeExtentCount, n_blocks, goal);
+
+    block_id first_alloc_id = 0;
+    block_id last_alloc_id = 0;
+    uint32_t remaining = n_blocks;
+    while (remaining > 0)
     {
-        // No fd slots left.
-        return -EMFILE;
+        // If nothing was big enough (or the goal extent has run out),
+        // fall back to consuming extents from the front.
+        if (idx >= freeExtentCount)
+            idx = 0;
+        uint32_t take = (uint32_t)sizeMin(remaining, freeExtents[idx].length);
+        block_id start = takeFromExtent(idx, take);
+        chainRun(start, take, type, &first_alloc_id, &last_alloc_id);
+        remaining -= take;
     }
+    return first_alloc_id;
+}
 
-    sfs_mem_file_t *fileEntry = openFileTable[entryIndex];
-    if (fileEntry == NULL)
+/** Return the allocation cache for the calling thread.  */
+static sfs_alloc_cache_t *threadCache(void)
+{
+    static atomic_uint nextCache;
+    static _Thread_local sfs_alloc_cache_t *cache;
+    if (cache == NULL)
+        cache = &allocCaches[atomic_fetch_add(&nextCache, 1) %
+                             ALLOC_CACHE_COUNT];
+    return cache;
+}
+
+/** Add the run [START, START + LENGTH), which has just been taken off
+    the free list, to cache C, merging it with any cached extent it
+    adjoins.  C must have a spare extent slot.  */
+static void cacheInsert(sfs_alloc_cache_t *c, block_id start,
+                        uint32_t length)
+{
+    assert(c->extentCount < ALLOC_CACHE_EXTENTS);
+    uint32_t idx = 0;
+    while (idx < c->extentCount && c->extents[idx].start < start)
+        idx++;
+    memmove(&c->extents[idx + 1], &c->extents[idx],
+            (c->extentCount - idx) * sizeof *c->extents);
+    c->extents[idx].start = start;
+    c->extents[idx].length = length;
+    c->extentCount++;
+    c->blockCount += length;
+
+    // Merging two extents means relinking the blocks on either side of
+    // the seam, which were last linked when they were on the free list.
+    for (uint32_t i = idx > 0 ? idx - 1 : 0;
+         i + 1 < c->extentCount && i <= idx;)
     {
-        fileEntry = malloc(sizeof(sfs_mem_file_t));
-        if (fileEntry == NULL)
+        sfs_extent_t *e = &c->extents[i];
+        block_id end = e->start + e->length;
+        if (end != e[1].start)
         {
-            free(memDescFile);
-            return -ENOMEM;
+            i++;
+            continue;
         }
-
-        sfs_filesystem_t *superBlock = accessSuperBlock();
-        fileEntry->diskFile = &superBlock->files[entryIndex];
-        fileEntry->fileEntryIdx = entryIndex;
-        fileEntry->refCount = 0;
-        openFileTable[entryIndex] = fileEntry;
+        sfs_journal_rec_t rec = {.kind = SFS_JREC_LINK,
+                                 .block = end - 1,
+                                 .next = end};
+        journalApply(&rec, 1);
+        e->length += e[1].length;
+        memmove(&e[1], &e[2], (c->extentCount - i - 2) * sizeof *e);
+        c->extentCount--;
     }
+}
 
-    fileEntry->refCount += 1;
-    memDescFile->fileEntry = fileEntry;
-    memDescFile->startBlock = fileEntry->diskFile->first_block;
-    memDescFile->currBlock = memDescFile->startBlock;
-    memDescFile->currPos = 0;
-    openFileDescTable[fd] = memDescFile;
-    return fd;
+/** Put everything in cache C back on the free list.  The caller must
+    hold C's lock and 'allocLock'.  */
+static void drainCache(sfs_alloc_cache_t *c)
+{
+    for (uint32_t i = 0; i < c->extentCount; i++)
+        releaseRun(c->extents[i].start, c->extents[i].length);
+    c->extentCount = 0;
+    c->blockCount = 0;
 }
 
-/** Create a new file named 'fileName' and return an open-file-table
-    entry for it.  'emptyIndex' is known to be a free slot in the
-    directory on disk.  */
-static int createFile(const char *fileName, int emptyIndex)
+/** Move up to ALLOC_CACHE_BATCH blocks, but at least N_BLOCKS if that
+    many are available, from the free list into cache C, whose lock the
+    caller holds.  If GOAL is the first block of a free extent, that
+    extent is used first.  If the free list runs short, first steal
+    from any other caches that aren't busy.  */
+static void refillCache(sfs_alloc_cache_t *c, uint32_t n_blocks,
+                        block_id goal)
 {
-    // Every file must occupy at least one block on disk, even if
-    // it is empty.  This is because we use nonzero 'first_block'
-    // to identify files that do exist.  (Optional puzzle for you:
-    // find a way to avoid this, so that empty files consume only
-    // a directory entry.)
+    pthread_mutex_lock(&allocLock);
+    if (c->blockCount < n_blocks &&
+        freeBlockCount < n_blocks - c->blockCount)
+    {
+        for (uint32_t i = 0; i < ALLOC_CACHE_COUNT; i++)
+        {
+            sfs_alloc_cache_t *victim = &allocCaches[i];
+            if (victim == c || pthread_mutex_trylock(&victim->lock) != 0)
+                continue;
+            drainCache(victim);
+            pthread_mutex_unlock(&victim->lock);
+        }
+    }
 
-    block_id startBlock = allocateBlocks(1, SFS_BLOCK_TYPE_FILE);
-    if (startBlock == 0)
-        return -ENOSPC;
+    // If the cache's extents are too fragmented to make room, start
+    // over with an empty cache.
+    if (c->extentCount == ALLOC_CACHE_EXTENTS)
+        drainCache(c);
 
-    sfs_filesystem_t *superBlock = accessSuperBlock();
-    sfs_dir_entry_t *sfe = &superBlock->files[emptyIndex];
-    sfe->first_block = startBlock;
-    sfe->size = 0;
+    while (c->blockCount < ALLOC_CACHE_BATCH &&
+           c->extentCount < ALLOC_CACHE_EXTENTS && freeBlockCount > 0)
+    {
+        uint32_t want = ALLOC_CACHE_BATCH - c->blockCount;
+        uint32_t idx = pickExtent(freeExtents, freeExtentCount, want, goal);
+        if (idx == freeExtentCount)
+            idx = 0;
+        uint32_t take = (uint32_t)sizeMin(want, freeExtents[idx].length);
+        cacheInsert(c, takeFromExtent(idx, take), take);
+        goal = 0;
+    }
+    pthread_mutex_unlock(&allocLock);
+}
 
-    // Overlength names _should_ have been excluded at a higher level.
-    size_t len = strlen(fileName);
-    assert(len + 1 <= SFS_FILE_NAME_SIZE_LIMIT);
+/** Put every cached block back on the free list.  */
+static void reclaimCachedBlocks(void)
+{
+    for (uint32_t i = 0; i < ALLOC_CACHE_COUNT; i++)
+        pthread_mutex_lock(&allocCaches[i].lock);
+    pthread_mutex_lock(&allocLock);
+    for (uint32_t i = 0; i < ALLOC_CACHE_COUNT; i++)
+    {
+        drainCache(&allocCaches[i]);
+        pthread_mutex_unlock(&allocCaches[i].lock);
+    }
+    pthread_mutex_unlock(&allocLock);
+}
 
-    // Copy the name and then clear the rest of the space.
-    memcpy(sfe->name, fileName, len);
-    memset(sfe->name + len, '\0', SFS_FILE_NAME_SIZE_LIMIT - len);
+/** Allocate N_BLOCKS blocks directly from the free list, for requests
+    that the caller's cache cannot satisfy.  If the free list itself is
+    short, the caches are emptied back into it first.  The caller must
+    not hold any cache's lock.  */
+static block_id allocateUncached(uint32_t n_blocks, const char *type,
+                                 block_id goal)
+{
+    pthread_mutex_lock(&allocLock);
+    if (n_blocks > freeBlockCount)
+    {
+        pthread_mutex_unlock(&allocLock);
+        reclaimCachedBlocks();
+        pthread_mutex_lock(&allocLock);
+    }
+    block_id first = 0;
+    if (n_blocks <= freeBlockCount)
+        first = takeFreeBlocks(n_blocks, type, goal);
+    pthread_mutex_unlock(&allocLock);
+    return first;
+}
 
-    return addOpenFileEntry(emptyIndex);
+/** Count an allocation of N_BLOCKS blocks, which returned FIRST, for
+    sfs_get_stats.  Returns FIRST.  */
+static block_id countAllocation(uint32_t n_blocks, block_id first)
+{
+    countStat(STAT_ALLOCATIONS, 1);
+    if (first != 0)
+        countStat(STAT_BLOCKS_ALLOCATED, n_blocks);
+    else
+        countStat(STAT_ALLOCATION_FAILURES, 1);
+    return first;
 }
 
-//
-// SFS API functions begin here
-// see sfs-api.h for documentation comments for these functions
-//
+/** Allocate N_BLOCKS free blocks.  Set each newly allocated block's
+    type to TYPE, and chain them all together.  Return the block ID of
+    the first block in the chain.
 
-int sfs_open(const char *fileName)
+    If GOAL is nonzero and is the first block of a free extent, the
+    allocation starts there; callers extending a file pass the ID just
+    past the file's last block, so that appends stay contiguous.
+    Otherwise the blocks come from the lowest-addressed extent that
+    can hold all of them, or failing that, from as many extents as
+    necessary, starting with the lowest.  Either way, the cost is
+    proportional to the number of extents, not the number of blocks,
+    apart from writing each new block's header.
+
+    Small allocations are served from the calling thread's cache, which
+    is refilled from the free list when it runs low; larger ones go to
+    the free list directly.
+
+    If N_BLOCKS blocks are not currently available for allocation,
+    returns 0.  Also returns 0 if N_BLOCKS is zero.  Unlike
+    allocateBlocks, this does not free empty packed blocks to make
+    room, so it may be called with 'packLock' held.  */
+static block_id allocateNow(uint32_t n_blocks, const char *type,
+                            block_id goal)
 {
-    // Can only have 23 characters, because the string on disk is NUL
-    // terminated.
-    if (strnlen(fileName, SFS_FILE_NAME_SIZE_LIMIT + 1) + 1 > 
-        SFS_FILE_NAME_SIZE_LIMIT)
-        return -ENAMETOOLONG;
+    if (n_blocks == 0)
+        return 0;
+    if (n_blocks > ALLOC_CACHE_BATCH)
+        return countAllocation(n_blocks,
+                               allocateUncached(n_blocks, type, goal));
 
-    // Is a disk image available?
-    if (getSFSStatus() < 0)
-        return -ENOMEDIUM;
+    sfs_alloc_cache_t *c = threadCache();
+    pthread_mutex_lock(&c->lock);
+    if (c->blockCount < n_blocks)
+        refillCache(c, n_blocks, goal);
+    if (c->blockCount < n_blocks)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return countAllocation(n_blocks,
+                               allocateUncached(n_blocks, type, goal));
+    }
 
-    sfs_filesystem_t *superBlock = accessSuperBlock();
-    int fileEntry;
-    int emptyEntry = -1;
-    for (fileEntry = 0; (unsigned long)fileEntry < FILE_COUNT_LIMIT;
-         fileEntry++)
+    block_id first_alloc_id = 0;
+    block_id last_alloc_id = 0;
+    uint32_t remaining = n_blocks;
+    uint32_t idx = pickExtent(c->extents, c->extentCount, n_blocks, goal);
+    while (remaining > 0)
     {
-        if (superBlock->files[fileEntry].first_block != 0 &&
-            strcmp(superBlock->files[fileEntry].name, fileName) == 0)
+        if (idx >= c->extentCount)
+            idx = 0;
+        sfs_extent_t *e = &c->extents[idx];
+        uint32_t take = (uint32_t)sizeMin(remaining, e->length);
+        block_id start = e->start;
+        e->start += take;
+        e->length -= take;
+        if (e->length == 0)
         {
-            return addOpenFileEntry(fileEntry);
+            memmove(e, e + 1, (c->extentCount - idx - 1) * sizeof *e);
+            c->extentCount--;
         }
-        else if (emptyEntry == -1 &&
-                 superBlock->files[fileEntry].first_block == 0)
+        c->blockCount -= take;
+        chainRun(start, take, type, &first_alloc_id, &last_alloc_id);
+        remaining -= take;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return countAllocation(n_blocks, first_alloc_id);
+}
+
+/** Change the type of each of the blocks [START, START + LENGTH),
+    which are in limbo, to SFS_BLOCK_TYPE_FREE, and put them back on the
+    free list.  The caller must hold 'allocLock'.  */
+static void freeRun(block_id start, uint32_t length)
+{
+    sfs_journal_rec_t rec = {.kind = SFS_JREC_CHAIN,
+                             .block = start,
+                             .count = length};
+    memcpy(rec.type, SFS_BLOCK_TYPE_FREE, sizeof rec.type);
+    journalApply(&rec, 1);
+    releaseRun(start, length);
+    countStat(STAT_BLOCKS_FREED, length);
+}
+
+/** Deallocate all of the blocks in the allocation chain starting at
+    'first_block'; that is, move them to the free list and change their type
+    to SFS_BLOCK_TYPE_FREE.  'first_block' does not have to be the very
+    first block in an allocation chain.  The chain is returned to the
+    free list one run of consecutively numbered blocks at a time.  */
+static void freeBlocks(block_id first_block)
+{
+    pthread_mutex_lock(&allocLock);
+    sfs_block_hdr_t *b = accessBlock(first_block);
+    if (b->prev_block != 0)
+    {
+        sfs_journal_rec_t rec = {.kind = SFS_JREC_LINK,
+                                 .block = b->prev_block};
+        journalApply(&rec, 1);
+    }
+
+    block_id id = first_block;
+    while (id != 0)
+    {
+        block_id start = id;
+        for (;;)
         {
-            emptyEntry = fileEntry;
+            b = accessBlock(id);
+            assert(memcmp(b->type, SFS_BLOCK_TYPE_FREE, sizeof b->type) != 0);
+            if (b->next_block != id + 1)
+                break;
+            id++;
         }
+        block_id next = b->next_block;
+        freeRun(start, id - start + 1);
+        id = next;
     }
+    pthread_mutex_unlock(&allocLock);
+}
 
-    // Optional challenge: Allow the super block to be just the first
-    // in a chain of directory blocks, and thus permit more than
-    // FILE_COUNT_LIMIT files to exist.
-    if (emptyEntry == -1)
-        return -ENOSPC;
+/** Return the number of free cells in packed block ID.  The caller
+    must hold 'packLock'.  */
+static uint32_t countFreeCells(block_id id)
+{
+    sfs_block_pack_t *p = accessPackBlock(id);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < cellsPerBlock; i++)
+        n += p->cells[i].owner == 0;
+    return n;
+}
 
-    return createFile(fileName, emptyEntry);
+/** Free every packed block that has no files in it, and return how
+    many there were.  This is only safe when nothing will be written to
+    the blocks before the log, if there is one, starts over; see
+    sfs-disk.h.  The caller must hold 'packLock'.  */
+static uint32_t freeEmptyPackBlocks(void)
+{
+    uint32_t kept = 0;
+    uint32_t freed = 0;
+    for (uint32_t i = 0; i < packStackCount; i++)
+    {
+        block_id id = packStack[i];
+        if (countFreeCells(id) == cellsPerBlock)
+        {
+            freeBlocks(id);
+            packBlockCount--;
+            freed++;
+        }
+        else
+        {
+            packStack[kept++] = id;
+        }
+    }
+    packStackCount = kept;
+    return freed;
 }
 
-void sfs_close(int fd)
+/** Free every packed block that has no files in it, first beginning a
+    new log if the disk image has a journal.  Records that concern
+    packed blocks are only logged with 'packLock' held, which is held
+    here from the checkpoint on, so the new log cannot mention any of
+    the blocks that are freed.  Returns the number of blocks freed, or
+    a negative error code from the checkpoint.  The caller must not
+    hold 'packLock'.  */
+static int reclaimPackBlocks(void)
 {
-    if (fd < 0 || fd > OPEN_FILE_LIMIT)
-        return;
-    sfs_mem_filedesc_t *tFile = openFileDescTable[fd];
-    if (!tFile)
-        return;
-    sfs_mem_file_t *fileEntry = tFile->fileEntry;
-    openFileDescTable[fd] = NULL;
-    free(tFile);
+    pthread_mutex_lock(&packLock);
+    uint32_t empty = 0;
+    for (uint32_t i = 0; i < packStackCount; i++)
+        empty += countFreeCells(packStack[i]) == cellsPerBlock;
+    int status = 0;
+    if (empty > 0)
+        status = journalCheckpoint();
+    if (empty > 0 && status == 0)
+        status = (int)freeEmptyPackBlocks();
+    pthread_mutex_unlock(&packLock);
+    return status;
+}
 
-    fileEntry->refCount--;
-    if (fileEntry->refCount > 0)
-        return;
+/** Allocate N_BLOCKS blocks as allocateNow does, but if they are not
+    available, first free the packed blocks with no files in them and
+    try again.  The caller must not hold 'packLock'.  */
+static block_id allocateBlocks(uint32_t n_blocks, const char *type,
+                               block_id goal)
+{
+    block_id first = allocateNow(n_blocks, type, goal);
+    if (first == 0 && n_blocks > 0 && reclaimPackBlocks() > 0)
+        first = allocateNow(n_blocks, type, goal);
+    return first;
+}
 
-    int idx = fileEntry->fileEntryIdx;
-    free(fileEntry);
-    openFileTable[idx] = NULL;
+/** Put back on the free list any blocks that replaying the journal
+    left in limbo: ones that were in allocation caches, or had been
+    allocated but not yet attached to anything, or detached but not
+    yet freed, when the disk image was last in use.  Then begin a new
+    log, which no longer needs to mention them.  */
+static int reclaimOrphans(void)
+{
+    block_id start;
+    uint32_t length;
+    if (!journalFirstOrphan(&start, &length))
+        return 0;
+    pthread_mutex_lock(&allocLock);
+    do
+        freeRun(start, length);
+    while (journalFirstOrphan(&start, &length));
+    pthread_mutex_unlock(&allocLock);
+    return journalCheckpoint();
 }
 
-ssize_t sfs_read(int fd, char *buf, size_t len)
+/** A position within the free extent snapshot (see sfs_free_snapshot_t
+    in sfs-disk.h): a block on the free list, and an offset within its
+    data area.  */
+typedef struct sfs_snapshot_cursor_t
 {
-    if (fd < 0 || fd > OPEN_FILE_LIMIT)
-        return -EBADF;
+    block_id id;
+    uint32_t offset;
+} sfs_snapshot_cursor_t;
 
-    sfs_mem_filedesc_t *tFile = openFileDescTable[fd];
-    if (tFile == NULL)
-        return -EBADF;
+/** Copy N bytes between BUF and the snapshot at CUR, advancing CUR past
+    them.  If TO_DISK, the bytes go from BUF into the snapshot;
+    otherwise they go the other way.  Returns 0, or -1 if the free list
+    ends, goes backward or leaves the free blocks first.  */
+static int snapshotCopy(sfs_snapshot_cursor_t *cur, void *buf, size_t n,
+                        int toDisk)
+{
+    uint32_t n_blocks = accessSuperBlock()->n_blocks;
+    char *p = buf;
+    while (n > 0)
+    {
+        if (cur->offset == blockDataSize)
+        {
+            block_id next = accessBlock(cur->id)->next_block;
+            if (next <= cur->id || next >= n_blocks ||
+                memcmp(accessBlock(next)->type, SFS_BLOCK_TYPE_FREE, 4) != 0)
+                return -1;
+            cur->id = next;
+            cur->offset = 0;
+        }
+        size_t chunk = sizeMin(n, blockDataSize - cur->offset);
+        char *data = (char *)(accessBlock(cur->id) + 1) + cur->offset;
+        if (toDisk)
+            memcpy(data, p, chunk);
+        else
+            memcpy(p, data, chunk);
+        cur->offset += (uint32_t)chunk;
+        p += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
 
-    // We are going to read 'len' bytes, or the amount of data remaining
-    // in the file, whichever is smaller.
-    // This subtraction cannot produce a value larger than SSIZE_MAX
-    // because it's impossible for a file in SFS to be that large.
-    size_t fileSize = tFile->fileEntry->diskFile->size;
-    size_t currPos = tFile->currPos;
+/** Return the checksum of the snapshot with header HDR whose extents are
+    at EXTENTS.  */
+static uint32_t snapshotChecksum(const sfs_free_snapshot_t *hdr,
+                                 const sfs_extent_t *extents)
+{
+    uint32_t crc = crc32c(0, &hdr->extent_count,
+                          sizeof *hdr - offsetof(sfs_free_snapshot_t,
+                                                 extent_count));
+    return crc32c(crc, extents, (size_t)hdr->extent_count * sizeof *extents);
+}
 
-    assert(currPos <= fileSize);
-    size_t totalToRead = sizeMin(fileSize - currPos, len);
+/** Save the free extent index in the data areas of the first blocks of
+    the free list, if the image is of a version that can have a
+    snapshot.  Nothing may change the free list after this.  Writing
+    the snapshot is not flushed: until it is, a torn one fails its
+    checksum, and the list is walked as before.  */
+static void saveFreeSnapshot(void)
+{
+    // A sparse image's free list may be empty, though its index is not.
+    if (getImageVersion() < 2 || accessSuperBlock()->freelist == 0)
+        return;
+    assert(accessSuperBlock()->freelist == freeExtents[0].start);
 
-    size_t toRead = totalToRead;
+    sfs_free_snapshot_t hdr = {.extent_count = freeExtentCount,
+                               .free_blocks = freeBlockCount};
+    memcpy(hdr.magic, SFS_SNAPSHOT_MAGIC, sizeof hdr.magic);
+    hdr.checksum = snapshotChecksum(&hdr, freeExtents);
 
-    // Copy chunks of data from the mapped disk image to the caller's buffer.
-    //
-    // Each chunk is the smaller of:
+    // Every extent takes far less room than the block it describes, so
+    // the free list always has room for the snapshot.
+    sfs_snapshot_cursor_t cur = {freeExtents[0].start, 0};
+    int status = snapshotCopy(&cur, &hdr, sizeof hdr, 1);
+    if (status == 0)
+        status = snapshotCopy(&cur, freeExtents,
+                              (size_t)freeExtentCount * sizeof *freeExtents,
+                              1);
+    assert(status == 0);
+}
+
+/** Load the free extent index from the snapshot saved when the image
+    was last unmounted, if it has one, into 'freeExtents', which has room
+    for CAPACITY extents, and clear the snapshot.  Returns 1 if the
+    index was loaded, or 0 if there was no snapshot, or it did not make
+    sense, and the free list must be walked instead.  */
+static int loadFreeSnapshot(uint32_t capacity)
+{
+    sfs_filesystem_t *super = accessSuperBlock();
+    block_id head = super->freelist;
+    if (getImageVersion() < 2 || head == 0 || head >= super->n_blocks ||
+        memcmp(accessBlock(head)->type, SFS_BLOCK_TYPE_FREE, 4) != 0)
+        return 0;
+
+    sfs_snapshot_cursor_t cur = {head, 0};
+    sfs_free_snapshot_t hdr;
+    if (snapshotCopy(&cur, &hdr, sizeof hdr, 0) < 0 ||
+        memcmp(hdr.magic, SFS_SNAPSHOT_MAGIC, sizeof hdr.magic) != 0)
+        return 0;
+
+    // The snapshot will be out of date as soon as anything is allocated
+    // or freed, so it must be gone from stable storage before then.
+    memset(accessBlock(head) + 1, 0, sizeof hdr.magic);
+    if (syncBlocks(head, 1) < 0)
+        return 0;
+
+    if (hdr.extent_count == 0 || hdr.extent_count > capacity ||
+        snapshotCopy(&cur, freeExtents,
+                     (size_t)hdr.extent_count * sizeof *freeExtents, 0) < 0 ||
+        snapshotChecksum(&hdr, freeExtents) != hdr.checksum ||
+        freeExtents[0].start != head)
+        return 0;
+
+    // The extents must be in order, inside the image, and maximal.
+    uint64_t total = 0;
+    uint64_t prevEnd = 0;
+    for (uint32_t i = 0; i < hdr.extent_count; i++)
+    {
+        uint64_t start = freeExtents[i].start;
+        uint64_t end = start + freeExtents[i].length;
+        if (start <= prevEnd || end <= start || end > super->n_blocks)
+            return 0;
+        total += freeExtents[i].length;
+        prevEnd = end;
+    }
+    if (total != hdr.free_blocks)
+        return 0;
+    freeExtentCount = hdr.extent_count;
+    freeBlockCount = hdr.free_blocks;
+    return 1;
+}
+
+/** Return the high-water mark of the active disk image (see
+    'highWater').  Blocks are only ever set up in order from the mark,
+    so every block before it has a nonzero header and every block from
+    it on has an all-zero one, and it can be found by bisection.  */
+static block_id findHighWater(void)
+{
+    static const sfs_block_hdr_t blank;
+    uint32_t n_blocks = accessSuperBlock()->n_blocks;
+    if (!imageIsSparse())
+        return n_blocks;
+
+    block_id lo = 1, hi = n_blocks;
+    while (lo < hi)
+    {
+        block_id mid = lo + (hi - lo) / 2;
+        if (memcmp(accessBlock(mid), &blank, sizeof blank) == 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/** Add the blocks past the high-water mark, if there are any, to the
+    end of the free extent index built from the free list.  */
+static void addUnwrittenExtent(void)
+{
+    uint32_t n_blocks = accessSuperBlock()->n_blocks;
+    if (highWater == n_blocks)
+        return;
+    if (freeExtentCount > 0 && extentEnd(freeExtentCount - 1) == highWater)
+    {
+        freeExtents[freeExtentCount - 1].length += n_blocks - highWater;
+    }
+    else
+    {
+        freeExtents[freeExtentCount].start = highWater;
+        freeExtents[freeExtentCount].length = n_blocks - highWater;
+        freeExtentCount++;
+    }
+    freeBlockCount += n_blocks - highWater;
+}
+
+/** Build the free extent index, from the snapshot saved when the image
+    was last unmounted if there is one, or otherwise by walking the
+    on-disk free list and adding the blocks past the high-water mark.
+    If the list turns out not to be in ascending order (as happens with
+    images written by older versions of this code, which pushed freed
+    blocks onto the front of the list), it is relinked in ascending
+    order.  The relinking is not journaled, since
+    an image with a journal was always written by code that keeps the
+    list in order.  Returns -EUCLEAN if the free list is malformed.  */
+static int buildFreeIndex(void)
+{
+    sfs_filesystem_t *super = accessSuperBlock();
+    uint32_t n_blocks = super->n_blocks;
+
+    freeExtents = malloc(((size_t)n_blocks / 2 + 1) * sizeof *freeExtents);
+    if (freeExtents == NULL)
+        return -ENOMEM;
+    freeExtentCount = 0;
+    freeBlockCount = 0;
+    highWater = findHighWater();
+    if (loadFreeSnapshot(n_blocks / 2 + 1))
+        return 0;
+
+    // Fast path: the list is in ascending order, which also proves it
+    // is not circular.  Build the extents as we go.
+    uint64_t *seen = NULL;
+    block_id prev = 0;
+    block_id id = super->freelist;
+    for (; id != 0; id = accessBlock(id)->next_block)
+    {
+        if (id >= n_blocks ||
+            memcmp(accessBlock(id)->type, SFS_BLOCK_TYPE_FREE, 4) != 0)
+            return -EUCLEAN;
+        if (id <= prev)
+            break;
+        if (freeExtentCount > 0 && extentEnd(freeExtentCount - 1) == id)
+        {
+            freeExtents[freeExtentCount - 1].length++;
+        }
+        else
+        {
+            freeExtents[freeExtentCount].start = id;
+            freeExtents[freeExtentCount].length = 1;
+            freeExtentCount++;
+        }
+        freeBlockCount++;
+        prev = id;
+    }
+    if (id == 0)
+    {
+        addUnwrittenExtent();
+        return 0;
+    }
+
+    // Slow path: record every free block in a bitmap, then rebuild the
+    // extents from the bitmap and relink the list to match them.
+    seen = calloc((n_blocks + 63) / 64, sizeof *seen);
+    if (seen == NULL)
+        return -ENOMEM;
+    for (uint32_t i = 0; i < freeExtentCount; i++)
+        for (block_id b = freeExtents[i].start; b < extentEnd(i); b++)
+            seen[b / 64] |= (uint64_t)1 << (b % 64);
+    for (; id != 0; id = accessBlock(id)->next_block)
+    {
+        if (id >= n_blocks ||
+            memcmp(accessBlock(id)->type, SFS_BLOCK_TYPE_FREE, 4) != 0 ||
+            (seen[id / 64] & ((uint64_t)1 << (id % 64))))
+        {
+            free(seen);
+            return -EUCLEAN;
+        }
+        seen[id / 64] |= (uint64_t)1 << (id % 64);
+        freeBlockCount++;
+    }
+
+    freeExtentCount = 0;
+    prev = 0;
+    for (block_id b = 1; b < n_blocks; b++)
+    {
+        if (!(seen[b / 64] & ((uint64_t)1 << (b % 64))))
+            continue;
+        if (freeExtentCount > 0 && extentEnd(freeExtentCount - 1) == b)
+        {
+            freeExtents[freeExtentCount - 1].length++;
+        }
+        else
+        {
+            freeExtents[freeExtentCount].start = b;
+            freeExtents[freeExtentCount].length = 1;
+            freeExtentCount++;
+        }
+        sfs_block_hdr_t *h = accessBlock(b);
+        h->prev_block = prev;
+        h->next_block = 0;
+        if (prev != 0)
+            accessBlock(prev)->next_block = b;
+        else
+            super->freelist = b;
+        prev = b;
+    }
+    free(seen);
+    addUnwrittenExtent();
+    return 0;
+}
+
+/** Append block ID to FILE's block map, enlarging it if necessary.
+    Returns 0 on success or -ENOMEM.  */
+static int appendToBlockMap(sfs_mem_file_t *file, block_id id)
+{
+    if (file->mapLength == file->mapCapacity)
+    {
+        uint32_t cap = file->mapCapacity ? file->mapCapacity * 2 : 4;
+        block_id *map = realloc(file->blockMap, (size_t)cap * sizeof *map);
+        if (map == NULL)
+            return -ENOMEM;
+        file->blockMap = map;
+        file->mapCapacity = cap;
+    }
+    file->blockMap[file->mapLength++] = id;
+    return 0;
+}
+
+/** Discard FILE's block map, if it has one.  */
+static void dropBlockMap(sfs_mem_file_t *file)
+{
+    free(file->blockMap);
+    file->blockMap = NULL;
+    file->mapLength = 0;
+    file->mapCapacity = 0;
+}
+
+/** Extend FILE's block map, or make one, so that it reaches block
+    number IDX of the file, counting from zero, which must exist.  Only
+    the part of the chain that the map does not cover yet is walked.
+    Returns 0 on success or -ENOMEM, in which case the map may have
+    been extended only part of the way.  The caller must hold
+    'mapLock'.  */
+static int mapBlocksThrough(sfs_mem_file_t *file, uint32_t idx)
+{
+    uint32_t hops = 0;
+    int status = 0;
+    while (file->mapLength <= idx && status == 0)
+    {
+        block_id id = file->diskFile->first_block;
+        if (file->mapLength > 0)
+        {
+            id = accessBlock(file->blockMap[file->mapLength - 1])->next_block;
+            hops++;
+        }
+        assert(id != 0);
+        status = appendToBlockMap(file, id);
+    }
+    countStat(STAT_CHAIN_HOPS, hops);
+    return status;
+}
+
+/** Record that the chain starting at FIRST_NEW has just been attached
+    to the end of FILE.  If FILE's block map covers the rest of the
+    chain, extend it; if the map cannot be enlarged, discard it so that
+    it will be rebuilt later.  A map that stops short of the old end of
+    the chain is left alone.  */
+static void extendBlockMap(sfs_mem_file_t *file, block_id first_new)
+{
+    if (file->mapLength == 0 ||
+        accessBlock(file->blockMap[file->mapLength - 1])->next_block !=
+            first_new)
+        return;
+
+    uint32_t hops = 0;
+    for (block_id id = first_new; id != 0; id = accessBlock(id)->next_block)
+    {
+        hops++;
+        if (appendToBlockMap(file, id) < 0)
+        {
+            dropBlockMap(file);
+            break;
+        }
+    }
+    countStat(STAT_CHAIN_HOPS, hops);
+}
+
+/** Return the ID of block number IDX of FILE, counting from zero.  For
+    any block but the first, uses the file's block map, extending it as
+    far as IDX if necessary.  If there is not enough memory for the
+    map, falls back to walking the chain.  The caller must hold FILE's
+    lock, in either mode.  */
+static block_id lookupBlock(sfs_mem_file_t *file, uint32_t idx)
+{
+    if (idx == 0)
+        return file->diskFile->first_block;
+    pthread_mutex_lock(&file->mapLock);
+    if (mapBlocksThrough(file, idx) == 0)
+    {
+        block_id id = file->blockMap[idx];
+        pthread_mutex_unlock(&file->mapLock);
+        return id;
+    }
+    pthread_mutex_unlock(&file->mapLock);
+
+    block_id id = file->diskFile->first_block;
+    for (uint32_t i = 0; i < idx; i++)
+        id = accessBlock(id)->next_block;
+    assert(id != 0);
+    countStat(STAT_CHAIN_HOPS, idx);
+    return id;
+}
+
+/** Return the ID of the last block of FILE, which must not be packed.
+    Only the first call after the file is opened has to look for it.
+    The caller must hold FILE's lock, in either mode.  */
+static block_id tailBlock(sfs_mem_file_t *file)
+{
+    assert(file->packCell == NO_CELL);
+    pthread_mutex_lock(&file->mapLock);
+    block_id id = file->lastBlock;
+    pthread_mutex_unlock(&file->mapLock);
+    if (id != 0)
+    {
+        assert(accessBlock(id)->next_block == 0);
+        return id;
+    }
+
+    id = lookupBlock(file, blockIndexOf(file->diskFile->size));
+    pthread_mutex_lock(&file->mapLock);
+    file->lastBlock = id;
+    pthread_mutex_unlock(&file->mapLock);
+    return id;
+}
+
+/** Return the ID of the block holding directory entry E.  */
+static block_id blockOfEntry(const sfs_dir_entry_t *e)
+{
+    const char *base = (const char *)accessSuperBlock();
+    return (block_id)((size_t)((const char *)e - base) / getBlockSize());
+}
+
+/** Add the LENGTH blocks starting at START to FILE's dirty set, merging
+    them with any runs they touch.  The caller must hold FILE's lock
+    exclusively.  */
+static void markDirty(sfs_mem_file_t *file, block_id start, uint32_t length)
+{
+    if (file->dirtyAll)
+        return;
+
+    // Find the first run that ends at or after START.  It, and the
+    // runs after it that begin at or before END, merge with the new one.
+    sfs_extent_t *runs = file->dirty;
+    block_id end = start + length;
+    uint32_t lo = 0, hi = file->dirtyCount;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (runs[mid].start + runs[mid].length < start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    uint32_t j = lo;
+    for (; j < file->dirtyCount && runs[j].start <= end; j++)
+    {
+        if (runs[j].start < start)
+            start = runs[j].start;
+        if (runs[j].start + runs[j].length > end)
+            end = runs[j].start + runs[j].length;
+    }
+
+    if (j == lo)
+    {
+        // Nothing to merge with; make room for a new run.
+        if (file->dirtyCount == file->dirtyCapacity)
+        {
+            uint32_t cap = file->dirtyCapacity ? file->dirtyCapacity * 2 : 4;
+            runs = realloc(runs, (size_t)cap * sizeof *runs);
+            if (runs == NULL)
+            {
+                file->dirtyAll = 1;
+                return;
+            }
+            file->dirty = runs;
+            file->dirtyCapacity = cap;
+        }
+        memmove(&runs[lo + 1], &runs[lo],
+                (file->dirtyCount - lo) * sizeof *runs);
+        file->dirtyCount++;
+    }
+    else
+    {
+        memmove(&runs[lo + 1], &runs[j], (file->dirtyCount - j) * sizeof *runs);
+        file->dirtyCount -= j - lo - 1;
+    }
+    runs[lo].start = start;
+    runs[lo].length = end - start;
+}
+
+/** Add the LENGTH blocks starting at START, whose data has just been
+    written, to FILE's dirty set, along with the part of the checksum
+    table that covers them, if the image has one.  The caller must hold
+    FILE's lock exclusively.  */
+static void markWritten(sfs_mem_file_t *file, block_id start,
+                        uint32_t length)
+{
+    markDirty(file, start, length);
+    if (checksumsEnabled)
+    {
+        block_id first = checksumBlockOf(start);
+        markDirty(file, first, checksumBlockOf(start + length - 1) - first + 1);
+    }
+}
+
+/** Empty FILE's dirty set.  The caller must hold FILE's lock in either
+    mode.  */
+static void clearDirty(sfs_mem_file_t *file)
+{
+    pthread_mutex_lock(&file->mapLock);
+    file->dirtyCount = 0;
+    file->dirtyAll = 0;
+    pthread_mutex_unlock(&file->mapLock);
+}
+
+/** Flush FILE's dirty set to stable storage, and then empty it.  The
+    set is only emptied once all of it has been flushed, so that a
+    concurrent sfs_fsync on the same file cannot return early.  Returns
+    0 or -EIO.  The caller must hold FILE's lock in either mode.  */
+static int flushDirty(sfs_mem_file_t *file)
+{
+    pthread_mutex_lock(&file->mapLock);
+    uint32_t n = file->dirtyCount;
+    int all = file->dirtyAll;
+    pthread_mutex_unlock(&file->mapLock);
+
+    int status = 0;
+    if (all)
+        status = syncBlocks(0, accessSuperBlock()->n_blocks);
+    else
+    {
+        // msync works a page at a time, so runs less than a page apart
+        // are flushed together.
+        uint32_t gap =
+            (uint32_t)((size_t)sysconf(_SC_PAGESIZE) / getBlockSize());
+        uint32_t i = 0;
+        while (status == 0 && i < n)
+        {
+            block_id start = file->dirty[i].start;
+            block_id end = start + file->dirty[i].length;
+            for (i++; i < n && file->dirty[i].start <= end + gap; i++)
+                end = file->dirty[i].start + file->dirty[i].length;
+            status = syncBlocks(start, end - start);
+        }
+    }
+    if (status == 0)
+        clearDirty(file);
+    return status;
+}
+
+/** Look up "file descriptor" FD.  Returns NULL if it is out of range,
+    not open, or being closed.  The caller must hold 'openLock'.  */
+static sfs_mem_filedesc_t *getFileDesc(int fd)
+{
+    if (fd < 0 || (uint32_t)fd >= openFileLimit)
+        return NULL;
+    sfs_mem_filedesc_t *tFile = &openFileDescTable[fd];
+    if (tFile->fileEntry == NULL || atomic_load(&tFile->closing))
+        return NULL;
+    return tFile;
+}
+
+/** Look up "file descriptor" FD for an operation that does not involve
+    its file position.  Returns NULL if FD is not open.  Otherwise the
+    descriptor is pinned, which keeps it and its file from going away,
+    until the caller passes it to unpinFileDesc.  'openLock' is only
+    held while the descriptor is looked up, so that opening and closing
+    files does not wait for operations in progress on other ones.  */
+static sfs_mem_filedesc_t *pinFileDesc(int fd)
+{
+    pthread_rwlock_rdlock(&openLock);
+    sfs_mem_filedesc_t *tFile = getFileDesc(fd);
+    if (tFile != NULL)
+        atomic_fetch_add(&tFile->pinCount, 1);
+    pthread_rwlock_unlock(&openLock);
+    return tFile;
+}
+
+/** Undo pinFileDesc, and if TFILE is being closed and this was the last
+    operation in progress on it, wake up the thread closing it.  */
+static void unpinFileDesc(sfs_mem_filedesc_t *tFile)
+{
+    if (atomic_fetch_sub(&tFile->pinCount, 1) == 1 &&
+        atomic_load(&tFile->closing))
+    {
+        pthread_mutex_lock(&unpinLock);
+        pthread_cond_broadcast(&unpinned);
+        pthread_mutex_unlock(&unpinLock);
+    }
+}
+
+/** Look up "file descriptor" FD for an operation on it, and lock it.
+    Returns NULL, holding no locks, if FD is not open.  Otherwise the
+    descriptor is pinned, and its own lock is held, until the caller
+    passes it to releaseFileDesc.  */
+static sfs_mem_filedesc_t *acquireFileDesc(int fd)
+{
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile != NULL)
+        pthread_mutex_lock(&tFile->lock);
+    return tFile;
+}
+
+/** Release the locks taken by acquireFileDesc.  */
+static void releaseFileDesc(sfs_mem_filedesc_t *tFile)
+{
+    pthread_mutex_unlock(&tFile->lock);
+    unpinFileDesc(tFile);
+}
+
+/** Return the directory entry in slot number SLOT.  */
+static sfs_dir_entry_t *dirEntry(uint32_t slot)
+{
+    assert(slot < dirSlotCount);
+    uint32_t blk = slot / dirEntriesPerBlock;
+    uint32_t idx = slot % dirEntriesPerBlock;
+    if (blk == 0)
+        return &accessSuperBlock()->files[idx];
+    return &accessDirBlock(dirBlocks[blk])->files[idx];
+}
+
+/** Hash function for file names (32-bit FNV-1a).  Looks at no more
+    than SFS_FILE_NAME_SIZE_LIMIT bytes of NAME.  */
+static uint32_t hashName(const char *name)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < SFS_FILE_NAME_SIZE_LIMIT && name[i]; i++)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Look up NAME, whose hash is HASH, in the name index.  Returns its
+    directory slot, or NO_SLOT if there is no such file.  */
+static uint32_t findFile(const char *name, uint32_t hash)
+{
+    uint32_t slot = NO_SLOT;
+    uint32_t probes = 1;
+    for (uint32_t b = hash & nameIndexMask; nameIndex[b].slot != 0;
+         b = (b + 1) & nameIndexMask, probes++)
+    {
+        if (nameIndex[b].hash != hash)
+            continue;
+        uint32_t s = nameIndex[b].slot - 1;
+        if (strncmp(dirEntry(s)->name, name, SFS_FILE_NAME_SIZE_LIMIT) == 0)
+        {
+            slot = s;
+            break;
+        }
+    }
+    countStat(STAT_LOOKUPS, 1);
+    countStat(STAT_LOOKUP_PROBES, probes);
+    return slot;
+}
+
+/** Add directory slot SLOT, whose name has hash HASH, to the name
+    index.  */
+static void indexName(uint32_t slot, uint32_t hash)
+{
+    uint32_t b = hash & nameIndexMask;
+    while (nameIndex[b].slot != 0)
+        b = (b + 1) & nameIndexMask;
+    nameIndex[b].hash = hash;
+    nameIndex[b].slot = slot + 1;
+}
+
+/** Remove directory slot SLOT, whose name has hash HASH, from the name
+    index.  Entries later in the same probe sequence are shifted back
+    to fill the gap, so that no tombstones are needed.  */
+static void unindexName(uint32_t slot, uint32_t hash)
+{
+    uint32_t b = hash & nameIndexMask;
+    while (nameIndex[b].slot != slot + 1)
+    {
+        assert(nameIndex[b].slot != 0);
+        b = (b + 1) & nameIndexMask;
+    }
+
+    uint32_t hole = b;
+    for (b = (b + 1) & nameIndexMask; nameIndex[b].slot != 0;
+         b = (b + 1) & nameIndexMask)
+    {
+        // The entry in bucket b may move into the hole only if its
+        // home bucket is not cyclically within (hole, b].
+        uint32_t home = nameIndex[b].hash & nameIndexMask;
+        if (((b - home) & nameIndexMask) >= ((b - hole) & nameIndexMask))
+        {
+            nameIndex[hole] = nameIndex[b];
+            hole = b;
+        }
+    }
+    nameIndex[hole].hash = 0;
+    nameIndex[hole].slot = 0;
+}
+
+/** Return the lowest-numbered free directory slot, or NO_SLOT if the
+    directory is full.  */
+static uint32_t findFreeSlot(void)
+{
+    uint32_t n_words = (dirSlotCount + 63) / 64;
+    for (; freeSlotHint < n_words; freeSlotHint++)
+    {
+        uint64_t w = freeSlots[freeSlotHint];
+        if (w != 0)
+            return freeSlotHint * 64 + (uint32_t)__builtin_ctzll(w);
+    }
+    return NO_SLOT;
+}
+
+/** Mark directory slot SLOT as in use or free in the free-slot bitmap.  */
+static void setSlotFree(uint32_t slot, int isFree)
+{
+    uint64_t bit = (uint64_t)1 << (slot % 64);
+    if (isFree)
+    {
+        freeSlots[slot / 64] |= bit;
+        if (slot / 64 < freeSlotHint)
+            freeSlotHint = slot / 64;
+    }
+    else
+    {
+        freeSlots[slot / 64] &= ~bit;
+    }
+}
+
+/** Make room in the in-memory directory state for N_BLOCKS directory
+    blocks, that is, N_BLOCKS * dirEntriesPerBlock slots.  New slots
+    are marked in use, and the name index is enlarged and rehashed if
+    it would otherwise be more than half full.  Returns 0 or -ENOMEM;
+    on failure, whatever was enlarged stays enlarged, which is
+    harmless.  */
+static int reserveDirSlots(uint32_t n_blocks)
+{
+    uint32_t n_slots = (uint32_t)((uint64_t)n_blocks * dirEntriesPerBlock);
+
+    block_id *blocks = realloc(dirBlocks, (size_t)n_blocks * sizeof *blocks);
+    if (blocks == NULL)
+        return -ENOMEM;
+    dirBlocks = blocks;
+
+    uint32_t oldWords = (dirSlotCount + 63) / 64;
+    uint32_t newWords = (n_slots + 63) / 64;
+    uint64_t *bits = realloc(freeSlots, (size_t)newWords * sizeof *bits);
+    if (bits == NULL)
+        return -ENOMEM;
+    memset(bits + oldWords, 0, (size_t)(newWords - oldWords) * sizeof *bits);
+    freeSlots = bits;
+
+    pthread_rwlock_wrlock(&openLock);
+    sfs_mem_file_t **files =
+        realloc(openFileTable, (size_t)n_slots * sizeof *files);
+    if (files != NULL)
+    {
+        memset(files + dirSlotCount, 0,
+               (size_t)(n_slots - dirSlotCount) * sizeof *files);
+        openFileTable = files;
+    }
+    block_id *tails = NULL;
+    if (files != NULL)
+        tails = realloc(fileTails, (size_t)n_slots * sizeof *tails);
+    if (tails != NULL)
+    {
+        memset(tails + dirSlotCount, 0,
+               (size_t)(n_slots - dirSlotCount) * sizeof *tails);
+        fileTails = tails;
+    }
+    int ring = tails != NULL;
+    for (uint32_t k = 0; ring && k < RING_SEGMENTS; k++)
+    {
+        uint64_t start = RING_SEGMENT_BASE * (((uint64_t)1 << k) - 1);
+        if (start >= n_slots || shareRing[k] != NULL)
+            continue;
+        shareRing[k] =
+            malloc(((size_t)RING_SEGMENT_BASE << k) * sizeof **shareRing);
+        ring = shareRing[k] != NULL;
+    }
+    if (ring)
+    {
+        for (uint32_t slot = dirSlotCount; slot < n_slots; slot++)
+            atomic_init(ringNext(slot), slot);
+    }
+    pthread_rwlock_unlock(&openLock);
+    if (!ring)
+        return -ENOMEM;
+
+    // Bucket numbers are 32 bits, so the index can't be kept half full
+    // if the directory is larger than 2**31 slots.
+    uint64_t n_buckets = (uint64_t)nameIndexMask + 1;
+    uint64_t want = sizeMin(2 * (uint64_t)n_slots, (uint64_t)1 << 32);
+    if (nameIndex == NULL || n_buckets < want)
+    {
+        while (n_buckets < want)
+            n_buckets *= 2;
+        sfs_name_bucket_t *oldIndex = nameIndex;
+        uint32_t oldMask = nameIndexMask;
+        nameIndex = calloc((size_t)n_buckets, sizeof *nameIndex);
+        if (nameIndex == NULL)
+        {
+            nameIndex = oldIndex;
+            return -ENOMEM;
+        }
+        nameIndexMask = (uint32_t)(n_buckets - 1);
+        if (oldIndex != NULL)
+        {
+            for (uint32_t b = 0; b <= oldMask; b++)
+                if (oldIndex[b].slot != 0)
+                    indexName(oldIndex[b].slot - 1, oldIndex[b].hash);
+            free(oldIndex);
+        }
+    }
+
+    dirSlotCount = n_slots;
+    return 0;
+}
+
+/** Store the location of directory entry E in the 'block' and 'count'
+    fields of journal record REC, as the directory entry records
+    expect.  */
+static void setEntryLocation(sfs_journal_rec_t *rec, const sfs_dir_entry_t *e)
+{
+    const char *base = (const char *)accessSuperBlock();
+    size_t offset = (size_t)((const char *)e - base);
+    rec->block = blockOfEntry(e);
+    rec->count = (uint32_t)(offset % getBlockSize() / sizeof *e - 1);
+}
+
+/** Log and carry out the N records RECS as a group, together with a
+    record of kind KIND for each run of consecutive blocks in the chain
+    starting at FIRST (if any, and if the disk image has a journal).
+    KIND is SFS_JREC_CLAIM, when RECS attach the chain to something, or
+    SFS_JREC_LIMBO, when they detach it.  They must be one group, since
+    a crash between the claims and the attaching records, or between
+    the detaching records and the limbo ones, would lose the blocks;
+    journalApply only splits a group that is too big for the whole log.
+    If there is not enough memory for a group that large, the records
+    are carried out JOURNAL_GROUP at a time instead, claims first and
+    limbo records last, and a crash in between can lose blocks, as it
+    can when journalApply runs out of memory.  */
+static void applyWithChain(const sfs_journal_rec_t *recs, uint32_t n,
+                           uint16_t kind, block_id first)
+{
+    assert(n < JOURNAL_GROUP);
+    uint32_t runs = 0;
+    block_id id = journalEnabled() ? first : 0;
+    while (id != 0)
+    {
+        sfs_block_hdr_t *b = accessBlock(id);
+        while (b->next_block == id + 1)
+            b = accessBlock(++id);
+        runs++;
+        id = b->next_block;
+    }
+
+    sfs_journal_rec_t small[JOURNAL_GROUP];
+    sfs_journal_rec_t *group = small;
+    uint32_t room = JOURNAL_GROUP;
+    if (n + runs > JOURNAL_GROUP)
+    {
+        sfs_journal_rec_t *big = malloc((n + runs) * sizeof *big);
+        if (big != NULL)
+        {
+            group = big;
+            room = n + runs;
+        }
+    }
+
+    uint32_t len = 0;
+    uint32_t reserve = kind == SFS_JREC_CLAIM ? n : 0;
+    if (kind == SFS_JREC_LIMBO)
+    {
+        memcpy(group, recs, n * sizeof *recs);
+        len = n;
+    }
+    id = runs > 0 ? first : 0;
+    while (id != 0)
+    {
+        block_id start = id;
+        sfs_block_hdr_t *b = accessBlock(id);
+        while (b->next_block == id + 1)
+            b = accessBlock(++id);
+        if (len + reserve == room)
+        {
+            journalApply(group, len);
+            len = 0;
+        }
+        group[len++] = (sfs_journal_rec_t){
+            .kind = kind, .block = start, .count = id - start + 1};
+        id = b->next_block;
+    }
+
+    if (kind == SFS_JREC_CLAIM)
+    {
+        memcpy(&group[len], recs, n * sizeof *recs);
+        len += n;
+    }
+    journalApply(group, len);
+    if (group != small)
+        free(group);
+}
+
+/** Add another block to the end of the root directory.  Returns 0 on
+    success, -ENOSPC if the disk or the directory is full, or -ENOMEM.  */
+static int growDirectory(void)
+{
+    if (dirSlotCount >= DIR_SLOT_LIMIT)
+        return -ENOSPC;
+
+    uint32_t oldSlots = dirSlotCount;
+    int status = reserveDirSlots(dirBlockCount + 1);
+    if (status < 0)
+        return status;
+    dirSlotCount = oldSlots;
+
+    block_id last = dirBlocks[dirBlockCount - 1];
+    block_id id =
+        allocateBlocks(1, SFS_BLOCK_TYPE_DIR, last != 0 ? last + 1 : 0);
+    if (id == 0)
+        return -ENOSPC;
+
+    sfs_journal_rec_t rec = {.kind = SFS_JREC_DIRGROW,
+                             .block = id,
+                             .prev = last};
+    applyWithChain(&rec, 1, SFS_JREC_CLAIM, id);
+
+    dirBlocks[dirBlockCount++] = id;
+    dirSlotCount += dirEntriesPerBlock;
+    for (uint32_t slot = oldSlots; slot < dirSlotCount; slot++)
+        setSlotFree(slot, 1);
+    return 0;
+}
+
+/** Build the name index and free-slot bitmap by scanning the directory.
+    Returns -EUCLEAN if the chain of directory blocks is malformed.  */
+static int buildDirIndex(void)
+{
+    sfs_filesystem_t *super = accessSuperBlock();
+
+    uint32_t n_blocks = 1;
+    for (block_id id = super->next_rootdir; id != 0;
+         id = accessBlock(id)->next_block)
+    {
+        if (id >= super->n_blocks || n_blocks >= super->n_blocks ||
+            memcmp(accessBlock(id)->type, SFS_BLOCK_TYPE_DIR, 4) != 0)
+            return -EUCLEAN;
+        n_blocks++;
+    }
+    if ((uint64_t)n_blocks * dirEntriesPerBlock > DIR_SLOT_LIMIT)
+        return -EUCLEAN;
+
+    int status = reserveDirSlots(n_blocks);
+    if (status < 0)
+        return status;
+
+    dirBlocks[0] = 0;
+    dirBlockCount = 1;
+    for (block_id id = super->next_rootdir; id != 0;
+         id = accessBlock(id)->next_block)
+        dirBlocks[dirBlockCount++] = id;
+
+    freeSlotHint = 0;
+    for (uint32_t slot = 0; slot < dirSlotCount; slot++)
+    {
+        sfs_dir_entry_t *e = dirEntry(slot);
+        if (e->first_block != 0)
+            indexName(slot, hashName(e->name));
+        else
+            setSlotFree(slot, 1);
+    }
+    return 0;
+}
+
+/** Check that NAME is short enough to be stored in a directory entry.
+    It can only have 23 characters, because the string on disk is NUL
+    terminated.  */
+static int checkName(const char *name)
+{
+    if (strnlen(name, SFS_FILE_NAME_SIZE_LIMIT) + 1 > SFS_FILE_NAME_SIZE_LIMIT)
+        return -ENAMETOOLONG;
+    return 0;
+}
+
+/** Report whether block ID, the first block of some file, is a packed
+    block.  */
+static int isPackBlock(block_id id)
+{
+    return packingEnabled &&
+           memcmp(accessBlock(id)->type, SFS_BLOCK_TYPE_PACK, 4) == 0;
+}
+
+/** Report whether block ID, the first block of some file, begins a
+    compressed stream (see sfs_compressed_hdr_t).  */
+static int isCompressedBlock(block_id id)
+{
+    return memcmp(accessBlock(id)->type, SFS_BLOCK_TYPE_COMPRESSED, 4) == 0;
+}
+
+/** Return the header of the compressed stream that begins in block ID.  */
+static sfs_compressed_hdr_t *compressedHeader(block_id id)
+{
+    return (sfs_compressed_hdr_t *)(void *)chainData(id);
+}
+
+/** Return the number of frames that a file of SIZE bytes is cut into
+    when it is compressed, and the size of the header of its stream.  */
+static uint32_t frameCount(size_t size)
+{
+    return (uint32_t)((size + SFS_FRAME_SIZE - 1) / SFS_FRAME_SIZE);
+}
+
+static size_t compressedHeaderSize(uint32_t frames)
+{
+    return offsetof(sfs_compressed_hdr_t, frame_end) +
+           (size_t)frames * sizeof(uint32_t);
+}
+
+/** Return the number of blocks in the chain of the file whose directory
+    entry is E, which must have a chain of its own.  */
+static uint32_t chainLength(const sfs_dir_entry_t *e)
+{
+    if (isCompressedBlock(e->first_block))
+        return compressedHeader(e->first_block)->blocks;
+    return blockIndexOf(e->size) + 1;
+}
+
+/** Report whether FILE's data is in a chain of ordinary file blocks,
+    rather than in a packed block or compressed, so that a descriptor
+    can keep track of the block it is positioned in.  */
+static int inPlainBlocks(const sfs_mem_file_t *file)
+{
+    return file->packCell == NO_CELL && !file->compressed;
+}
+
+/** Return the number of the first cell of packed block ID that belongs
+    to OWNER (as in sfs_pack_cell_t), or NO_CELL if there is none.  The
+    caller must hold 'packLock'.  */
+static uint32_t findCell(block_id id, uint32_t owner)
+{
+    sfs_block_pack_t *p = accessPackBlock(id);
+    for (uint32_t i = 0; i < cellsPerBlock; i++)
+        if (p->cells[i].owner == owner)
+            return i;
+    return NO_CELL;
+}
+
+/** Return a pointer to the data of FILE, which is in a packed block.  */
+static char *cellData(sfs_mem_file_t *file)
+{
+    sfs_block_pack_t *p = accessPackBlock(file->diskFile->first_block);
+    return p->cells[file->packCell].data;
+}
+
+/** Put packed block ID, which has just gone from having no free cells
+    to having one, back on 'packStack'.  The caller must hold
+    'packLock'.  */
+static void pushPackBlock(block_id id)
+{
+    assert(packStackCount < packStackCapacity);
+    packStack[packStackCount++] = id;
+}
+
+/** Give the file in directory slot SLOT a free cell of a packed block,
+    making a new packed block if none has one, by adding records to
+    the *N records at RECS, for the caller to carry out before
+    releasing 'packLock'.  A block that has no files in it is in limbo,
+    so it is claimed as well.  The block's ID is stored in *ID.
+    Returns 0, -ENOSPC or -ENOMEM.  The caller must hold 'packLock'.  */
+static int takeCell(sfs_journal_rec_t *recs, uint32_t *n, uint32_t slot,
+                    block_id *id)
+{
+    block_id blk;
+    uint32_t cell = 0;
+    uint32_t freeCells = cellsPerBlock;
+    if (packStackCount > 0)
+    {
+        blk = packStack[packStackCount - 1];
+        cell = findCell(blk, 0);
+        freeCells = countFreeCells(blk);
+        assert(cell != NO_CELL);
+    }
+    else
+    {
+        if (packBlockCount == packStackCapacity)
+        {
+            uint32_t cap = packStackCapacity ? packStackCapacity * 2 : 16;
+            block_id *stack = realloc(packStack, (size_t)cap * sizeof *stack);
+            if (stack == NULL)
+                return -ENOMEM;
+            packStack = stack;
+            packStackCapacity = cap;
+        }
+        blk = allocateNow(1, SFS_BLOCK_TYPE_FILE, 0);
+        if (blk == 0)
+            return -ENOSPC;
+        packBlockCount++;
+        packStack[packStackCount++] = blk;
+        recs[(*n)++] = (sfs_journal_rec_t){.kind = SFS_JREC_PACK,
+                                           .block = blk};
+    }
+
+    if (freeCells == cellsPerBlock && journalEnabled())
+        recs[(*n)++] = (sfs_journal_rec_t){.kind = SFS_JREC_CLAIM,
+                                           .block = blk,
+                                           .count = 1};
+    recs[(*n)++] = (sfs_journal_rec_t){.kind = SFS_JREC_CELL,
+                                       .block = blk,
+                                       .count = cell,
+                                       .prev = slot + 1};
+    if (freeCells == 1)
+        packStackCount--;
+    *id = blk;
+    return 0;
+}
+
+/** Add a record freeing cell CELL of packed block ID to the *N records
+    at RECS, for the caller to carry out before releasing 'packLock',
+    together with one putting the block in limbo if that leaves it
+    empty and the disk image has a journal.  Returns 1 if the block has
+    no free cell yet, in which case the caller must push it back on
+    'packStack' once the records have been carried out.  The caller
+    must hold 'packLock'.  */
+static int releaseCell(sfs_journal_rec_t *recs, uint32_t *n, block_id id,
+                       uint32_t cell)
+{
+    uint32_t freeCells = countFreeCells(id);
+    recs[(*n)++] = (sfs_journal_rec_t){.kind = SFS_JREC_CELL,
+                                       .block = id,
+                                       .count = cell};
+    if (freeCells + 1 == cellsPerBlock && journalEnabled())
+        recs[(*n)++] = (sfs_journal_rec_t){.kind = SFS_JREC_LIMBO,
+                                           .block = id,
+                                           .count = 1};
+    return freeCells == 0;
+}
+
+/** Move FILE, which is in a cell of a packed block, into a block of its
+    own, so that it can grow past SFS_PACKED_FILE_MAX bytes.  Returns 0
+    or -ENOSPC.  The caller must hold FILE's lock exclusively.  */
+static int unpackFile(sfs_mem_file_t *file)
+{
+    block_id packId = file->diskFile->first_block;
+    block_id id = allocateBlocks(1, SFS_BLOCK_TYPE_FILE, 0);
+    if (id == 0)
+        return -ENOSPC;
+    memcpy(accessFileBlock(id)->data, cellData(file), file->diskFile->size);
+    if (checksumsEnabled)
+        *checksumSlot(id) = blockChecksum(id);
+
+    // The new block is attached and the cell given up in one group, so
+    // that a crash leaves the file in one place or the other.
+    sfs_journal_rec_t recs[4];
+    uint32_t n = 0;
+    if (journalEnabled())
+        recs[n++] = (sfs_journal_rec_t){.kind = SFS_JREC_CLAIM,
+                                        .block = id,
+                                        .count = 1};
+    recs[n] = (sfs_journal_rec_t){.kind = SFS_JREC_MOVE, .next = id};
+    setEntryLocation(&recs[n++], file->diskFile);
+    pthread_mutex_lock(&packLock);
+    int wasFull = releaseCell(recs, &n, packId, file->packCell);
+    journalApply(recs, n);
+    if (wasFull)
+        pushPackBlock(packId);
+    pthread_mutex_unlock(&packLock);
+
+    file->packCell = NO_CELL;
+    file->lastBlock = id;
+    markWritten(file, id, 1);
+    markDirty(file, blockOfEntry(file->diskFile), 1);
+    return 0;
+}
+
+/** Check every file that is kept in a packed block, if the disk image
+    may have any, and put each packed block with a free cell on
+    'packStack'.  Returns 0, -EUCLEAN if a directory entry refers to a
+    packed block that does not have a cell for it, or to no block at
+    all, or -ENOMEM.  */
+static int buildPackIndex(void)
+{
+    packingEnabled = imagePacksFiles();
+    cellsPerBlock = SFS_PACK_CELLS_PER_BLOCK(getBlockSize());
+    packStackCount = 0;
+    packBlockCount = 0;
+    if (!packingEnabled)
+        return 0;
+
+    // Several files can share a block, so note each one in a bitmap
+    // the first time it is seen.
+    uint32_t n_blocks = accessSuperBlock()->n_blocks;
+    uint64_t *seen = calloc((n_blocks + 63) / 64, sizeof *seen);
+    packStack = malloc((size_t)dirSlotCount * sizeof *packStack);
+    if (seen == NULL || packStack == NULL)
+    {
+        free(seen);
+        return -ENOMEM;
+    }
+    packStackCapacity = dirSlotCount;
+
+    int status = 0;
+    for (uint32_t slot = 0; slot < dirSlotCount && status == 0; slot++)
+    {
+        block_id id = dirEntry(slot)->first_block;
+        if (id == 0)
+            continue;
+        if (id >= n_blocks)
+            status = -EUCLEAN;
+        else if (!isPackBlock(id))
+            continue;
+        else if (dirEntry(slot)->size > SFS_PACKED_FILE_MAX ||
+                 findCell(id, slot + 1) == NO_CELL)
+            status = -EUCLEAN;
+        else if (!(seen[id / 64] & ((uint64_t)1 << (id % 64))))
+        {
+            seen[id / 64] |= (uint64_t)1 << (id % 64);
+            packBlockCount++;
+            if (countFreeCells(id) > 0)
+                packStack[packStackCount++] = id;
+        }
+    }
+    free(seen);
+    return status;
+}
+
+/** A directory slot, and the first block of its file, for
+    buildShareIndex.  */
+typedef struct sfs_slot_chain_t
+{
+    block_id first;
+    uint32_t slot;
+} sfs_slot_chain_t;
+
+static int compareSlotChains(const void *a, const void *b)
+{
+    const sfs_slot_chain_t *x = a, *y = b;
+    if (x->first != y->first)
+        return x->first < y->first ? -1 : 1;
+    return (x->slot > y->slot) - (x->slot < y->slot);
+}
+
+/** Link the directory slots of files that share a chain of blocks into
+    rings in 'shareRing', if the disk image may have any, by sorting
+    the files that have chains of their own by first block.  Returns
+    0, -EUCLEAN if files that share a chain differ in size, or
+    -ENOMEM.  */
+static int buildShareIndex(void)
+{
+    if (!imageSharesChains())
+        return 0;
+    sfs_slot_chain_t *chains = malloc((size_t)dirSlotCount * sizeof *chains);
+    if (chains == NULL)
+        return -ENOMEM;
+    uint32_t n = 0;
+    for (uint32_t slot = 0; slot < dirSlotCount; slot++)
+    {
+        block_id id = dirEntry(slot)->first_block;
+        if (id != 0 && !isPackBlock(id))
+            chains[n++] = (sfs_slot_chain_t){id, slot};
+    }
+    qsort(chains, n, sizeof *chains, compareSlotChains);
+
+    int status = 0;
+    for (uint32_t i = 0, j; i < n; i = j)
+    {
+        uint32_t size = dirEntry(chains[i].slot)->size;
+        for (j = i + 1; j < n && chains[j].first == chains[i].first; j++)
+        {
+            if (dirEntry(chains[j].slot)->size != size)
+                status = -EUCLEAN;
+            atomic_init(ringNext(chains[j - 1].slot), chains[j].slot);
+        }
+        atomic_init(ringNext(chains[j - 1].slot), chains[i].slot);
+    }
+    free(chains);
+    return status;
+}
+
+/** Check the header of every compressed file, and that each one's chain
+    is a single run of blocks, as far as its ends show, since reading
+    the file takes both on trust.  Returns 0, or -EUCLEAN if any is
+    wrong.  */
+static int checkCompressedFiles(void)
+{
+    uint32_t n_blocks = accessSuperBlock()->n_blocks;
+    for (uint32_t slot = 0; slot < dirSlotCount; slot++)
+    {
+        sfs_dir_entry_t *e = dirEntry(slot);
+        if (e->first_block == 0)
+            continue;
+        if (e->first_block >= n_blocks)
+            return -EUCLEAN;
+        if (!isCompressedBlock(e->first_block))
+            continue;
+        const sfs_compressed_hdr_t *hdr = compressedHeader(e->first_block);
+        uint32_t frames = frameCount(e->size);
+        block_id last = e->first_block + hdr->blocks - 1;
+        if (hdr->size != e->size || hdr->frame_count != frames ||
+            hdr->blocks == 0 || hdr->blocks > n_blocks - e->first_block ||
+            compressedHeaderSize(frames) >
+                (size_t)hdr->blocks * blockDataSize ||
+            !isCompressedBlock(last) || accessBlock(last)->next_block != 0 ||
+            accessBlock(e->first_block)->prev_block != 0)
+            return -EUCLEAN;
+    }
+    return 0;
+}
+
+/** Take directory slot SLOT out of its ring in 'shareRing', leaving it
+    in a ring of its own.  The caller must hold 'shareLock'.  */
+static void leaveRing(uint32_t slot)
+{
+    uint32_t prev = slot;
+    while (atomic_load(ringNext(prev)) != slot)
+        prev = atomic_load(ringNext(prev));
+    atomic_store(ringNext(prev), atomic_load(ringNext(slot)));
+    atomic_store(ringNext(slot), slot);
+}
+
+/** Delete the file in directory slot SLOT, whose name has hash HASH.
+    The file must not be open.  If ALSO is not NULL, it is a journal
+    record that is carried out in the same group as the removal of the
+    directory entry, so that neither can happen without the other.  */
+static void deleteFile(uint32_t slot, uint32_t hash,
+                       const sfs_journal_rec_t *also)
+{
+    sfs_dir_entry_t *e = dirEntry(slot);
+    block_id firstBlock = e->first_block;
+    unindexName(slot, hash);
+
+    sfs_journal_rec_t recs[4] = {{.kind = SFS_JREC_DIRENT, .entry = *e}};
+    setEntryLocation(&recs[0], e);
+    recs[0].entry.first_block = 0;
+    uint32_t n = 1;
+    if (also != NULL)
+        recs[n++] = *also;
+
+    // A file in a packed block only gives up its cell.
+    if (isPackBlock(firstBlock))
+    {
+        pthread_mutex_lock(&packLock);
+        uint32_t cell = findCell(firstBlock, slot + 1);
+        int wasFull = releaseCell(recs, &n, firstBlock, cell);
+        journalApply(recs, n);
+        if (wasFull)
+            pushPackBlock(firstBlock);
+        pthread_mutex_unlock(&packLock);
+        setSlotFree(slot, 1);
+        return;
+    }
+
+    // A file that shares its chain with others only leaves its ring.
+    // No file can join the ring meanwhile, since that takes 'dirLock'.
+    pthread_mutex_lock(&shareLock);
+    int shared = atomic_load(ringNext(slot)) != slot;
+    if (shared)
+    {
+        journalApply(recs, n);
+        leaveRing(slot);
+    }
+    pthread_mutex_unlock(&shareLock);
+    if (!shared)
+    {
+        applyWithChain(recs, n, SFS_JREC_LIMBO, firstBlock);
+        freeBlocks(firstBlock);
+    }
+    setSlotFree(slot, 1);
+    fileTails[slot] = 0;
+}
+
+/** Take an open file table entry from the pool for the file whose
+    directory entry is at index ENTRYINDEX, with no descriptors yet.
+    There is always one to spare while there is a "file descriptor" to
+    spare.  The caller must hold 'openLock' exclusively.  */
+static sfs_mem_file_t *newFileEntry(uint32_t entryIndex)
+{
+    assert(freeFileEntryCount > 0);
+    sfs_mem_file_t *fileEntry = freeFileEntries[--freeFileEntryCount];
+    fileEntry->diskFile = dirEntry(entryIndex);
+    fileEntry->fileEntryIdx = entryIndex;
+    fileEntry->refCount = 0;
+    fileEntry->packCell = NO_CELL;
+    fileEntry->compressed = 0;
+    fileEntry->lastBlock = fileTails[entryIndex];
+    fileEntry->reserveFirst = 0;
+    fileEntry->reserveLast = 0;
+    fileEntry->reserveCount = 0;
+    if (isPackBlock(fileEntry->diskFile->first_block))
+    {
+        pthread_mutex_lock(&packLock);
+        fileEntry->packCell =
+            findCell(fileEntry->diskFile->first_block, entryIndex + 1);
+        pthread_mutex_unlock(&packLock);
+        assert(fileEntry->packCell != NO_CELL);
+    }
+    else if (isCompressedBlock(fileEntry->diskFile->first_block))
+    {
+        fileEntry->compressed = 1;
+    }
+    fileEntry->keepCompressed = fileEntry->compressed;
+    for (uint32_t i = 0; i < FRAME_CACHE_SLOTS; i++)
+        fileEntry->frames[i].frame = NO_FRAME;
+    fileEntry->nextFrameSlot = 0;
+    return fileEntry;
+}
+
+/** Put FILEENTRY, which has no descriptors left, back in the pool,
+    and free any blocks reserved for it.  The caller must hold
+    'openLock' exclusively.  */
+static void discardFileEntry(sfs_mem_file_t *fileEntry)
+{
+    assert(fileEntry->refCount == 0);
+    openFileTable[fileEntry->fileEntryIdx] = NULL;
+    fileTails[fileEntry->fileEntryIdx] = fileEntry->lastBlock;
+    if (fileEntry->reserveFirst != 0)
+        freeBlocks(fileEntry->reserveFirst);
+    dropBlockMap(fileEntry);
+    for (uint32_t i = 0; i < FRAME_CACHE_SLOTS; i++)
+    {
+        free(fileEntry->frames[i].data);
+        fileEntry->frames[i].data = NULL;
+    }
+    free(fileEntry->dirty);
+    fileEntry->dirty = NULL;
+    fileEntry->dirtyCount = 0;
+    fileEntry->dirtyCapacity = 0;
+    fileEntry->dirtyAll = 0;
+    freeFileEntries[freeFileEntryCount++] = fileEntry;
+}
+
+/** Take an unused "file descriptor" and make it refer to FILEENTRY,
+    positioned at the start of the file, with the SFS_OPEN_* flags
+    FLAGS, and if they include SFS_OPEN_COMPRESS, have the file kept
+    compressed.  Returns the descriptor, or -EMFILE if there are none
+    left.  The caller must hold 'openLock' exclusively.  */
+static int attachFileDesc(sfs_mem_file_t *fileEntry, int flags)
+{
+    if (freeFdCount == 0)
+        return -EMFILE;
+    while (freeFds[freeFdHint] == 0)
+        freeFdHint++;
+    uint64_t w = freeFds[freeFdHint];
+    int fd = (int)(freeFdHint * 64 + (uint32_t)__builtin_ctzll(w));
+    freeFds[freeFdHint] = w & (w - 1);
+    freeFdCount--;
+    sfs_mem_filedesc_t *memDescFile = &openFileDescTable[fd];
+    fileEntry->refCount += 1;
+    if ((flags & SFS_OPEN_COMPRESS) != 0)
+        fileEntry->keepCompressed = 1;
+    // Other descriptors for the file may be in use, so its blocks are
+    // not looked at until the first operation on this one, which holds
+    // the file's lock; see readFile.
+    memDescFile->currBlock = 0;
+    memDescFile->currPos = 0;
+    memDescFile->flags = flags;
+    memDescFile->seqPos = 0;
+    memDescFile->seqCount = 0;
+    memDescFile->aheadPos = 0;
+    pthread_mutex_lock(&descLock);
+    memDescFile->fileEntry = fileEntry;
+    pthread_mutex_unlock(&descLock);
+    return fd;
+}
+
+/** Find or make the open-file-table entry for the existing file on
+    disk whose directory entry is at index 'entryIndex', and return a
+    new "file descriptor" referring to it, with the SFS_OPEN_* flags
+    FLAGS.  The caller must hold 'dirLock', in either mode, so that the
+    file cannot be removed in the meantime.  */
+static int addOpenFileEntry(uint32_t entryIndex, int flags)
+{
+    pthread_rwlock_wrlock(&openLock);
+    if (freeFdCount == 0)
+    {
+        pthread_rwlock_unlock(&openLock);
+        return -EMFILE;
+    }
+
+    sfs_mem_file_t *fileEntry = openFileTable[entryIndex];
+    if (fileEntry == NULL)
+    {
+        fileEntry = newFileEntry(entryIndex);
+        openFileTable[entryIndex] = fileEntry;
+    }
+
+    int fd = attachFileDesc(fileEntry, flags);
+    pthread_rwlock_unlock(&openLock);
+    return fd;
+}
+
+/** Report whether the file in directory slot SLOT is open.  The caller
+    must hold 'dirLock' exclusively, so that the answer cannot change
+    from "no" to "yes" before the caller acts on it.  */
+static int isFileOpen(uint32_t slot)
+{
+    pthread_rwlock_rdlock(&openLock);
+    int open = openFileTable[slot] != NULL;
+    pthread_rwlock_unlock(&openLock);
+    return open;
+}
+
+/** Create a new file named 'fileName', whose hash is 'hash', and
+    return a "file descriptor" for it, with the SFS_OPEN_* flags
+    'flags'.  'emptyIndex' is known to be a free slot in the directory
+    on disk.  The caller must hold 'dirLock' exclusively.  */
+static int createFile(const char *fileName, uint32_t hash, uint32_t emptyIndex,
+                      int flags)
+{
+    sfs_journal_rec_t rec = {.kind = SFS_JREC_DIRENT};
+    setEntryLocation(&rec, dirEntry(emptyIndex));
+    rec.entry.size = 0;
+
+    // Overlength names _should_ have been excluded at a higher level.
+    size_t len = strlen(fileName);
+    assert(len + 1 <= SFS_FILE_NAME_SIZE_LIMIT);
+
+    // Copy the name.  The rest of the space is already clear, because
+    // the whole record is.
+    memcpy(rec.entry.name, fileName, len);
+
+    // Every file must occupy at least one block on disk, even if
+    // it is empty.  This is because we use nonzero 'first_block'
+    // to identify files that do exist.  If the image allows it, the
+    // block is shared with other small files, each in a cell of its
+    // own, so that an empty file costs only a cell.
+    if (packingEnabled)
+    {
+        sfs_journal_rec_t recs[4];
+        uint32_t n = 0;
+        pthread_mutex_lock(&packLock);
+        int status = takeCell(recs, &n, emptyIndex, &rec.entry.first_block);
+        if (status == 0)
+        {
+            recs[n++] = rec;
+            journalApply(recs, n);
+        }
+        pthread_mutex_unlock(&packLock);
+        if (status < 0)
+            return status;
+    }
+    else
+    {
+        rec.entry.first_block = allocateBlocks(1, SFS_BLOCK_TYPE_FILE, 0);
+        if (rec.entry.first_block == 0)
+            return -ENOSPC;
+        applyWithChain(&rec, 1, SFS_JREC_CLAIM, rec.entry.first_block);
+        fileTails[emptyIndex] = rec.entry.first_block;
+    }
+
+    setSlotFree(emptyIndex, 0);
+    indexName(emptyIndex, hash);
+
+    return addOpenFileEntry(emptyIndex, flags);
+}
+
+/** Make a file named NAME, whose hash is HASH, in directory slot DST,
+    which is free, with the same contents as the file in slot SRC.  A
+    file with a chain of blocks of its own is cloned by sharing the
+    chain, which costs only the directory entry; a file in a packed
+    block has its data copied into a cell of its own.  Returns 0,
+    -ENOSPC, -ENOMEM or -EIO.  The caller must hold 'dirLock'
+    exclusively, 'openLock' in either mode, and, if SRC is open, its
+    file's lock in either mode.  */
+static int cloneFile(uint32_t src, uint32_t dst, const char *name,
+                     uint32_t hash)
+{
+    sfs_dir_entry_t *e = dirEntry(src);
+    sfs_journal_rec_t rec = {.kind = SFS_JREC_DIRENT};
+    setEntryLocation(&rec, dirEntry(dst));
+    rec.entry.size = e->size;
+    memcpy(rec.entry.name, name, strlen(name));
+
+    if (isPackBlock(e->first_block))
+    {
+        // The data in a cell is not logged, so it is copied first.  The
+        // last record from takeCell is the one giving DST its cell.  A
+        // new packed block is only typed as one once the records are
+        // carried out, so it cannot go through accessPackBlock yet.
+        sfs_journal_rec_t recs[4];
+        uint32_t n = 0;
+        pthread_mutex_lock(&packLock);
+        uint32_t from = findCell(e->first_block, src + 1);
+        int status = takeCell(recs, &n, dst, &rec.entry.first_block);
+        if (status == 0)
+        {
+            sfs_block_pack_t *to =
+                (sfs_block_pack_t *)(void *)accessBlock(rec.entry.first_block);
+            memcpy(to->cells[recs[n - 1].count].data,
+                   accessPackBlock(e->first_block)->cells[from].data,
+                   e->size);
+            recs[n++] = rec;
+            journalApply(recs, n);
+        }
+        pthread_mutex_unlock(&packLock);
+        if (status < 0)
+            return status;
+    }
+    else
+    {
+        // Whatever SRC's writes have left unflushed is about to be DST's
+        // as well.  Only SRC's dirty set knows about it, and it forgets
+        // it if SRC moves to a copy of the chain, so it is flushed now.
+        sfs_mem_file_t *file = openFileTable[src];
+        int status = file != NULL ? flushDirty(file) : 0;
+        if (status == 0)
+            status = setImageShared();
+        if (status < 0)
+            return status;
+        rec.entry.first_block = e->first_block;
+        pthread_mutex_lock(&shareLock);
+        journalApply(&rec, 1);
+        atomic_store(ringNext(dst), atomic_load(ringNext(src)));
+        atomic_store(ringNext(src), dst);
+        pthread_mutex_unlock(&shareLock);
+
+        if (file != NULL)
+        {
+            pthread_mutex_lock(&file->mapLock);
+            fileTails[dst] = file->lastBlock;
+            pthread_mutex_unlock(&file->mapLock);
+        }
+        else
+        {
+            fileTails[dst] = fileTails[src];
+        }
+    }
+
+    setSlotFree(dst, 0);
+    indexName(dst, hash);
+    return 0;
+}
+
+/** Copy N bytes between the block data at DATA and the buffers at
+    CUR, advancing CUR past them.  If TO_DISK, the bytes go from the
+    buffers to DATA; otherwise they go the other way.  */
+static void iovCopy(sfs_iov_cursor_t *cur, char *data, size_t n, int toDisk)
+{
+    while (n > 0)
+    {
+        size_t avail = cur->iov->iov_len - cur->offset;
+        if (avail == 0)
+        {
+            cur->iov++;
+            cur->offset = 0;
+            continue;
+        }
+        size_t k = sizeMin(avail, n);
+        char *base = (char *)cur->iov->iov_base + cur->offset;
+        if (toDisk)
+            memcpy(data, base, k);
+        else
+            memcpy(base, data, k);
+        data += k;
+        n -= k;
+        cur->offset += k;
+    }
+}
+
+/** Add up the lengths of the IOVCNT buffers described by IOV into
+    *TOTAL.  Returns 0, or -EINVAL if IOVCNT is negative or the total
+    would not fit in ssize_t.  */
+static int iovTotal(const struct iovec *iov, int iovcnt, size_t *total)
+{
+    if (iovcnt < 0)
+        return -EINVAL;
+    size_t sum = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len > (size_t)SSIZE_MAX - sum)
+            return -EINVAL;
+        sum += iov[i].iov_len;
+    }
+    *total = sum;
+    return 0;
+}
+
+/** Copy the N bytes at offset OFF of the compressed stream that begins
+    in block FIRST to BUF, checking each block they come from against
+    its checksum.  Returns 0 or -EIO.  */
+static int streamRead(block_id first, size_t off, void *buf, size_t n)
+{
+    char *out = buf;
+    while (n > 0)
+    {
+        block_id id = first + (block_id)(off / blockDataSize);
+        size_t at = off % blockDataSize;
+        size_t k = sizeMin(blockDataSize - at, n);
+        if (checkBlock(id) < 0)
+            return -EIO;
+        memcpy(out, chainData(id) + at, k);
+        out += k;
+        off += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/** Decode frame number K of FILE, which is compressed, into OUT, which
+    has room for SFS_FRAME_SIZE bytes.  Returns the length of the
+    frame, or -EIO if the stream is damaged.  The caller must hold
+    FILE's lock in either mode.  */
+static ssize_t decodeFrame(sfs_mem_file_t *file, uint32_t k, char *out)
+{
+    block_id first = file->diskFile->first_block;
+    size_t size = file->diskFile->size;
+    size_t want = sizeMin(SFS_FRAME_SIZE, size - (size_t)k * SFS_FRAME_SIZE);
+
+    // The frame runs from the end of the one before, or of the header.
+    uint32_t bounds[2];
+    size_t at = offsetof(sfs_compressed_hdr_t, frame_end) +
+                (size_t)k * sizeof(uint32_t);
+    int status;
+    if (k == 0)
+    {
+        bounds[0] = (uint32_t)compressedHeaderSize(frameCount(size));
+        status = streamRead(first, at, &bounds[1], sizeof bounds[1]);
+    }
+    else
+    {
+        status = streamRead(first, at - sizeof bounds[0], bounds,
+                            sizeof bounds);
+    }
+    if (status < 0)
+        return -EIO;
+    size_t streamSize = (size_t)compressedHeader(first)->blocks * blockDataSize;
+    if (bounds[1] < bounds[0] || bounds[1] > streamSize ||
+        bounds[1] - bounds[0] > want)
+        return -EIO;
+
+    // A frame that was not worth compressing is kept as it is.
+    size_t len = bounds[1] - bounds[0];
+    char packed[SFS_FRAME_SIZE];
+    if (streamRead(first, bounds[0], len == want ? out : packed, len) < 0)
+        return -EIO;
+    if (len != want && lzDecompress(packed, len, out, want) != (ssize_t)want)
+        return -EIO;
+    countStat(STAT_FRAMES_DECODED, 1);
+    return (ssize_t)want;
+}
+
+/** If frame number K of FILE is in its frame cache, copy the N bytes
+    at offset OFF in it to the buffers at CUR, advancing CUR past them,
+    and return 1; otherwise return 0.  The caller must hold FILE's lock
+    in either mode.  */
+static int copyCachedFrame(sfs_mem_file_t *file, uint32_t k, size_t off,
+                           size_t n, sfs_iov_cursor_t *cur)
+{
+    pthread_mutex_lock(&file->frameLock);
+    for (uint32_t i = 0; i < FRAME_CACHE_SLOTS; i++)
+    {
+        if (file->frames[i].frame == k)
+        {
+            iovCopy(cur, file->frames[i].data + off, n, 0);
+            pthread_mutex_unlock(&file->frameLock);
+            countStat(STAT_FRAME_CACHE_HITS, 1);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&file->frameLock);
+    return 0;
+}
+
+/** Put frame number K of FILE, the LEN bytes at DATA, in its frame
+    cache, in place of the one put there longest ago, unless another
+    thread has just put it there, or there is no memory for it.  The
+    caller must hold FILE's lock in either mode.  */
+static void cacheFrame(sfs_mem_file_t *file, uint32_t k, const char *data,
+                       size_t len)
+{
+    pthread_mutex_lock(&file->frameLock);
+    for (uint32_t i = 0; i < FRAME_CACHE_SLOTS; i++)
+    {
+        if (file->frames[i].frame == k)
+        {
+            pthread_mutex_unlock(&file->frameLock);
+            return;
+        }
+    }
+    uint32_t slot = file->nextFrameSlot;
+    if (file->frames[slot].data == NULL)
+        file->frames[slot].data = malloc(SFS_FRAME_SIZE);
+    if (file->frames[slot].data != NULL)
+    {
+        memcpy(file->frames[slot].data, data, len);
+        file->frames[slot].frame = k;
+        file->nextFrameSlot = (slot + 1) % FRAME_CACHE_SLOTS;
+    }
+    pthread_mutex_unlock(&file->frameLock);
+}
+
+/** Empty FILE's frame cache, whose frames no longer describe its data.
+    The caller must hold FILE's lock exclusively.  */
+static void dropFrames(sfs_mem_file_t *file)
+{
+    for (uint32_t i = 0; i < FRAME_CACHE_SLOTS; i++)
+        file->frames[i].frame = NO_FRAME;
+}
+
+/** Copy the N bytes of FILE, which is compressed, from file position
+    POS onward, to the buffers at CUR, a frame at a time, advancing CUR
+    past them.  Each frame comes from the frame cache if it is there,
+    and otherwise is decoded and put there.  Returns 0, or -EIO if a
+    frame cannot be decoded.  The caller must hold FILE's lock in
+    either mode.  */
+static int readCompressed(sfs_mem_file_t *file, size_t pos,
+                          sfs_iov_cursor_t *cur, size_t n)
+{
+    char frame[SFS_FRAME_SIZE];
+    while (n > 0)
+    {
+        uint32_t k = (uint32_t)(pos / SFS_FRAME_SIZE);
+        size_t off = pos % SFS_FRAME_SIZE;
+        size_t len = sizeMin(SFS_FRAME_SIZE - off, n);
+        if (!copyCachedFrame(file, k, off, len, cur))
+        {
+            ssize_t got = decodeFrame(file, k, frame);
+            if (got < 0)
+                return -EIO;
+            iovCopy(cur, frame + off, len, 0);
+            cacheFrame(file, k, frame, (size_t)got);
+        }
+        pos += len;
+        n -= len;
+    }
+    return 0;
+}
+
+/** Read from FILE, starting at file position POS, into the buffers
+    described by IOV, which hold TOTAL bytes between them, stopping
+    early at the end of the file.  BLK is the block that a descriptor
+    positioned at POS would have as its 'currBlock'; the block for the
+    final position is stored in *END_BLK.  Both are 0 if the file is
+    packed or compressed.  Returns the number of bytes read, or -EIO if
+    a block to be read from does not match its checksum, or a frame of
+    a compressed file cannot be decoded, in which case *END_BLK is not
+    set.  The caller must hold FILE's lock in either mode.  */
+static ssize_t readAt(sfs_mem_file_t *file, block_id blk, size_t pos,
+                      const struct iovec *iov, size_t total, block_id *endBlk)
+{
+    // We are going to read 'total' bytes, or the amount of data
+    // remaining in the file, whichever is smaller.
+    size_t fileSize = file->diskFile->size;
+    assert(pos <= fileSize);
+    size_t totalToRead = sizeMin(fileSize - pos, total);
+
+    size_t toRead = totalToRead;
+    sfs_iov_cursor_t cur = {iov, 0};
+
+    // A file in a packed block is all in one piece.
+    if (file->packCell != NO_CELL)
+    {
+        iovCopy(&cur, cellData(file) + pos, toRead, 0);
+        *endBlk = 0;
+        countStat(STAT_BYTES_READ, totalToRead);
+        return (ssize_t)totalToRead;
+    }
+    if (file->compressed)
+    {
+        if (readCompressed(file, pos, &cur, toRead) < 0)
+            return -EIO;
+        *endBlk = 0;
+        countStat(STAT_BYTES_READ, totalToRead);
+        return (ssize_t)totalToRead;
+    }
+
+    // Copy chunks of data from the mapped disk image to the caller's
+    // buffers.
+    //
+    // Each chunk is the smaller of:
     //  - the amount of data still to be read
-    //  - the amount of data between currPos and the end of the current block
-    // This number can be different from BLOCK_DATA_SIZE only for the
+    //  - the amount of data between pos and the end of the current block
+    // This number can be different from blockDataSize only for the
     // very first and the very last chunk of a read operation.
     //
     // Each chunk starts at the beginning of a disk block's data area,
     // except the very first chunk, which will begin in the middle of a
-    // data area if the previous read or seek operation left the file
-    // position not a multiple of BLOCK_DATA_SIZE.
-    sfs_block_file_t *diskBlock = accessFileBlock(tFile->currBlock);
-    size_t blockPos = currPos % BLOCK_DATA_SIZE;
+    // data area if POS is not a multiple of blockDataSize.  The
+    // chain is walked once for the whole request, however many
+    // buffers it is split into.
+    sfs_block_file_t *diskBlock = accessFileBlock(blk);
+    size_t blockPos = pos % blockDataSize;
+    size_t chunkSize = sizeMin(roundUp(pos, blockDataSize) - pos, toRead);
+    uint64_t hops = 0;
+    for (;;)
+    {
+        // The chunk size can be zero on the first iteration, if the
+        // starting position was exactly at a block boundary.
+        if (chunkSize > 0)
+        {
+            if (checkBlock(idOfBlock(&diskBlock->h)) < 0)
+            {
+                countStat(STAT_CHAIN_HOPS, hops);
+                return -EIO;
+            }
+            iovCopy(&cur, &diskBlock->data[blockPos], chunkSize, 0);
+            toRead -= chunkSize;
+        }
+        if (toRead == 0)
+            break;
+
+        blockPos = 0;
+        chunkSize = sizeMin(blockDataSize, toRead);
+        diskBlock = accessFileBlock(diskBlock->h.next_block);
+        hops++;
+        // This could only happen legitimately if we were reading to the end
+        // of a file whose size was an exact multiple of blockDataSize, but
+        // then we would already have exited the loop.
+        assert(diskBlock != NULL);
+    }
+
+    *endBlk = idOfBlock(&diskBlock->h);
+    countStat(STAT_CHAIN_HOPS, hops);
+    countStat(STAT_BYTES_READ, totalToRead);
+    return (ssize_t)totalToRead;
+}
+
+/** Return the ID of block number IDX of the chain starting at FIRST,
+    counting from zero.  */
+static block_id chainBlock(block_id first, uint32_t idx)
+{
+    block_id id = first;
+    for (uint32_t i = 0; i < idx; i++)
+        id = accessBlock(id)->next_block;
+    countStat(STAT_CHAIN_HOPS, idx);
+    return id;
+}
+
+/** Allocate N_BLOCKS blocks for FILE to grow into, as allocateBlocks
+    would, but taking as many as possible from the blocks reserved for
+    it, which come first.  GOAL is only used if none are reserved.  The
+    caller must hold FILE's lock exclusively.  */
+static block_id allocateFileBlocks(sfs_mem_file_t *file, uint32_t n_blocks,
+                                   block_id goal)
+{
+    if (file->reserveCount == 0)
+        return allocateBlocks(n_blocks, SFS_BLOCK_TYPE_FILE, goal);
+
+    uint32_t take = (uint32_t)sizeMin(n_blocks, file->reserveCount);
+    block_id more = 0;
+    if (n_blocks > take)
+    {
+        more = allocateBlocks(n_blocks - take, SFS_BLOCK_TYPE_FILE, 0);
+        if (more == 0)
+            return 0;
+    }
+
+    // Cut the blocks taken from the rest of the reserve, and put any
+    // newly allocated ones after them.  Both stay in limbo.
+    block_id first = file->reserveFirst;
+    block_id last = take == file->reserveCount
+                        ? file->reserveLast
+                        : chainBlock(first, take - 1);
+    block_id rest = accessBlock(last)->next_block;
+    sfs_journal_rec_t recs[2] = {
+        {.kind = SFS_JREC_LINK, .block = last, .next = more}};
+    uint32_t n = 1;
+    if (rest != 0)
+        recs[n++] = (sfs_journal_rec_t){.kind = SFS_JREC_LINK, .next = rest};
+    journalApply(recs, n);
+
+    file->reserveFirst = rest;
+    file->reserveCount -= take;
+    if (rest == 0)
+        file->reserveLast = 0;
+    return first;
+}
+
+/** Give FILE a chain of blocks of its own, if it shares one with other
+    files, by copying as much of the shared chain as holds its first
+    LEN bytes, so that it can be changed without changing them.  LEN
+    must be at most the size of the file, and if it is less, the file
+    is cut down to LEN bytes in the same step; the caller still has to
+    do the rest of what cutting it down involves.  If the other files
+    have all let go of the chain by the time the copy is made, the copy
+    is thrown away, and FILE keeps the chain and its size.  Every
+    descriptor for FILE is left without a 'currBlock', to be looked up
+    again.  Returns 1 if FILE was moved to a copy, 0 if not, -ENOSPC,
+    -EIO, or -EBUSY if it has data borrowed.  The caller must hold
+    FILE's lock exclusively, and FILE must not be packed.  */
+static int unshareFile(sfs_mem_file_t *file, size_t len)
+{
+    uint32_t slot = file->fileEntryIdx;
+    if (atomic_load(ringNext(slot)) == slot)
+        return 0;
+    if (atomic_load(&file->borrowCount) != 0)
+        return -EBUSY;
+
+    // The copy is flushed before the file is switched over to it, as
+    // by relocateFile, a run at a time.
+    sfs_dir_entry_t *e = file->diskFile;
+    assert(len <= e->size);
+    uint32_t n_blocks = blockIndexOf(len) + 1;
+    block_id newFirst = allocateBlocks(n_blocks, SFS_BLOCK_TYPE_FILE, 0);
+    if (newFirst == 0)
+        return -ENOSPC;
+    block_id from = e->first_block;
+    block_id to = newFirst;
+    block_id last = 0;
+    block_id runStart = newFirst;
+    int status = 0;
+    for (uint32_t i = 0; i < n_blocks; i++)
+    {
+        memcpy(accessFileBlock(to)->data, accessFileBlock(from)->data,
+               blockDataSize);
+        if (checksumsEnabled)
+            *checksumSlot(to) = *checksumSlot(from);
+        last = to;
+        from = accessBlock(from)->next_block;
+        to = accessBlock(to)->next_block;
+        if (to != last + 1)
+        {
+            if (syncBlocks(runStart, last - runStart + 1) < 0 ||
+                syncChecksums(runStart, last - runStart + 1) < 0)
+                status = -EIO;
+            runStart = to;
+        }
+    }
+    countStat(STAT_CHAIN_HOPS, n_blocks - 1);
+    if (status < 0)
+    {
+        freeBlocks(newFirst);
+        return status;
+    }
+
+    // A shorter copy gets its size in the same group, so that a crash
+    // cannot leave the file with the size of the chain it left.
+    sfs_journal_rec_t recs[2] = {{.kind = SFS_JREC_MOVE, .next = newFirst}};
+    setEntryLocation(&recs[0], e);
+    uint32_t n = 1;
+    if (len < e->size)
+    {
+        recs[n] = (sfs_journal_rec_t){.kind = SFS_JREC_APPEND};
+        setEntryLocation(&recs[n], e);
+        recs[n++].entry.size = (uint32_t)len;
+    }
+    pthread_mutex_lock(&shareLock);
+    int shared = atomic_load(ringNext(slot)) != slot;
+    if (shared)
+    {
+        applyWithChain(recs, n, SFS_JREC_CLAIM, newFirst);
+        leaveRing(slot);
+    }
+    pthread_mutex_unlock(&shareLock);
+    if (!shared)
+    {
+        freeBlocks(newFirst);
+        return 0;
+    }
+
+    // Whatever refers to the shared blocks in memory must now refer to
+    // the copy, which has already been flushed.
+    dropBlockMap(file);
+    file->lastBlock = last;
+    pthread_mutex_lock(&descLock);
+    for (uint32_t fd = 0; fd < openFileLimit; fd++)
+    {
+        sfs_mem_filedesc_t *tFile = &openFileDescTable[fd];
+        if (tFile->fileEntry != file)
+            continue;
+        tFile->currBlock = 0;
+    }
+    pthread_mutex_unlock(&descLock);
+    if (!file->dirtyAll)
+        file->dirtyCount = 0;
+    markDirty(file, blockOfEntry(e), 1);
+    return 1;
+}
+
+/** Decode FILE, which is compressed, back into a chain of ordinary file
+    blocks, so that it can be changed.  If it shares its compressed
+    chain with other files, they keep it.  Every descriptor for FILE is
+    left without a 'currBlock', to be looked up again.  Returns 1, or
+    -ENOSPC, -EIO if the compressed data is damaged or the new blocks
+    could not be written to stable storage, or -EBUSY if it has data
+    borrowed.  The caller must hold FILE's lock exclusively.  */
+static int inflateFile(sfs_mem_file_t *file)
+{
+    if (atomic_load(&file->borrowCount) != 0)
+        return -EBUSY;
+    sfs_dir_entry_t *e = file->diskFile;
+    uint32_t n_blocks = blockIndexOf(e->size) + 1;
+    block_id newFirst = allocateBlocks(n_blocks, SFS_BLOCK_TYPE_FILE, 0);
+    if (newFirst == 0)
+        return -ENOSPC;
+
+    // The frames are decoded straight into the new blocks, which are
+    // then flushed, a run at a time, before the file is switched over,
+    // as by unshareFile.
+    char frame[SFS_FRAME_SIZE];
+    block_id to = newFirst;
+    size_t used = 0;
+    int status = 0;
+    uint32_t frames = frameCount(e->size);
+    for (uint32_t k = 0; k < frames; k++)
+    {
+        ssize_t len = decodeFrame(file, k, frame);
+        if (len < 0)
+        {
+            status = -EIO;
+            break;
+        }
+        for (size_t done = 0; done < (size_t)len;)
+        {
+            if (used == blockDataSize)
+            {
+                to = accessBlock(to)->next_block;
+                used = 0;
+            }
+            size_t n = sizeMin(blockDataSize - used, (size_t)len - done);
+            memcpy(accessFileBlock(to)->data + used, frame + done, n);
+            done += n;
+            used += n;
+        }
+    }
+    block_id runStart = newFirst;
+    block_id last = 0;
+    for (block_id id = newFirst; id != 0 && status == 0;)
+    {
+        if (checksumsEnabled)
+            *checksumSlot(id) = blockChecksum(id);
+        last = id;
+        id = accessBlock(id)->next_block;
+        if (id != last + 1)
+        {
+            if (syncBlocks(runStart, last - runStart + 1) < 0 ||
+                syncChecksums(runStart, last - runStart + 1) < 0)
+                status = -EIO;
+            runStart = id;
+        }
+    }
+    countStat(STAT_CHAIN_HOPS, n_blocks - 1);
+    if (status < 0)
+    {
+        freeBlocks(newFirst);
+        return status;
+    }
+
+    // The new chain is attached and, unless other files still share it,
+    // the compressed one detached in one group, so that a crash leaves
+    // the file in one form or the other.
+    uint32_t slot = file->fileEntryIdx;
+    block_id oldFirst = e->first_block;
+    uint32_t oldBlocks = compressedHeader(oldFirst)->blocks;
+    sfs_journal_rec_t recs[2] = {{.kind = SFS_JREC_MOVE, .next = newFirst}};
+    setEntryLocation(&recs[0], e);
+    uint32_t n = 1;
+    pthread_mutex_lock(&shareLock);
+    int shared = atomic_load(ringNext(slot)) != slot;
+    if (!shared && journalEnabled())
+        recs[n++] = (sfs_journal_rec_t){.kind = SFS_JREC_LIMBO,
+                                        .block = oldFirst,
+                                        .count = oldBlocks};
+    applyWithChain(recs, n, SFS_JREC_CLAIM, newFirst);
+    if (shared)
+        leaveRing(slot);
+    pthread_mutex_unlock(&shareLock);
+    if (!shared)
+        freeBlocks(oldFirst);
+
+    file->compressed = 0;
+    dropFrames(file);
+    file->lastBlock = last;
+    pthread_mutex_lock(&descLock);
+    for (uint32_t fd = 0; fd < openFileLimit; fd++)
+    {
+        sfs_mem_filedesc_t *tFile = &openFileDescTable[fd];
+        if (tFile->fileEntry != file)
+            continue;
+        tFile->currBlock = 0;
+    }
+    pthread_mutex_unlock(&descLock);
+    if (!file->dirtyAll)
+        file->dirtyCount = 0;
+    markDirty(file, blockOfEntry(e), 1);
+    return 1;
+}
+
+/** Copy the N bytes at BUF to offset OFF of the compressed stream that
+    is being put together in the run of blocks starting at FIRST.  */
+static void streamWrite(block_id first, size_t off, const void *buf, size_t n)
+{
+    const char *in = buf;
+    while (n > 0)
+    {
+        block_id id = first + (block_id)(off / blockDataSize);
+        size_t at = off % blockDataSize;
+        size_t k = sizeMin(blockDataSize - at, n);
+        memcpy(chainData(id) + at, in, k);
+        in += k;
+        off += k;
+        n -= k;
+    }
+}
+
+/** Compress FILE into a run of blocks of type SFS_BLOCK_TYPE_COMPRESSED,
+    if that takes fewer blocks than it has now, and there is a free run
+    long enough.  If it shares its chain with other files, they keep it.
+    Returns 1 if FILE was compressed, 0 if not, or -EIO if its data does
+    not match its checksums or the compressed copy could not be written
+    to stable storage.  The caller must hold FILE's lock exclusively,
+    and FILE must be in ordinary blocks, not packed, with no data
+    borrowed and no descriptor but the caller's.  */
+static int compressFile(sfs_mem_file_t *file)
+{
+    sfs_dir_entry_t *e = file->diskFile;
+    uint32_t have = blockIndexOf(e->size) + 1;
+    uint32_t frames = frameCount(e->size);
+    size_t used = compressedHeaderSize(frames);
+    if (used >= (size_t)(have - 1) * blockDataSize)
+        return 0;
+
+    // The stream goes in a single run, so that its blocks can be found
+    // without following the chain.  How long it is is only known once
+    // it is done, so it is put together a frame at a time in the first
+    // free run that is one block shorter than the file, or failing that
+    // the longest there is, and whatever it does not use is freed
+    // again.  It is given up on as soon as it is clear that it would
+    // not fit.
+    uint32_t room = have - 1;
+    pthread_mutex_lock(&allocLock);
+    uint32_t idx = pickExtent(freeExtents, freeExtentCount, room, 0);
+    if (idx == freeExtentCount)
+    {
+        for (uint32_t i = 0; i < freeExtentCount; i++)
+            if (idx == freeExtentCount ||
+                freeExtents[i].length > freeExtents[idx].length)
+                idx = i;
+        if (idx < freeExtentCount)
+            room = freeExtents[idx].length;
+    }
+    block_id newFirst = 0;
+    if (idx < freeExtentCount && used < (size_t)room * blockDataSize)
+        newFirst = takeFreeBlocks(room, SFS_BLOCK_TYPE_COMPRESSED,
+                                  freeExtents[idx].start);
+    pthread_mutex_unlock(&allocLock);
+    if (newFirst == 0)
+        return 0;
+    countAllocation(room, newFirst);
+
+    size_t cap = (size_t)room * blockDataSize;
+    char frame[SFS_FRAME_SIZE];
+    char packed[SFS_FRAME_SIZE];
+    block_id blk = e->first_block;
+    int status = 1;
+    for (uint32_t k = 0; k < frames; k++)
+    {
+        size_t pos = (size_t)k * SFS_FRAME_SIZE;
+        size_t len = sizeMin(SFS_FRAME_SIZE, e->size - pos);
+        struct iovec iov = {frame, len};
+        if (readAt(file, blk, pos, &iov, len, &blk) < 0)
+        {
+            status = -EIO;
+            break;
+        }
+        size_t max = sizeMin(len - 1, cap - used);
+        size_t n = max > 0 ? lzCompress(frame, len, packed, max) : 0;
+        const char *out = packed;
+        if (n == 0)
+        {
+            if (cap - used < len)
+            {
+                status = 0;
+                break;
+            }
+            out = frame;
+            n = len;
+        }
+        streamWrite(newFirst, used, out, n);
+        used += n;
+        uint32_t frameEnd = (uint32_t)used;
+        streamWrite(newFirst,
+                    offsetof(sfs_compressed_hdr_t, frame_end) +
+                        (size_t)k * sizeof frameEnd,
+                    &frameEnd, sizeof frameEnd);
+    }
+    if (status <= 0)
+    {
+        freeBlocks(newFirst);
+        return status;
+    }
+    uint32_t n_blocks = (uint32_t)((used + blockDataSize - 1) / blockDataSize);
+    if (n_blocks < room)
+        freeBlocks(newFirst + n_blocks);
+    sfs_compressed_hdr_t *hdr = compressedHeader(newFirst);
+    hdr->size = e->size;
+    hdr->blocks = n_blocks;
+    hdr->frame_count = frames;
+    if (checksumsEnabled)
+        for (uint32_t i = 0; i < n_blocks; i++)
+            *checksumSlot(newFirst + i) = blockChecksum(newFirst + i);
+    if (setImageCompressed() < 0 || syncBlocks(newFirst, n_blocks) < 0 ||
+        syncChecksums(newFirst, n_blocks) < 0)
+    {
+        freeBlocks(newFirst);
+        return -EIO;
+    }
+
+    // As in relocateFile, the new blocks are attached and the old ones
+    // detached in one group, unless other files still share them.
+    uint32_t slot = file->fileEntryIdx;
+    block_id oldFirst = e->first_block;
+    sfs_journal_rec_t recs[2];
+    uint32_t n = 0;
+    if (journalEnabled())
+        recs[n++] = (sfs_journal_rec_t){.kind = SFS_JREC_CLAIM,
+                                        .block = newFirst,
+                                        .count = n_blocks};
+    recs[n] = (sfs_journal_rec_t){.kind = SFS_JREC_MOVE, .next = newFirst};
+    setEntryLocation(&recs[n++], e);
+    pthread_mutex_lock(&shareLock);
+    int shared = atomic_load(ringNext(slot)) != slot;
+    if (shared)
+    {
+        journalApply(recs, n);
+        leaveRing(slot);
+    }
+    pthread_mutex_unlock(&shareLock);
+    if (!shared)
+    {
+        applyWithChain(recs, n, SFS_JREC_LIMBO, oldFirst);
+        freeBlocks(oldFirst);
+    }
+
+    file->compressed = 1;
+    dropFrames(file);
+    dropBlockMap(file);
+    file->lastBlock = 0;
+    pthread_mutex_lock(&descLock);
+    for (uint32_t fd = 0; fd < openFileLimit; fd++)
+    {
+        sfs_mem_filedesc_t *tFile = &openFileDescTable[fd];
+        if (tFile->fileEntry != file)
+            continue;
+        tFile->currBlock = 0;
+    }
+    pthread_mutex_unlock(&descLock);
+    if (!file->dirtyAll)
+        file->dirtyCount = 0;
+    markDirty(file, blockOfEntry(e), 1);
+    return 1;
+}
+
+/** Check the blocks that a write to FILE of the bytes [POS, END_POS)
+    would change only part of, if what it leaves of them is part of the
+    file, since once the write has set their checksums, any damage to
+    the rest could no longer be found.  BLK is as for writeAt.  Returns
+    0, or -EIO if either does not match its checksum.  The caller must
+    hold FILE's lock exclusively.  */
+static int checkEdgeBlocks(sfs_mem_file_t *file, block_id blk, size_t pos,
+                           size_t endPos)
+{
+    if (!checksumsEnabled || endPos == pos)
+        return 0;
+    if (pos % blockDataSize != 0 && checkBlock(blk) < 0)
+        return -EIO;
+    uint32_t last = (uint32_t)(endPos / blockDataSize);
+    if (endPos >= file->diskFile->size || endPos % blockDataSize == 0 ||
+        (pos % blockDataSize != 0 && last == pos / blockDataSize))
+        return 0;
+    return checkBlock(lookupBlock(file, last));
+}
+
+/** Write to FILE, starting at file position POS, first ZEROS zero bytes
+    and then the contents of the buffers described by IOV, which hold
+    TOTAL bytes between them.  POS must not be past the end of the
+    file; to write past the end, pass the current size as POS and the
+    size of the gap as ZEROS.  BLK and END_BLK are as for readAt.
+    Returns TOTAL, or a negative error code if the file could not be
+    made big enough, or shares its blocks with other files and could
+    not be copied, or is compressed and could not be decoded, or keeps
+    part of a block that does not match its checksum, in which case
+    nothing is written.  The caller must hold
+    FILE's lock exclusively.  */
+static ssize_t writeAt(sfs_mem_file_t *file, block_id blk, size_t pos,
+                       size_t zeros, const struct iovec *iov, size_t total,
+                       block_id *endBlk)
+{
+    size_t fileSize = file->diskFile->size;
+    assert(pos <= fileSize);
+    if (atomic_load(&file->borrowCount) != 0)
+        return -EBUSY;
+
+    // This implementation does not do a partial write if there is
+    // insufficient space on disk for the complete write; it always
+    // either writes all 'total' bytes, or none.
+    if (zeros + total > SFS_MAX_FILE_SIZE - pos)
+        return -EFBIG;
+    size_t endPos = pos + zeros + total;
+    size_t toWrite = zeros + total;
+    sfs_iov_cursor_t cur = {iov, 0};
+
+    // A file in a packed block is written in place while it still
+    // fits in its cell, and otherwise moved into a block of its own
+    // first, which is then the block the write starts in.
+    if (file->packCell != NO_CELL)
+    {
+        if (endPos <= SFS_PACKED_FILE_MAX)
+        {
+            char *data = cellData(file) + pos;
+            memset(data, 0, zeros);
+            iovCopy(&cur, data + zeros, total, 1);
+            markDirty(file, file->diskFile->first_block, 1);
+            countStat(STAT_BYTES_WRITTEN, endPos - pos);
+            *endBlk = 0;
+            if (endPos > fileSize)
+            {
+                sfs_journal_rec_t rec = {.kind = SFS_JREC_APPEND};
+                setEntryLocation(&rec, file->diskFile);
+                rec.entry.size = (uint32_t)endPos;
+                journalApply(&rec, 1);
+                markDirty(file, blockOfEntry(file->diskFile), 1);
+            }
+            return (ssize_t)total;
+        }
+        int status = unpackFile(file);
+        if (status < 0)
+            return status;
+        blk = file->diskFile->first_block;
+    }
+    else
+    {
+        // A file that shares its blocks with others is copied first,
+        // and the write goes to the copy; a compressed one is decoded.
+        int status = file->compressed ? inflateFile(file)
+                                      : unshareFile(file, fileSize);
+        if (status < 0)
+            return status;
+        if (status > 0)
+            blk = lookupBlock(file, blockIndexOf(pos));
+    }
+    if (checkEdgeBlocks(file, blk, pos, endPos) < 0)
+        return -EIO;
+    size_t fileAllocSize = roundUp(fileSize, blockDataSize);
+
+    // If we need to enlarge the file, do so now, and if we can't make
+    // it big enough, fail the whole operation.  Note that empty files
+    // still have one allocated block, unless they are packed: with
+    // 512-byte blocks, files of length [0, 500] require one block,
+    // [501, 1000] require two, etc.
+    block_id firstNewId = 0;
+    if (endPos > fileAllocSize)
+    {
+        size_t fileNewAllocSize = roundUp(endPos, blockDataSize);
+        if (fileNewAllocSize > SFS_MAX_FILE_SIZE)
+            return -EFBIG;
+
+        uint32_t addlBlocks =
+            (uint32_t)((fileNewAllocSize - fileAllocSize) / blockDataSize);
+        assert(addlBlocks >= 1);
+
+        // If the write starts in the last block of the file, ask for
+        // the new blocks to follow it directly.  Blocks reserved by
+        // sfs_fallocate are used first, wherever they are.
+        block_id goal = 0;
+        if (blockIndexOf(pos) == blockIndexOf(fileSize))
+            goal = blk + 1;
+        firstNewId = allocateFileBlocks(file, addlBlocks, goal);
+        if (firstNewId == 0)
+            return -ENOSPC;
+    }
+
+    // Copy chunks of data from the caller's buffers to the mapped disk
+    // image.  See comments above the very similar loop in readAt() for
+    // more detail.  The blocks written to are added to the file's dirty
+    // set a run at a time.
+    block_id lastOldId = 0;
+    block_id runStart = 0;
+    uint32_t runLength = 0;
+    sfs_block_file_t *diskBlock = accessFileBlock(blk);
+    size_t blockPos = pos % blockDataSize;
     size_t chunkSize =
-        sizeMin(roundUp(currPos, BLOCK_DATA_SIZE) - currPos, toRead);
+        sizeMin(roundUp(pos, blockDataSize) - pos, toWrite);
+    uint64_t hops = 0;
+    for (;;)
+    {
+        // The chunk size can be zero on the first iteration, if the
+        // starting position was exactly at a block boundary.
+        if (chunkSize > 0)
+        {
+            // The block's checksum is cleared while the data changes,
+            // so that dying part way through leaves it unknown rather
+            // than wrong; the fences keep the copy between the two.
+            block_id id = idOfBlock(&diskBlock->h);
+            if (checksumsEnabled)
+            {
+                *checksumSlot(id) = 0;
+                atomic_signal_fence(memory_order_seq_cst);
+            }
+            char *data = &diskBlock->data[blockPos];
+            size_t z = sizeMin(zeros, chunkSize);
+            memset(data, 0, z);
+            zeros -= z;
+            iovCopy(&cur, data + z, chunkSize - z, 1);
+            toWrite -= chunkSize;
+            if (checksumsEnabled)
+            {
+                atomic_signal_fence(memory_order_seq_cst);
+                *checksumSlot(id) = blockChecksum(id);
+            }
+
+            if (id != runStart + runLength)
+            {
+                if (runLength > 0)
+                    markWritten(file, runStart, runLength);
+                runStart = id;
+                runLength = 0;
+            }
+            runLength++;
+        }
+        if (toWrite == 0)
+            break;
+
+        blockPos = 0;
+        chunkSize = sizeMin(blockDataSize, toWrite);
+        sfs_block_file_t *nextBlock = accessFileBlock(diskBlock->h.next_block);
+        if (nextBlock == NULL)
+        {
+            // We should only get here once, at most, per write call.
+            assert(firstNewId != 0 && lastOldId == 0);
+            // We have just advanced the file position to the end of the
+            // original allocation for the file.  Carry on into the
+            // additional blocks beginning at 'firstNewId', which are
+            // attached to the file below, once they hold their data.
+            lastOldId = idOfBlock(&diskBlock->h);
+            nextBlock = accessFileBlock(firstNewId);
+        }
+        diskBlock = nextBlock;
+        hops++;
+    }
+    assert(firstNewId == 0 || lastOldId != 0);
+    if (runLength > 0)
+        markWritten(file, runStart, runLength);
+    countStat(STAT_CHAIN_HOPS, hops);
+    countStat(STAT_BYTES_WRITTEN, endPos - pos);
+
+    // Attach the new blocks and set the new size in a single record, so
+    // that a crash cannot leave a file with one but not the other.
+    *endBlk = idOfBlock(&diskBlock->h);
+    if (endPos > fileSize)
+    {
+        sfs_journal_rec_t rec = {.kind = SFS_JREC_APPEND,
+                                 .prev = lastOldId,
+                                 .next = firstNewId};
+        setEntryLocation(&rec, file->diskFile);
+        rec.entry.size = (uint32_t)endPos;
+        applyWithChain(&rec, 1, SFS_JREC_CLAIM, firstNewId);
+        if (firstNewId != 0)
+        {
+            extendBlockMap(file, firstNewId);
+            file->lastBlock = *endBlk;
+            markDirty(file, lastOldId, 1);
+        }
+        markDirty(file, blockOfEntry(file->diskFile), 1);
+    }
+    return (ssize_t)total;
+}
+
+/** Fill in up to MAX_SPANS entries of SPANS with pointers to the data
+    of FILE from file position POS onward, one span per block, covering
+    at most LEN bytes and stopping at the end of the file.  Returns the
+    number of spans filled in, or -EIO if a block they cover does not
+    match its checksum.  FILE must not be compressed.  The caller must
+    hold FILE's lock in either mode.  */
+static int borrowAt(sfs_mem_file_t *file, size_t pos, size_t len,
+                    sfs_span *spans, int max_spans)
+{
+    size_t fileSize = file->diskFile->size;
+    assert(!file->compressed);
+    if (pos >= fileSize || len == 0 || max_spans == 0)
+        return 0;
+    if (file->packCell != NO_CELL)
+    {
+        spans[0].data = cellData(file) + pos;
+        spans[0].len = sizeMin(fileSize - pos, len);
+        return 1;
+    }
+
+    // Unlike a descriptor's 'currBlock', we want the block that holds
+    // the byte at POS itself, which exists because POS < fileSize.
+    size_t left = sizeMin(fileSize - pos, len);
+    size_t blockPos = pos % blockDataSize;
+    sfs_block_file_t *diskBlock =
+        accessFileBlock(lookupBlock(file, (uint32_t)(pos / blockDataSize)));
+    int n = 0;
     for (;;)
     {
-        // The chunk size can be zero on the first iteration, if the
-        // starting position was exactly at a block boundary.
-        if (chunkSize > 0)
+        if (checkBlock(idOfBlock(&diskBlock->h)) < 0)
+        {
+            countStat(STAT_CHAIN_HOPS, (uint64_t)n);
+            return -EIO;
+        }
+        size_t chunkSize = sizeMin(blockDataSize - blockPos, left);
+        spans[n].data = &diskBlock->data[blockPos];
+        spans[n].len = chunkSize;
+        n++;
+        left -= chunkSize;
+        if (left == 0 || n == max_spans)
+            break;
+        blockPos = 0;
+        diskBlock = accessFileBlock(diskBlock->h.next_block);
+        assert(diskBlock != NULL);
+    }
+    countStat(STAT_CHAIN_HOPS, (uint64_t)n - 1);
+    return n;
+}
+
+/** Ask for blocks number FIRST through LAST of FILE, counting from
+    zero, to be read in ahead of use.  The blocks of a file need not be
+    in order on disk, so the kernel, left to itself, would read ahead
+    whatever follows in the image instead.  The block map says where
+    they are; it is only extended as far as LAST, so a hint costs no
+    more than the blocks it is for.  If there is not enough memory for
+    the map, nothing is done.  The caller must hold FILE's lock, in
+    either mode.  */
+static void readAheadBlocks(sfs_mem_file_t *file, uint32_t first,
+                            uint32_t last)
+{
+    pthread_mutex_lock(&file->mapLock);
+    if (mapBlocksThrough(file, last) < 0)
+    {
+        pthread_mutex_unlock(&file->mapLock);
+        return;
+    }
+
+    // One hint for each run of consecutive blocks.
+    block_id start = file->blockMap[first];
+    uint32_t length = 1;
+    for (uint32_t i = first + 1; i <= last; i++)
+    {
+        if (file->blockMap[i] == start + length)
+        {
+            length++;
+            continue;
+        }
+        prefetchBlocks(start, length);
+        start = file->blockMap[i];
+        length = 1;
+    }
+    prefetchBlocks(start, length);
+    pthread_mutex_unlock(&file->mapLock);
+    countStat(STAT_READAHEAD_BLOCKS, last - first + 1);
+}
+
+/** Note that N bytes were just read or written through TFILE, starting
+    at file position POS, and if TFILE is being used sequentially, keep
+    the blocks of its file that it will get to next being read ahead.
+    The window starts at READAHEAD_MIN blocks and doubles with each
+    sequential access, up to READAHEAD_MAX, and a new stretch is asked
+    for once the descriptor is half way through the last one, so that
+    there is only a hint for every so many reads.  Any other access
+    pattern stops readahead until the descriptor is sequential again.
+    The caller must have acquired TFILE, and must hold its file's lock
+    in either mode.  */
+static void trackAccess(sfs_mem_filedesc_t *tFile, size_t pos, size_t n)
+{
+    if (pos != tFile->seqPos)
+    {
+        tFile->seqCount = 0;
+        tFile->aheadPos = 0;
+    }
+    else if (tFile->seqCount < UINT32_MAX)
+    {
+        tFile->seqCount++;
+    }
+    size_t end = pos + n;
+    tFile->seqPos = end;
+
+    sfs_mem_file_t *file = tFile->fileEntry;
+    if (tFile->seqCount < 2 || !inPlainBlocks(file))
+        return;
+    size_t blocks = READAHEAD_MIN;
+    for (uint32_t i = 2; i < tFile->seqCount && blocks < READAHEAD_MAX; i++)
+        blocks *= 2;
+    size_t window = sizeMin(blocks, READAHEAD_MAX) * blockDataSize;
+    if (tFile->aheadPos >= end + window / 2)
+        return;
+
+    size_t from = tFile->aheadPos > end ? tFile->aheadPos : end;
+    size_t to = sizeMin(end + window, file->diskFile->size);
+    if (from >= to)
+        return;
+    readAheadBlocks(file, (uint32_t)(from / blockDataSize),
+                    blockIndexOf(to));
+    tFile->aheadPos = to;
+}
+
+/** Read into IOV, which holds TOTAL bytes, at the file position of
+    TFILE, and advance it.  The caller must have acquired TFILE, and
+    must hold its file's lock in either mode.  */
+static ssize_t readFile(sfs_mem_filedesc_t *tFile, const struct iovec *iov,
+                        size_t total)
+{
+    // The descriptor may be new, or its file's blocks may have moved, or
+    // the file may have been packed or compressed.
+    sfs_mem_file_t *file = tFile->fileEntry;
+    if (tFile->currBlock == 0 && inPlainBlocks(file))
+        tFile->currBlock = lookupBlock(file, blockIndexOf(tFile->currPos));
+    size_t pos = tFile->currPos;
+    ssize_t n = readAt(file, tFile->currBlock, pos, iov, total,
+                       &tFile->currBlock);
+    if (n < 0)
+        return n;
+    tFile->currPos += (size_t)n;
+    trackAccess(tFile, pos, (size_t)n);
+    return n;
+}
+
+/** Write IOV, which holds TOTAL bytes, at the file position of TFILE,
+    or at the end of the file if TFILE was opened with SFS_OPEN_APPEND,
+    and advance it.  The caller must have acquired TFILE, and must hold
+    its file's lock exclusively.  */
+static ssize_t writeFile(sfs_mem_filedesc_t *tFile, const struct iovec *iov,
+                         size_t total)
+{
+    sfs_mem_file_t *file = tFile->fileEntry;
+    if ((tFile->flags & SFS_OPEN_APPEND) != 0)
+    {
+        tFile->currPos = file->diskFile->size;
+        tFile->currBlock = inPlainBlocks(file) ? tailBlock(file) : 0;
+    }
+    if (tFile->currBlock == 0 && inPlainBlocks(file))
+        tFile->currBlock = lookupBlock(file, blockIndexOf(tFile->currPos));
+    block_id endBlk;
+    ssize_t n = writeAt(file, tFile->currBlock, tFile->currPos, 0, iov,
+                        total, &endBlk);
+    if (n >= 0)
+    {
+        trackAccess(tFile, tFile->currPos, (size_t)n);
+        tFile->currBlock = endBlk;
+        tFile->currPos += (size_t)n;
+    }
+    return n;
+}
+
+/** Read into IOV, which holds TOTAL bytes, from position POS of the file
+    open on TFILE, without using or changing TFILE's file position.
+    The caller must have pinned TFILE, and must hold its file's lock in
+    either mode.  */
+static ssize_t preadFile(sfs_mem_filedesc_t *tFile, const struct iovec *iov,
+                         size_t total, size_t pos)
+{
+    sfs_mem_file_t *file = tFile->fileEntry;
+    if (pos >= file->diskFile->size)
+        return 0;
+    block_id endBlk;
+    block_id blk = 0;
+    if (inPlainBlocks(file))
+        blk = lookupBlock(file, blockIndexOf(pos));
+    return readAt(file, blk, pos, iov, total, &endBlk);
+}
+
+/** Write IOV, which holds TOTAL bytes, at position POS of the file open
+    on TFILE, without using or changing TFILE's file position.  If POS
+    is past the end of the file, the gap is filled with zeros.  The
+    caller must have pinned TFILE, and must hold its file's lock
+    exclusively.  */
+static ssize_t pwriteFile(sfs_mem_filedesc_t *tFile, const struct iovec *iov,
+                          size_t total, size_t pos)
+{
+    sfs_mem_file_t *file = tFile->fileEntry;
+    size_t fileSize = file->diskFile->size;
+    size_t zeros = 0;
+    if (pos > fileSize)
+    {
+        if (pos > SFS_MAX_FILE_SIZE)
+            return -EFBIG;
+        zeros = pos - fileSize;
+        pos = fileSize;
+    }
+    block_id endBlk;
+    block_id blk = 0;
+    if (inPlainBlocks(file))
+        blk = pos == fileSize ? tailBlock(file)
+                              : lookupBlock(file, blockIndexOf(pos));
+    return writeAt(file, blk, pos, zeros, iov, total, &endBlk);
+}
+
+/** Set aside blocks for FILE to grow into, so that it can reach LEN
+    bytes without allocating any more.  They go right after the end of
+    the file, or of whatever was already set aside, if there is room
+    there.  A file in a packed block is first moved into a block of its
+    own, if LEN would not fit in its cell, a file that shares its
+    blocks with others is copied, and a compressed one is decoded.
+    Returns 0, -ENOSPC, -EIO, or -EBUSY
+    if the file would have to move but has data borrowed.  The caller
+    must hold FILE's lock exclusively.  */
+static int reserveFileBlocks(sfs_mem_file_t *file, size_t len)
+{
+    if (file->packCell != NO_CELL)
+    {
+        if (len <= SFS_PACKED_FILE_MAX)
+            return 0;
+        if (atomic_load(&file->borrowCount) != 0)
+            return -EBUSY;
+        int status = unpackFile(file);
+        if (status < 0)
+            return status;
+    }
+    else
+    {
+        // Writing to a file that shares its blocks would copy it, and to
+        // a compressed one would decode it, which could run out of
+        // space, so that is done now instead.
+        int status = file->compressed
+                         ? inflateFile(file)
+                         : unshareFile(file, file->diskFile->size);
+        if (status < 0)
+            return status;
+    }
+
+    uint32_t have = blockIndexOf(file->diskFile->size) + 1;
+    uint32_t want = (uint32_t)(roundUp(len, blockDataSize) / blockDataSize);
+    if (want <= have + file->reserveCount)
+        return 0;
+    uint32_t n_blocks = want - have - file->reserveCount;
+
+    block_id last = file->reserveLast;
+    if (last == 0)
+        last = lookupBlock(file, have - 1);
+    block_id first = allocateBlocks(n_blocks, SFS_BLOCK_TYPE_FILE, last + 1);
+    if (first == 0)
+        return -ENOSPC;
+    if (file->reserveLast != 0)
+    {
+        sfs_journal_rec_t rec = {.kind = SFS_JREC_LINK,
+                                 .block = file->reserveLast,
+                                 .next = first};
+        journalApply(&rec, 1);
+    }
+    else
+    {
+        file->reserveFirst = first;
+    }
+    file->reserveLast = chainBlock(first, n_blocks - 1);
+    file->reserveCount += n_blocks;
+    return 0;
+}
+
+/** Cut FILE down to LEN bytes, which is less than its size, and free
+    the blocks past the new end, which are cut off the chain in one
+    piece.  Descriptors positioned past the new end are moved back to
+    it.  A file that shares its blocks with others is copied first, and
+    a compressed one is decoded.  Returns 0, -ENOSPC, -EIO, or -EBUSY
+    if the file has data borrowed.  The caller must have pinned a
+    descriptor for FILE, and must hold FILE's lock exclusively.  */
+static int shrinkFile(sfs_mem_file_t *file, size_t len)
+{
+    sfs_dir_entry_t *e = file->diskFile;
+    assert(len < e->size);
+    if (atomic_load(&file->borrowCount) != 0)
+        return -EBUSY;
+    // A shared file is only copied as far as LEN, and the copy already
+    // has the new size.
+    if (file->packCell == NO_CELL)
+    {
+        int status = file->compressed ? inflateFile(file)
+                                      : unshareFile(file, len);
+        if (status < 0)
+            return status;
+    }
+
+    // The tail is detached and the size set in one group, so that a
+    // crash cannot leave a file with one but not the other.
+    uint32_t keep = blockIndexOf(len) + 1;
+    block_id last = 0;
+    block_id tail = 0;
+    sfs_journal_rec_t recs[2];
+    uint32_t n = 0;
+    if (file->packCell == NO_CELL)
+    {
+        last = lookupBlock(file, keep - 1);
+        tail = accessBlock(last)->next_block;
+    }
+    if (tail != 0)
+        recs[n++] = (sfs_journal_rec_t){.kind = SFS_JREC_LINK, .block = last};
+    if (e->size != len)
+    {
+        recs[n] = (sfs_journal_rec_t){.kind = SFS_JREC_APPEND};
+        setEntryLocation(&recs[n], e);
+        recs[n++].entry.size = (uint32_t)len;
+    }
+    if (n > 0)
+        applyWithChain(recs, n, SFS_JREC_LIMBO, tail);
+    if (tail != 0)
+    {
+        freeBlocks(tail);
+        if (file->mapLength > keep)
+            file->mapLength = keep;
+        file->lastBlock = last;
+        markDirty(file, last, 1);
+    }
+    markDirty(file, blockOfEntry(e), 1);
+
+    pthread_mutex_lock(&descLock);
+    for (uint32_t fd = 0; fd < openFileLimit; fd++)
+    {
+        sfs_mem_filedesc_t *tFile = &openFileDescTable[fd];
+        if (tFile->fileEntry == file && tFile->currPos > len)
+        {
+            tFile->currPos = len;
+            tFile->currBlock = last;
+        }
+    }
+    pthread_mutex_unlock(&descLock);
+    return 0;
+}
+
+/** Add the file in directory slot SLOT, if it has blocks of its own, to
+    the counts in *STATS.  The caller must hold 'dirLock' and 'openLock',
+    in either mode.  */
+static void measureFile(uint32_t slot, sfs_frag_stats *stats)
+{
+    // An open file may be growing, or being copied, compressed or
+    // decoded into other blocks, under its own lock.
+    sfs_dir_entry_t *e = dirEntry(slot);
+    sfs_mem_file_t *file = openFileTable[slot];
+    if (file != NULL)
+        pthread_rwlock_rdlock(&file->lock);
+    block_id first = e->first_block;
+    if (first == 0 || isPackBlock(first))
+    {
+        if (file != NULL)
+            pthread_rwlock_unlock(&file->lock);
+        return;
+    }
+    uint32_t n_blocks = 0;
+    uint32_t breaks = 0;
+    for (block_id id = first; id != 0;)
+    {
+        block_id next = accessBlock(id)->next_block;
+        n_blocks++;
+        breaks += next != 0 && next != id + 1;
+        id = next;
+    }
+    if (file != NULL)
+        pthread_rwlock_unlock(&file->lock);
+    countStat(STAT_CHAIN_HOPS, n_blocks - 1);
+
+    stats->files++;
+    stats->file_blocks += n_blocks;
+    stats->breaks += breaks;
+    stats->fragmented_files += breaks != 0;
+}
+
+/** Fill in *STATS for the whole disk image.  The caller must hold
+    'dirLock' and 'openLock', in either mode.  */
+static void measureFragmentation(sfs_frag_stats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+    for (uint32_t slot = 0; slot < dirSlotCount; slot++)
+        measureFile(slot, stats);
+
+    // Blocks in the allocation caches are counted as free, though an
+    // extent in a cache is counted separately from one on the free
+    // list that it adjoins.
+    for (uint32_t i = 0; i < ALLOC_CACHE_COUNT; i++)
+        pthread_mutex_lock(&allocCaches[i].lock);
+    pthread_mutex_lock(&allocLock);
+    stats->free_blocks = freeBlockCount;
+    stats->free_runs = freeExtentCount;
+    for (uint32_t i = 0; i < ALLOC_CACHE_COUNT; i++)
+    {
+        stats->free_blocks += allocCaches[i].blockCount;
+        stats->free_runs += allocCaches[i].extentCount;
+        pthread_mutex_unlock(&allocCaches[i].lock);
+    }
+    pthread_mutex_unlock(&allocLock);
+}
+
+/** Move the file in directory slot SLOT into the lowest-numbered run
+    of free blocks that can hold all of its blocks, if it has blocks of
+    its own, shared with no other file, none of them are borrowed, and
+    the move either puts them in order or brings them nearer the start
+    of the disk.  A compressed file moves as it is, still compressed.
+    Returns 1 if the file was moved, 0 if not, or -EIO.  The caller must
+    hold 'dirLock' exclusively and 'openLock' in either mode, and if the
+    file is open, its lock exclusively.  */
+static int relocateFile(uint32_t slot)
+{
+    sfs_dir_entry_t *e = dirEntry(slot);
+    block_id oldFirst = e->first_block;
+    if (oldFirst == 0 || isPackBlock(oldFirst) ||
+        atomic_load(ringNext(slot)) != slot)
+        return 0;
+    sfs_mem_file_t *file = openFileTable[slot];
+    if (file != NULL && atomic_load(&file->borrowCount) != 0)
+        return 0;
+
+    // A compressed file is always in order, and moves as it is.
+    int compressed = isCompressedBlock(oldFirst);
+    uint32_t n_blocks = chainLength(e);
+    int inOrder = 1;
+    block_id id = oldFirst;
+    for (uint32_t i = 1; i < n_blocks && inOrder && !compressed; i++)
+    {
+        block_id next = accessBlock(id)->next_block;
+        inOrder = next == id + 1;
+        id = next;
+    }
+
+    pthread_mutex_lock(&allocLock);
+    uint32_t idx = pickExtent(freeExtents, freeExtentCount, n_blocks, 0);
+    block_id newFirst = 0;
+    if (idx < freeExtentCount &&
+        (!inOrder || freeExtents[idx].start < oldFirst))
+        newFirst = takeFreeBlocks(n_blocks,
+                                  compressed ? SFS_BLOCK_TYPE_COMPRESSED
+                                             : SFS_BLOCK_TYPE_FILE,
+                                  freeExtents[idx].start);
+    pthread_mutex_unlock(&allocLock);
+    if (newFirst == 0)
+        return 0;
+    countAllocation(n_blocks, newFirst);
+
+    // The copy is flushed before the file is switched over to it, so
+    // that data which had already reached stable storage stays there.
+    // Checksums are copied rather than worked out again, so that data
+    // that was already damaged is still found to be.
+    id = oldFirst;
+    for (uint32_t i = 0; i < n_blocks; i++)
+    {
+        memcpy(chainData(newFirst + i), chainData(id), blockDataSize);
+        if (checksumsEnabled)
+            *checksumSlot(newFirst + i) = *checksumSlot(id);
+        id = accessBlock(id)->next_block;
+    }
+    countStat(STAT_CHAIN_HOPS, n_blocks - 1);
+    if (syncBlocks(newFirst, n_blocks) < 0 ||
+        syncChecksums(newFirst, n_blocks) < 0)
+    {
+        freeBlocks(newFirst);
+        return -EIO;
+    }
+
+    // The new blocks are attached and the old ones detached in one
+    // group, so that a crash leaves the file in one place or the other.
+    sfs_journal_rec_t recs[2];
+    uint32_t n = 0;
+    if (journalEnabled())
+        recs[n++] = (sfs_journal_rec_t){.kind = SFS_JREC_CLAIM,
+                                        .block = newFirst,
+                                        .count = n_blocks};
+    recs[n] = (sfs_journal_rec_t){.kind = SFS_JREC_MOVE, .next = newFirst};
+    setEntryLocation(&recs[n++], e);
+    applyWithChain(recs, n, SFS_JREC_LIMBO, oldFirst);
+    freeBlocks(oldFirst);
+
+    // Whatever refers to the old blocks in memory must now refer to the
+    // new ones, which have already been flushed.
+    block_id last = compressed ? 0 : newFirst + n_blocks - 1;
+    if (file == NULL)
+    {
+        fileTails[slot] = last;
+        return 1;
+    }
+    dropBlockMap(file);
+    file->lastBlock = last;
+    pthread_mutex_lock(&descLock);
+    for (uint32_t fd = 0; fd < openFileLimit; fd++)
+    {
+        sfs_mem_filedesc_t *tFile = &openFileDescTable[fd];
+        if (tFile->fileEntry == file && tFile->currBlock != 0)
+            tFile->currBlock = newFirst + blockIndexOf(tFile->currPos);
+    }
+    pthread_mutex_unlock(&descLock);
+    if (!file->dirtyAll)
+        file->dirtyCount = 0;
+    markDirty(file, blockOfEntry(e), 1);
+    return 1;
+}
+
+/** Commit whatever the calling thread has logged to the journal, at
+    the end of an API call whose result is RESULT.  Returns RESULT, or
+    the error from committing if RESULT is not an error already.  */
+static ssize_t commit(ssize_t result)
+{
+    int status = journalCommit();
+    return status < 0 && result >= 0 ? status : result;
+}
+
+//
+// Called by sfs-support.c when a disk image becomes active or inactive
+//
+
+/** Allocate the descriptor table and the pool of open file table
+    entries, for up to LIMIT open files.  Returns 0 or -ENOMEM.  */
+static int allocOpenFiles(uint32_t limit)
+{
+    openFileDescTable = calloc(limit, sizeof *openFileDescTable);
+    size_t fdWords = (limit + 63) / 64;
+    freeFds = calloc(fdWords, sizeof *freeFds);
+    fileEntryPool = calloc(limit, sizeof *fileEntryPool);
+    freeFileEntries = malloc(limit * sizeof *freeFileEntries);
+    if (openFileDescTable == NULL || freeFds == NULL ||
+        fileEntryPool == NULL || freeFileEntries == NULL)
+    {
+        free(openFileDescTable);
+        free(freeFds);
+        free(fileEntryPool);
+        free(freeFileEntries);
+        openFileDescTable = NULL;
+        freeFds = NULL;
+        fileEntryPool = NULL;
+        freeFileEntries = NULL;
+        return -ENOMEM;
+    }
+
+    for (uint32_t i = 0; i < limit; i++)
+    {
+        sfs_mem_filedesc_t *memDescFile = &openFileDescTable[i];
+        pthread_mutex_init(&memDescFile->lock, NULL);
+        atomic_init(&memDescFile->borrowCount, 0);
+        atomic_init(&memDescFile->pinCount, 0);
+        atomic_init(&memDescFile->closing, 0);
+        freeFds[i / 64] |= (uint64_t)1 << (i % 64);
+
+        sfs_mem_file_t *fileEntry = &fileEntryPool[i];
+        pthread_rwlock_init(&fileEntry->lock, NULL);
+        pthread_mutex_init(&fileEntry->frameLock, NULL);
+        pthread_mutex_init(&fileEntry->mapLock, NULL);
+        atomic_init(&fileEntry->borrowCount, 0);
+        freeFileEntries[i] = fileEntry;
+    }
+    openFileLimit = limit;
+    freeFdHint = 0;
+    freeFdCount = limit;
+    freeFileEntryCount = limit;
+    return 0;
+}
+
+/** Free everything allocated by allocOpenFiles.  */
+static void freeOpenFiles(void)
+{
+    for (uint32_t i = 0; i < openFileLimit; i++)
+    {
+        pthread_mutex_destroy(&openFileDescTable[i].lock);
+        pthread_rwlock_destroy(&fileEntryPool[i].lock);
+        pthread_mutex_destroy(&fileEntryPool[i].frameLock);
+        pthread_mutex_destroy(&fileEntryPool[i].mapLock);
+    }
+    free(openFileDescTable);
+    openFileDescTable = NULL;
+    free(freeFds);
+    freeFds = NULL;
+    free(fileEntryPool);
+    fileEntryPool = NULL;
+    free(freeFileEntries);
+    freeFileEntries = NULL;
+    openFileLimit = 0;
+    freeFdHint = 0;
+    freeFdCount = 0;
+    freeFileEntryCount = 0;
+}
+
+/** Return whether the ends of the checksum table, which lies in blocks
+    1 through SFS_CHECKSUM_BLOCKS of the image's size, are where they
+    should be, since everything else about it is taken on trust.  */
+static int checksumTableFits(void)
+{
+    uint32_t n_blocks = accessSuperBlock()->n_blocks;
+    uint32_t tableBlocks = SFS_CHECKSUM_BLOCKS(n_blocks, getBlockSize());
+    if (tableBlocks >= n_blocks)
+        return 0;
+    const sfs_block_hdr_t *first = accessBlock(1);
+    const sfs_block_hdr_t *last = accessBlock(tableBlocks);
+    return memcmp(first->type, SFS_BLOCK_TYPE_CHECKSUM, 4) == 0 &&
+           memcmp(last->type, SFS_BLOCK_TYPE_CHECKSUM, 4) == 0 &&
+           first->prev_block == 0 && last->next_block == 0;
+}
+
+/** Free everything allocated by initDiskState.  */
+static void freeDiskState(void)
+{
+    freeOpenFiles();
+    for (uint32_t i = 0; i < ALLOC_CACHE_COUNT; i++)
+        pthread_mutex_destroy(&allocCaches[i].lock);
+
+    free(freeExtents);
+    freeExtents = NULL;
+    freeExtentCount = 0;
+    freeBlockCount = 0;
+    highWater = 0;
+
+    free(nameIndex);
+    nameIndex = NULL;
+    nameIndexMask = 0;
+    free(freeSlots);
+    freeSlots = NULL;
+    free(openFileTable);
+    openFileTable = NULL;
+    free(fileTails);
+    fileTails = NULL;
+    for (uint32_t k = 0; k < RING_SEGMENTS; k++)
+    {
+        free(shareRing[k]);
+        shareRing[k] = NULL;
+    }
+    free(dirBlocks);
+    dirBlocks = NULL;
+    dirBlockCount = 0;
+    dirSlotCount = 0;
+
+    free(packStack);
+    packStack = NULL;
+    packStackCount = 0;
+    packStackCapacity = 0;
+    packBlockCount = 0;
+    packingEnabled = 0;
+    checksumsEnabled = 0;
+}
+
+int initDiskState(uint32_t maxOpenFiles)
+{
+    blockDataSize = SFS_BLOCK_DATA_SIZE(getBlockSize());
+    dirEntriesPerBlock = SFS_DIR_ENTRIES_PER_BLOCK(getBlockSize());
+    checksumsEnabled = imageHasChecksums();
+    checksumsPerBlock = SFS_CHECKSUMS_PER_BLOCK(getBlockSize());
+    if (checksumsEnabled && !checksumTableFits())
+    {
+        checksumsEnabled = 0;
+        return -EUCLEAN;
+    }
+    if (allocOpenFiles(maxOpenFiles != 0 ? maxOpenFiles
+                                         : OPEN_FILE_LIMIT_DEFAULT) < 0)
+        return -ENOMEM;
+
+    for (uint32_t i = 0; i < ALLOC_CACHE_COUNT; i++)
+    {
+        pthread_mutex_init(&allocCaches[i].lock, NULL);
+        allocCaches[i].extentCount = 0;
+        allocCaches[i].blockCount = 0;
+    }
+
+    // Replaying the journal has to come first, since it may change any
+    // of the on-disk structures that the indexes are built from, except
+    // that the change summary must be ready to note those changes.
+    int status = summaryOpen();
+    if (status < 0)
+    {
+        freeOpenFiles();
+        return status;
+    }
+    status = journalOpen();
+    if (status < 0)
+    {
+        summaryClose(0);
+        freeOpenFiles();
+        return status;
+    }
+    status = buildFreeIndex();
+    if (status == 0)
+        status = buildDirIndex();
+    if (status == 0)
+        status = buildPackIndex();
+    if (status == 0)
+        status = buildShareIndex();
+    if (status == 0)
+        status = checkCompressedFiles();
+    if (status == 0)
+        status = reclaimOrphans();
+    if (status < 0)
+    {
+        journalClose();
+        summaryClose(0);
+        freeDiskState();
+    }
+    return status;
+}
+
+int releaseDiskState(void)
+{
+    pthread_rwlock_rdlock(&openLock);
+    int busy = freeFdCount != openFileLimit;
+    pthread_rwlock_unlock(&openLock);
+    if (busy)
+        return -EBUSY;
+    // There are no live openFileDescTable entries. It _should_ be
+    // impossible for there to be any live openFileTable entries.
+    for (uint32_t idx = 0; idx < dirSlotCount; idx++)
+    {
+        assert(openFileTable[idx] == NULL);
+    }
+
+    // Blocks that are sitting in allocation caches are not on the free
+    // list on disk, and neither are packed blocks with no files left in
+    // them, so they must be put back before the image goes.  The
+    // change summary can only be marked clean once everything else is
+    // in order.
+    reclaimCachedBlocks();
+    reclaimPackBlocks();
+    int status = journalClose();
+    if (status == 0)
+        saveFreeSnapshot();
+    int summaryStatus = summaryClose(status == 0);
+    freeDiskState();
+    return status < 0 ? status : summaryStatus;
+}
+
+//
+// SFS API functions begin here
+// see sfs-api.h for documentation comments for these functions
+//
+
+int sfs_open(const char *fileName)
+{
+    return sfs_open_with_flags(fileName, 0);
+}
+
+int sfs_open_with_flags(const char *fileName, int flags)
+{
+    if ((flags & ~(SFS_OPEN_APPEND | SFS_OPEN_COMPRESS)) != 0)
+        return -EINVAL;
+
+    int status = checkName(fileName);
+    if (status < 0)
+        return status;
+
+    // Is a disk image available?
+    if (getSFSStatus() < 0)
+        return -ENOMEDIUM;
+
+    uint32_t hash = hashName(fileName);
+    pthread_rwlock_rdlock(&dirLock);
+    uint32_t fileEntry = findFile(fileName, hash);
+    if (fileEntry != NO_SLOT)
+    {
+        status = addOpenFileEntry(fileEntry, flags);
+        pthread_rwlock_unlock(&dirLock);
+        return status;
+    }
+    pthread_rwlock_unlock(&dirLock);
+
+    // Creating the file needs the directory lock exclusively.  Another
+    // thread may have created it while we weren't holding the lock, so
+    // look again first.
+    pthread_rwlock_wrlock(&dirLock);
+    fileEntry = findFile(fileName, hash);
+    if (fileEntry != NO_SLOT)
+    {
+        status = addOpenFileEntry(fileEntry, flags);
+    }
+    else
+    {
+        // If the directory is full, add another block to it.
+        uint32_t emptyEntry = findFreeSlot();
+        if (emptyEntry == NO_SLOT)
         {
-            memcpy(buf, &diskBlock->data[blockPos], chunkSize);
-            buf += chunkSize;
-            toRead -= chunkSize;
+            status = growDirectory();
+            emptyEntry = findFreeSlot();
+            assert(status < 0 || emptyEntry != NO_SLOT);
         }
-        if (toRead == 0)
-            break;
+        if (status == 0)
+            status = createFile(fileName, hash, emptyEntry, flags);
+    }
+    pthread_rwlock_unlock(&dirLock);
+    if (journalCommit() < 0 && status >= 0)
+    {
+        sfs_close(status);
+        status = -EIO;
+    }
+    return status;
+}
 
-        blockPos = 0;
-        chunkSize = sizeMin(BLOCK_DATA_SIZE, toRead);
-        diskBlock = accessFileBlock(diskBlock->h.next_block);
-        // This could only happen legitimately if we were reading to the end
-        // of a file whose size was an exact multiple of BLOCK_DATA_SIZE, but
-        // then we would already have exited the loop.
-        assert(diskBlock != NULL);
+int sfs_reopen(int fd)
+{
+    // The file is already open, so it cannot be removed, and there is
+    // no need to look at the directory at all.
+    pthread_rwlock_wrlock(&openLock);
+    sfs_mem_filedesc_t *tFile = getFileDesc(fd);
+    int newFd = tFile != NULL ? attachFileDesc(tFile->fileEntry, 0) : -EBADF;
+    pthread_rwlock_unlock(&openLock);
+    return newFd;
+}
+
+/** If FD is the last descriptor for a file that is to be kept
+    compressed, compress it, if that saves space.  A file that cannot be
+    compressed now stays as it is, and compressing it is tried again
+    at the next last close.  */
+static void compressOnClose(int fd)
+{
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return;
+
+    sfs_mem_file_t *file = tFile->fileEntry;
+    pthread_rwlock_rdlock(&openLock);
+    int last = file->keepCompressed && file->refCount == 1;
+    pthread_rwlock_unlock(&openLock);
+    if (last)
+    {
+        pthread_rwlock_wrlock(&file->lock);
+        if (!file->compressed && file->packCell == NO_CELL &&
+            atomic_load(&file->borrowCount) == 0)
+            (void)compressFile(file);
+        pthread_rwlock_unlock(&file->lock);
+        (void)journalCommit();
     }
+    unpinFileDesc(tFile);
+}
 
-    tFile->currBlock = idOfBlock(&diskBlock->h);
-    tFile->currPos = currPos + totalToRead;
+void sfs_close(int fd)
+{
+    compressOnClose(fd);
 
-    return (ssize_t)totalToRead;
+    // Once the descriptor is marked as closing, no more operations can
+    // start on it, but those already in progress have to finish before
+    // it can go.  Operations on other descriptors carry on meanwhile.
+    pthread_rwlock_wrlock(&openLock);
+    sfs_mem_filedesc_t *tFile = getFileDesc(fd);
+    if (!tFile)
+    {
+        pthread_rwlock_unlock(&openLock);
+        return;
+    }
+    atomic_store(&tFile->closing, 1);
+    pthread_rwlock_unlock(&openLock);
+    pthread_mutex_lock(&unpinLock);
+    while (atomic_load(&tFile->pinCount) != 0)
+        pthread_cond_wait(&unpinned, &unpinLock);
+    pthread_mutex_unlock(&unpinLock);
+
+    pthread_rwlock_wrlock(&openLock);
+    sfs_mem_file_t *fileEntry = tFile->fileEntry;
+    // Closing a descriptor releases everything borrowed through it.
+    atomic_fetch_sub(&fileEntry->borrowCount,
+                     atomic_exchange(&tFile->borrowCount, 0));
+    pthread_mutex_lock(&descLock);
+    tFile->fileEntry = NULL;
+    pthread_mutex_unlock(&descLock);
+    atomic_store(&tFile->closing, 0);
+    freeFds[fd / 64] |= (uint64_t)1 << (fd % 64);
+    if ((uint32_t)fd / 64 < freeFdHint)
+        freeFdHint = (uint32_t)fd / 64;
+    freeFdCount++;
+
+    fileEntry->refCount--;
+    if (fileEntry->refCount == 0)
+        discardFileEntry(fileEntry);
+    pthread_rwlock_unlock(&openLock);
+}
+
+ssize_t sfs_read(int fd, char *buf, size_t len)
+{
+    struct iovec iov = {buf, len};
+    return sfs_readv(fd, &iov, 1);
 }
 
 ssize_t sfs_write(int fd, const char *buf, size_t len)
 {
-    if (fd < 0 || fd > OPEN_FILE_LIMIT)
+    struct iovec iov = {(char *)buf, len};
+    return sfs_writev(fd, &iov, 1);
+}
+
+ssize_t sfs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    size_t total;
+    int status = iovTotal(iov, iovcnt, &total);
+    if (status < 0)
+        return status;
+
+    sfs_mem_filedesc_t *tFile = acquireFileDesc(fd);
+    if (tFile == NULL)
         return -EBADF;
 
-    sfs_mem_filedesc_t *tFile = openFileDescTable[fd];
+    pthread_rwlock_rdlock(&tFile->fileEntry->lock);
+    ssize_t n = readFile(tFile, iov, total);
+    pthread_rwlock_unlock(&tFile->fileEntry->lock);
+    releaseFileDesc(tFile);
+    return n;
+}
+
+ssize_t sfs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    size_t total;
+    int status = iovTotal(iov, iovcnt, &total);
+    if (status < 0)
+        return status;
+
+    sfs_mem_filedesc_t *tFile = acquireFileDesc(fd);
     if (tFile == NULL)
         return -EBADF;
 
-    size_t fileSize = tFile->fileEntry->diskFile->size;
-    size_t currPos = tFile->currPos;
-    assert(currPos <= fileSize);
+    pthread_rwlock_wrlock(&tFile->fileEntry->lock);
+    ssize_t n = writeFile(tFile, iov, total);
+    pthread_rwlock_unlock(&tFile->fileEntry->lock);
+    releaseFileDesc(tFile);
+    return commit(n);
+}
 
-    // This implementation does not do a partial write if there is
-    // insufficient space on disk for the complete write; it always
-    // either writes all 'len' bytes, or none.
-    size_t fileAllocSize = roundUp(fileSize, BLOCK_DATA_SIZE);
-    size_t endPos = len + currPos;
-    size_t toWrite = len;
+ssize_t sfs_pread(int fd, char *buf, size_t len, size_t pos)
+{
+    if (len > (size_t)SSIZE_MAX)
+        return -EINVAL;
 
-    // If we need to enlarge the file, do so now, and if we can't make
-    // it big enough, fail the whole operation.  Note that empty files
-    // still have one allocated block: files of length [0, 500]
-    // require one block, [501, 1000] require two, etc.  (Optional
-    // challenge: Think of a way to make empty files not require any
-    // allocated blocks.)
-    block_id firstNewId = 0;
-    if (endPos > fileAllocSize)
-    {
-        size_t fileNewAllocSize = roundUp(endPos, BLOCK_DATA_SIZE);
-        if (fileNewAllocSize > SFS_MAX_FILE_SIZE)
-            return -EFBIG;
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
 
-        uint32_t addlBlocks =
-            (uint32_t)((fileNewAllocSize - fileAllocSize) / BLOCK_DATA_SIZE);
-        assert(addlBlocks >= 1);
+    struct iovec iov = {buf, len};
+    pthread_rwlock_rdlock(&tFile->fileEntry->lock);
+    ssize_t n = preadFile(tFile, &iov, len, pos);
+    pthread_rwlock_unlock(&tFile->fileEntry->lock);
+    unpinFileDesc(tFile);
+    return n;
+}
 
-        firstNewId = allocateBlocks(addlBlocks, SFS_BLOCK_TYPE_FILE);
-        if (firstNewId == 0)
-            return -ENOSPC;
+ssize_t sfs_pwrite(int fd, const char *buf, size_t len, size_t pos)
+{
+    if (len > (size_t)SSIZE_MAX)
+        return -EINVAL;
+
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+
+    struct iovec iov = {(char *)buf, len};
+    pthread_rwlock_wrlock(&tFile->fileEntry->lock);
+    ssize_t n = pwriteFile(tFile, &iov, len, pos);
+    pthread_rwlock_unlock(&tFile->fileEntry->lock);
+    unpinFileDesc(tFile);
+    return commit(n);
+}
+
+int sfs_fstat(int fd, sfs_file_stat *stat)
+{
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+
+    sfs_mem_file_t *file = tFile->fileEntry;
+    pthread_rwlock_rdlock(&file->lock);
+    stat->size = file->diskFile->size;
+    stat->blocks = file->packCell == NO_CELL ? chainLength(file->diskFile) : 0;
+    stat->reserved_blocks = file->reserveCount;
+    pthread_rwlock_unlock(&file->lock);
+    unpinFileDesc(tFile);
+    return 0;
+}
+
+int sfs_ftruncate(int fd, size_t len)
+{
+    if (len > SFS_MAX_FILE_SIZE)
+        return -EFBIG;
+
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+
+    // Growing the file is writing nothing past the end of it.
+    sfs_mem_file_t *file = tFile->fileEntry;
+    pthread_rwlock_wrlock(&file->lock);
+    ssize_t status = 0;
+    if (len > file->diskFile->size)
+    {
+        struct iovec none = {NULL, 0};
+        status = pwriteFile(tFile, &none, 0, len);
     }
+    else if (len < file->diskFile->size)
+    {
+        status = shrinkFile(file, len);
+    }
+    pthread_rwlock_unlock(&file->lock);
+    unpinFileDesc(tFile);
+    return (int)commit(status);
+}
 
-    // Copy chunks of data from the caller's buffer to the mapped disk image.
-    // See comments above the very similar loop in sfs_read() for more detail.
-    sfs_block_file_t *diskBlock = accessFileBlock(tFile->currBlock);
-    size_t blockPos = currPos % BLOCK_DATA_SIZE;
-    size_t chunkSize =
-        sizeMin(roundUp(currPos, BLOCK_DATA_SIZE) - currPos, toWrite);
-    for (;;)
+int sfs_fallocate(int fd, size_t len)
+{
+    if (len > SFS_MAX_FILE_SIZE)
+        return -EFBIG;
+
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+
+    pthread_rwlock_wrlock(&tFile->fileEntry->lock);
+    int status = reserveFileBlocks(tFile->fileEntry, len);
+    pthread_rwlock_unlock(&tFile->fileEntry->lock);
+    unpinFileDesc(tFile);
+    return (int)commit(status);
+}
+
+int sfs_borrow(int fd, size_t pos, size_t len, sfs_span *spans,
+               int max_spans)
+{
+    if (max_spans < 0)
+        return -EINVAL;
+
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+
+    // A compressed file has no blocks that hold its data as it is, so
+    // it is decoded first; it may be compressed again at its last close.
+    sfs_mem_file_t *file = tFile->fileEntry;
+    pthread_rwlock_rdlock(&file->lock);
+    while (file->compressed)
     {
-        // The chunk size can be zero on the first iteration, if the
-        // starting position was exactly at a block boundary.
-        if (chunkSize > 0)
+        pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_wrlock(&file->lock);
+        int status = file->compressed ? inflateFile(file) : 0;
+        pthread_rwlock_unlock(&file->lock);
+        status = (int)commit(status);
+        if (status < 0)
         {
-            memcpy(&diskBlock->data[blockPos], buf, chunkSize);
-            buf += chunkSize;
-            toWrite -= chunkSize;
+            unpinFileDesc(tFile);
+            return status;
         }
-        if (toWrite == 0)
-            break;
+        pthread_rwlock_rdlock(&file->lock);
+    }
+    int n = borrowAt(file, pos, len, spans, max_spans);
+    if (n > 0)
+    {
+        // Counted while we still hold the lock, so that no write can
+        // slip in between filling in the spans and pinning them.
+        atomic_fetch_add(&file->borrowCount, 1);
+        atomic_fetch_add(&tFile->borrowCount, 1);
+    }
+    pthread_rwlock_unlock(&file->lock);
+    unpinFileDesc(tFile);
+    return n;
+}
 
-        blockPos = 0;
-        chunkSize = sizeMin(BLOCK_DATA_SIZE, toWrite);
-        sfs_block_file_t *nextBlock = accessFileBlock(diskBlock->h.next_block);
-        if (nextBlock == NULL)
+int sfs_release(int fd)
+{
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+
+    unsigned int count = atomic_load(&tFile->borrowCount);
+    do
+    {
+        if (count == 0)
         {
-            // We should only get here once, at most, per write call.
-            assert(firstNewId != 0);
-            // We have just advanced the file position to the end of the
-            // original allocation for the file.  Attach the additional
-            // blocks beginning at 'firstNewId' to the end of the file,
-            // and continue.
-            nextBlock = accessFileBlock(firstNewId);
-            diskBlock->h.next_block = firstNewId;
-            nextBlock->h.prev_block = idOfBlock(&diskBlock->h);
-            firstNewId = 0;
+            unpinFileDesc(tFile);
+            return -EINVAL;
         }
-        diskBlock = nextBlock;
+    } while (!atomic_compare_exchange_weak(&tFile->borrowCount, &count,
+                                           count - 1));
+    atomic_fetch_sub(&tFile->fileEntry->borrowCount, 1);
+    unpinFileDesc(tFile);
+    return 0;
+}
+
+int sfs_fsync(int fd)
+{
+    sfs_mem_filedesc_t *tFile = pinFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+
+    // Holding the file's lock shared keeps writers from adding to the
+    // dirty set while it is flushed, without holding up readers.
+    sfs_mem_file_t *file = tFile->fileEntry;
+    pthread_rwlock_rdlock(&file->lock);
+    int status = flushDirty(file);
+    pthread_rwlock_unlock(&file->lock);
+    unpinFileDesc(tFile);
+    return status;
+}
+
+int sfs_sync(void)
+{
+    // Is a disk image available?
+    if (getSFSStatus() < 0)
+        return -ENOMEDIUM;
+
+    // Empty packed blocks are freed first, which with a journal takes a
+    // checkpoint of its own.  Then, with a journal, a checkpoint flushes
+    // the whole image and lets the log start over.  Without one, cached
+    // blocks must go back on the free list first, or a crash would
+    // leave them lost.
+    int status = reclaimPackBlocks();
+    if (status < 0)
+        return status;
+    if (journalEnabled())
+        return journalCheckpoint();
+    reclaimCachedBlocks();
+    return syncBlocks(0, accessSuperBlock()->n_blocks);
+}
+
+int sfs_get_stats(sfs_stats *stats)
+{
+#ifdef SFS_NO_STATS
+    memset(stats, 0, sizeof *stats);
+    return -ENOSYS;
+#else
+    uint64_t totals[STAT_COUNT];
+    pthread_mutex_lock(&statsLock);
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        totals[i] = retiredStats[i] +
+                    atomic_load_explicit(&sharedStats.counts[i],
+                                         memory_order_relaxed);
+        for (sfs_thread_stats_t *s = threadStatsList; s; s = s->next)
+            totals[i] += atomic_load_explicit(&s->counts[i],
+                                              memory_order_relaxed);
     }
+    pthread_mutex_unlock(&statsLock);
 
-    tFile->currBlock = idOfBlock(&diskBlock->h);
-    tFile->currPos = endPos;
-    if (endPos > fileSize)
+    stats->chain_hops = totals[STAT_CHAIN_HOPS];
+    stats->bytes_read = totals[STAT_BYTES_READ];
+    stats->bytes_written = totals[STAT_BYTES_WRITTEN];
+    stats->allocations = totals[STAT_ALLOCATIONS];
+    stats->blocks_allocated = totals[STAT_BLOCKS_ALLOCATED];
+    stats->allocation_failures = totals[STAT_ALLOCATION_FAILURES];
+    stats->blocks_freed = totals[STAT_BLOCKS_FREED];
+    stats->lookups = totals[STAT_LOOKUPS];
+    stats->lookup_probes = totals[STAT_LOOKUP_PROBES];
+    stats->readahead_blocks = totals[STAT_READAHEAD_BLOCKS];
+    stats->checksum_failures = totals[STAT_CHECKSUM_FAILURES];
+    stats->frames_decoded = totals[STAT_FRAMES_DECODED];
+    stats->frame_cache_hits = totals[STAT_FRAME_CACHE_HITS];
+
+    pthread_rwlock_rdlock(&openLock);
+    stats->open_fds = openFileLimit - freeFdCount;
+    stats->fd_limit = openFileLimit;
+    pthread_rwlock_unlock(&openLock);
+    return 0;
+#endif
+}
+
+int sfs_get_frag_stats(sfs_frag_stats *stats)
+{
+    if (getSFSStatus() < 0)
+        return -ENOMEDIUM;
+    pthread_rwlock_rdlock(&dirLock);
+    pthread_rwlock_rdlock(&openLock);
+    measureFragmentation(stats);
+    pthread_rwlock_unlock(&openLock);
+    pthread_rwlock_unlock(&dirLock);
+    return 0;
+}
+
+int sfs_defrag(sfs_frag_stats *before, sfs_frag_stats *after)
+{
+    if (getSFSStatus() < 0)
+        return -ENOMEDIUM;
+
+    // Every free block has to be on the free list to be found.
+    reclaimCachedBlocks();
+    if (before != NULL)
+        sfs_get_frag_stats(before);
+
+    // Each file is moved with the directory, and the file itself if it
+    // is open, held off, but the locks are let go in between, so that
+    // other threads get to run.
+    int moved = 0;
+    int status = 0;
+    for (uint32_t slot = 0; status >= 0; slot++)
     {
-        assert(endPos < SFS_MAX_FILE_SIZE);
-        tFile->fileEntry->diskFile->size = (uint32_t)endPos;
+        pthread_rwlock_wrlock(&dirLock);
+        if (slot >= dirSlotCount)
+        {
+            pthread_rwlock_unlock(&dirLock);
+            break;
+        }
+        pthread_rwlock_rdlock(&openLock);
+        sfs_mem_file_t *file = openFileTable[slot];
+        if (file != NULL)
+            pthread_rwlock_wrlock(&file->lock);
+        status = relocateFile(slot);
+        if (file != NULL)
+            pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_unlock(&openLock);
+        pthread_rwlock_unlock(&dirLock);
+        if (status > 0)
+            moved++;
+        status = (int)commit(status);
     }
-    return (ssize_t)len;
+    if (status < 0)
+        return status;
+
+    if (after != NULL)
+        sfs_get_frag_stats(after);
+    return moved;
 }
 
 ssize_t sfs_getpos(int fd)
 {
-    // It's your job as the student to implement this function.
-    // See sfs-disk.h for the specification.
-    return -ENOSYS;
+    sfs_mem_filedesc_t *tFile = acquireFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+    // sfs_ftruncate may move the position, holding only the file's lock.
+    pthread_rwlock_rdlock(&tFile->fileEntry->lock);
+    ssize_t pos = (ssize_t)tFile->currPos;
+    pthread_rwlock_unlock(&tFile->fileEntry->lock);
+    releaseFileDesc(tFile);
+    return pos;
 }
 
 ssize_t sfs_seek(int fd, ssize_t delta)
 {
-    // It's your job as the student to implement this function.
-    // See sfs-disk.h for the specification.
-    return -ENOSYS;
+    sfs_mem_filedesc_t *tFile = acquireFileDesc(fd);
+    if (tFile == NULL)
+        return -EBADF;
+    sfs_mem_file_t *file = tFile->fileEntry;
+    pthread_rwlock_rdlock(&file->lock);
+
+    // Clamp the new position to [0, fileSize].  File sizes are at most
+    // SFS_MAX_FILE_SIZE, so none of this arithmetic can overflow.
+    size_t fileSize = file->diskFile->size;
+    size_t currPos = tFile->currPos;
+    size_t newPos;
+    if (delta < 0)
+    {
+        size_t back = (size_t)0 - (size_t)delta;
+        newPos = back >= currPos ? 0 : currPos - back;
+    }
+    else
+    {
+        newPos = sizeMin(currPos + sizeMin((size_t)delta, fileSize), fileSize);
+    }
+
+    // The block map, or the cached last block for a seek to the end,
+    // takes us straight to the right block, however far away it is.  A
+    // packed or compressed file has no blocks to track; reads find their
+    // data by position, and writes move the file into blocks first.
+    if (!inPlainBlocks(file))
+        tFile->currBlock = 0;
+    else if (blockIndexOf(newPos) != blockIndexOf(currPos))
+        tFile->currBlock = newPos == fileSize
+                               ? tailBlock(file)
+                               : lookupBlock(file, blockIndexOf(newPos));
+    tFile->currPos = newPos;
+
+    pthread_rwlock_unlock(&file->lock);
+    releaseFileDesc(tFile);
+    return (ssize_t)newPos;
 }
 
 int sfs_remove(const char *name)
 {
-    // Can only have 23 characters, because the string on disk is NUL
-    // terminated.
-    if (strlen(name) + 1 > SFS_FILE_NAME_SIZE_LIMIT)
-        return -ENAMETOOLONG;
+    int status = checkName(name);
+    if (status < 0)
+        return status;
 
     // Is a disk image available?
     if (getSFSStatus() < 0)
         return -ENOMEDIUM;
 
-    sfs_filesystem_t *superBlock = accessSuperBlock();
-    for (int fileEntry = 0; (unsigned long)fileEntry < FILE_COUNT_LIMIT;
-         fileEntry++)
+    uint32_t hash = hashName(name);
+    pthread_rwlock_wrlock(&dirLock);
+    uint32_t fileEntry = findFile(name, hash);
+    if (fileEntry == NO_SLOT)
     {
-        if (superBlock->files[fileEntry].first_block != 0 &&
-            strcmp(superBlock->files[fileEntry].name, name) == 0)
-        {
-            // Is this file currently open?
-            if (openFileTable[fileEntry] != NULL)
-            {
-                // The Unix convention is, when you delete a file that's
-                // open, it disappears from its directory, but its contents
-                // survive until everyone has closed it.  SFS is not set up
-                // to handle this, so instead we refuse to delete files
-                // that are open.  Optional challenge for you: Change SFS so
-                // it *can* do what Unix does.
-                return -EBUSY;
-            }
-            block_id firstBlock = superBlock->files[fileEntry].first_block;
-            superBlock->files[fileEntry].first_block = 0;
-            freeBlocks(firstBlock);
-            return 0;
-        }
+        // The file we were asked to delete does not exist.  The Unix
+        // convention is to report this as an error.  It would be
+        // equally valid to report success -- we were asked to make the
+        // file not exist, and indeed it doesn't!
+        status = -ENOENT;
     }
-
-    // If we get here, the file we were asked to delete does not exist.
-    // The Unix convention is to report this as an error.  It would be
-    // equally valid to report success -- we were asked to make the
-    // file not exist, and indeed it doesn't!
-    return -ENOENT;
+    else if (isFileOpen(fileEntry))
+    {
+        // The Unix convention is, when you delete a file that's
+        // open, it disappears from its directory, but its contents
+        // survive until everyone has closed it.  SFS is not set up
+        // to handle this, so instead we refuse to delete files
+        // that are open.  Optional challenge for you: Change SFS so
+        // it *can* do what Unix does.
+        status = -EBUSY;
+    }
+    else
+    {
+        deleteFile(fileEntry, hash, NULL);
+    }
+    pthread_rwlock_unlock(&dirLock);
+    return (int)commit(status);
 }
 
 int sfs_rename(const char *old_name, const char *new_name)
 {
-    // It's your job as the student to implement this function.
-    // See sfs-disk.h for the specification.
-    return -ENOSYS;
+    int status = checkName(old_name);
+    if (status == 0)
+        status = checkName(new_name);
+    if (status < 0)
+        return status;
+
+    // Is a disk image available?
+    if (getSFSStatus() < 0)
+        return -ENOMEDIUM;
+
+    uint32_t oldHash = hashName(old_name);
+    uint32_t newHash = hashName(new_name);
+    pthread_rwlock_wrlock(&dirLock);
+    uint32_t oldEntry = findFile(old_name, oldHash);
+    uint32_t newEntry = findFile(new_name, newHash);
+    if (oldEntry == NO_SLOT || newEntry == oldEntry)
+    {
+        pthread_rwlock_unlock(&dirLock);
+        return oldEntry == NO_SLOT ? -ENOENT : 0;
+    }
+    // As with sfs_remove, we refuse to delete a file that is open.
+    if (newEntry != NO_SLOT && isFileOpen(newEntry))
+    {
+        pthread_rwlock_unlock(&dirLock);
+        return -EBUSY;
+    }
+
+    // The file keeps its directory slot, so descriptors already open on
+    // it are unaffected by the change of name.  If a file is being
+    // replaced, its directory entry is cleared in the same group of
+    // journal records as this one is changed.  If the file is open, its
+    // size, or even its first block, may be changing under its own
+    // lock, so that is held while the entry is copied and rewritten.
+    pthread_rwlock_rdlock(&openLock);
+    sfs_mem_file_t *file = openFileTable[oldEntry];
+    if (file != NULL)
+        pthread_rwlock_wrlock(&file->lock);
+    sfs_dir_entry_t *e = dirEntry(oldEntry);
+    sfs_journal_rec_t rec = {.kind = SFS_JREC_DIRENT, .entry = *e};
+    setEntryLocation(&rec, e);
+    size_t len = strlen(new_name);
+    memcpy(rec.entry.name, new_name, len);
+    memset(rec.entry.name + len, '\0', SFS_FILE_NAME_SIZE_LIMIT - len);
+    unindexName(oldEntry, oldHash);
+    if (newEntry != NO_SLOT)
+        deleteFile(newEntry, newHash, &rec);
+    else
+        journalApply(&rec, 1);
+    if (file != NULL)
+        pthread_rwlock_unlock(&file->lock);
+    pthread_rwlock_unlock(&openLock);
+    indexName(oldEntry, newHash);
+    pthread_rwlock_unlock(&dirLock);
+    return (int)commit(0);
+}
+
+int sfs_clone(const char *src_name, const char *dst_name)
+{
+    int status = checkName(src_name);
+    if (status == 0)
+        status = checkName(dst_name);
+    if (status < 0)
+        return status;
+
+    // Is a disk image available?
+    if (getSFSStatus() < 0)
+        return -ENOMEDIUM;
+
+    uint32_t srcHash = hashName(src_name);
+    uint32_t dstHash = hashName(dst_name);
+    pthread_rwlock_wrlock(&dirLock);
+    uint32_t srcEntry = findFile(src_name, srcHash);
+    uint32_t dstEntry = NO_SLOT;
+    if (srcEntry == NO_SLOT)
+    {
+        status = -ENOENT;
+    }
+    else if (findFile(dst_name, dstHash) != NO_SLOT)
+    {
+        status = -EEXIST;
+    }
+    else
+    {
+        dstEntry = findFreeSlot();
+        if (dstEntry == NO_SLOT)
+        {
+            status = growDirectory();
+            dstEntry = findFreeSlot();
+            assert(status < 0 || dstEntry != NO_SLOT);
+        }
+    }
+
+    // If the source is open, it may be changing under its own lock,
+    // which is held while it is cloned.
+    if (status == 0)
+    {
+        pthread_rwlock_rdlock(&openLock);
+        sfs_mem_file_t *file = openFileTable[srcEntry];
+        if (file != NULL)
+            pthread_rwlock_rdlock(&file->lock);
+        status = cloneFile(srcEntry, dstEntry, dst_name, dstHash);
+        if (file != NULL)
+            pthread_rwlock_unlock(&file->lock);
+        pthread_rwlock_unlock(&openLock);
+    }
+    pthread_rwlock_unlock(&dirLock);
+    return (int)commit(status);
 }
 
 int sfs_list(sfs_list_cookie *cookie, char filename_out[],
@@ -572,33 +5270,53 @@ int sfs_list(sfs_list_cookie *cookie, char filename_out[],
     if (getSFSStatus() < 0)
         return -ENOMEDIUM;
 
-    // The cookie value is just an offset within the localFiles array,
-    // cast to void*.  It could be necessary to change this in order
-    // to make the filesystem thread-safe, and/or to increase the
-    // number of files that can exist.  If you decide to change it,
-    // keep in mind that the "cookie" argument is a pointer _to_ the
-    // cookie value, not the cookie value itself.
-    uintptr_t next_file_slot = (uintptr_t)*cookie;
-    struct sfs_filesystem_t *superBlock = accessSuperBlock();
-    while (next_file_slot < FILE_COUNT_LIMIT)
-    {
-        sfs_dir_entry_t *e = &superBlock->files[next_file_slot];
-        if (e->first_block)
-        {
-            // Found a "live" directory entry.
-            size_t len = strlen(e->name);
-            if (len + 1 > filename_space)
+    // The cookie value encodes the ID of a directory block (0 for the
+    // super block) in its high 32 bits and the index of an entry within
+    // that block in its low 32 bits, so the null cookie refers to the
+    // first entry of the directory.  This lets each call resume exactly
+    // where the previous one left off, without consulting any
+    // in-memory state that might have changed in between.  Directory
+    // blocks are never freed, so a cookie cannot become dangling, and
+    // the directory lock need only be held for the duration of each
+    // call.
+    pthread_rwlock_rdlock(&dirLock);
+    uintptr_t c = (uintptr_t)*cookie;
+    block_id blk = (block_id)(c >> 32);
+    uint32_t idx = (uint32_t)(c & UINT32_MAX);
+    for (;;)
+    {
+        sfs_dir_entry_t *files = blk == 0 ? accessSuperBlock()->files
+                                          : accessDirBlock(blk)->files;
+        for (; idx < dirEntriesPerBlock; idx++)
+        {
+            // A file's first block changes, without the directory lock,
+            // when it moves out of a packed block, but never to or from
+            // 0, so this test is not upset by that.
+            sfs_dir_entry_t *e = &files[idx];
+            if (e->first_block)
             {
-                return -ENAMETOOLONG;
+                // Found a "live" directory entry.
+                size_t len = strlen(e->name);
+                if (len + 1 > filename_space)
+                {
+                    pthread_rwlock_unlock(&dirLock);
+                    return -ENAMETOOLONG;
+                }
+                memcpy(filename_out, e->name, len + 1);
+                *cookie = (void *)(((uintptr_t)blk << 32) | (idx + 1));
+                pthread_rwlock_unlock(&dirLock);
+                return 0;
             }
-            memcpy(filename_out, e->name, len + 1);
-            *cookie = (void *)(next_file_slot + 1);
-            return 0;
         }
-        next_file_slot++;
+        blk = blk == 0 ? accessSuperBlock()->next_rootdir
+                       : accessDirBlock(blk)->h.next_block;
+        if (blk == 0)
+            break;
+        idx = 0;
     }
 
     // No more files to report.
     *cookie = NULL;
+    pthread_rwlock_unlock(&dirLock);
     return 1;
 }
@@ -16,9 +16,20 @@ Email: tutorcs@163.com
 
 #include <stdint.h>
 
-/** An SFS file system is divided into "blocks" each of which is
-    this many bytes.  */
+/** An SFS file system is divided into "blocks", all the same size.
+    The block size is chosen when the file system is formatted, and
+    recorded in the super block; it is a power of two between
+    SFS_BLOCK_SIZE and SFS_MAX_BLOCK_SIZE.  SFS_BLOCK_SIZE is the
+    original, and default, block size.  Larger blocks spend less space
+    on block headers and make long files' chains shorter, at the cost
+    of more wasted space at the end of each file.  */
 #define SFS_BLOCK_SIZE 512
+#define SFS_MAX_BLOCK_SIZE 65536
+
+/** True if BS is an acceptable block size.  */
+#define SFS_VALID_BLOCK_SIZE(bs)                                               \
+    ((bs) >= SFS_BLOCK_SIZE && (bs) <= SFS_MAX_BLOCK_SIZE &&                   \
+     ((bs) & ((bs)-1)) == 0)
 
 /** You can identify an SFS disk image because its first 8 bytes are
     always this string (*including* the terminating NUL).  They are
@@ -32,8 +43,57 @@ Email: tutorcs@163.com
 
     The trailing \x01 is a version number for the format.  If the
     format ever has to change in a way that makes old programs unable
-    to read it, this number will be incremented.  */
+    to read it, this number will be incremented.
+
+    Version 1 images always have SFS_BLOCK_SIZE-byte blocks, no
+    journal, and no change summary.  Version 2 images
+    (SFS_DISK_MAGIC_V2) have the block size given by the 'block_size'
+    field of the super block, and may have a journal or a change
+    summary; they are otherwise the same.  Images with the default
+    block size and neither of those are still written as version 1, so
+    that older programs can read them.
+
+    Images formatted with packed files have SFS_DISK_PACKED added to
+    their version number, which must be 2: small files may be kept in
+    packed blocks (see sfs_block_pack_t).  Sparse images have
+    SFS_DISK_SPARSE added in the same way: the blocks from some point
+    to the end of the image, the "high-water mark", may never have been
+    written, so that formatting does not have to touch them.  Such
+    blocks are entirely zero, are on no list, and count as free; every
+    block before the mark has a type.  The super block has no room to
+    record the mark, so it is found by bisection.  The two may be
+    combined.  Images that were formatted before these were flags have
+    version 3 (SFS_DISK_MAGIC_V3) if they have packed files, or 4
+    (SFS_DISK_MAGIC_V4) if they are sparse, and are still read; they are
+    no longer written.
+
+    Once a file has been cloned (see sfs_clone), several directory
+    entries may refer to the same chain of blocks, which is then shared
+    by all of them, and they must all have the same size.  Such images
+    have SFS_DISK_SHARED added to their version number, which must be
+    2, 3 or 4 -- a version 1 image becomes version 2 when it is first
+    cloned -- so that older programs, which would write to a shared
+    chain in place, or report it as cross-linked, refuse them.
+
+    Images formatted with checksums (see sfs_block_checksums_t) have
+    SFS_DISK_CHECKSUMS added to their version number, which again must
+    be 2, 3 or 4, since older programs would not keep the checksums up
+    to date.
+
+    Once a file has been compressed (see sfs_compressed_hdr_t), the
+    image has SFS_DISK_COMPRESSED added to its version number, in the
+    same way as for SFS_DISK_SHARED, so that older programs, which
+    would take the compressed data for the file's contents, refuse
+    it.  */
 #define SFS_DISK_MAGIC "SFS\xB2\xB1\xB3\x01"
+#define SFS_DISK_MAGIC_V2 "SFS\xB2\xB1\xB3\x02"
+#define SFS_DISK_MAGIC_V3 "SFS\xB2\xB1\xB3\x03"
+#define SFS_DISK_MAGIC_V4 "SFS\xB2\xB1\xB3\x04"
+#define SFS_DISK_PACKED 0x08
+#define SFS_DISK_SHARED 0x10
+#define SFS_DISK_CHECKSUMS 0x20
+#define SFS_DISK_COMPRESSED 0x40
+#define SFS_DISK_SPARSE 0x80
 
 /** Each block of a SFS disk image, except the super block, has one of
     these codes as its first four bytes.  Unlike SFS_DISK_MAGIC,
@@ -41,9 +101,14 @@ Email: tutorcs@163.com
 #define SFS_BLOCK_TYPE_FREE "SFU\xF5" // block is unallocated
 #define SFS_BLOCK_TYPE_FILE "SFF\xE6" // block holds (part of) a file
 #define SFS_BLOCK_TYPE_DIR "SFD\xE4"  // block holds directory entries
+#define SFS_BLOCK_TYPE_JOURNAL "SFJ\xEA" // block is part of the journal
+#define SFS_BLOCK_TYPE_SUMMARY "SFM\xED" // block is the change summary
+#define SFS_BLOCK_TYPE_PACK "SFP\xF0" // block holds several small files
+#define SFS_BLOCK_TYPE_CHECKSUM "SFC\xE3" // block is part of the checksums
+#define SFS_BLOCK_TYPE_COMPRESSED "SFZ\xFA" // block holds compressed data
 
 /** Block IDs are 32-bit unsigned (little-endian) numbers.  Block N is at
-    offset SFS_BLOCK_SIZE * N from the beginning of the filesystem.  Thus,
+    offset N times the block size from the beginning of the filesystem.  Thus,
     the super block is block 0, but it is never referred to as such.  When
     a 'block_id' field of any on-disk structure has the value 0, this means
     the same thing as a NULL pointer in memory -- "end of list", "absent",
@@ -51,9 +116,10 @@ Email: tutorcs@163.com
 typedef uint32_t block_id;
 
 /** Because block IDs are 32 bits long, the maximum size of an SFS
-    disk image is 2**32 * SFS_BLOCK_SIZE bytes.  We presume that
-    size_t and off_t can both hold this number.  */
-#define SFS_MAX_DISK_SIZE ((((size_t)UINT32_MAX) + 1) * SFS_BLOCK_SIZE)
+    disk image is 2**32 blocks, which is this many bytes with the
+    largest block size.  We presume that size_t and off_t can both
+    hold this number.  */
+#define SFS_MAX_DISK_SIZE ((((size_t)UINT32_MAX) + 1) * SFS_MAX_BLOCK_SIZE)
 
 /** The maximum size of a single file in SFS is capped by the 32-bit
     'size' field in a sfs_dir_entry_t.  */
@@ -70,16 +136,48 @@ typedef struct sfs_block_hdr_t
                                 free list containing this block */
 } sfs_block_hdr_t;
 
-/** Amount of file data that can be stored in any one block.  */
-#define BLOCK_DATA_SIZE ((uint32_t)(SFS_BLOCK_SIZE - sizeof(sfs_block_hdr_t)))
+/** Amount of file data that can be stored in any one block, if blocks
+    are BS bytes long.  */
+#define SFS_BLOCK_DATA_SIZE(bs) ((uint32_t)((bs) - sizeof(sfs_block_hdr_t)))
 
-/** A block containing file data is laid out according to this struct.  */
+/** A block containing file data is laid out according to this struct.
+    'data' fills the rest of the block.  */
 typedef struct sfs_block_file_t
 {
     sfs_block_hdr_t h;
-    char data[BLOCK_DATA_SIZE];
+    char data[];
 } sfs_block_file_t;
 
+/** A file may instead be kept compressed, in a chain of blocks of type
+    SFS_BLOCK_TYPE_COMPRESSED, laid out like file blocks, whose data
+    areas, taken together, hold a "stream" beginning with this header.
+    The file's data is cut into frames of SFS_FRAME_SIZE bytes (the
+    last may be shorter), each compressed on its own, in the format of
+    sfs-lz.c, so that any part of the file can be read without decoding
+    the rest.  They follow the header in order, and 'frame_end' gives
+    the offset in the stream just past each one, so frame K starts
+    where frame K - 1 ends, or just past the header.  A frame whose
+    stored length is its full length was not worth compressing and is
+    kept as it is.  The chain is always a single run of consecutive
+    blocks, so that block K of the stream is the first block plus K.
+    Its length is 'blocks', which is just enough to hold the stream,
+    and the directory entry's 'size' is that of the data itself.
+
+    Only files that were asked to be (see SFS_OPEN_COMPRESS), and files
+    that already were, are compressed, when their last descriptor is
+    closed, and only if it saves space.  A compressed file is decoded
+    back into file blocks as soon as anything changes it.  */
+typedef struct sfs_compressed_hdr_t
+{
+    uint32_t size;        /**< Size of the file's data, in bytes */
+    uint32_t blocks;      /**< Number of blocks in the chain */
+    uint32_t frame_count; /**< Number of frames */
+    uint32_t frame_end[]; /**< Offset just past the end of each frame */
+} sfs_compressed_hdr_t;
+
+/** Number of bytes of a compressed file's data in each frame.  */
+#define SFS_FRAME_SIZE 4096
+
 /** Maximum number of characters in a file name, _including_ a terminating NUL.
     Caution: This constant also appears in sfs-api.h.  */
 #define SFS_FILE_NAME_SIZE_LIMIT 24
@@ -93,41 +191,333 @@ typedef struct sfs_dir_entry_t
     char name[SFS_FILE_NAME_SIZE_LIMIT]; /**< NUL-terminated name */
 } sfs_dir_entry_t;
 
-/** Number of directory entries that can be stored in one block.  */
-#define DIR_ENTRIES_PER_BLOCK ((SFS_BLOCK_SIZE / sizeof(sfs_dir_entry_t)) - 1)
+/** Number of directory entries that can be stored in one block, if
+    blocks are BS bytes long.  */
+#define SFS_DIR_ENTRIES_PER_BLOCK(bs)                                          \
+    ((uint32_t)((bs) / sizeof(sfs_dir_entry_t) - 1))
 
-/** A block containing directory entries is laid out according to this struct.
- */
+/** A block containing directory entries is laid out according to this
+    struct.  'files' fills the rest of the block.  */
 typedef struct sfs_block_dir_t
 {
     sfs_block_hdr_t h;
     char unused[sizeof(sfs_dir_entry_t) - sizeof(sfs_block_hdr_t)];
-    sfs_dir_entry_t files[DIR_ENTRIES_PER_BLOCK];
+    sfs_dir_entry_t files[];
 } sfs_block_dir_t;
 
+/** Largest file, in bytes, that can be kept in a packed block.  */
+#define SFS_PACKED_FILE_MAX 120
+
+/** One cell of a packed block, holding the data of one small file.
+    'owner' is one more than the directory slot of the file (slots are
+    numbered across the whole root directory, from the super block
+    onward), or 0 if the cell is free.  */
+typedef struct sfs_pack_cell_t
+{
+    uint32_t owner;
+    char data[SFS_PACKED_FILE_MAX];
+} sfs_pack_cell_t;
+
+/** In an image with packed files, a file of at most SFS_PACKED_FILE_MAX bytes
+    may live in a cell of a packed block instead of a chain of blocks
+    of its own; its directory entry's 'first_block' is then the packed
+    block, which is told apart from a file block by its type.  A packed
+    block is on no list, so both of its links are 0, and 'cells' fills
+    as much of the rest of it as whole cells fit in.  A packed block
+    with no files in it is allowed; sfs_mount frees it.  */
+typedef struct sfs_block_pack_t
+{
+    sfs_block_hdr_t h;
+    sfs_pack_cell_t cells[];
+} sfs_block_pack_t;
+
+/** Number of cells in a packed block, if blocks are BS bytes long.  */
+#define SFS_PACK_CELLS_PER_BLOCK(bs)                                           \
+    ((uint32_t)(SFS_BLOCK_DATA_SIZE(bs) / sizeof(sfs_pack_cell_t)))
+
 /** The super block -- the first block of the file system, from which
     everything else can be found -- does not contain a normal block header.
     Its entire contents are laid out according to *this* struct, instead.  */
 typedef struct sfs_filesystem_t
 {
-    char magic[8];         /**< SFS_DISK_MAGIC, including NUL */
-    uint32_t n_blocks;     /**< Size of file system in SFS_BLOCK_SIZE units */
+    char magic[8];         /**< SFS_DISK_MAGIC(_V2/_V3/_V4), with NUL,
+                                and maybe some of the SFS_DISK_*
+                                flags */
+    uint32_t n_blocks;     /**< Size of file system in blocks */
     block_id freelist;     /**< First block in the list of unallocated blocks */
     block_id next_rootdir; /**< Next block in the list of blocks holding
                                 entries in the root directory */
+    uint32_t block_size;   /**< Block size in bytes (version 2 and up;
+                                may be zero in version 1 images) */
+    block_id journal;      /**< First block of the journal, or 0 if there
+                                is none (version 2 and up) */
+    block_id summary;      /**< The change summary block, or 0 if there
+                                is none (version 2 and up) */
 
-    char unused[sizeof(sfs_dir_entry_t) -
-                (8 + sizeof(uint32_t) + 2 * sizeof(block_id))];
-
-    sfs_dir_entry_t files[DIR_ENTRIES_PER_BLOCK];
+    sfs_dir_entry_t files[]; /**< fills the rest of the block */
 } sfs_filesystem_t;
 
+/** The change summary, if there is one, is a single block, on no list,
+    laid out according to this struct.  The disk is divided into
+    regions of 2**region_shift consecutive blocks, the first starting
+    at block 0, and each region has a bit in 'dirty': bit N % 8 of
+    dirty[N / 8] for region N.  A region's bit is set, and the summary
+    flushed to stable storage, before the first change since the image
+    was last cleanly unmounted to the header of any block in it, to
+    any directory entry in it, or to the owner of any cell of a packed
+    block in it.  sfs_unmount clears all the bits, once
+    everything else is on stable storage.  So the parts of the image
+    that sfs-fsck needs to look at, to check an image that was known to
+    be consistent when it was last cleanly unmounted, are the regions
+    whose bits are set, and the lists that pass through them.  */
+typedef struct sfs_summary_t
+{
+    sfs_block_hdr_t h;
+    uint32_t region_shift; /**< log2 of the number of blocks per region */
+    unsigned char dirty[]; /**< one bit per region; fills the block */
+} sfs_summary_t;
+
+/** Number of regions a change summary has room for, if blocks are BS
+    bytes long.  sfs_format picks the smallest region size for which
+    this is enough.  */
+#define SFS_SUMMARY_REGIONS(bs)                                                \
+    ((uint32_t)(((bs) - sizeof(sfs_summary_t)) * 8))
+
+/** In an image with SFS_DISK_CHECKSUMS, the blocks from 1 to
+    SFS_CHECKSUM_BLOCKS of the image's size, ahead of the journal and
+    the change summary, hold a checksum table.  They are a chain of
+    consecutive blocks of type SFS_BLOCK_TYPE_CHECKSUM, each laid out
+    according to this struct, and 'crc' holds an entry for every block
+    of the image in turn, the super block and the table included.  The
+    entry for a block that is part of a file, compressed or not, is
+    either 0, meaning that its checksum is not known, or the CRC-32C of
+    the block's whole data area, bytes past the end of the file (or of
+    the compressed stream) included; entries for other blocks mean
+    nothing.  (So a data area whose CRC is 0 is never checked.)  Only
+    file data is covered, since the rest is checked by following the
+    lists, and the table is kept apart from the data so that
+    SFS_BLOCK_DATA_SIZE is the same as for other images.
+
+    Like file data, the table is not journaled.  A block's entry is
+    cleared before the block is given to a file, and before each write
+    to it, and set once the write is done, so a process that dies part
+    way through a write leaves the blocks it was writing unchecked
+    rather than wrong.  If the whole system goes down, however, a data
+    area and its entry may not both have reached the disk, and the
+    block may then be reported as damaged.  */
+typedef struct sfs_block_checksums_t
+{
+    sfs_block_hdr_t h;
+    uint32_t crc[];
+} sfs_block_checksums_t;
+
+/** Number of checksum table entries in one block, and number of blocks
+    the table of an image of N blocks takes up, if blocks are BS bytes
+    long.  */
+#define SFS_CHECKSUMS_PER_BLOCK(bs)                                            \
+    ((uint32_t)(SFS_BLOCK_DATA_SIZE(bs) / sizeof(uint32_t)))
+#define SFS_CHECKSUM_BLOCKS(n, bs)                                             \
+    ((uint32_t)(((uint64_t)(n) + SFS_CHECKSUMS_PER_BLOCK(bs) - 1) /           \
+                SFS_CHECKSUMS_PER_BLOCK(bs)))
+
+/** When an image of version 2 or later is cleanly unmounted, the free
+    extent index kept in memory is saved in the data areas of the
+    first blocks of the free list, so that the next mount can read it
+    back instead of walking the whole list.  The first of those blocks
+    begins with this header.  The extents follow it as 'extent_count'
+    pairs of first block and length, in ascending order, continuing
+    from each block into the next one on the free list.  sfs_mount
+    clears the magic number, and flushes that to stable storage,
+    before it changes anything, so a snapshot that is found always
+    describes the free list as it is.  Nothing else uses the data
+    areas of free blocks, so sfs-fsck ignores the snapshot.  Version 1
+    images never have one, since older programs, which would not know
+    to clear it, can change them.  */
+typedef struct sfs_free_snapshot_t
+{
+    char magic[8];         /**< SFS_SNAPSHOT_MAGIC, including NUL */
+    uint32_t checksum;     /**< CRC-32C of the rest, extents included */
+    uint32_t extent_count; /**< Number of extents */
+    uint32_t free_blocks;  /**< Total length of the extents */
+} sfs_free_snapshot_t;
+
+#define SFS_SNAPSHOT_MAGIC "SFX\xF3\xEE\xE1\x01"
+
+/** The journal, if there is one, is a chain of consecutive blocks of
+    type SFS_BLOCK_TYPE_JOURNAL.  The first is laid out according to
+    this struct; the rest hold the log, which is a sequence of
+    sfs_journal_rec_t records, filling each block's data area as far as
+    whole records fit before going on to the next block.  */
+typedef struct sfs_journal_t
+{
+    sfs_block_hdr_t h;
+    uint32_t n_blocks; /**< Blocks in the journal, including this one */
+    uint32_t sequence; /**< Sequence number of the current log */
+} sfs_journal_t;
+
+/** Kinds of journal record.  Each one describes the end result of a
+    change to the metadata, not the change itself, so it does no harm
+    to carry one out more than once.  The fields a record uses are
+    listed after its kind; "limbo" is explained below.
+
+    LIMBO    BLOCK, COUNT: the run [BLOCK, BLOCK + COUNT) is in limbo.
+    TAKE     BLOCK, COUNT, PREV, NEXT: the run has been taken off the
+             free list, where it lay between blocks PREV and NEXT (0 at
+             either end of the list), and is now in limbo.
+    RELEASE  BLOCK, COUNT, PREV, NEXT: the run, which is already free
+             and linked in order, goes back on the free list between
+             PREV and NEXT, and out of limbo.
+    CHAIN    BLOCK, COUNT, PREV, TYPE: each block of the run gets type
+             TYPE and is linked to its neighbours; the first one also
+             follows block PREV, if PREV is not 0, and the last one
+             ends the chain.
+    LINK     BLOCK, NEXT: block NEXT follows block BLOCK.  Either may
+             be 0, meaning that the other ends a chain.
+    CLAIM    BLOCK, COUNT: the run is out of limbo.
+    DIRENT   BLOCK, COUNT, ENTRY: directory entry number COUNT of
+             directory block BLOCK (0 for the super block) is ENTRY.
+    APPEND   BLOCK, COUNT, PREV, NEXT, ENTRY: if NEXT is not 0, the
+             chain starting at block NEXT follows block PREV; then the
+             size of the file in directory entry COUNT of directory
+             block BLOCK is ENTRY.size.  The rest of ENTRY is ignored.
+    DIRGROW  BLOCK, PREV: directory block BLOCK, whose entries are all
+             cleared, follows PREV in the directory (0 for the super
+             block).
+    PACK     BLOCK: block BLOCK is a packed block, on no list, with all
+             of its cells free.  The data in the cells is left alone.
+    CELL     BLOCK, COUNT, PREV: cell COUNT of packed block BLOCK
+             belongs to directory slot PREV - 1, or is free if PREV is
+             0.
+    MOVE     BLOCK, COUNT, NEXT: the 'first_block' of directory entry
+             COUNT of directory block BLOCK is NEXT.  The rest of the
+             entry is left alone.
+
+    Blocks that are neither on the free list nor part of a file, the
+    directory, or the journal are "in limbo".  A block is in limbo
+    while it sits in an allocation cache, and between being allocated
+    and being attached to a file, or being detached from a file and
+    being freed.  Replaying the log keeps track of which blocks are in
+    limbo, and puts any that still are at the end back on the free
+    list; so the log must say when blocks go into limbo, and the
+    journal starts each log with LIMBO records for the blocks that
+    already are.
+
+    A packed block is only freed when the log does not mention it: once
+    the old log has been replayed, or right after a checkpoint, before
+    any more records about the block have been logged.  Otherwise a
+    replay could carry out PACK or CELL records on a block that had
+    since been given to a file, and overwrite its data.
+
+    Records are applied only as whole groups: a record with
+    SFS_JREC_MORE set in its flags is part of a group with the record
+    after it.  */
+enum
+{
+    SFS_JREC_LIMBO = 1,
+    SFS_JREC_TAKE,
+    SFS_JREC_RELEASE,
+    SFS_JREC_CHAIN,
+    SFS_JREC_LINK,
+    SFS_JREC_CLAIM,
+    SFS_JREC_DIRENT,
+    SFS_JREC_APPEND,
+    SFS_JREC_DIRGROW,
+    SFS_JREC_PACK,
+    SFS_JREC_CELL,
+    SFS_JREC_MOVE
+};
+#define SFS_JREC_MORE 0x0001
+
+/** One journal record.  A record belongs to the current log only if
+    its 'sequence' matches the journal's and its 'checksum' is right;
+    the log ends at the first record that does not.  A checkpoint
+    writes the next log over the start of the current one before it
+    changes the journal's 'sequence', so the current one may begin with
+    records whose 'sequence' is one more; they are skipped.  The
+    checksum is the 32-bit FNV-1a hash of the whole record, taken with
+    'checksum' itself set to zero.  */
+typedef struct sfs_journal_rec_t
+{
+    uint32_t sequence;
+    uint32_t checksum;
+    uint16_t kind;  /**< one of the SFS_JREC_* kinds */
+    uint16_t flags; /**< SFS_JREC_MORE, or 0 */
+    block_id block;
+    uint32_t count;
+    block_id prev;
+    block_id next;
+    unsigned char type[4];
+    sfs_dir_entry_t entry;
+} sfs_journal_rec_t;
+
+/** Number of journal records that fit in one block of the log, if
+    blocks are BS bytes long.  */
+#define SFS_JOURNAL_RECORDS_PER_BLOCK(bs)                                      \
+    ((uint32_t)(SFS_BLOCK_DATA_SIZE(bs) / sizeof(sfs_journal_rec_t)))
+
+/** sfs_format never makes a log with room for fewer records than this.  */
+#define SFS_JOURNAL_MIN_RECORDS 64
+
+/** A block of the log is laid out according to this struct.  */
+typedef struct sfs_block_log_t
+{
+    sfs_block_hdr_t h;
+    sfs_journal_rec_t records[];
+} sfs_block_log_t;
+
 sfs_block_hdr_t *accessBlock(block_id id);
 sfs_block_hdr_t *accessFreeBlock(block_id id);
 sfs_block_file_t *accessFileBlock(block_id id);
+sfs_block_dir_t *accessDirBlock(block_id id);
+sfs_block_pack_t *accessPackBlock(block_id id);
 block_id idOfBlock(const sfs_block_hdr_t *blk);
 sfs_filesystem_t *accessSuperBlock(void);
 int getSFSStatus(void);
+uint32_t getBlockSize(void);
+int getImageVersion(void);
+int imagePacksFiles(void);
+int imageIsSparse(void);
+int imageSharesChains(void);
+int setImageShared(void);
+int imageHasChecksums(void);
+int imageHasCompressed(void);
+int setImageCompressed(void);
+int syncBlocks(block_id first, uint32_t n_blocks);
+void prefetchBlocks(block_id first, uint32_t n_blocks);
 void setBlockType(sfs_block_hdr_t *blk, const char *type);
 
+/** Implemented by sfs-disk.c.  sfs-support.c calls initDiskState once a
+    disk image has been mapped by sfs_format or sfs_mount, to build the
+    in-memory indexes over it, with room for MAXOPENFILES "file
+    descriptors", or the default number if it is 0; if it fails, the
+    image is unmapped again.
+    releaseDiskState is called by sfs_unmount before the image is
+    unmapped, and fails with -EBUSY if any files are still open.  If it
+    fails with -EIO, the image could not be flushed to storage, but
+    the in-memory state is gone anyway.  */
+int initDiskState(uint32_t maxOpenFiles);
+int releaseDiskState(void);
+
+/** Implemented by sfs-journal.c, and used by sfs-disk.c to make every
+    change to the metadata; see the comment at the top of that file.
+    journalFormat lays out an empty journal of N_BLOCKS blocks starting
+    at block START, for sfs_format.  */
+void journalFormat(block_id start, uint32_t n_blocks);
+int journalOpen(void);
+int journalEnabled(void);
+int journalFirstOrphan(block_id *start, uint32_t *length);
+void journalApply(const sfs_journal_rec_t *recs, uint32_t n);
+int journalCommit(void);
+int journalCheckpoint(void);
+int journalClose(void);
+
+/** Implemented by sfs-summary.c, which keeps the change summary, if
+    the disk image has one, and used by sfs-journal.c as it carries out
+    each record.  summaryFormat lays out an empty summary in block ID,
+    for sfs_format.  */
+void summaryFormat(block_id id);
+int summaryOpen(void);
+void summaryMark(block_id start, uint32_t count);
+int summaryClose(int clean);
+
 #endif
@@ -0,0 +1,854 @@
+//
+// SFS Journal - write-ahead log of metadata changes
+//
+// Every change that sfs-disk.c makes to the structure of the file
+//   system -- block headers, the free list, directory entries, the
+//   owners of the cells of packed blocks, and the super block -- is
+//   described by one or more sfs_journal_rec_t records (see
+//   sfs-disk.h) and carried out by journalApply.  If the disk image
+//   has a journal, the records are first appended to the log there, so
+//   that if the process dies while they are being carried out,
+//   sfs_mount can replay the log and finish the job.
+//   Records describe end results rather than changes, so replaying
+//   ones that had already been carried out does no harm.  A group of
+//   records is appended all at once, and replay ignores a group that
+//   was not appended completely, which was never carried out either.
+//
+// Not everything one API call does is a single group.  Allocating
+//   blocks and attaching them to a file are separate steps, and
+//   between the two the blocks are "in limbo": off the free list, but
+//   not part of anything.  Blocks in the allocation caches are in
+//   limbo too.  Replay follows the records that put blocks into limbo
+//   and take them out, and afterwards sfs-disk.c frees whatever is
+//   left.  To the same end, the journal keeps the set of blocks in
+//   limbo in memory, and starts each new log with it.  sfs-disk.c
+//   orders records so that a crash between any two groups can at
+//   worst leave blocks in limbo that would not otherwise have been.
+//
+// Records become durable when journalCommit flushes the part of the
+//   log they are in.  sfs-disk.c commits at the end of each API call
+//   that logged anything.  When several threads commit at once, the
+//   first one flushes everything appended so far, on behalf of all of
+//   them, while the rest wait for it ("group commit"); so a busy image
+//   needs far fewer flushes than it has operations.  When the log
+//   fills up, the whole image is flushed, after which the log is no
+//   longer needed, and a new one is begun ("checkpoint").  This also
+//   happens when the image is mounted and unmounted.
+//
+// The log only protects against the process dying.  Because the disk
+//   image is mapped shared, the kernel may write a block back to the
+//   file at any time, including after a change to it has been made
+//   but before the record describing the change has been flushed; if
+//   the whole system goes down at that moment, the change may survive
+//   without its record.  The window is as long as it takes the calling
+//   thread to get from journalApply to journalCommit.  File data is not
+//   logged at all.
+//
+// 'journalLock' protects all of the state below.  It is the last lock
+//   in the order described above 'dirLock' in sfs-disk.c, and is held
+//   while records are both appended and carried out, so that the log
+//   is always in the same order as the changes, and a checkpoint never
+//   sees a record that has been appended but not yet carried out.
+//
+// Carrying out a record also marks what it changes in the change
+//   summary, if the image has one; see sfs-summary.c.
+//
+
+#include "sfs-disk.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** A checkpoint leaves at least this much of the log free, even if it
+    means forgetting about some of the blocks in limbo.  */
+#define JOURNAL_RESERVE (SFS_JOURNAL_MIN_RECORDS / 2)
+
+/** A group of records is only appended if room for as many more as
+    there will then be runs of blocks in limbo, up to this many, is
+    left after it, so that a checkpoint can copy them to the end of the
+    old log first (see checkpointLocked).  */
+#define LIMBO_SPARE (JOURNAL_RESERVE / 2)
+
+/** A run of consecutively numbered blocks, [start, start + length).  */
+typedef struct sfs_run_t
+{
+    block_id start;
+    uint32_t length;
+} sfs_run_t;
+
+/** The journal's header block, or NULL if the image has no journal.  */
+static sfs_journal_t *journal;
+static block_id journalStart;
+static uint32_t recordsPerBlock;
+/** Number of records the log can hold, and the number it does.  */
+static uint32_t journalCapacity;
+static uint32_t journalTail;
+
+/** Log sequence numbers: the sequence number of a log in the upper 32
+    bits, and the number of records in it in the lower 32.  Every
+    record appended up to 'appendedLsn' has been carried out, and
+    every one up to 'committedLsn' is on stable storage.  'flushing' is
+    set while some thread is flushing the log for journalCommit.  If
+    'journalFailed' is set, flushing the log went wrong and there is no
+    reason to think it would work if tried again; records are carried
+    out without being logged, and every commit fails.  */
+static uint64_t appendedLsn;
+static uint64_t committedLsn;
+static int flushing;
+static int journalFailed;
+
+/** The blocks in limbo, as a sorted array of maximal runs.  */
+static sfs_run_t *limbo;
+static uint32_t limboCount;
+static uint32_t limboCapacity;
+
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journalFlushed = PTHREAD_COND_INITIALIZER;
+
+/** The last record this thread has logged since it last committed,
+    or 0 if none.  */
+static _Thread_local uint64_t threadLsn;
+
+/** Compute the checksum of REC, as described in sfs-disk.h.  */
+static uint32_t recordChecksum(const sfs_journal_rec_t *rec)
+{
+    sfs_journal_rec_t copy = *rec;
+    copy.checksum = 0;
+    const unsigned char *p = (const unsigned char *)&copy;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < sizeof copy; i++)
+    {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Get a pointer to slot K of the log.  */
+static sfs_journal_rec_t *recordAt(uint32_t k)
+{
+    block_id id = journalStart + 1 + k / recordsPerBlock;
+    sfs_block_log_t *b = (sfs_block_log_t *)(void *)accessBlock(id);
+    return &b->records[k % recordsPerBlock];
+}
+
+/** Get a pointer to directory entry IDX of directory block BLOCK, or of
+    the super block if BLOCK is 0.  */
+static sfs_dir_entry_t *entryAt(block_id block, uint32_t idx)
+{
+    if (block == 0)
+        return &accessSuperBlock()->files[idx];
+    return &((sfs_block_dir_t *)(void *)accessBlock(block))->files[idx];
+}
+
+/** One past the last block of run number IDX in limbo.  */
+static uint64_t runEnd(uint32_t idx)
+{
+    return (uint64_t)limbo[idx].start + limbo[idx].length;
+}
+
+/** Return the index of the first run in limbo that ends at or after
+    block X.  */
+static uint32_t findRun(uint64_t x)
+{
+    uint32_t lo = 0, hi = limboCount;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (runEnd(mid) < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/** Make room for one more run in limbo.  Returns 0 or -ENOMEM.  */
+static int growLimbo(void)
+{
+    if (limboCount < limboCapacity)
+        return 0;
+    uint32_t cap = limboCapacity ? limboCapacity * 2 : 16;
+    sfs_run_t *runs = realloc(limbo, (size_t)cap * sizeof *runs);
+    if (runs == NULL)
+        return -ENOMEM;
+    limbo = runs;
+    limboCapacity = cap;
+    return 0;
+}
+
+/** Put the run [START, START + LENGTH) in limbo.  Returns 0 or
+    -ENOMEM.  */
+static int addToLimbo(block_id start, uint32_t length)
+{
+    uint64_t s = start, e = s + length;
+    uint32_t lo = findRun(s);
+    uint32_t hi = lo;
+    while (hi < limboCount && limbo[hi].start <= e)
+        hi++;
+
+    if (lo == hi)
+    {
+        int status = growLimbo();
+        if (status < 0)
+            return status;
+        memmove(&limbo[lo + 1], &limbo[lo], (limboCount - lo) * sizeof *limbo);
+        limbo[lo].start = start;
+        limbo[lo].length = length;
+        limboCount++;
+        return 0;
+    }
+
+    // Merge with every run the new one overlaps or adjoins.
+    if (limbo[lo].start < s)
+        s = limbo[lo].start;
+    if (runEnd(hi - 1) > e)
+        e = runEnd(hi - 1);
+    limbo[lo].start = (block_id)s;
+    limbo[lo].length = (uint32_t)(e - s);
+    memmove(&limbo[lo + 1], &limbo[hi], (limboCount - hi) * sizeof *limbo);
+    limboCount -= hi - lo - 1;
+    return 0;
+}
+
+/** Take the run [START, START + LENGTH) out of limbo.  Returns 0 or
+    -ENOMEM.  */
+static int removeFromLimbo(block_id start, uint32_t length)
+{
+    uint64_t s = start, e = s + length;
+    uint32_t i = findRun(s + 1);
+    while (i < limboCount && limbo[i].start < e)
+    {
+        uint64_t rs = limbo[i].start, re = runEnd(i);
+        if (rs < s && re > e)
+        {
+            int status = growLimbo();
+            if (status < 0)
+                return status;
+            memmove(&limbo[i + 1], &limbo[i], (limboCount - i) * sizeof *limbo);
+            limboCount++;
+            limbo[i].length = (uint32_t)(s - rs);
+            limbo[i + 1].start = (block_id)e;
+            limbo[i + 1].length = (uint32_t)(re - e);
+            return 0;
+        }
+        if (rs < s)
+        {
+            limbo[i].length = (uint32_t)(s - rs);
+            i++;
+        }
+        else if (re > e)
+        {
+            limbo[i].start = (block_id)e;
+            limbo[i].length = (uint32_t)(re - e);
+            i++;
+        }
+        else
+        {
+            memmove(&limbo[i], &limbo[i + 1],
+                    (limboCount - i - 1) * sizeof *limbo);
+            limboCount--;
+        }
+    }
+    return 0;
+}
+
+/** Update the set of blocks in limbo for record REC.  Returns 0 or
+    -ENOMEM.  */
+static int noteLimbo(const sfs_journal_rec_t *rec)
+{
+    switch (rec->kind)
+    {
+    case SFS_JREC_LIMBO:
+    case SFS_JREC_TAKE:
+        return addToLimbo(rec->block, rec->count);
+    case SFS_JREC_RELEASE:
+    case SFS_JREC_CLAIM:
+        return removeFromLimbo(rec->block, rec->count);
+    default:
+        return 0;
+    }
+}
+
+/** Check that REC, which came from the log, makes sense for this disk
+    image, so that carrying it out cannot write outside the image.  */
+static int recordIsSane(const sfs_journal_rec_t *rec)
+{
+    sfs_filesystem_t *super = accessSuperBlock();
+    uint32_t n_blocks = super->n_blocks;
+    uint64_t end = (uint64_t)rec->block + rec->count;
+    int run = rec->block != 0 && rec->count != 0 && end <= n_blocks;
+    int links = rec->prev < n_blocks && rec->next < n_blocks;
+    int entry = rec->block < n_blocks &&
+                rec->count < SFS_DIR_ENTRIES_PER_BLOCK(getBlockSize());
+    int pack = rec->block != 0 && rec->block < n_blocks;
+
+    switch (rec->kind)
+    {
+    case SFS_JREC_LIMBO:
+    case SFS_JREC_CLAIM:
+        return run;
+    case SFS_JREC_TAKE:
+    case SFS_JREC_RELEASE:
+        return run && links;
+    case SFS_JREC_CHAIN:
+        return run && links &&
+               (!memcmp(rec->type, SFS_BLOCK_TYPE_FREE, 4) ||
+                !memcmp(rec->type, SFS_BLOCK_TYPE_FILE, 4) ||
+                !memcmp(rec->type, SFS_BLOCK_TYPE_DIR, 4) ||
+                !memcmp(rec->type, SFS_BLOCK_TYPE_COMPRESSED, 4));
+    case SFS_JREC_LINK:
+        return rec->block < n_blocks && links;
+    case SFS_JREC_DIRENT:
+        return entry;
+    case SFS_JREC_APPEND:
+        return entry && links && (rec->next == 0 || rec->prev != 0);
+    case SFS_JREC_DIRGROW:
+        return rec->block != 0 && entry && links;
+    case SFS_JREC_PACK:
+        return pack;
+    case SFS_JREC_CELL:
+        return pack && rec->count < SFS_PACK_CELLS_PER_BLOCK(getBlockSize());
+    case SFS_JREC_MOVE:
+        return entry && rec->next != 0 && rec->next < n_blocks;
+    default:
+        return 0;
+    }
+}
+
+/** Tell the change summary about every block whose header REC is
+    about to change, or that it is about to put on or take off a list
+    without changing the block itself, and about the directory block
+    that any directory entry it changes is in.  A block number of 0
+    stands for the super block, which holds the heads of the lists.  */
+static void markRecord(const sfs_journal_rec_t *rec)
+{
+    switch (rec->kind)
+    {
+    case SFS_JREC_TAKE:
+    case SFS_JREC_RELEASE:
+        summaryMark(rec->block, rec->count);
+        summaryMark(rec->prev, 1);
+        if (rec->next != 0)
+            summaryMark(rec->next, 1);
+        break;
+
+    case SFS_JREC_CHAIN:
+        summaryMark(rec->block, rec->count);
+        if (rec->prev != 0)
+            summaryMark(rec->prev, 1);
+        break;
+
+    case SFS_JREC_LINK:
+        // Whatever followed REC->block is being cut loose.
+        if (rec->block != 0)
+        {
+            summaryMark(rec->block, 1);
+            block_id old = accessBlock(rec->block)->next_block;
+            if (old != 0)
+                summaryMark(old, 1);
+        }
+        if (rec->next != 0)
+            summaryMark(rec->next, 1);
+        break;
+
+    case SFS_JREC_DIRENT:
+    {
+        // So is the chain of a file whose entry is being overwritten.
+        block_id old = entryAt(rec->block, rec->count)->first_block;
+        summaryMark(rec->block, 1);
+        if (old != 0 && old != rec->entry.first_block)
+            summaryMark(old, 1);
+        break;
+    }
+
+    case SFS_JREC_APPEND:
+        summaryMark(rec->block, 1);
+        if (rec->next != 0)
+        {
+            summaryMark(rec->prev, 1);
+            summaryMark(rec->next, 1);
+        }
+        break;
+
+    case SFS_JREC_DIRGROW:
+        summaryMark(rec->block, 1);
+        summaryMark(rec->prev, 1);
+        break;
+
+    case SFS_JREC_PACK:
+    case SFS_JREC_CELL:
+        summaryMark(rec->block, 1);
+        break;
+
+    case SFS_JREC_MOVE:
+    {
+        // The file leaves the block it was in for its new chain.
+        block_id old = entryAt(rec->block, rec->count)->first_block;
+        summaryMark(rec->block, 1);
+        if (old != 0)
+            summaryMark(old, 1);
+        summaryMark(rec->next, 1);
+        break;
+    }
+
+    default:
+        break;
+    }
+}
+
+/** Carry out record REC, as described in sfs-disk.h, after marking
+    what it changes in the change summary.  */
+static void applyRecord(const sfs_journal_rec_t *rec)
+{
+    markRecord(rec);
+
+    sfs_filesystem_t *super = accessSuperBlock();
+    block_id first = rec->block;
+    block_id last = rec->block + rec->count - 1;
+
+    switch (rec->kind)
+    {
+    case SFS_JREC_TAKE:
+        if (rec->prev != 0)
+            accessBlock(rec->prev)->next_block = rec->next;
+        else
+            super->freelist = rec->next;
+        if (rec->next != 0)
+            accessBlock(rec->next)->prev_block = rec->prev;
+        break;
+
+    case SFS_JREC_RELEASE:
+        accessBlock(first)->prev_block = rec->prev;
+        accessBlock(last)->next_block = rec->next;
+        if (rec->prev != 0)
+            accessBlock(rec->prev)->next_block = first;
+        else
+            super->freelist = first;
+        if (rec->next != 0)
+            accessBlock(rec->next)->prev_block = last;
+        break;
+
+    case SFS_JREC_CHAIN:
+        for (block_id id = first; id <= last; id++)
+        {
+            sfs_block_hdr_t *b = accessBlock(id);
+            memcpy(b->type, rec->type, sizeof b->type);
+            b->prev_block = id == first ? rec->prev : id - 1;
+            b->next_block = id == last ? 0 : id + 1;
+        }
+        if (rec->prev != 0)
+            accessBlock(rec->prev)->next_block = first;
+        break;
+
+    case SFS_JREC_LINK:
+        if (rec->block != 0)
+            accessBlock(rec->block)->next_block = rec->next;
+        if (rec->next != 0)
+            accessBlock(rec->next)->prev_block = rec->block;
+        break;
+
+    case SFS_JREC_DIRENT:
+        *entryAt(rec->block, rec->count) = rec->entry;
+        break;
+
+    case SFS_JREC_APPEND:
+        if (rec->next != 0)
+        {
+            accessBlock(rec->prev)->next_block = rec->next;
+            accessBlock(rec->next)->prev_block = rec->prev;
+        }
+        entryAt(rec->block, rec->count)->size = rec->entry.size;
+        break;
+
+    case SFS_JREC_DIRGROW:
+    {
+        sfs_block_hdr_t *b = accessBlock(first);
+        memset(b + 1, 0, getBlockSize() - sizeof *b);
+        b->prev_block = rec->prev;
+        b->next_block = 0;
+        if (rec->prev != 0)
+            accessBlock(rec->prev)->next_block = first;
+        else
+            super->next_rootdir = first;
+        break;
+    }
+
+    case SFS_JREC_PACK:
+    {
+        sfs_block_hdr_t *b = accessBlock(first);
+        memcpy(b->type, SFS_BLOCK_TYPE_PACK, sizeof b->type);
+        b->prev_block = 0;
+        b->next_block = 0;
+        sfs_block_pack_t *p = accessPackBlock(first);
+        for (uint32_t i = 0; i < SFS_PACK_CELLS_PER_BLOCK(getBlockSize());
+             i++)
+            p->cells[i].owner = 0;
+        break;
+    }
+
+    case SFS_JREC_CELL:
+    {
+        sfs_block_pack_t *p = (sfs_block_pack_t *)(void *)accessBlock(first);
+        p->cells[rec->count].owner = rec->prev;
+        break;
+    }
+
+    case SFS_JREC_MOVE:
+        entryAt(rec->block, rec->count)->first_block = rec->next;
+        break;
+
+    default:
+        break;
+    }
+}
+
+/** Store REC in slot K of the log, as part of the log with sequence
+    number SEQUENCE, marking it as part of a group with the next record
+    if MORE.  */
+static void storeRecord(uint32_t k, const sfs_journal_rec_t *rec,
+                        uint32_t sequence, int more)
+{
+    sfs_journal_rec_t *slot = recordAt(k);
+    *slot = *rec;
+    slot->sequence = sequence;
+    slot->flags = (uint16_t)((rec->flags & ~SFS_JREC_MORE) |
+                             (more ? SFS_JREC_MORE : 0));
+    slot->checksum = recordChecksum(slot);
+}
+
+/** Append REC to the log, marking it as part of a group with the next
+    record if MORE.  The caller must hold 'journalLock' and must have
+    checked that there is room.  */
+static void appendRecord(const sfs_journal_rec_t *rec, int more)
+{
+    assert(journalTail < journalCapacity);
+    storeRecord(journalTail, rec, journal->sequence, more);
+    journalTail++;
+    appendedLsn = ((uint64_t)journal->sequence << 32) | journalTail;
+}
+
+/** Return a LIMBO record for run number IDX in limbo.  */
+static sfs_journal_rec_t limboRecord(uint32_t idx)
+{
+    return (sfs_journal_rec_t){.kind = SFS_JREC_LIMBO,
+                               .block = limbo[idx].start,
+                               .count = limbo[idx].length};
+}
+
+/** Give up on the journal after failing to flush it.  The log is
+    abandoned, as it may describe changes that are older than what is
+    on disk, and is not going to be kept up to date.  The caller must
+    hold 'journalLock'.  */
+static void failJournal(void)
+{
+    journalFailed = 1;
+    journal->sequence++;
+    syncBlocks(journalStart, 1);
+    pthread_cond_broadcast(&journalFlushed);
+}
+
+/** Flush the whole disk image, and then begin a new log, which starts
+    by listing the blocks in limbo.  The caller must hold
+    'journalLock'.  Returns 0 or -EIO.  */
+static int checkpointLocked(void)
+{
+    if (journalFailed)
+        return -EIO;
+
+    // Once everything is on disk, the old log is only needed for the
+    // blocks in limbo.  The new one is written over the start of the
+    // old one, before the journal's sequence number tells replay to
+    // use it, so the LIMBO records it begins with are first added to
+    // the end of the old one as well, if they fit; if the process dies
+    // in between, replay skips what there is of the new log and finds
+    // them there.  If we crash after starting the new one, but before
+    // it is flushed, the old one is gone and the new one is empty; that
+    // only loses track of the blocks in limbo.
+    int status = syncBlocks(0, accessSuperBlock()->n_blocks);
+    if (status == 0)
+    {
+        uint32_t n = limboCount;
+        if (n > journalCapacity - JOURNAL_RESERVE)
+            n = journalCapacity - JOURNAL_RESERVE;
+        if (n <= journalTail && n <= journalCapacity - journalTail)
+            for (uint32_t i = 0; i < n; i++)
+            {
+                sfs_journal_rec_t rec = limboRecord(i);
+                appendRecord(&rec, 0);
+            }
+        uint32_t sequence = journal->sequence + 1;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            sfs_journal_rec_t rec = limboRecord(i);
+            storeRecord(i, &rec, sequence, 0);
+        }
+        // Nothing may be moved past the switch to the new log.
+        atomic_signal_fence(memory_order_seq_cst);
+        journal->sequence = sequence;
+        journalTail = n;
+        appendedLsn = ((uint64_t)sequence << 32) | n;
+        status = syncBlocks(journalStart, journal->n_blocks);
+    }
+    if (status < 0)
+    {
+        failJournal();
+        return status;
+    }
+    committedLsn = appendedLsn;
+    return 0;
+}
+
+/** Flush the part of the log holding records [FROM, TO).  */
+static int syncRecords(uint32_t from, uint32_t to)
+{
+    if (from >= to)
+        return 0;
+    block_id first = journalStart + 1 + from / recordsPerBlock;
+    block_id last = journalStart + 1 + (to - 1) / recordsPerBlock;
+    return syncBlocks(first, last - first + 1);
+}
+
+/** Report whether slot K of the log holds a record of the log with
+    sequence number SEQUENCE.  */
+static int recordInLog(uint32_t k, uint32_t sequence)
+{
+    const sfs_journal_rec_t *rec = recordAt(k);
+    return rec->sequence == sequence && rec->checksum == recordChecksum(rec);
+}
+
+/** Replay the log: carry out, in order, every group of records in it
+    that was appended completely, keeping track of the blocks in limbo
+    as we go, and leave 'journalTail' just past the last such group.
+    Returns 0, -EUCLEAN if a record is nonsense, or -ENOMEM.  */
+static int replayLog(void)
+{
+    // A checkpoint that was cut short may have begun the next log over
+    // the start of this one.  Whatever is left of this one still ends
+    // with the blocks in limbo, and carrying out records a second time
+    // does no harm, even without the ones before them.
+    uint32_t k = 0;
+    while (k < journalCapacity && recordInLog(k, journal->sequence + 1))
+        k++;
+    uint32_t groupStart = k;
+    for (; k < journalCapacity; k++)
+    {
+        const sfs_journal_rec_t *rec = recordAt(k);
+        if (!recordInLog(k, journal->sequence))
+            break;
+        if (!recordIsSane(rec))
+            return -EUCLEAN;
+        if (rec->flags & SFS_JREC_MORE)
+            continue;
+
+        for (uint32_t i = groupStart; i <= k; i++)
+        {
+            int status = noteLimbo(recordAt(i));
+            if (status < 0)
+                return status;
+            applyRecord(recordAt(i));
+        }
+        groupStart = k + 1;
+    }
+    journalTail = groupStart;
+    return 0;
+}
+
+/** Free the journal's in-memory state.  */
+static void forgetJournal(void)
+{
+    free(limbo);
+    limbo = NULL;
+    limboCount = 0;
+    limboCapacity = 0;
+    journal = NULL;
+}
+
+/** Lay out an empty journal of N_BLOCKS blocks, starting at block
+    START, in an image that is being formatted and is all zeros.  */
+void journalFormat(block_id start, uint32_t n_blocks)
+{
+    for (block_id id = start; id < start + n_blocks; id++)
+    {
+        sfs_block_hdr_t *b = accessBlock(id);
+        setBlockType(b, SFS_BLOCK_TYPE_JOURNAL);
+        b->prev_block = id == start ? 0 : id - 1;
+        b->next_block = id + 1 == start + n_blocks ? 0 : id + 1;
+    }
+    sfs_journal_t *j = (sfs_journal_t *)(void *)accessBlock(start);
+    j->n_blocks = n_blocks;
+    j->sequence = 1;
+}
+
+/** Find the journal of the disk image that is being activated, if it
+    has one, replay its log, and begin a new one.  Afterwards, the
+    blocks left in limbo can be found with journalFirstOrphan.  Returns
+    0, -EUCLEAN if the journal is malformed, or a negative error code
+    from replaying or flushing it.  */
+int journalOpen(void)
+{
+    sfs_filesystem_t *super = accessSuperBlock();
+    journal = NULL;
+    journalFailed = 0;
+    flushing = 0;
+    if (getImageVersion() < 2 || super->journal == 0)
+        return 0;
+
+    block_id start = super->journal;
+    if (start >= super->n_blocks)
+        return -EUCLEAN;
+    sfs_journal_t *j = (sfs_journal_t *)(void *)accessBlock(start);
+    if (memcmp(j->h.type, SFS_BLOCK_TYPE_JOURNAL, sizeof j->h.type) != 0 ||
+        j->n_blocks < 2 || j->n_blocks > super->n_blocks - start)
+        return -EUCLEAN;
+
+    journal = j;
+    journalStart = start;
+    recordsPerBlock = SFS_JOURNAL_RECORDS_PER_BLOCK(getBlockSize());
+    journalCapacity = (j->n_blocks - 1) * recordsPerBlock;
+    if (journalCapacity <= JOURNAL_RESERVE)
+    {
+        forgetJournal();
+        return -EUCLEAN;
+    }
+
+    int status = replayLog();
+    if (status == 0)
+        status = checkpointLocked();
+    if (status < 0)
+        forgetJournal();
+    return status;
+}
+
+/** Report whether the disk image has a journal, which tells sfs-disk.c
+    whether it needs to log the records that only concern limbo.  */
+int journalEnabled(void)
+{
+    return journal != NULL;
+}
+
+/** If any blocks are in limbo, store the first run of them in *START
+    and *LENGTH and return 1; otherwise, return 0.  */
+int journalFirstOrphan(block_id *start, uint32_t *length)
+{
+    if (limboCount == 0)
+        return 0;
+    *start = limbo[0].start;
+    *length = limbo[0].length;
+    return 1;
+}
+
+/** Log the N records RECS as a group, if the disk image has a journal,
+    and carry them out.  If the group is too big for the log, even
+    after a checkpoint, it is logged and carried out one piece at a
+    time.  */
+void journalApply(const sfs_journal_rec_t *recs, uint32_t n)
+{
+    if (journal == NULL)
+    {
+        for (uint32_t i = 0; i < n; i++)
+            applyRecord(&recs[i]);
+        return;
+    }
+
+    pthread_mutex_lock(&journalLock);
+    while (n > 0)
+    {
+        uint32_t take = n;
+        if (!journalFailed)
+        {
+            uint64_t spare = (uint64_t)limboCount + n;
+            if (spare > LIMBO_SPARE)
+                spare = LIMBO_SPARE;
+            if (journalCapacity - journalTail < n + spare)
+                checkpointLocked();
+            if (!journalFailed && journalCapacity - journalTail < take)
+                take = journalCapacity - journalTail;
+        }
+        for (uint32_t i = 0; i < take && !journalFailed; i++)
+            appendRecord(&recs[i], i + 1 < take);
+        for (uint32_t i = 0; i < take; i++)
+        {
+            // Running out of memory here only means that the blocks
+            // concerned might be lost if we crash before the next
+            // checkpoint.
+            if (!journalFailed)
+                noteLimbo(&recs[i]);
+            applyRecord(&recs[i]);
+        }
+        recs += take;
+        n -= take;
+    }
+    if (!journalFailed)
+        threadLsn = appendedLsn;
+    pthread_mutex_unlock(&journalLock);
+}
+
+/** Wait until every record this thread has logged is on stable
+    storage, flushing the log if no other thread is already doing so.
+    Returns 0, or -EIO if the log could not be flushed.  */
+int journalCommit(void)
+{
+    uint64_t want = threadLsn;
+    if (want == 0)
+        return 0;
+    threadLsn = 0;
+
+    pthread_mutex_lock(&journalLock);
+    while (committedLsn < want && !journalFailed)
+    {
+        if (flushing)
+        {
+            pthread_cond_wait(&journalFlushed, &journalLock);
+            continue;
+        }
+
+        // Flush everything appended so far, for whoever is waiting.
+        // A checkpoint may start a new log while we do so; that
+        // flushes the whole image, including these records.
+        uint64_t target = appendedLsn;
+        uint32_t from = 0;
+        if (committedLsn >> 32 == target >> 32)
+            from = (uint32_t)committedLsn;
+        flushing = 1;
+        pthread_mutex_unlock(&journalLock);
+        int status = syncRecords(from, (uint32_t)target);
+        pthread_mutex_lock(&journalLock);
+        flushing = 0;
+        if (status < 0)
+            failJournal();
+        else if (committedLsn < target)
+            committedLsn = target;
+        pthread_cond_broadcast(&journalFlushed);
+    }
+    int status = journalFailed ? -EIO : 0;
+    pthread_mutex_unlock(&journalLock);
+    return status;
+}
+
+/** Flush the whole disk image and begin a new log.  Returns 0, or -EIO
+    if the image could not be flushed.  */
+int journalCheckpoint(void)
+{
+    if (journal == NULL)
+        return 0;
+    pthread_mutex_lock(&journalLock);
+    int status = checkpointLocked();
+    pthread_mutex_unlock(&journalLock);
+    return status;
+}
+
+/** Checkpoint the journal for the last time, as the disk image is
+    being deactivated, and forget about it.  Returns 0 or -EIO.  */
+int journalClose(void)
+{
+    int status = journalCheckpoint();
+    forgetJournal();
+    return status;
+}
@@ -0,0 +1,224 @@
+//
+// SFS LZ - compression for the frames of compressed files
+//
+// The frames are compressed in the block format of LZ4, which is meant
+//   to be decoded at close to the speed of a copy: the output is a
+//   series of sequences, each of some bytes to be copied as they are
+//   ("literals") followed by a match, an earlier stretch of the output
+//   to be copied again, given by its distance back and its length.  A
+//   sequence begins with a token byte whose upper four bits are the
+//   number of literals and whose lower four are the match length less
+//   MIN_MATCH; 15 in either means that more length bytes follow, each
+//   added on, until one that is not 255.  The literals come next, then
+//   the distance, as two little-endian bytes, then the rest of the
+//   match length.  The last sequence has literals only, and the rules
+//   of the format keep matches out of the last few bytes, so that a
+//   decoder could copy in whole words without checking every step.
+//
+// The compressor is the simple greedy one: a hash table holds the last
+//   position at which each four-byte sequence was seen, and a match
+//   found there is extended as far as it goes in both directions, and
+//   taken.  Frames are only a few kilobytes long, so the table is
+//   small, and starts out empty for each one.
+//
+// The decompressor trusts nothing it is given, since it reads what is
+//   on the disk: every length and distance is checked against both
+//   buffers before anything is copied.
+//
+
+#include "sfs-lz.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/** The shortest match the format can express.  */
+#define MIN_MATCH 4
+
+/** The last LAST_LITERALS bytes are always literals, and no match
+    begins in the last MATCH_LIMIT bytes.  */
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+
+/** The farthest back a match can refer to.  */
+#define MAX_DISTANCE 65535
+
+/** log2 of the number of entries in the compressor's hash table.  */
+#define HASH_BITS 12
+
+static uint32_t load32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t hashOf(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/** Append the rest of a length of LEN, past the 15 that its token
+    holds, at OP, which may not pass END.  Returns the new OP, or NULL
+    if there is no room.  */
+static unsigned char *putLength(unsigned char *op, unsigned char *end,
+                                size_t len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (op == end)
+            return NULL;
+        *op++ = 255;
+    }
+    if (op == end)
+        return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/** Append a sequence of the LIT_LEN literals at LIT followed by a match
+    of MATCH_LEN bytes DISTANCE back, or by nothing if MATCH_LEN is 0,
+    at OP, which may not pass END.  Returns the new OP, or NULL if there
+    is no room.  */
+static unsigned char *putSequence(unsigned char *op, unsigned char *end,
+                                  const unsigned char *lit, size_t litLen,
+                                  size_t distance, size_t matchLen)
+{
+    if (op == end)
+        return NULL;
+    unsigned char *token = op++;
+    *token = (unsigned char)((litLen < 15 ? litLen : 15) << 4);
+    if (litLen >= 15 && (op = putLength(op, end, litLen - 15)) == NULL)
+        return NULL;
+    if ((size_t)(end - op) < litLen)
+        return NULL;
+    memcpy(op, lit, litLen);
+    op += litLen;
+    if (matchLen == 0)
+        return op;
+
+    if (end - op < 2)
+        return NULL;
+    *op++ = (unsigned char)(distance & 0xFF);
+    *op++ = (unsigned char)(distance >> 8);
+    size_t extra = matchLen - MIN_MATCH;
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    if (extra >= 15)
+        op = putLength(op, end, extra - 15);
+    return op;
+}
+
+size_t lzCompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const unsigned char *in = src;
+    const unsigned char *inEnd = in + len;
+    const unsigned char *ip = in;
+    const unsigned char *anchor = in;
+    unsigned char *op = dst;
+    unsigned char *end = op + cap;
+
+    // The table holds positions plus one, so that zero means none.
+    uint32_t table[1 << HASH_BITS];
+    if (len >= MATCH_LIMIT)
+    {
+        memset(table, 0, sizeof table);
+        const unsigned char *limit = inEnd - MATCH_LIMIT;
+        const unsigned char *matchEnd = inEnd - LAST_LITERALS;
+        while (ip <= limit)
+        {
+            uint32_t v = load32(ip);
+            uint32_t h = hashOf(v);
+            uint32_t seen = table[h];
+            table[h] = (uint32_t)(ip - in) + 1;
+            const unsigned char *ref = seen != 0 ? in + seen - 1 : NULL;
+            if (ref == NULL || ip - ref > MAX_DISTANCE || load32(ref) != v)
+            {
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > in && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            size_t m = MIN_MATCH;
+            while (ip + m < matchEnd && ip[m] == ref[m])
+                m++;
+            op = putSequence(op, end, anchor, (size_t)(ip - anchor),
+                             (size_t)(ip - ref), m);
+            if (op == NULL)
+                return 0;
+            ip += m;
+            anchor = ip;
+        }
+    }
+    op = putSequence(op, end, anchor, (size_t)(inEnd - anchor), 0, 0);
+    return op != NULL ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+/** Add the rest of a length, past the 15 that its token holds, from
+    *IP, which may not pass END, to *LEN, and advance *IP past it.
+    Returns 0, or -1 if it runs past END.  */
+static int getLength(const unsigned char **ip, const unsigned char *end,
+                     size_t *len)
+{
+    unsigned char b;
+    do
+    {
+        // No buffer is anywhere near this long, so a length that gets
+        // this far is damage, not data.
+        if (*ip == end || *len > SIZE_MAX / 2)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+ssize_t lzDecompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const unsigned char *ip = src;
+    const unsigned char *ipEnd = ip + len;
+    unsigned char *out = dst;
+    unsigned char *op = out;
+    unsigned char *opEnd = out + cap;
+    for (;;)
+    {
+        if (ip == ipEnd)
+            return -1;
+        unsigned int token = *ip++;
+        size_t litLen = token >> 4;
+        if (litLen == 15 && getLength(&ip, ipEnd, &litLen) < 0)
+            return -1;
+        if ((size_t)(ipEnd - ip) < litLen || (size_t)(opEnd - op) < litLen)
+            return -1;
+        memcpy(op, ip, litLen);
+        op += litLen;
+        ip += litLen;
+        if (ip == ipEnd)
+            break;
+
+        if (ipEnd - ip < 2)
+            return -1;
+        size_t distance = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (distance == 0 || distance > (size_t)(op - out))
+            return -1;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && getLength(&ip, ipEnd, &matchLen) < 0)
+            return -1;
+        matchLen += MIN_MATCH;
+        if ((size_t)(opEnd - op) < matchLen)
+            return -1;
+
+        // A match may overlap the bytes it produces, repeating them.
+        const unsigned char *ref = op - distance;
+        if (distance >= matchLen)
+            memcpy(op, ref, matchLen);
+        else
+            for (size_t i = 0; i < matchLen; i++)
+                op[i] = ref[i];
+        op += matchLen;
+    }
+    return op - out;
+}
@@ -0,0 +1,22 @@
+/** This file declares the compressor used by sfs-disk.c for the frames
+    of compressed files (see sfs_compressed_hdr_t), and by sfs-fsck to
+    check them.  See sfs-lz.c for the format.  */
+
+#ifndef SFS_LZ_H_
+#define SFS_LZ_H_ 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Compress the LEN bytes at SRC into the CAP bytes at DST.  Returns
+    the length of the result, or 0 if it would not fit.  Safe to call
+    from any number of threads at once.  */
+size_t lzCompress(const void *src, size_t len, void *dst, size_t cap);
+
+/** Decompress the LEN bytes at SRC, as produced by lzCompress, into
+    the CAP bytes at DST.  Returns the length of the result, or -1 if
+    SRC is not valid compressed data or the result would not fit;
+    nothing outside either buffer is touched in any case.  */
+ssize_t lzDecompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
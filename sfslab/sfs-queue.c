@@ -0,0 +1,567 @@
+//
+// SFS Queue - batched submission of SFS operations
+//
+// A queue holds a FIFO of batches.  Each batch is split, when it is
+//   submitted, into groups of operations that involve the same file
+//   (see sfs-queue.h), using a union-find over the batch's operations
+//   and a small hash table from each name and "file descriptor" number
+//   to the last operation in the batch that used it.  Worker threads
+//   take whole groups from the batch at the head of the queue and run
+//   each group's operations in order, so that no locking is needed
+//   between the operations of one group; the groups themselves run in
+//   parallel, relying on the locking inside sfs-disk.c.  When the last
+//   group of a batch finishes, the next batch becomes the head.
+//
+// A group's completions are posted all at once, when the whole group
+//   has run.  The completion ring has one slot per operation that may
+//   be in flight, so posting never has to wait for a poller.
+//
+
+#include "sfs-api.h"
+#include "sfs-queue.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "sfs_threads.h"
+
+/** Index value meaning "no operation".  */
+#define NO_ENTRY UINT_MAX
+
+/** Maximum number of reads or writes combined into one sfs_readv or
+    sfs_writev call.  */
+#define MAX_RUN 64
+
+/** One operation of a batch, with the bookkeeping needed to run it.  */
+typedef struct
+{
+    sfs_sqe sqe;
+    ssize_t result;
+    int openFd;        /**< for an open, the descriptor it returned */
+    bool closed;       /**< for an open, whether openFd was closed */
+    unsigned int prevName;  /**< last earlier op that used the same name */
+    unsigned int nextInGroup; /**< next op of the same group */
+} sfs_queue_entry_t;
+
+typedef struct sfs_queue_batch
+{
+    struct sfs_queue_batch *next;
+    unsigned int n_entries;
+    unsigned int n_groups;
+    unsigned int nextGroup;    /**< first group no worker has taken yet */
+    unsigned int groupsDone;
+    unsigned int *groupHeads;  /**< first op of each group */
+    sfs_queue_entry_t entries[];
+} sfs_queue_batch_t;
+
+/** An entry in the hash table used to group a batch: a name or a
+    "file descriptor" number, and the last op that used it.  */
+typedef struct
+{
+    const char *name; /**< NULL for a descriptor number */
+    int fd;
+    unsigned int last; /**< NO_ENTRY if the slot is empty */
+} sfs_queue_key_t;
+
+struct sfs_queue
+{
+    // 'lock' protects everything below it.  Workers wait on
+    // 'workReady' for a group to run; pollers, and sfs_queue_destroy,
+    // wait on 'completed'.
+    pthread_mutex_t lock;
+    pthread_cond_t workReady;
+    pthread_cond_t completed;
+    bool stopping;
+    unsigned int capacity;
+    unsigned int inFlight; // submitted and not yet polled
+    sfs_queue_batch_t *head;
+    sfs_queue_batch_t *tail;
+    sfs_cqe *ring;
+    unsigned int ringStart;
+    unsigned int ringCount;
+    unsigned int n_workers;
+    pthread_t *workers;
+};
+
+static uint32_t hashName(const char *name)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+    {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/** Find the slot for a name, or for descriptor number FD if NAME is
+    NULL, in a table of MASK + 1 slots.  The table is never full, so
+    this always finds either the key or an empty slot.  */
+static sfs_queue_key_t *findKey(sfs_queue_key_t *table, uint32_t mask,
+                                const char *name, int fd)
+{
+    uint32_t h = name ? hashName(name) : (uint32_t)fd * 2654435761u;
+    for (uint32_t i = h & mask;; i = (i + 1) & mask)
+    {
+        sfs_queue_key_t *k = &table[i];
+        if (k->last == NO_ENTRY)
+        {
+            k->name = name;
+            k->fd = fd;
+            return k;
+        }
+        if (name ? (k->name && strcmp(k->name, name) == 0)
+                 : (!k->name && k->fd == fd))
+            return k;
+    }
+}
+
+static unsigned int findRoot(unsigned int *parent, unsigned int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/** Put I and J in the same group.  The root of a group is always its
+    earliest op, so that groups come out in submission order.  */
+static void unite(unsigned int *parent, unsigned int i, unsigned int j)
+{
+    unsigned int ri = findRoot(parent, i);
+    unsigned int rj = findRoot(parent, j);
+    if (ri < rj)
+        parent[rj] = ri;
+    else
+        parent[ri] = rj;
+}
+
+/** Record that op I uses KEY, putting it in the same group as the last
+    op that did.  Returns that op, or NO_ENTRY.  */
+static unsigned int useKey(unsigned int *parent, sfs_queue_key_t *key,
+                           unsigned int i)
+{
+    unsigned int prev = key->last;
+    if (prev != NO_ENTRY)
+        unite(parent, i, prev);
+    key->last = i;
+    return prev;
+}
+
+/** Check that op I of SQES is well-formed.  */
+static bool validEntry(const sfs_sqe *sqes, unsigned int i)
+{
+    const sfs_sqe *s = &sqes[i];
+    switch (s->op)
+    {
+    case SFS_OP_RENAME:
+        if (!s->new_name)
+            return false;
+        // fall through
+    case SFS_OP_OPEN:
+    case SFS_OP_REMOVE:
+        return s->name != NULL;
+    case SFS_OP_CLOSE:
+    case SFS_OP_READ:
+    case SFS_OP_WRITE:
+        if (s->fd <= SFS_BATCH_FD(0))
+        {
+            unsigned int k = (unsigned int)(-2 - s->fd);
+            return k < i && sqes[k].op == SFS_OP_OPEN;
+        }
+        return true;
+    }
+    return false;
+}
+
+/** Split the ops of BATCH into groups.  Returns 0 or -ENOMEM.  */
+static int groupBatch(sfs_queue_batch_t *batch)
+{
+    unsigned int n = batch->n_entries;
+    uint32_t n_slots = 4;
+    while (n_slots < 4 * (uint32_t)n)
+        n_slots *= 2;
+
+    unsigned int *parent = malloc(n * sizeof *parent);
+    unsigned int *tails = malloc(n * sizeof *tails);
+    sfs_queue_key_t *table = malloc(n_slots * sizeof *table);
+    batch->groupHeads = malloc(n * sizeof *batch->groupHeads);
+    if (!parent || !tails || !table || !batch->groupHeads)
+    {
+        free(parent);
+        free(tails);
+        free(table);
+        free(batch->groupHeads);
+        return -ENOMEM;
+    }
+    for (uint32_t s = 0; s < n_slots; s++)
+        table[s].last = NO_ENTRY;
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        sfs_queue_entry_t *e = &batch->entries[i];
+        parent[i] = i;
+        e->prevName = NO_ENTRY;
+        e->nextInGroup = NO_ENTRY;
+        switch (e->sqe.op)
+        {
+        case SFS_OP_RENAME:
+            useKey(parent, findKey(table, n_slots - 1, e->sqe.new_name, 0), i);
+            // fall through
+        case SFS_OP_OPEN:
+        case SFS_OP_REMOVE:
+            e->prevName =
+                useKey(parent, findKey(table, n_slots - 1, e->sqe.name, 0), i);
+            break;
+        case SFS_OP_CLOSE:
+        case SFS_OP_READ:
+        case SFS_OP_WRITE:
+            if (e->sqe.fd <= SFS_BATCH_FD(0))
+                unite(parent, i, (unsigned int)(-2 - e->sqe.fd));
+            else
+                useKey(parent, findKey(table, n_slots - 1, NULL, e->sqe.fd),
+                       i);
+            break;
+        }
+    }
+
+    // Chain each group's ops together in order.  Since a group's root
+    // is its first op, the root is always seen before its members.
+    batch->n_groups = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        unsigned int r = findRoot(parent, i);
+        if (r == i)
+            batch->groupHeads[batch->n_groups++] = i;
+        else
+            batch->entries[tails[r]].nextInGroup = i;
+        tails[r] = i;
+    }
+
+    free(parent);
+    free(tails);
+    free(table);
+    return 0;
+}
+
+/** Get the descriptor that op E of BATCH refers to, or -EBADF if it
+    refers to an open in the batch that failed.  */
+static int resolveFd(sfs_queue_batch_t *batch, const sfs_queue_entry_t *e)
+{
+    if (e->sqe.fd > SFS_BATCH_FD(0))
+        return e->sqe.fd;
+    int fd = batch->entries[-2 - e->sqe.fd].openFd;
+    return fd < 0 ? -EBADF : fd;
+}
+
+/** Run an open, reusing the descriptor opened by the previous op on
+    the same name, if there was one and it is still open, so that the
+    name does not have to be looked up again.  */
+static void runOpen(sfs_queue_batch_t *batch, sfs_queue_entry_t *e)
+{
+    const sfs_queue_entry_t *prev =
+        e->prevName == NO_ENTRY ? NULL : &batch->entries[e->prevName];
+    int fd;
+    if (prev && prev->sqe.op == SFS_OP_OPEN && prev->openFd >= 0 &&
+        !prev->closed)
+        fd = sfs_reopen(prev->openFd);
+    else
+        fd = sfs_open(e->sqe.name);
+    e->openFd = fd;
+    e->result = fd;
+}
+
+/** Run the read or write E of BATCH, together with as many of the ops
+    that follow it in its group as are the same kind of op on the same
+    descriptor, as a single sfs_readv or sfs_writev call.  Returns the
+    last op that was run.  */
+static sfs_queue_entry_t *runTransfer(sfs_queue_batch_t *batch,
+                                      sfs_queue_entry_t *e)
+{
+    sfs_queue_entry_t *run[MAX_RUN];
+    struct iovec iov[MAX_RUN];
+    int count = 0;
+    for (sfs_queue_entry_t *r = e;; r = &batch->entries[r->nextInGroup])
+    {
+        run[count] = r;
+        iov[count].iov_base = r->sqe.buf;
+        iov[count].iov_len = r->sqe.len;
+        count++;
+        if (count == MAX_RUN || r->nextInGroup == NO_ENTRY)
+            break;
+        const sfs_sqe *next = &batch->entries[r->nextInGroup].sqe;
+        if (next->op != e->sqe.op || next->fd != e->sqe.fd)
+            break;
+    }
+
+    int fd = resolveFd(batch, e);
+    if (fd < 0)
+    {
+        for (int i = 0; i < count; i++)
+            run[i]->result = fd;
+        return run[count - 1];
+    }
+
+    ssize_t done = e->sqe.op == SFS_OP_READ ? sfs_readv(fd, iov, count)
+                                            : sfs_writev(fd, iov, count);
+    if (done < 0)
+        done = 0;
+
+    // Hand out what was transferred in order.  If the call stopped
+    // short, the op it stopped in gets a short count and the rest are
+    // run one at a time, so that each gets the result (end of file or
+    // an error) it would have got on its own.
+    int i = 0;
+    size_t left = (size_t)done;
+    for (; i < count && left > 0; i++)
+    {
+        size_t n = left < run[i]->sqe.len ? left : run[i]->sqe.len;
+        run[i]->result = (ssize_t)n;
+        left -= n;
+        if (n < run[i]->sqe.len)
+        {
+            i++;
+            break;
+        }
+    }
+    for (; i < count; i++)
+    {
+        if (e->sqe.op == SFS_OP_READ)
+            run[i]->result = sfs_read(fd, run[i]->sqe.buf, run[i]->sqe.len);
+        else
+            run[i]->result = sfs_write(fd, run[i]->sqe.buf, run[i]->sqe.len);
+    }
+    return run[count - 1];
+}
+
+/** Run all the ops of the group starting with op HEAD of BATCH.  */
+static void runGroup(sfs_queue_batch_t *batch, unsigned int head)
+{
+    for (unsigned int i = head; i != NO_ENTRY;)
+    {
+        sfs_queue_entry_t *e = &batch->entries[i];
+        int fd;
+        switch (e->sqe.op)
+        {
+        case SFS_OP_OPEN:
+            runOpen(batch, e);
+            break;
+        case SFS_OP_CLOSE:
+            fd = resolveFd(batch, e);
+            if (fd >= 0)
+            {
+                sfs_close(fd);
+                if (e->sqe.fd <= SFS_BATCH_FD(0))
+                    batch->entries[-2 - e->sqe.fd].closed = true;
+                fd = 0;
+            }
+            e->result = fd;
+            break;
+        case SFS_OP_READ:
+        case SFS_OP_WRITE:
+            e = runTransfer(batch, e);
+            break;
+        case SFS_OP_REMOVE:
+            e->result = sfs_remove(e->sqe.name);
+            break;
+        case SFS_OP_RENAME:
+            e->result = sfs_rename(e->sqe.name, e->sqe.new_name);
+            break;
+        }
+        i = e->nextInGroup;
+    }
+}
+
+/** Post the completions of the group starting with op HEAD of the
+    batch at the head of QUEUE, and retire the batch if that was its
+    last group.  Called with the queue locked.  */
+static void finishGroup(sfs_queue *queue, unsigned int head)
+{
+    sfs_queue_batch_t *batch = queue->head;
+    for (unsigned int i = head; i != NO_ENTRY;
+         i = batch->entries[i].nextInGroup)
+    {
+        unsigned int slot =
+            (queue->ringStart + queue->ringCount) % queue->capacity;
+        queue->ring[slot].user_data = batch->entries[i].sqe.user_data;
+        queue->ring[slot].result = batch->entries[i].result;
+        queue->ringCount++;
+    }
+
+    if (++batch->groupsDone == batch->n_groups)
+    {
+        queue->head = batch->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        free(batch->groupHeads);
+        free(batch);
+        if (queue->head)
+            pthread_cond_broadcast(&queue->workReady);
+    }
+    pthread_cond_broadcast(&queue->completed);
+}
+
+static void *workerThread(void *arg)
+{
+    sfs_queue *queue = arg;
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        sfs_queue_batch_t *batch = queue->head;
+        if (batch && batch->nextGroup < batch->n_groups)
+        {
+            unsigned int head = batch->groupHeads[batch->nextGroup++];
+            pthread_mutex_unlock(&queue->lock);
+            runGroup(batch, head);
+            pthread_mutex_lock(&queue->lock);
+            finishGroup(queue, head);
+        }
+        else if (queue->stopping)
+            break;
+        else
+            pthread_cond_wait(&queue->workReady, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+int sfs_queue_create(sfs_queue **queue_out, unsigned int entries,
+                     unsigned int workers)
+{
+    if (entries == 0 || workers == 0)
+        return -EINVAL;
+
+    sfs_queue *queue = calloc(1, sizeof *queue);
+    if (!queue)
+        return -ENOMEM;
+    queue->capacity = entries;
+    queue->ring = malloc(entries * sizeof *queue->ring);
+    queue->workers = malloc(workers * sizeof *queue->workers);
+    if (!queue->ring || !queue->workers)
+    {
+        free(queue->ring);
+        free(queue->workers);
+        free(queue);
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->workReady, NULL);
+    pthread_cond_init(&queue->completed, NULL);
+
+    for (; queue->n_workers < workers; queue->n_workers++)
+    {
+        int err = sfs_thread_create_internal(
+            &queue->workers[queue->n_workers], NULL, workerThread, queue);
+        if (err)
+        {
+            sfs_queue_destroy(queue);
+            return -err;
+        }
+    }
+
+    *queue_out = queue;
+    return 0;
+}
+
+int sfs_queue_submit(sfs_queue *queue, const sfs_sqe *sqes, unsigned int n)
+{
+    if (n > queue->capacity)
+        return -EINVAL;
+    if (n == 0)
+        return 0;
+    for (unsigned int i = 0; i < n; i++)
+        if (!validEntry(sqes, i))
+            return -EINVAL;
+
+    sfs_queue_batch_t *batch =
+        malloc(sizeof *batch + n * sizeof batch->entries[0]);
+    if (!batch)
+        return -ENOMEM;
+    batch->next = NULL;
+    batch->n_entries = n;
+    batch->nextGroup = 0;
+    batch->groupsDone = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        batch->entries[i].sqe = sqes[i];
+        batch->entries[i].result = 0;
+        batch->entries[i].openFd = -EBADF;
+        batch->entries[i].closed = false;
+    }
+    int status = groupBatch(batch);
+    if (status < 0)
+    {
+        free(batch);
+        return status;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->inFlight + n > queue->capacity)
+    {
+        pthread_mutex_unlock(&queue->lock);
+        free(batch->groupHeads);
+        free(batch);
+        return -EAGAIN;
+    }
+    queue->inFlight += n;
+    if (queue->tail)
+        queue->tail->next = batch;
+    else
+    {
+        queue->head = batch;
+        pthread_cond_broadcast(&queue->workReady);
+    }
+    queue->tail = batch;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+unsigned int sfs_queue_poll(sfs_queue *queue, sfs_cqe *cqes, unsigned int max,
+                            int wait)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (wait)
+        while (queue->ringCount == 0 && queue->inFlight > 0)
+            pthread_cond_wait(&queue->completed, &queue->lock);
+
+    unsigned int n = queue->ringCount < max ? queue->ringCount : max;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        cqes[i] = queue->ring[queue->ringStart];
+        queue->ringStart = (queue->ringStart + 1) % queue->capacity;
+    }
+    queue->ringCount -= n;
+    queue->inFlight -= n;
+    pthread_mutex_unlock(&queue->lock);
+    return n;
+}
+
+void sfs_queue_destroy(sfs_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head)
+        pthread_cond_wait(&queue->completed, &queue->lock);
+    queue->stopping = true;
+    pthread_cond_broadcast(&queue->workReady);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (unsigned int i = 0; i < queue->n_workers; i++)
+        pthread_join(queue->workers[i], NULL);
+
+    pthread_cond_destroy(&queue->completed);
+    pthread_cond_destroy(&queue->workReady);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->workers);
+    free(queue->ring);
+    free(queue);
+}
@@ -0,0 +1,105 @@
+/** This file defines a submission/completion queue layered over the API
+    in sfs-api.h, for callers that issue many small operations at once.
+    Operations are submitted in batches, carried out by a pool of
+    worker threads, and their results collected by polling.
+
+    Within a batch, operations that involve the same file run one after
+    another, in the order they were submitted, and work is shared
+    between them: repeated opens of a name look it up only once, and a
+    run of consecutive reads or writes on the same descriptor becomes
+    a single sfs_readv or sfs_writev call, which walks the file's block
+    chain, and allocates any new blocks, only once.  Operations on
+    different files may run in parallel and complete in any order.
+    Each batch finishes completely before the next one starts.
+
+    "The same file" means: the same name, for opens, removes and
+    renames (a rename involves both of its names); the same "file
+    descriptor" number, for the other operations; and, for an
+    operation whose descriptor is SFS_BATCH_FD(i), the same file as
+    entry i of the batch.  Operations on a descriptor opened in an
+    earlier batch are not ordered relative to operations on the same
+    file by name.  */
+
+#ifndef SFS_QUEUE_H_
+#define SFS_QUEUE_H_ 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Operation codes for sfs_sqe.  */
+typedef enum sfs_op
+{
+    SFS_OP_OPEN,   /**< sfs_open(name) */
+    SFS_OP_CLOSE,  /**< sfs_close(fd); the result is 0 */
+    SFS_OP_READ,   /**< sfs_read(fd, buf, len) */
+    SFS_OP_WRITE,  /**< sfs_write(fd, buf, len) */
+    SFS_OP_REMOVE, /**< sfs_remove(name) */
+    SFS_OP_RENAME  /**< sfs_rename(name, new_name) */
+} sfs_op;
+
+/** Use as the 'fd' of an sfs_sqe to mean the "file descriptor" opened
+    by entry I of the same batch, which must be an SFS_OP_OPEN that
+    comes before it.  If that open failed, the operation fails with
+    -EBADF.  */
+#define SFS_BATCH_FD(i) (-2 - (int)(i))
+
+/** One submitted operation.  The strings and buffers it points to must
+    stay valid until its completion has been polled.  Fields that the
+    operation does not use are ignored.  */
+typedef struct sfs_sqe
+{
+    sfs_op op;
+    int fd;
+    const char *name;
+    const char *new_name;
+    char *buf; /**< read into, or written from (and not modified) */
+    size_t len;
+    uint64_t user_data; /**< copied into the completion */
+} sfs_sqe;
+
+/** The completion of one operation.  'result' is what the equivalent
+    sfs-api.h call would have returned.  */
+typedef struct sfs_cqe
+{
+    uint64_t user_data;
+    ssize_t result;
+} sfs_cqe;
+
+/** An opaque submission/completion queue.  */
+typedef struct sfs_queue sfs_queue;
+
+/** Create a queue that can have up to ENTRIES operations in flight
+    (submitted but not yet polled), serviced by WORKERS threads,
+    which are created with sfs_thread_create_internal.  Stores the
+    queue in *QUEUE_OUT.  Returns 0 on success, or a negative error
+    code: -EINVAL if either number is zero.  */
+int sfs_queue_create(sfs_queue **queue_out, unsigned int entries,
+                     unsigned int workers);
+
+/** Submit the N operations in SQES as one batch.  They are copied, so
+    SQES itself may be reused as soon as this returns.
+
+    Returns 0 on success, or a negative error code, in which case none
+    of the operations were submitted:
+
+    -EAGAIN    There is not room for N more operations in flight; poll
+               for some completions and try again.
+    -EINVAL    N is larger than the queue, or some operation is
+               malformed (e.g. an SFS_BATCH_FD that does not refer to
+               an earlier open).  */
+int sfs_queue_submit(sfs_queue *queue, const sfs_sqe *sqes, unsigned int n);
+
+/** Copy up to MAX completions into CQES, in the order they finished.
+    If WAIT is nonzero and no completions are ready, block until at
+    least one is, unless nothing at all is in flight.  Returns the
+    number of completions copied.  */
+unsigned int sfs_queue_poll(sfs_queue *queue, sfs_cqe *cqes, unsigned int max,
+                            int wait);
+
+/** Wait for every submitted operation to finish, then destroy the
+    queue and its worker threads.  Completions that were never polled
+    are discarded.  Must not be called while another thread is using
+    the queue.  */
+void sfs_queue_destroy(sfs_queue *queue);
+
+#endif
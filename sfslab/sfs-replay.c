@@ -0,0 +1,633 @@
+/** Replays the traces that 'sfs-tester --record' writes.
+
+    This program reads a trace (see sfs-trace.h) and makes its calls
+    again, directly on the functions in sfs-api.h, without going
+    through Lua, so that what it measures is sfs-disk.c itself.  Each
+    thread that made calls when the trace was recorded gets a thread of
+    its own, which makes the same calls in the same order.
+
+    Calls by different threads that overlapped when they were recorded
+    may overlap on replay, but a call never starts before the replay of
+    every call that had returned, in any thread, by the time it was
+    first made; so, for instance, a thread that opened a file only
+    after another thread formatted the disk still does so.  Beyond
+    that, by default, each call is made as long after the replay starts
+    as it was made after the recording started, or as soon after that
+    as it can be; with --fast, each call is made as soon as it can be.
+
+    File descriptors may be numbered differently on replay, so a call on
+    a file descriptor uses whatever was returned by the replay of the
+    open that returned it when recorded: the latest such open that had
+    returned by the time of the call.  The data written is not in the
+    trace; each write writes as many pseudo-random bytes, which do not
+    compress, instead.
+
+    A call whose result (see sfs_trace_record) is not what was recorded
+    has "diverged"; an open diverges only if it succeeds where it failed
+    or fails where it succeeded, or fails differently.  Divergences are
+    counted and, with --verbose, described on standard error, but do
+    not stop the replay.  When it is over, a CSV report is written to
+    standard output, with a row for each function called and one for
+    all of them: the number of calls, how many diverged, the mean and
+    maximum latency of the calls on replay, in nanoseconds, and their
+    mean latency when they were recorded.  */
+
+#include "sfs-api.h"
+#include "sfs-trace.h"
+
+#include <argp.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/** What disk.read reads if not given a size: LUAL_BUFFERSIZE, on a
+    64-bit machine.  */
+#define DEFAULT_READ_SIZE 1024
+
+/** Index value meaning "no record".  */
+#define NO_RECORD SIZE_MAX
+
+/** Command line settings.  */
+static const char *trace_file = NULL;
+static const char *disk = NULL;
+static int fast = 0;
+static int verbose = 0;
+
+/** What is counted for each op.  */
+typedef struct replay_counters
+{
+    uint64_t calls;
+    uint64_t diverged;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t recorded_ns;
+} replay_counters;
+
+/** One thread of the replay, and the records, by index into the
+    trace, that it replays.  'done' is how many of them have been
+    replayed.  'returned' is, for each thread, how many of its records
+    had returned when the one being replayed started; they all have to
+    be replayed before it.  'buf' is big enough for any of their reads
+    or writes, and 'iov' for any of their vectors.  */
+typedef struct replay_thread
+{
+    pthread_t thread;
+    size_t *records;
+    size_t n_records;
+    atomic_size_t done;
+    size_t *returned;
+    char *buf;
+    size_t buf_size;
+    struct iovec *iov;
+    size_t iov_count;
+    replay_counters counters[SFS_TRACE_N_OPS];
+} replay_thread;
+
+static sfs_trace trace;
+static replay_thread *threads;
+
+/** For each record on a file descriptor, the index of the open whose
+    result it uses, or NO_RECORD to use the descriptor as recorded.  */
+static size_t *fd_sources;
+
+/** For each open, its result on replay.  */
+static int64_t *open_results;
+
+/** Threads waiting for others to replay more records wait on 'progress',
+    and count themselves in 'n_waiting' so that threads that have
+    replayed a record need not take the lock when nobody is waiting.  */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress = PTHREAD_COND_INITIALIZER;
+static atomic_uint n_waiting;
+
+static pthread_barrier_t start_barrier;
+static uint64_t start_ns;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/** When record R returned, since the trace began.  */
+static uint64_t end_ns(const sfs_trace_record *r)
+{
+    return r->start_ns + r->duration_ns;
+}
+
+/** Whether the first argument of OP is a file descriptor.  */
+static int takes_fd(sfs_trace_op op)
+{
+    return sfs_trace_op_args[op][0] == 'f';
+}
+
+/** The number of bytes that record R reads or writes, and so needs a
+    buffer for, and the length of its vector, if it has one.  */
+static size_t io_size(const sfs_trace_record *r, size_t *iov_count)
+{
+    *iov_count = 0;
+    switch (r->op)
+    {
+    case SFS_TRACE_READ:
+        return r->args[1].present ? (size_t)r->args[1].value
+                                  : DEFAULT_READ_SIZE;
+    case SFS_TRACE_WRITE:
+    case SFS_TRACE_PREAD:
+    case SFS_TRACE_PWRITE:
+        return (size_t)r->args[1].value;
+    case SFS_TRACE_READV:
+    case SFS_TRACE_WRITEV:
+    {
+        size_t total = 0;
+        *iov_count = (size_t)r->args[1].value;
+        for (size_t i = 0; i < *iov_count; i++)
+            total += r->args[1].list[i];
+        return total;
+    }
+    default:
+        return 0;
+    }
+}
+
+/** Work out which open each record on a file descriptor depends on,
+    split the records up between the threads, and give each thread its
+    buffers.  Returns 0, or -ENOMEM.  */
+static int plan_replay(void)
+{
+    size_t n = trace.n_records;
+    fd_sources = malloc((n + 1) * sizeof *fd_sources);
+    open_results = calloc(n + 1, sizeof *open_results);
+    threads = calloc(trace.n_threads + 1, sizeof *threads);
+    if (!fd_sources || !open_results || !threads)
+        return -ENOMEM;
+
+    // The open that most recently returned each descriptor, by number.
+    // Records are in the order they returned, so an open made by
+    // another thread that is not yet known to have returned when a
+    // record started is one that the record cannot have got its
+    // descriptor from.
+    size_t *last_open = NULL;
+    size_t n_fds = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        const sfs_trace_record *r = &trace.records[i];
+        fd_sources[i] = NO_RECORD;
+        if (takes_fd(r->op) && r->args[0].value >= 0 &&
+            (size_t)r->args[0].value < n_fds)
+        {
+            size_t source = last_open[r->args[0].value];
+            if (source != NO_RECORD &&
+                (trace.records[source].thread == r->thread ||
+                 end_ns(&trace.records[source]) <= r->start_ns))
+                fd_sources[i] = source;
+        }
+        if (r->op == SFS_TRACE_OPEN && r->result >= 0 &&
+            r->result <= SFS_OPEN_FILE_LIMIT_MAX)
+        {
+            size_t fd = (size_t)r->result;
+            if (fd >= n_fds)
+            {
+                size_t *grown = realloc(last_open, (fd + 1) * sizeof *grown);
+                if (grown == NULL)
+                {
+                    free(last_open);
+                    return -ENOMEM;
+                }
+                last_open = grown;
+                while (n_fds <= fd)
+                    last_open[n_fds++] = NO_RECORD;
+            }
+            last_open[fd] = i;
+        }
+        threads[r->thread].n_records++;
+    }
+    free(last_open);
+
+    for (unsigned int t = 0; t < trace.n_threads; t++)
+    {
+        threads[t].records =
+            malloc(threads[t].n_records * sizeof *threads[t].records);
+        threads[t].returned =
+            calloc(trace.n_threads, sizeof *threads[t].returned);
+        if (threads[t].records == NULL || threads[t].returned == NULL)
+            return -ENOMEM;
+        threads[t].n_records = 0;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        const sfs_trace_record *r = &trace.records[i];
+        replay_thread *t = &threads[r->thread];
+        size_t iov_count;
+        size_t size = io_size(r, &iov_count);
+        if (size > t->buf_size)
+            t->buf_size = size;
+        if (iov_count > t->iov_count)
+            t->iov_count = iov_count;
+        t->records[t->n_records++] = i;
+    }
+
+    // Every thread writes the same bytes, from a fixed xorshift64*
+    // sequence.
+    for (unsigned int t = 0; t < trace.n_threads; t++)
+    {
+        replay_thread *rt = &threads[t];
+        rt->buf = malloc(rt->buf_size + 1);
+        rt->iov = malloc((rt->iov_count + 1) * sizeof *rt->iov);
+        if (rt->buf == NULL || rt->iov == NULL)
+            return -ENOMEM;
+        uint64_t x = 0x9E3779B97F4A7C15u;
+        for (size_t i = 0; i < rt->buf_size; i++)
+        {
+            x ^= x >> 12;
+            x ^= x << 25;
+            x ^= x >> 27;
+            rt->buf[i] = (char)((x * 2685821657736338717u) >> 56);
+        }
+    }
+    return 0;
+}
+
+/** Wait until every record that had returned when record R, of thread
+    T, started has been replayed.  */
+static void wait_for_returned(replay_thread *t, const sfs_trace_record *r)
+{
+    for (unsigned int k = 0; k < trace.n_threads; k++)
+    {
+        replay_thread *other = &threads[k];
+        if (other == t)
+            continue;
+        // Each thread's records are in order, and so are the times they
+        // returned, so the count only ever goes up.
+        size_t *returned = &t->returned[k];
+        while (*returned < other->n_records &&
+               end_ns(&trace.records[other->records[*returned]]) <=
+                   r->start_ns)
+            ++*returned;
+        if (atomic_load(&other->done) >= *returned)
+            continue;
+
+        pthread_mutex_lock(&progress_lock);
+        atomic_fetch_add(&n_waiting, 1);
+        while (atomic_load(&other->done) < *returned)
+            pthread_cond_wait(&progress, &progress_lock);
+        atomic_fetch_sub(&n_waiting, 1);
+        pthread_mutex_unlock(&progress_lock);
+    }
+}
+
+/** Count another of thread T's records as replayed, and wake any
+    threads waiting for it.  */
+static void record_replayed(replay_thread *t)
+{
+    atomic_fetch_add(&t->done, 1);
+    if (atomic_load(&n_waiting) != 0)
+    {
+        pthread_mutex_lock(&progress_lock);
+        pthread_cond_broadcast(&progress);
+        pthread_mutex_unlock(&progress_lock);
+    }
+}
+
+/** The descriptor that record I should use.  */
+static int replay_fd(size_t i)
+{
+    size_t source = fd_sources[i];
+    if (source == NO_RECORD)
+        return (int)trace.records[i].args[0].value;
+    // A descriptor whose open failed on replay is not valid.
+    int64_t fd = open_results[source];
+    return fd >= 0 ? (int)fd : -1;
+}
+
+/** Point thread T's vector at its buffer, in pieces of the lengths in
+    ARG, and return their number.  */
+static int fill_iov(replay_thread *t, const sfs_trace_arg *arg)
+{
+    size_t off = 0;
+    for (size_t i = 0; i < (size_t)arg->value; i++)
+    {
+        t->iov[i].iov_base = t->buf + off;
+        t->iov[i].iov_len = arg->list[i];
+        off += arg->list[i];
+    }
+    return (int)arg->value;
+}
+
+/** Make the call that R records, on descriptor FD if it takes one, and
+    return its result, in the same terms as a recorded result.  */
+static int64_t replay_call(replay_thread *t, const sfs_trace_record *r,
+                           int fd)
+{
+    const sfs_trace_arg *a = r->args;
+    switch (r->op)
+    {
+    case SFS_TRACE_FORMAT:
+    {
+        sfs_format_options options;
+        options.block_size = a[2].present ? (size_t)a[2].value : 512;
+        options.journal_size = (size_t)a[3].value;
+        options.change_summary = a[4].value != 0;
+        options.max_open_files = (unsigned int)a[5].value;
+        options.packed_files = a[6].value != 0;
+        options.sparse = a[7].value != 0;
+        options.checksums = a[8].value != 0;
+        return sfs_format_with_options(disk ? disk : a[0].str,
+                                       (size_t)a[1].value, &options);
+    }
+    case SFS_TRACE_MOUNT:
+    {
+        sfs_mount_options options;
+        options.max_open_files = (unsigned int)a[1].value;
+        options.huge_pages = a[2].value != 0;
+        return sfs_mount_with_options(disk ? disk : a[0].str, &options);
+    }
+    case SFS_TRACE_UNMOUNT:
+        return sfs_unmount();
+    case SFS_TRACE_OPEN:
+    {
+        int flags = 0;
+        if (strchr(a[1].str, 'a'))
+            flags |= SFS_OPEN_APPEND;
+        if (strchr(a[1].str, 'z'))
+            flags |= SFS_OPEN_COMPRESS;
+        return sfs_open_with_flags(a[0].str, flags);
+    }
+    case SFS_TRACE_CLOSE:
+        sfs_close(fd);
+        return 0;
+    case SFS_TRACE_READ:
+        return sfs_read(fd, t->buf, a[1].present ? (size_t)a[1].value
+                                                 : DEFAULT_READ_SIZE);
+    case SFS_TRACE_WRITE:
+        return sfs_write(fd, t->buf, (size_t)a[1].value);
+    case SFS_TRACE_PREAD:
+        return sfs_pread(fd, t->buf, (size_t)a[1].value, (size_t)a[2].value);
+    case SFS_TRACE_PWRITE:
+        return sfs_pwrite(fd, t->buf, (size_t)a[1].value,
+                          (size_t)a[2].value);
+    case SFS_TRACE_READV:
+        return sfs_readv(fd, t->iov, fill_iov(t, &a[1]));
+    case SFS_TRACE_WRITEV:
+        return sfs_writev(fd, t->iov, fill_iov(t, &a[1]));
+    case SFS_TRACE_FSYNC:
+        return sfs_fsync(fd);
+    case SFS_TRACE_FTRUNCATE:
+        return sfs_ftruncate(fd, (size_t)a[1].value);
+    case SFS_TRACE_FALLOCATE:
+        return sfs_fallocate(fd, (size_t)a[1].value);
+    case SFS_TRACE_FSTAT:
+    {
+        sfs_file_stat stat;
+        return sfs_fstat(fd, &stat);
+    }
+    case SFS_TRACE_SYNC:
+        return sfs_sync();
+    case SFS_TRACE_DEFRAG:
+    {
+        sfs_frag_stats before, after;
+        return sfs_defrag(&before, &after);
+    }
+    case SFS_TRACE_SEEK:
+        return sfs_seek(fd, (ssize_t)a[1].value);
+    case SFS_TRACE_GETPOS:
+        return sfs_getpos(fd);
+    case SFS_TRACE_REMOVE:
+        return sfs_remove(a[0].str);
+    case SFS_TRACE_RENAME:
+        return sfs_rename(a[0].str, a[1].str);
+    case SFS_TRACE_CLONE:
+        return sfs_clone(a[0].str, a[1].str);
+    case SFS_TRACE_LIST:
+    {
+        sfs_list_cookie cookie = NULL;
+        char name[SFS_FILE_NAME_SIZE_LIMIT];
+        int64_t total = 0;
+        int status;
+        while ((status = sfs_list(&cookie, name, sizeof name)) == 0)
+            total += (int64_t)strlen(name);
+        return status < 0 ? status : total;
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+/** Whether RESULT, on replay, differs from what record R recorded.  */
+static int diverged(const sfs_trace_record *r, int64_t result)
+{
+    if (r->op == SFS_TRACE_OPEN && r->result >= 0)
+        return result < 0;
+    return result != r->result;
+}
+
+static void *replay_threadproc(void *arg)
+{
+    replay_thread *t = arg;
+    pthread_barrier_wait(&start_barrier);
+
+    for (size_t k = 0; k < t->n_records; k++)
+    {
+        size_t i = t->records[k];
+        const sfs_trace_record *r = &trace.records[i];
+        wait_for_returned(t, r);
+        int fd = takes_fd(r->op) ? replay_fd(i) : -1;
+        if (!fast)
+        {
+            uint64_t when = start_ns + r->start_ns;
+            struct timespec ts = {(time_t)(when / 1000000000u),
+                                  (long)(when % 1000000000u)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                   NULL) == EINTR)
+                ;
+        }
+
+        uint64_t before = monotonic_ns();
+        int64_t result = replay_call(t, r, fd);
+        uint64_t ns = monotonic_ns() - before;
+
+        if (r->op == SFS_TRACE_OPEN)
+            open_results[i] = result;
+        record_replayed(t);
+
+        replay_counters *c = &t->counters[r->op];
+        c->calls++;
+        c->total_ns += ns;
+        if (ns > c->max_ns)
+            c->max_ns = ns;
+        c->recorded_ns += r->duration_ns;
+        if (diverged(r, result))
+        {
+            c->diverged++;
+            if (verbose)
+                fprintf(stderr,
+                        "sfs-replay: record %zu, thread %u: %s returned "
+                        "%" PRId64 ", recorded %" PRId64 "\n",
+                        i, r->thread, sfs_trace_op_names[r->op], result,
+                        r->result);
+        }
+    }
+    return NULL;
+}
+
+/** Write one row of the report.  */
+static void report_row(const char *name, const replay_counters *c)
+{
+    printf("%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+           "\n",
+           name, c->calls, c->diverged, c->total_ns / c->calls, c->max_ns,
+           c->recorded_ns / c->calls);
+}
+
+static const struct argp_option command_line_options[] = {
+    {"disk", 'd', "IMAGE", 0,
+     "Format and mount IMAGE, whatever disk image the trace names", 0},
+    {"fast", 'f', 0, 0,
+     "Make the calls as fast as possible, instead of at the times they"
+     " were recorded",
+     0},
+    {"verbose", 'v', 0, 0, "Describe every call that diverges", 0},
+    {0, 0, 0, 0, 0, 0}};
+
+static int command_line_parse_1(int key, char *arg, struct argp_state *state)
+{
+    switch (key)
+    {
+    case 'd':
+        disk = arg;
+        return 0;
+    case 'f':
+        fast = 1;
+        return 0;
+    case 'v':
+        verbose = 1;
+        return 0;
+    case ARGP_KEY_ARG:
+        if (trace_file)
+        {
+            argp_error(state, "can only replay one trace per invocation");
+        }
+        trace_file = arg;
+        return 0;
+    case ARGP_KEY_END:
+        if (trace_file == NULL)
+        {
+            argp_error(state, "no trace to replay");
+        }
+        return 0;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+}
+
+static const struct argp command_line_spec = {
+    command_line_options,
+    command_line_parse_1,
+    "TRACE",
+    "\nReplay a trace recorded with 'sfs-tester --record', without Lua.\n"
+    "A report is written to standard output as CSV.\n"
+    "\n"
+    "Options:",
+    NULL,
+    NULL,
+    NULL};
+
+int main(int argc, char **argv)
+{
+    int err = argp_parse(&command_line_spec, argc, argv, 0, 0, NULL);
+    if (err)
+    {
+        fprintf(stderr, "argp_parse: %s\n", strerror(err));
+        return 1;
+    }
+
+    err = sfs_trace_load(&trace, trace_file);
+    if (err < 0)
+    {
+        fprintf(stderr, "sfs-replay: %s: %s\n", trace_file, strerror(-err));
+        return 1;
+    }
+    if (trace.n_records == 0)
+    {
+        fprintf(stderr, "sfs-replay: %s: no calls to replay\n", trace_file);
+        return 1;
+    }
+    err = plan_replay();
+    if (err < 0)
+    {
+        fprintf(stderr, "sfs-replay: %s\n", strerror(-err));
+        return 1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, trace.n_threads + 1);
+    for (unsigned int t = 0; t < trace.n_threads; t++)
+    {
+        err = pthread_create(&threads[t].thread, NULL, replay_threadproc,
+                             &threads[t]);
+        if (err)
+        {
+            // The barrier cannot be released without every thread, so
+            // there is no clean way to carry on.
+            fprintf(stderr, "sfs-replay: starting threads: %s\n",
+                    strerror(err));
+            exit(1);
+        }
+    }
+    start_ns = monotonic_ns();
+    pthread_barrier_wait(&start_barrier);
+    for (unsigned int t = 0; t < trace.n_threads; t++)
+        pthread_join(threads[t].thread, NULL);
+    double elapsed = (double)(monotonic_ns() - start_ns) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    replay_counters all = {0, 0, 0, 0, 0};
+    printf("op,calls,diverged,mean_ns,max_ns,recorded_mean_ns\n");
+    for (int op = 0; op < SFS_TRACE_N_OPS; op++)
+    {
+        replay_counters c = {0, 0, 0, 0, 0};
+        for (unsigned int t = 0; t < trace.n_threads; t++)
+        {
+            const replay_counters *tc = &threads[t].counters[op];
+            c.calls += tc->calls;
+            c.diverged += tc->diverged;
+            c.total_ns += tc->total_ns;
+            c.max_ns = tc->max_ns > c.max_ns ? tc->max_ns : c.max_ns;
+            c.recorded_ns += tc->recorded_ns;
+        }
+        if (c.calls == 0)
+            continue;
+        report_row(sfs_trace_op_names[op], &c);
+        all.calls += c.calls;
+        all.diverged += c.diverged;
+        all.total_ns += c.total_ns;
+        all.max_ns = c.max_ns > all.max_ns ? c.max_ns : all.max_ns;
+        all.recorded_ns += c.recorded_ns;
+    }
+    report_row("all", &all);
+
+    fprintf(stderr,
+            "sfs-replay: %zu calls from %u threads in %.3f s (%.1f calls/s);"
+            " %" PRIu64 " diverged\n",
+            trace.n_records, trace.n_threads, elapsed,
+            (double)trace.n_records / elapsed, all.diverged);
+
+    for (unsigned int t = 0; t < trace.n_threads; t++)
+    {
+        free(threads[t].records);
+        free(threads[t].returned);
+        free(threads[t].buf);
+        free(threads[t].iov);
+    }
+    free(threads);
+    free(fd_sources);
+    free(open_results);
+    sfs_trace_free(&trace);
+    return 0;
+}
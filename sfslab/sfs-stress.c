@@ -0,0 +1,65 @@
+//
+// SFS Stress - a multi-threaded workload generator for sfs-tester
+//
+// This is the C part of the tester's Lua module "stress".  The module
+//   itself is written in Lua, in sfs-stress.lua, which also says how
+//   to use it; this file loads it when the tester starts, from the
+//   directory the tester's executable is in, and supplies the one
+//   function it needs that plain Lua does not have.
+//
+
+#include "sfs-stress.h"
+
+#include "lauxlib.h"
+#include "lua.h"
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** stress.clock() returns the time, in seconds, on a monotonic clock.  */
+static int stress_clock(lua_State *L)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lua_pushnumber(L, (lua_Number)ts.tv_sec + (lua_Number)ts.tv_nsec / 1e9);
+    return 1;
+}
+
+/** Name of the file that holds the Lua part of the module.  */
+#define STRESS_SOURCE "sfs-stress.lua"
+
+/** Push the path of STRESS_SOURCE in the directory of the running
+    executable, or just its name, to look for it in the current
+    directory, if that directory cannot be found out.  */
+static void push_stress_path(lua_State *L)
+{
+    char exe[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", exe, sizeof exe - 1);
+    const char *slash = NULL;
+    if (n > 0)
+    {
+        exe[n] = '\0';
+        slash = strrchr(exe, '/');
+    }
+    if (slash == NULL)
+    {
+        lua_pushstring(L, STRESS_SOURCE);
+        return;
+    }
+    lua_pushlstring(L, exe, (size_t)(slash + 1 - exe));
+    lua_pushstring(L, STRESS_SOURCE);
+    lua_concat(L, 2);
+}
+
+int luaopen_stress(lua_State *L)
+{
+    push_stress_path(L);
+    if (luaL_loadfilex(L, lua_tostring(L, -1), "t") != LUA_OK)
+        lua_error(L);
+    lua_remove(L, -2);
+    lua_pushcfunction(L, stress_clock);
+    lua_call(L, 1, 1);
+    return 1;
+}
@@ -0,0 +1,13 @@
+#ifndef SFS_STRESS_H_
+#define SFS_STRESS_H_ 1
+
+/** This file declares the "stress" Lua module built into sfs-tester;
+    see sfs-stress.c for what it does and how to use it.  */
+
+#include "lua.h"
+
+/** Open the "stress" module and leave its table on the stack, for use
+    with luaL_requiref.  The "disk" module must already be loaded.  */
+int luaopen_stress(lua_State *L);
+
+#endif
@@ -0,0 +1,412 @@
+--
+-- SFS Stress - a multi-threaded workload generator for sfs-tester
+--
+-- sfs-tester loads this file when it starts, as the Lua module
+--   "stress"; see sfs-stress.c.  stress.run(options) creates a set of
+--   files on the mounted disk, then runs a random mix of operations on
+--   them from several lanes at once for a fixed time, and prints a CSV
+--   report.  Given a list of lane counts, it does that once for each,
+--   so that the report shows how throughput scales.  For example:
+--
+--     disk.format("stress.img", 16 * 1024 * 1024)
+--     stress.run{lanes = {1, 2, 4, 8}, skew = 1.2,
+--                mix = {read = 70, write = 20, list = 10}}
+--
+-- The options, all optional, are:
+--
+--   lanes           number of lanes, or a list of them (default 4)
+--   seconds         how long each run lasts (default 5)
+--   files           number of files to work on (default 64)
+--   prefix          what their names start with (default "stress")
+--   mix             relative weights of the operations (default
+--                   {read = 50, write = 30, create = 5, remove = 5,
+--                   rename = 5, list = 5}); any left out are not done
+--   size            bytes per read or write, and the initial size of
+--                   each file: {"fixed", N}, {"uniform", MIN, MAX}, or
+--                   {"exponential", MEAN}, capped at 4 * MEAN (default
+--                   {"uniform", 1, 4096})
+--   skew            Zipf exponent for picking which file an operation
+--                   works on; 0 picks uniformly (default 0)
+--   open_per_lane   how many files each lane keeps open (default 1);
+--                   the total must stay below the tester's fd limit
+--   seed            seed for the lanes' random numbers (default 1)
+--   quiet           if true, print nothing (default false)
+--
+-- read and write are pread and pwrite at a random position; create
+--   opens and closes a file, creating it if it was removed; remove
+--   closes the lane's own fd on the file, if it has one, and removes
+--   the file; rename renames a file and back again; and list lists
+--   the directory.
+--
+-- Each report row describes one operation at one lane count: calls,
+--   failures, ops/s and MB/s over the run, and mean and maximum latency
+--   in microseconds.  The row for "all" also has the contention
+--   figures: 'fairness' is the fewest calls any lane made over the
+--   most, and 'scaling' is the throughput per lane over that of the
+--   first lane count in the list, so 1.0 means perfect scaling.
+--   stress.run also returns those figures, and counts of failures by
+--   error message, for each lane count.  Operations that fail because
+--   of what another lane did, such as reading a file it has just
+--   removed, are counted as failures; they do not stop the run.
+--
+
+-- sfs-stress.c runs this file with stress.clock, which returns the
+-- time in seconds on a monotonic clock, as its argument, and uses
+-- what it returns as the module table.
+local clock = ...
+local disk = require 'disk'
+local stress = {clock = clock}
+
+stress.defaults = {
+    lanes = 4,
+    seconds = 5,
+    files = 64,
+    prefix = 'stress',
+    mix = {read = 50, write = 30, create = 5, remove = 5,
+           rename = 5, list = 5},
+    size = {'uniform', 1, 4096},
+    skew = 0,
+    open_per_lane = 1,
+    seed = 1,
+    quiet = false,
+}
+
+local OPS = {'read', 'write', 'create', 'remove', 'rename', 'list'}
+
+-- Everything from here to lane_main runs inside the lanes, and may
+-- only refer to other Lua functions and plain values, which Lanes
+-- can copy into the lane's own Lua state.
+
+local function largest_size(size)
+    if size[1] == 'fixed' then
+        return size[2]
+    elseif size[1] == 'uniform' then
+        return size[3]
+    else
+        return 4 * size[2]
+    end
+end
+
+local function random_size(size)
+    if size[1] == 'fixed' then
+        return size[2]
+    elseif size[1] == 'uniform' then
+        return math.random(size[2], size[3])
+    else
+        local n = math.floor(-size[2] * math.log(1 - math.random()))
+        return math.max(1, math.min(n, 4 * size[2]))
+    end
+end
+
+-- cumulative[k] is the chance of picking a file numbered k or less.
+local function key_cdf(files, skew)
+    local cumulative, total = {}, 0
+    for k = 1, files do
+        total = total + k ^ -skew
+        cumulative[k] = total
+    end
+    for k = 1, files do
+        cumulative[k] = cumulative[k] / total
+    end
+    return cumulative
+end
+
+local function new_counts()
+    return {calls = 0, failures = 0, bytes = 0, time = 0, max = 0,
+            errors = {}}
+end
+
+local function random_key(cumulative)
+    local r = math.random()
+    local lo, hi = 1, #cumulative
+    while lo < hi do
+        local mid = (lo + hi) // 2
+        if cumulative[mid] < r then
+            lo = mid + 1
+        else
+            hi = mid
+        end
+    end
+    return lo
+end
+
+local function lane_main(cfg, lane, start_at, deadline)
+    local disk = require 'disk'
+    local clock = require('stress').clock
+    math.randomseed(cfg.seed, lane)
+
+    local cumulative = key_cdf(cfg.files, cfg.skew)
+    local max_size = largest_size(cfg.size)
+    local data = string.rep(string.char(64 + lane % 26), max_size)
+    local weights, total_weight = {}, 0
+    for _, op in ipairs(OPS) do
+        total_weight = total_weight + (cfg.mix[op] or 0)
+        weights[#weights + 1] = {op, total_weight}
+    end
+
+    -- The files this lane has open, oldest first, and their fds.
+    local fds, open_order = {}, {}
+    local function name_of(k)
+        return cfg.prefix .. k
+    end
+    local function close_key(k)
+        if fds[k] then
+            disk.close(fds[k])
+            fds[k] = nil
+            for i, key in ipairs(open_order) do
+                if key == k then
+                    table.remove(open_order, i)
+                    break
+                end
+            end
+        end
+    end
+    local function fd_of(k)
+        if fds[k] then
+            return fds[k]
+        end
+        if #open_order >= cfg.open_per_lane then
+            close_key(open_order[1])
+        end
+        local fd, err, errno = disk.open(name_of(k))
+        if fd then
+            fds[k] = fd
+            open_order[#open_order + 1] = k
+        end
+        return fd, err, errno
+    end
+
+    local run = {}
+    function run.read(k)
+        local fd, err, errno = fd_of(k)
+        if not fd then return nil, err, errno end
+        local pos = math.random(0, max_size)
+        local len = random_size(cfg.size)
+        local got, err2, errno2 = disk.pread(fd, len, pos)
+        if not got then return nil, err2, errno2 end
+        return #got
+    end
+    function run.write(k)
+        local fd, err, errno = fd_of(k)
+        if not fd then return nil, err, errno end
+        local n = random_size(cfg.size)
+        local pos = math.random(0, max_size - n)
+        return disk.pwrite(fd, data:sub(1, n), pos)
+    end
+    function run.create(k)
+        local fd, err, errno = disk.open(name_of(k))
+        if not fd then return nil, err, errno end
+        disk.close(fd)
+        return 0
+    end
+    function run.remove(k)
+        close_key(k)
+        local ok, err, errno = disk.remove(name_of(k))
+        if not ok then return nil, err, errno end
+        return 0
+    end
+    function run.rename(k)
+        local name = name_of(k)
+        local other = name .. '~' .. lane
+        local ok, err, errno = disk.rename(name, other)
+        if not ok then return nil, err, errno end
+        ok, err, errno = disk.rename(other, name)
+        if not ok then return nil, err, errno end
+        return 0
+    end
+    function run.list()
+        local names, err, errno = disk.list()
+        if not names then return nil, err, errno end
+        return 0
+    end
+
+    local stats = {}
+    for _, op in ipairs(OPS) do
+        stats[op] = new_counts()
+    end
+
+    while clock() < start_at do
+    end
+    local now = clock()
+    while now < deadline do
+        local r, op = math.random() * total_weight
+        for _, w in ipairs(weights) do
+            if r < w[2] then
+                op = w[1]
+                break
+            end
+        end
+        op = op or weights[#weights][1]
+
+        local k = random_key(cumulative)
+        local began = now
+        local bytes, err = run[op](k)
+        now = clock()
+
+        local s = stats[op]
+        local took = now - began
+        s.calls = s.calls + 1
+        s.time = s.time + took
+        if took > s.max then
+            s.max = took
+        end
+        if bytes then
+            s.bytes = s.bytes + bytes
+        else
+            s.failures = s.failures + 1
+            err = err or 'unknown error'
+            s.errors[err] = (s.errors[err] or 0) + 1
+        end
+    end
+    for k in pairs(fds) do
+        disk.close(fds[k])
+    end
+    return stats
+end
+
+local function merge_options(opts)
+    local cfg = {}
+    for key, value in pairs(stress.defaults) do
+        cfg[key] = value
+    end
+    for key, value in pairs(opts or {}) do
+        if cfg[key] == nil then
+            error('stress.run: unknown option ' .. tostring(key), 3)
+        end
+        cfg[key] = value
+    end
+    local known, total_weight = {}, 0
+    for _, op in ipairs(OPS) do
+        known[op] = true
+        total_weight = total_weight + (cfg.mix[op] or 0)
+    end
+    for op in pairs(cfg.mix) do
+        if not known[op] then
+            error('stress.run: unknown operation ' .. tostring(op), 3)
+        end
+    end
+    if total_weight <= 0 then
+        error('stress.run: the mix has no operations in it', 3)
+    end
+    return cfg
+end
+
+local function create_files(cfg)
+    local data = string.rep('s', largest_size(cfg.size))
+    for k = 1, cfg.files do
+        local name = cfg.prefix .. k
+        local fd = assert(disk.open(name))
+        assert(disk.write(fd, data:sub(1, random_size(cfg.size))))
+        disk.close(fd)
+    end
+end
+
+local function summarize(n_lanes, results, seconds)
+    local summary = new_counts()
+    summary.lanes = n_lanes
+    summary.ops = {}
+    local fewest, most
+    for _, stats in ipairs(results) do
+        local lane_calls = 0
+        for _, op in ipairs(OPS) do
+            local s, t = stats[op], summary.ops[op]
+            if not t then
+                t = new_counts()
+                summary.ops[op] = t
+            end
+            t.calls = t.calls + s.calls
+            t.failures = t.failures + s.failures
+            t.bytes = t.bytes + s.bytes
+            t.time = t.time + s.time
+            t.max = math.max(t.max, s.max)
+            for err, n in pairs(s.errors) do
+                t.errors[err] = (t.errors[err] or 0) + n
+                summary.errors[err] = (summary.errors[err] or 0) + n
+            end
+            lane_calls = lane_calls + s.calls
+        end
+        fewest = math.min(fewest or lane_calls, lane_calls)
+        most = math.max(most or lane_calls, lane_calls)
+    end
+    for _, op in ipairs(OPS) do
+        local t = summary.ops[op]
+        summary.calls = summary.calls + t.calls
+        summary.failures = summary.failures + t.failures
+        summary.bytes = summary.bytes + t.bytes
+        summary.time = summary.time + t.time
+        summary.max = math.max(summary.max, t.max)
+    end
+    summary.ops_per_s = summary.calls / seconds
+    summary.fairness = most > 0 and fewest / most or 1
+    return summary
+end
+
+local function report_row(n_lanes, op, t, seconds, extra)
+    local mean = t.calls > 0 and t.time / t.calls or 0
+    print(string.format('%d,%s,%d,%d,%.1f,%.3f,%.1f,%.1f%s',
+                        n_lanes, op, t.calls, t.failures,
+                        t.calls / seconds, t.bytes / 1e6 / seconds,
+                        mean * 1e6, t.max * 1e6, extra))
+end
+
+-- stress.run([options]) runs a mix of operations on the mounted
+-- disk from several lanes at once, and returns, for each number of
+-- lanes, a summary of what happened.  See sfs-stress.c for the
+-- options.
+function stress.run(opts)
+    local cfg = merge_options(opts)
+    local lanes = require 'lanes'
+    if lanes.configure then
+        lanes = lanes.configure()
+    end
+    local lane_counts = cfg.lanes
+    if type(lane_counts) ~= 'table' then
+        lane_counts = {lane_counts}
+    end
+
+    create_files(cfg)
+    local required = {'disk', 'stress'}
+    local gen = lanes.gen('*', {required = required}, lane_main)
+    local summaries = {}
+    if not cfg.quiet then
+        print('lanes,op,calls,failures,ops_per_s,mb_per_s,'
+              .. 'mean_us,max_us,fairness,scaling')
+    end
+    for _, n_lanes in ipairs(lane_counts) do
+        -- Give every lane time to start before the clock does.
+        local start_at = clock() + 0.05 * n_lanes
+        local deadline = start_at + cfg.seconds
+        local handles = {}
+        for lane = 1, n_lanes do
+            handles[lane] = gen(cfg, lane, start_at, deadline)
+        end
+        local results = {}
+        for lane = 1, n_lanes do
+            results[lane] = handles[lane][1]
+        end
+
+        local summary = summarize(n_lanes, results, cfg.seconds)
+        local base = summaries[1] or summary
+        summary.scaling = (summary.ops_per_s / n_lanes)
+            / (base.ops_per_s / base.lanes)
+        summaries[#summaries + 1] = summary
+        if not cfg.quiet then
+            for _, op in ipairs(OPS) do
+                local t = summary.ops[op]
+                if t.calls > 0 then
+                    report_row(n_lanes, op, t, cfg.seconds, ',,')
+                end
+            end
+            report_row(n_lanes, 'all', summary, cfg.seconds,
+                       string.format(',%.3f,%.3f', summary.fairness,
+                                     summary.scaling))
+        end
+    end
+
+    for k = 1, cfg.files do
+        disk.remove(cfg.prefix .. k)
+    end
+    return summaries
+end
+
+return stress
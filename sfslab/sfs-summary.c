@@ -0,0 +1,162 @@
+//
+// SFS Summary - which parts of the disk image have changed
+//
+// If the disk image was formatted with a change summary (see
+//   sfs_summary_t in sfs-disk.h), every journal record, as it is
+//   carried out, first marks the regions of the disk whose metadata it
+//   changes.  The first time a region is marked since the image was
+//   last cleanly unmounted, its bit is set in the summary block, and
+//   the block is flushed to stable storage before the change is made;
+//   after that, marking it costs no more than an atomic load.  When
+//   the image is unmounted, once everything else is on stable storage,
+//   all the bits are cleared again.  sfs-fsck --incremental can then
+//   check just the regions that are marked, which after a crash is
+//   usually a small part of the disk.
+//
+// 'summaryLock' protects the summary block.  It comes after every
+//   other lock, including 'journalLock' in sfs-journal.c, since
+//   records are carried out while that is held.
+//
+
+#include "sfs-disk.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** The summary block, or NULL if the image has no summary.  */
+static sfs_summary_t *summary;
+static block_id summaryBlock;
+static uint32_t regionShift;
+
+/** A copy of the summary's bits, so that most calls to summaryMark can
+    see that there is nothing to do without taking the lock.  A bit is
+    set here only once it is on stable storage.  */
+static _Atomic uint64_t *marked;
+
+/** Set if the summary block could not be flushed, in which case the
+    summary can no longer be trusted, and is not marked clean.  */
+static int summaryFailed;
+
+static pthread_mutex_t summaryLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Number of regions of 2**SHIFT blocks needed to cover N_BLOCKS
+    blocks.  */
+static uint64_t regionCount(uint32_t n_blocks, uint32_t shift)
+{
+    return ((uint64_t)n_blocks + ((uint64_t)1 << shift) - 1) >> shift;
+}
+
+/** Lay out an empty change summary in block ID, in an image that is
+    being formatted and is all zeros, and whose super block already
+    has its size filled in.  */
+void summaryFormat(block_id id)
+{
+    sfs_summary_t *s = (sfs_summary_t *)(void *)accessBlock(id);
+    setBlockType(&s->h, SFS_BLOCK_TYPE_SUMMARY);
+    uint32_t n_blocks = accessSuperBlock()->n_blocks;
+    uint32_t shift = 0;
+    while (regionCount(n_blocks, shift) > SFS_SUMMARY_REGIONS(getBlockSize()))
+        shift++;
+    s->region_shift = shift;
+}
+
+/** Find the change summary of the disk image that is being activated,
+    if it has one.  Returns 0, -EUCLEAN if the summary is malformed, or
+    -ENOMEM.  */
+int summaryOpen(void)
+{
+    sfs_filesystem_t *super = accessSuperBlock();
+    summary = NULL;
+    summaryFailed = 0;
+    if (getImageVersion() < 2 || super->summary == 0)
+        return 0;
+
+    if (super->summary >= super->n_blocks)
+        return -EUCLEAN;
+    sfs_summary_t *s = (sfs_summary_t *)(void *)accessBlock(super->summary);
+    if (memcmp(s->h.type, SFS_BLOCK_TYPE_SUMMARY, sizeof s->h.type) != 0 ||
+        s->region_shift >= 32 ||
+        regionCount(super->n_blocks, s->region_shift) >
+            SFS_SUMMARY_REGIONS(getBlockSize()))
+        return -EUCLEAN;
+
+    uint32_t n_regions = (uint32_t)regionCount(super->n_blocks,
+                                               s->region_shift);
+    size_t n_words = (size_t)n_regions / 64 + 1;
+    marked = malloc(n_words * sizeof *marked);
+    if (marked == NULL)
+        return -ENOMEM;
+    for (size_t w = 0; w < n_words; w++)
+        atomic_init(&marked[w], 0);
+    for (uint32_t r = 0; r < n_regions; r++)
+        if (s->dirty[r / 8] & (1u << (r % 8)))
+            marked[r / 64] |= (uint64_t)1 << (r % 64);
+
+    summary = s;
+    summaryBlock = super->summary;
+    regionShift = s->region_shift;
+    return 0;
+}
+
+/** Note that the headers of the COUNT blocks starting at START, or
+    directory entries in them, are about to change, and do not return
+    until the regions they are in are marked on stable storage.  */
+void summaryMark(block_id start, uint32_t count)
+{
+    if (summary == NULL || count == 0)
+        return;
+
+    uint32_t last = (start + count - 1) >> regionShift;
+    for (uint32_t r = start >> regionShift; r <= last; r++)
+    {
+        uint64_t bit = (uint64_t)1 << (r % 64);
+        if (atomic_load_explicit(&marked[r / 64], memory_order_acquire) & bit)
+            continue;
+
+        pthread_mutex_lock(&summaryLock);
+        if (!(atomic_load_explicit(&marked[r / 64], memory_order_relaxed) &
+              bit))
+        {
+            summary->dirty[r / 8] |= (unsigned char)(1u << (r % 8));
+            if (syncBlocks(summaryBlock, 1) < 0)
+                summaryFailed = 1;
+            atomic_fetch_or_explicit(&marked[r / 64], bit,
+                                     memory_order_release);
+        }
+        pthread_mutex_unlock(&summaryLock);
+    }
+}
+
+/** Forget about the change summary, as the disk image is being
+    deactivated.  If CLEAN, the image is known to be consistent, so
+    flush the whole image, and then mark every region as unchanged.
+    Returns 0, or -EIO if the image or the summary could not be
+    flushed, or could not be earlier, in which case the marks are left
+    as they were.  */
+int summaryClose(int clean)
+{
+    if (summary == NULL)
+        return 0;
+
+    int status = 0;
+    if (clean)
+    {
+        status = summaryFailed ? -EIO
+                               : syncBlocks(0, accessSuperBlock()->n_blocks);
+        if (status == 0)
+        {
+            memset(summary->dirty, 0,
+                   getBlockSize() - offsetof(sfs_summary_t, dirty));
+            status = syncBlocks(summaryBlock, 1);
+        }
+    }
+    free(marked);
+    marked = NULL;
+    summary = NULL;
+    return status;
+}
@@ -8,6 +8,7 @@ Email: tutorcs@163.com
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,8 +19,9 @@ Email: tutorcs@163.com
 #include <sys/types.h>
 #include <unistd.h>
 
-static sfs_block_file_t *diskBlocks = NULL;
+static char *diskBlocks = NULL;
 static size_t diskSizeInBytes = 0;
+static uint32_t diskBlockSize = 0;
 
 /** Given a pointer to a specific field of a structure, recover a
     pointer to the whole structure.  This can only be written as a
@@ -42,10 +44,10 @@ void setBlockType(sfs_block_hdr_t *blk, const char *type)
 sfs_block_hdr_t *accessBlock(block_id id)
 {
     assert(diskBlocks);
-    assert(id < diskSizeInBytes / SFS_BLOCK_SIZE);
+    assert(id < diskSizeInBytes / diskBlockSize);
     if (id == 0)
         return NULL;
-    return &diskBlocks[id].h;
+    return (sfs_block_hdr_t *)(diskBlocks + (size_t)id * diskBlockSize);
 }
 
 /** Get a pointer to the block with ID 'id', verifying that it is
@@ -71,21 +73,47 @@ sfs_block_file_t *accessFileBlock(block_id id)
     return NULL;
 }
 
+/** Get a pointer to the block with ID 'id', verifying that it is
+    a directory block.  */
+sfs_block_dir_t *accessDirBlock(block_id id)
+{
+    sfs_block_hdr_t *b = accessBlock(id);
+    if (b != NULL)
+    {
+        assert(memcmp(b->type, SFS_BLOCK_TYPE_DIR, sizeof b->type) == 0);
+        return container_of(b, sfs_block_dir_t, h);
+    }
+    return NULL;
+}
+
+/** Get a pointer to the block with ID 'id', verifying that it is
+    a packed block.  */
+sfs_block_pack_t *accessPackBlock(block_id id)
+{
+    sfs_block_hdr_t *b = accessBlock(id);
+    if (b != NULL)
+    {
+        assert(memcmp(b->type, SFS_BLOCK_TYPE_PACK, sizeof b->type) == 0);
+        return container_of(b, sfs_block_pack_t, h);
+    }
+    return NULL;
+}
+
 /** Get the block ID corresponding to any valid block pointer.  */
 block_id idOfBlock(const sfs_block_hdr_t *blk)
 {
     const char *p = (const char *)blk;
-    const char *base = (const char *)diskBlocks;
+    const char *base = diskBlocks;
     assert(base);
     assert(p >= base);
     size_t offset = (size_t)(p - base);
     assert(offset < diskSizeInBytes);
-    assert(offset % SFS_BLOCK_SIZE == 0);
-    return (block_id)(offset / SFS_BLOCK_SIZE);
+    assert(offset % diskBlockSize == 0);
+    return (block_id)(offset / diskBlockSize);
 }
 
 /** Get a pointer to the super block, which is in fact the zeroth
-    entry in the diskBlocks array. */
+    block of the disk image. */
 sfs_filesystem_t *accessSuperBlock(void)
 {
     assert(diskBlocks != NULL);
@@ -99,19 +127,244 @@ int getSFSStatus(void)
     return 0;
 }
 
+/** Get the block size of the active disk image, in bytes.  */
+uint32_t getBlockSize(void)
+{
+    assert(diskBlocks != NULL);
+    return diskBlockSize;
+}
+
+/** The flags that may be added to the version number of an image.  */
+#define SFS_DISK_FLAGS                                                         \
+    (SFS_DISK_PACKED | SFS_DISK_SHARED | SFS_DISK_CHECKSUMS |                  \
+     SFS_DISK_COMPRESSED | SFS_DISK_SPARSE)
+
+/** Get the format version of the active disk image: 1 to 4, leaving
+    out the flags that may be added to it.  */
+int getImageVersion(void)
+{
+    assert(diskBlocks != NULL);
+    return (unsigned char)accessSuperBlock()->magic[6] & ~SFS_DISK_FLAGS;
+}
+
+/** Report whether small files of the active disk image may be kept in
+    packed blocks (see SFS_DISK_PACKED).  */
+int imagePacksFiles(void)
+{
+    assert(diskBlocks != NULL);
+    return (accessSuperBlock()->magic[6] & SFS_DISK_PACKED) != 0 ||
+           getImageVersion() == 3;
+}
+
+/** Report whether the active disk image is sparse (see
+    SFS_DISK_SPARSE).  */
+int imageIsSparse(void)
+{
+    assert(diskBlocks != NULL);
+    return (accessSuperBlock()->magic[6] & SFS_DISK_SPARSE) != 0 ||
+           getImageVersion() == 4;
+}
+
+/** Report whether files of the active disk image may share chains of
+    blocks (see SFS_DISK_SHARED).  */
+int imageSharesChains(void)
+{
+    assert(diskBlocks != NULL);
+    return (accessSuperBlock()->magic[6] & SFS_DISK_SHARED) != 0;
+}
+
+/** Report whether the active disk image has a checksum table (see
+    sfs_block_checksums_t).  */
+int imageHasChecksums(void)
+{
+    assert(diskBlocks != NULL);
+    return (accessSuperBlock()->magic[6] & SFS_DISK_CHECKSUMS) != 0;
+}
+
+/** Report whether files of the active disk image may be compressed
+    (see SFS_DISK_COMPRESSED).  */
+int imageHasCompressed(void)
+{
+    assert(diskBlocks != NULL);
+    return (accessSuperBlock()->magic[6] & SFS_DISK_COMPRESSED) != 0;
+}
+
+/** Add FLAG to the version number of the active disk image, if it is
+    not there already, making a version 1 image version 2 first, and
+    flush the super block to stable storage.  Returns 0 or -EIO.  The
+    flags are added by threads holding different locks in sfs-disk.c,
+    so they take one of their own, after those.  */
+static int setImageFlag(char flag)
+{
+    static pthread_mutex_t flagLock = PTHREAD_MUTEX_INITIALIZER;
+    sfs_filesystem_t *super = accessSuperBlock();
+    int status = 0;
+    pthread_mutex_lock(&flagLock);
+    if (!(super->magic[6] & flag))
+    {
+        if (getImageVersion() == 1)
+        {
+            super->block_size = SFS_BLOCK_SIZE;
+            super->journal = 0;
+            super->summary = 0;
+            super->magic[6] = 2;
+        }
+        super->magic[6] |= flag;
+        status = syncBlocks(0, 1);
+    }
+    pthread_mutex_unlock(&flagLock);
+    return status;
+}
+
+/** Mark the active disk image as one whose files may share chains of
+    blocks, if it is not marked already, and flush the mark to stable
+    storage, so that no chain is shared before it is there.  Returns 0
+    or -EIO.  */
+int setImageShared(void)
+{
+    return setImageFlag(SFS_DISK_SHARED);
+}
+
+/** Mark the active disk image as one whose files may be compressed,
+    in the same way.  Returns 0 or -EIO.  */
+int setImageCompressed(void)
+{
+    return setImageFlag(SFS_DISK_COMPRESSED);
+}
+
+/** Get the block size recorded in a super block, or 0 if SUPER does
+    not begin a valid SFS disk image.  */
+static uint32_t blockSizeOf(const sfs_filesystem_t *super)
+{
+    if (!memcmp(super->magic, SFS_DISK_MAGIC, sizeof super->magic))
+        return SFS_BLOCK_SIZE;
+    int version = (unsigned char)super->magic[6] & ~SFS_DISK_FLAGS;
+    if (!memcmp(super->magic, SFS_DISK_MAGIC, 6) && super->magic[7] == 0 &&
+        version >= 2 && version <= 4 &&
+        SFS_VALID_BLOCK_SIZE(super->block_size))
+        return super->block_size;
+    return 0;
+}
+
+/** Finish activating a freshly mapped disk image by letting sfs-disk.c
+    build its in-memory state, with room for MAXOPENFILES "file
+    descriptors".  If that fails, the image is unmapped again and the
+    error is returned.  */
+static int activateDiskImage(unsigned int maxOpenFiles)
+{
+    int status = initDiskState(maxOpenFiles);
+    if (status < 0)
+    {
+        munmap(diskBlocks, diskSizeInBytes);
+        diskBlocks = NULL;
+        diskSizeInBytes = 0;
+        diskBlockSize = 0;
+    }
+    return status;
+}
+
+/** Flush blocks [FIRST, FIRST + N_BLOCKS) of the disk image to
+    storage, and wait for that to finish.  Returns 0 or -EIO.  */
+int syncBlocks(block_id first, uint32_t n_blocks)
+{
+    assert(diskBlocks != NULL);
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)first * diskBlockSize;
+    size_t end = start + (size_t)n_blocks * diskBlockSize;
+    assert(end <= diskSizeInBytes);
+    start -= start % pagesize;
+    if (end == start)
+        return 0;
+    if (msync(diskBlocks + start, end - start, MS_SYNC) < 0)
+        return -EIO;
+    return 0;
+}
+
+/** Tell the kernel that blocks [FIRST, FIRST + N_BLOCKS) of the disk
+    image will be wanted soon, so that it can start reading them in
+    now.  This is only a hint, so errors are ignored.  */
+void prefetchBlocks(block_id first, uint32_t n_blocks)
+{
+    assert(diskBlocks != NULL);
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)first * diskBlockSize;
+    size_t end = start + (size_t)n_blocks * diskBlockSize;
+    assert(end <= diskSizeInBytes);
+    start -= start % pagesize;
+    if (end > start)
+        madvise(diskBlocks + start, end - start, MADV_WILLNEED);
+}
+
 int sfs_format(const char *diskName, size_t diskSize)
+{
+    return sfs_format_with_options(diskName, diskSize, NULL);
+}
+
+int sfs_format_with_block_size(const char *diskName, size_t diskSize,
+                               size_t blockSize)
+{
+    sfs_format_options options = {blockSize, 0, 0, 0, 0, 0, 0};
+    return sfs_format_with_options(diskName, diskSize, &options);
+}
+
+int sfs_format_with_options(const char *diskName, size_t diskSize,
+                            const sfs_format_options *options)
 {
     // Since we mmap the disk image, its size must be a multiple of
     // the system page size, even though the format only requires it to
-    // be a multiple of SFS_BLOCK_SIZE.
+    // be a multiple of the block size.
     size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
     assert(pagesize != (size_t)-1);
     assert(pagesize % SFS_BLOCK_SIZE == 0);
 
-    if (diskSize == 0 || diskSize % pagesize != 0)
+    size_t blockSize = SFS_BLOCK_SIZE;
+    size_t journalSize = 0;
+    int summary = 0;
+    unsigned int maxOpenFiles = 0;
+    int packed = 0;
+    int sparse = 0;
+    int checksums = 0;
+    if (options != NULL)
+    {
+        if (options->block_size != 0)
+            blockSize = options->block_size;
+        journalSize = options->journal_size;
+        summary = options->change_summary != 0;
+        maxOpenFiles = options->max_open_files;
+        packed = options->packed_files != 0;
+        sparse = options->sparse != 0;
+        checksums = options->checksums != 0;
+    }
+    if (maxOpenFiles > SFS_OPEN_FILE_LIMIT_MAX)
         return -EINVAL;
-    if (diskSize > SFS_MAX_DISK_SIZE)
+
+    if (!SFS_VALID_BLOCK_SIZE(blockSize))
+        return -EINVAL;
+    if (diskSize == 0 || diskSize % pagesize != 0 || diskSize % blockSize != 0)
+        return -EINVAL;
+    if (diskSize / blockSize > UINT32_MAX)
         return -EFBIG;
+
+    // The journal has a header block, and enough blocks after it for
+    // the requested size or SFS_JOURNAL_MIN_RECORDS records, whichever
+    // is more.  At least one block must be left over for files.
+    uint64_t n_blocks = diskSize / blockSize;
+    uint64_t checksumBlocks =
+        checksums ? SFS_CHECKSUM_BLOCKS(n_blocks, blockSize) : 0;
+    uint64_t journalBlocks = 0;
+    if (journalSize != 0)
+    {
+        uint32_t perBlock = SFS_JOURNAL_RECORDS_PER_BLOCK(blockSize);
+        uint64_t minBlocks =
+            (SFS_JOURNAL_MIN_RECORDS + perBlock - 1) / perBlock;
+        journalBlocks = 1 + (journalSize + blockSize - 1) / blockSize;
+        if (journalBlocks < 1 + minBlocks)
+            journalBlocks = 1 + minBlocks;
+        if (journalSize > diskSize || journalBlocks + 2 > n_blocks)
+            return -EINVAL;
+    }
+    if (checksumBlocks + journalBlocks + (uint64_t)summary + 2 > n_blocks)
+        return -EINVAL;
     if (diskBlocks != NULL)
         return -EBUSY;
 
@@ -140,31 +393,74 @@ int sfs_format(const char *diskName, size_t diskSize)
 
     diskBlocks = mapping;
     diskSizeInBytes = diskSize;
+    diskBlockSize = (uint32_t)blockSize;
 
     // Because we opened the file with O_TRUNC and then enlarged it to the
     // desired size with ftruncate, we can be sure that every byte of the
     // file is currently '\0'.
     sfs_filesystem_t *superBlock = accessSuperBlock();
-    memcpy(superBlock->magic, SFS_DISK_MAGIC, sizeof superBlock->magic);
-
-    uint64_t n_blocks = diskSize / SFS_BLOCK_SIZE;
-    assert(n_blocks <= (uint64_t)UINT32_MAX);
-
+    int v1 = blockSize == SFS_BLOCK_SIZE && journalBlocks == 0 && !summary &&
+             !packed && !sparse && !checksums;
+    const char *magic = v1 ? SFS_DISK_MAGIC : SFS_DISK_MAGIC_V2;
+    memcpy(superBlock->magic, magic, sizeof superBlock->magic);
+    int flags = (packed ? SFS_DISK_PACKED : 0) |
+                (sparse ? SFS_DISK_SPARSE : 0) |
+                (checksums ? SFS_DISK_CHECKSUMS : 0);
+    superBlock->magic[6] = (char)(superBlock->magic[6] | flags);
+    superBlock->block_size = (uint32_t)blockSize;
     superBlock->n_blocks = (uint32_t)n_blocks;
-    superBlock->freelist = 1;
-    for (block_id idx = 1; idx < n_blocks; idx++)
+
+    // The checksum table, if any, comes first, with every entry 0,
+    // then the journal, if any, then the change summary, if any, and
+    // the free list is the rest.  In a sparse image, all of the rest is
+    // past the high-water mark, and the list starts empty.
+    block_id firstFree = 1;
+    for (block_id idx = 1; idx <= checksumBlocks; idx++)
     {
         sfs_block_hdr_t *currBlock = accessBlock(idx);
-        setBlockType(currBlock, SFS_BLOCK_TYPE_FREE);
+        setBlockType(currBlock, SFS_BLOCK_TYPE_CHECKSUM);
         currBlock->prev_block = idx - 1;
+        currBlock->next_block = idx == checksumBlocks ? 0 : idx + 1;
+    }
+    firstFree += (block_id)checksumBlocks;
+    if (journalBlocks != 0)
+    {
+        superBlock->journal = firstFree;
+        journalFormat(firstFree, (uint32_t)journalBlocks);
+        firstFree += (block_id)journalBlocks;
+    }
+    if (summary)
+    {
+        superBlock->summary = firstFree;
+        summaryFormat(firstFree);
+        firstFree++;
+    }
+    if (sparse)
+        return activateDiskImage(maxOpenFiles);
+    superBlock->freelist = firstFree;
+    for (block_id idx = firstFree; idx < n_blocks; idx++)
+    {
+        sfs_block_hdr_t *currBlock = accessBlock(idx);
+        setBlockType(currBlock, SFS_BLOCK_TYPE_FREE);
+        currBlock->prev_block = idx == firstFree ? 0 : idx - 1;
         currBlock->next_block = (idx + 1 == n_blocks) ? 0 : idx + 1;
     }
 
-    return 0;
+    return activateDiskImage(maxOpenFiles);
 }
 
 int sfs_mount(const char *diskName)
 {
+    return sfs_mount_with_options(diskName, NULL);
+}
+
+int sfs_mount_with_options(const char *diskName,
+                           const sfs_mount_options *options)
+{
+    unsigned int maxOpenFiles = options != NULL ? options->max_open_files : 0;
+    int hugePages = options != NULL && options->huge_pages != 0;
+    if (maxOpenFiles > SFS_OPEN_FILE_LIMIT_MAX)
+        return -EINVAL;
     if (diskBlocks != NULL)
         return -EBUSY;
 
@@ -181,7 +477,8 @@ int sfs_mount(const char *diskName)
     }
 
     // Block numbers are 32-bit, so the biggest supported filesystem
-    // is 2**32 * SFS_BLOCK_SIZE bytes.
+    // is 2**32 blocks of the largest size.  (The limit for the image's
+    // actual block size is checked below.)
     if (diskst.st_size > (off_t)SFS_MAX_DISK_SIZE)
     {
         close(diskfd);
@@ -190,7 +487,7 @@ int sfs_mount(const char *diskName)
 
     // Since we mmap the disk image, its size must be a multiple of
     // the system page size, even though the format only requires it to
-    // be a multiple of SFS_BLOCK_SIZE.
+    // be a multiple of the block size.
     size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
     assert(pagesize != (size_t)-1);
     assert(pagesize % SFS_BLOCK_SIZE == 0);
@@ -201,19 +498,27 @@ int sfs_mount(const char *diskName)
         return -EINVAL;
     }
 
-    char magic[sizeof SFS_DISK_MAGIC];
-    ssize_t nread = pread(diskfd, magic, sizeof magic, 0);
+    // Read just the fixed part of the super block, to check the magic
+    // number and find out the block size.
+    sfs_filesystem_t super;
+    ssize_t nread = pread(diskfd, &super, sizeof super, 0);
     if (nread < 0)
     {
         int err = -errno;
         close(diskfd);
         return err;
     }
-    if (nread != sizeof magic || memcmp(magic, SFS_DISK_MAGIC, sizeof magic))
+    uint32_t blockSize = nread == sizeof super ? blockSizeOf(&super) : 0;
+    if (blockSize == 0 || (size_t)diskst.st_size % blockSize != 0)
     {
         close(diskfd);
         return -EINVAL;
     }
+    if ((size_t)diskst.st_size / blockSize > UINT32_MAX)
+    {
+        close(diskfd);
+        return -EFBIG;
+    }
 
     void *mapping = mmap(NULL, (size_t)diskst.st_size, PROT_READ | PROT_WRITE,
                          MAP_SHARED, diskfd, 0);
@@ -224,9 +529,15 @@ int sfs_mount(const char *diskName)
         return err;
     }
     close(diskfd);
+#ifdef MADV_HUGEPAGE
+    // This is only a hint.
+    if (hugePages)
+        madvise(mapping, (size_t)diskst.st_size, MADV_HUGEPAGE);
+#endif
     diskBlocks = mapping;
     diskSizeInBytes = (size_t)diskst.st_size;
-    return 0;
+    diskBlockSize = blockSize;
+    return activateDiskImage(maxOpenFiles);
 }
 
 int sfs_unmount(void)
@@ -234,26 +545,18 @@ int sfs_unmount(void)
     if (diskBlocks == NULL)
         return 0;
 
-    /*for (int idx = 0; idx < OPEN_FILE_LIMIT; idx++)
-    {
-        if (openFileDescTable[idx] != NULL)
-        {
-            return -EBUSY;
-        }
-    }
-    // There are no live openFileDescTable entries. It _should_ be
-    // impossible for there to be any live openFileTable entries.
-    for (int idx = 0; (unsigned long)idx < FILE_COUNT_LIMIT; idx++)
-    {
-        assert(openFileTable[idx] == NULL);
-    }*/
+    int status = releaseDiskState();
+    if (status == -EBUSY)
+        return status;
 
-    size_t diskSize = accessSuperBlock()->n_blocks * SFS_BLOCK_SIZE;
+    size_t diskSize = (size_t)accessSuperBlock()->n_blocks * diskBlockSize;
     // munmap could conceivably report an I/O error.  If it does,
     // the file has been unmapped anyway (same principle as close().)
-    int status = munmap(diskBlocks, diskSize);
+    if (munmap(diskBlocks, diskSize) < 0 && status == 0)
+        status = -errno;
     diskBlocks = NULL;
     diskSizeInBytes = 0;
+    diskBlockSize = 0;
     
-    return status ? -errno : 0;
+    return status;
 }
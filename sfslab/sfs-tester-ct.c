@@ -6,18 +6,25 @@ Email: tutorcs@163.com
 #include "lua.h"
 #include "lualib.h"
 #include "sfs-api.h"
+#include "sfs-queue.h"
+#include "sfs-stress.h"
+#include "sfs-trace.h"
 #include "sfs_threads.h"
 
 #include <argp.h>
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <readline/history.h>
@@ -87,6 +94,20 @@ static int luaL_checkfd(lua_State *L, int index)
     return (int)val;
 }
 
+/// Helper: Accept an argument which is a limit on the number of open
+/// files, for disk.mount and disk.format.  If it is less than 1 or more
+/// than SFS_OPEN_FILE_LIMIT_MAX, issue an error.
+static unsigned int luaL_checkopenlimit(lua_State *L, int index)
+{
+    lua_Integer val = luaL_checkinteger(L, index);
+    if (val < 1 || val > SFS_OPEN_FILE_LIMIT_MAX)
+    {
+        luaL_argerror(L, index, "not a valid number of open files");
+        return 0;
+    }
+    return (unsigned int)val;
+}
+
 /// Helper: Return (fail, strerror(err), err) to Lua. This is the
 /// error reporting convention used by the stock 'io' library.  'fail'
 /// is an unspecified but falsey value.  Note that all integer values
@@ -115,27 +136,45 @@ static int luaL_ioerror_f(lua_State *L, int err, const char *fname)
 // The sfs-disk API is wrapped as a table of functions which is made
 // available to trace code.
 
-// disk.format(diskName, diskSize) returns an unspecified truthy value
-// on success or a failure tuple on error.
+// disk.format(diskName, diskSize, [blockSize], [journalSize],
+// [changeSummary], [maxOpenFiles], [packedFiles], [sparse],
+// [checksums]) returns an unspecified truthy value on success or a
+// failure tuple on error.  'blockSize' defaults to 512; 'journalSize'
+// defaults to 0, meaning no journal; 'changeSummary', 'packedFiles',
+// 'sparse' and 'checksums' are booleans and default to false;
+// 'maxOpenFiles' is as for disk.mount.
 static int disk_format(lua_State *L)
 {
     const char *disk = luaL_checklstring_strict(L, 1, NULL);
+    sfs_format_options options;
     size_t size = luaL_checksize(L, 2);
-
-    int result = sfs_format(disk, size);
+    options.block_size = luaL_opt(L, luaL_checksize, 3, 512);
+    options.journal_size = luaL_opt(L, luaL_checksize, 4, 0);
+    options.change_summary = lua_toboolean(L, 5);
+    options.max_open_files = luaL_opt(L, luaL_checkopenlimit, 6, 0);
+    options.packed_files = lua_toboolean(L, 7);
+    options.sparse = lua_toboolean(L, 8);
+    options.checksums = lua_toboolean(L, 9);
+
+    int result = sfs_format_with_options(disk, size, &options);
     if (result != 0)
         return luaL_ioerror_f(L, -result, disk);
     lua_pushboolean(L, 1);
     return 1;
 }
 
-// disk.mount(diskName) returns an unspecified truthy value on success
-// or a failure tuple on error.
+// disk.mount(diskName, [maxOpenFiles], [hugePages]) returns an
+// unspecified truthy value on success or a failure tuple on error.
+// 'maxOpenFiles' is the most files that can be open at once, and
+// defaults to 32; 'hugePages' is a boolean and defaults to false.
 static int disk_mount(lua_State *L)
 {
     const char *disk = luaL_checklstring_strict(L, 1, NULL);
+    sfs_mount_options options;
+    options.max_open_files = luaL_opt(L, luaL_checkopenlimit, 2, 0);
+    options.huge_pages = lua_toboolean(L, 3);
 
-    int result = sfs_mount(disk);
+    int result = sfs_mount_with_options(disk, &options);
     if (result != 0)
         return luaL_ioerror_f(L, -result, disk);
     lua_pushboolean(L, 1);
@@ -153,11 +192,18 @@ static int disk_unmount(lua_State *L)
     return 1;
 }
 
-// disk.open(fileName) returns the fd on success or a failure tuple on error.
+// disk.open(fileName, mode) returns the fd on success or a failure
+// tuple on error.  'mode' is optional; if it has "a", every write
+// through the fd goes at the end of the file (SFS_OPEN_APPEND), and if
+// it has "z", the file is kept compressed (SFS_OPEN_COMPRESS).
 static int disk_open(lua_State *L)
 {
     const char *fname = luaL_checklstring_strict(L, 1, NULL);
-    int fd = sfs_open(fname);
+    static const char *const modes[] = {"", "a", "z", "az", NULL};
+    static const int mode_flags[] = {0, SFS_OPEN_APPEND, SFS_OPEN_COMPRESS,
+                                     SFS_OPEN_APPEND | SFS_OPEN_COMPRESS};
+    int flags = mode_flags[luaL_checkoption(L, 2, "", modes)];
+    int fd = sfs_open_with_flags(fname, flags);
     if (fd < 0)
     {
         return luaL_ioerror_f(L, -fd, fname);
@@ -218,6 +264,568 @@ static int disk_write(lua_State *L)
     return 1;
 }
 
+// disk.pread(fd, maxbytes, pos) is like disk.read, but reads from
+// file position 'pos' and leaves the seek position alone.
+static int disk_pread(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    size_t maxbytes = luaL_checksize(L, 2);
+    size_t pos = luaL_checksize(L, 3);
+
+    luaL_Buffer B;
+    char *place = luaL_buffinitsize(L, &B, maxbytes);
+
+    ssize_t nread = sfs_pread(fd, place, maxbytes, pos);
+    if (nread < 0)
+    {
+        luaL_pushresultsize(&B, 0);
+        lua_pop(L, 1);
+        return luaL_ioerror(L, (int)-nread);
+    }
+
+    luaL_pushresultsize(&B, (size_t)nread);
+    return 1;
+}
+
+// disk.pwrite(fd, buf, pos) is like disk.write, but writes at file
+// position 'pos' and leaves the seek position alone.
+static int disk_pwrite(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+
+    size_t bufsiz;
+    const char *buf = luaL_checklstring_strict(L, 2, &bufsiz);
+    size_t pos = luaL_checksize(L, 3);
+
+    ssize_t nwritten = sfs_pwrite(fd, buf, bufsiz, pos);
+    if (nwritten < 0)
+    {
+        return luaL_ioerror(L, (int)-nwritten);
+    }
+
+    lua_pushinteger(L, nwritten);
+    return 1;
+}
+
+/// Helper: Check that argument INDEX is an array, and return its
+/// length as an iovec count.
+static int luaL_checkiovcnt(lua_State *L, int index)
+{
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_Unsigned n = lua_rawlen(L, index);
+    if (n > (lua_Unsigned)INT_MAX)
+    {
+        luaL_argerror(L, index, "too many buffers");
+        return 0;
+    }
+    return (int)n;
+}
+
+// disk.readv(fd, sizes) reads, in a single operation, as many bytes as
+// the integers in the array 'sizes' add up to, and returns an array of
+// strings of those sizes.  If the end of the file comes first, the
+// strings at the end of the array are shorter, or empty.  Returns a
+// failure tuple on error.
+static int disk_readv(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    int iovcnt = luaL_checkiovcnt(L, 2);
+
+    // Both the iovec array and the data buffer are userdata, so that
+    // they are freed even if we raise an error.
+    struct iovec *iov =
+        lua_newuserdatauv(L, (size_t)iovcnt * sizeof *iov, 0);
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        lua_rawgeti(L, 2, i + 1);
+        int isnum;
+        lua_Integer len = lua_tointegerx(L, -1, &isnum);
+        lua_pop(L, 1);
+        if (!isnum || len < 0 || (size_t)len > (size_t)SSIZE_MAX - total)
+            return luaL_argerror(L, 2, "sizes must be non-negative integers"
+                                       " adding up to at most SSIZE_MAX");
+        iov[i].iov_len = (size_t)len;
+        total += (size_t)len;
+    }
+    char *data = lua_newuserdatauv(L, total, 0);
+    size_t off = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        iov[i].iov_base = data + off;
+        off += iov[i].iov_len;
+    }
+
+    ssize_t nread = sfs_readv(fd, iov, iovcnt);
+    if (nread < 0)
+        return luaL_ioerror(L, (int)-nread);
+
+    lua_createtable(L, iovcnt, 0);
+    size_t left = (size_t)nread;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        size_t len = iov[i].iov_len < left ? iov[i].iov_len : left;
+        lua_pushlstring(L, iov[i].iov_base, len);
+        lua_rawseti(L, -2, i + 1);
+        left -= len;
+    }
+    return 1;
+}
+
+// disk.writev(fd, bufs) writes the strings in the array 'bufs', in
+// order, in a single operation.  Returns the number of bytes
+// successfully written, or a failure tuple.
+static int disk_writev(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    int iovcnt = luaL_checkiovcnt(L, 2);
+
+    struct iovec *iov =
+        lua_newuserdatauv(L, (size_t)iovcnt * sizeof *iov, 0);
+    // The strings stay on the stack until we are done with them, which
+    // is what guarantees that the pointers to them remain valid.
+    luaL_checkstack(L, iovcnt, "too many buffers");
+    for (int i = 0; i < iovcnt; i++)
+    {
+        lua_rawgeti(L, 2, i + 1);
+        if (lua_type(L, -1) != LUA_TSTRING)
+            return luaL_argerror(L, 2, "buffers must be strings");
+        size_t len;
+        iov[i].iov_base = (void *)lua_tolstring(L, -1, &len);
+        iov[i].iov_len = len;
+    }
+
+    ssize_t nwritten = sfs_writev(fd, iov, iovcnt);
+    if (nwritten < 0)
+    {
+        return luaL_ioerror(L, (int)-nwritten);
+    }
+
+    lua_pushinteger(L, nwritten);
+    return 1;
+}
+
+/// Iterator function for disk.spans.  Upvalue 1 is the fd, upvalue 2
+/// is the file position to continue from, and upvalue 3 is the number
+/// of bytes still wanted.
+static int disk_spans_next(lua_State *L)
+{
+    int fd = (int)lua_tointeger(L, lua_upvalueindex(1));
+    size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(2));
+    size_t left = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+
+    sfs_span span;
+    int n = sfs_borrow(fd, pos, left, &span, 1);
+    if (n < 0)
+        return luaL_error(L, "disk.spans: %s", strerror(-n));
+    if (n == 0)
+        return 0;
+
+    // Copying the span into a Lua string is unavoidable, but nothing
+    // else is copied, and only one block's worth at a time.
+    lua_pushlstring(L, span.data, span.len);
+    sfs_release(fd);
+
+    lua_pushinteger(L, (lua_Integer)(pos + span.len));
+    lua_replace(L, lua_upvalueindex(2));
+    lua_pushinteger(L, (lua_Integer)(left - span.len));
+    lua_replace(L, lua_upvalueindex(3));
+    return 1;
+}
+
+// disk.spans(fd, [pos], [len]) returns an iterator over the contents of
+// the file open on fd, from position 'pos' (default 0) for 'len' bytes
+// (default: to the end of the file), one disk block's worth of data at
+// a time, for use like
+//     for chunk in disk.spans(fd) do ... end
+// The seek position of fd is not used or changed.  The iterator raises
+// an error if the underlying sfs_borrow call fails.
+static int disk_spans(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    size_t pos = luaL_opt(L, luaL_checksize, 2, 0);
+    size_t len = luaL_opt(L, luaL_checksize, 3, (size_t)SSIZE_MAX);
+
+    lua_pushinteger(L, fd);
+    lua_pushinteger(L, (lua_Integer)pos);
+    lua_pushinteger(L, (lua_Integer)len);
+    lua_pushcclosure(L, disk_spans_next, 3);
+    return 1;
+}
+
+/// Number of worker threads in the queue used by disk.batch.
+#define BATCH_WORKERS 4
+
+/// The queue used by disk.batch is kept in the registry, one per Lua
+/// state, as a full userdata of this type, whose __gc metamethod
+/// destroys the queue.
+struct batch_queue
+{
+    sfs_queue *queue;
+    unsigned int entries;
+};
+
+static int batch_queue_gc(lua_State *L)
+{
+    struct batch_queue *bq = luaL_checkudata(L, 1, "sfs_batch_queue");
+    if (bq->queue)
+        sfs_queue_destroy(bq->queue);
+    bq->queue = NULL;
+    return 0;
+}
+
+/// Helper: Get a queue with room for at least N operations, creating
+/// it, or replacing it with a bigger one, if necessary.
+static sfs_queue *batch_get_queue(lua_State *L, unsigned int n)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, "sfs_batch_queue");
+    struct batch_queue *bq = luaL_testudata(L, -1, "sfs_batch_queue");
+    lua_pop(L, 1);
+    if (bq && bq->entries >= n)
+        return bq->queue;
+
+    unsigned int entries = bq ? bq->entries : 64;
+    while (entries < n)
+        entries = entries > UINT_MAX / 2 ? UINT_MAX : entries * 2;
+    if (bq)
+    {
+        sfs_queue_destroy(bq->queue);
+        bq->queue = NULL;
+    }
+    else
+    {
+        bq = lua_newuserdatauv(L, sizeof *bq, 0);
+        bq->queue = NULL;
+        if (luaL_newmetatable(L, "sfs_batch_queue"))
+        {
+            lua_pushcfunction(L, batch_queue_gc);
+            lua_setfield(L, -2, "__gc");
+        }
+        lua_setmetatable(L, -2);
+        lua_setfield(L, LUA_REGISTRYINDEX, "sfs_batch_queue");
+    }
+
+    int err = sfs_queue_create(&bq->queue, entries, BATCH_WORKERS);
+    if (err < 0)
+        luaL_error(L, "disk.batch: %s", strerror(-err));
+    bq->entries = entries;
+    return bq->queue;
+}
+
+/// Helper: Get the string field NAME of the table at the top of the
+/// stack, for operation I of a disk.batch call.  The string stays
+/// valid as long as the table does.
+static const char *batch_string(lua_State *L, lua_Integer i, const char *name,
+                                size_t *len)
+{
+    lua_getfield(L, -1, name);
+    if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_error(L, "disk.batch: op %d: '%s' must be a string", (int)i,
+                   name);
+    const char *s = lua_tolstring(L, -1, len);
+    lua_pop(L, 1);
+    return s;
+}
+
+/// Helper: Get the integer field NAME of the table at the top of the
+/// stack, for operation I of a disk.batch call.
+static lua_Integer batch_integer(lua_State *L, lua_Integer i,
+                                 const char *name)
+{
+    lua_getfield(L, -1, name);
+    int isnum;
+    lua_Integer val = lua_tointegerx(L, -1, &isnum);
+    if (!isnum)
+        luaL_error(L, "disk.batch: op %d: '%s' must be an integer", (int)i,
+                   name);
+    lua_pop(L, 1);
+    return val;
+}
+
+// disk.batch(ops) submits the operations in the array 'ops' as one
+// batch (see sfs-queue.h), waits for all of them to complete, and
+// returns an array of their results.  Each operation is a table with
+// an 'op' field and arguments:
+//     {op="open", name=...}            result: fd
+//     {op="close", fd=...}             result: 0
+//     {op="read", fd=..., len=...}     result: the string read
+//     {op="write", fd=..., data=...}   result: bytes written
+//     {op="remove", name=...}
+//     {op="rename", name=..., new_name=...}
+// A negative fd -k means the fd opened by the k-th operation of the
+// same batch, which must be an "open".  A failed operation's result is
+// a negative error code, not a failure tuple; a failure tuple is
+// returned only if the batch as a whole could not be submitted.
+static int disk_batch(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Unsigned count = lua_rawlen(L, 1);
+    if (count > (lua_Unsigned)INT_MAX / sizeof(sfs_sqe))
+        return luaL_argerror(L, 1, "too many operations");
+    unsigned int n = (unsigned int)count;
+
+    sfs_sqe *sqes = lua_newuserdatauv(L, n * sizeof *sqes, 0);
+    size_t total = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        lua_Integer li = (lua_Integer)i + 1;
+        lua_rawgeti(L, 1, li);
+        if (!lua_istable(L, -1))
+            return luaL_error(L, "disk.batch: op %d is not a table", (int)li);
+        sfs_sqe *s = &sqes[i];
+        memset(s, 0, sizeof *s);
+        s->user_data = i;
+
+        const char *op = batch_string(L, li, "op", NULL);
+        if (!strcmp(op, "open") || !strcmp(op, "remove"))
+        {
+            s->op = op[0] == 'o' ? SFS_OP_OPEN : SFS_OP_REMOVE;
+            s->name = batch_string(L, li, "name", NULL);
+        }
+        else if (!strcmp(op, "rename"))
+        {
+            s->op = SFS_OP_RENAME;
+            s->name = batch_string(L, li, "name", NULL);
+            s->new_name = batch_string(L, li, "new_name", NULL);
+        }
+        else if (!strcmp(op, "close") || !strcmp(op, "read") ||
+                 !strcmp(op, "write"))
+        {
+            lua_Integer fd = batch_integer(L, li, "fd");
+            if (fd < -(lua_Integer)n || fd > (lua_Integer)INT_MAX)
+                return luaL_error(L, "disk.batch: op %d: bad fd", (int)li);
+            s->fd = fd < 0 ? SFS_BATCH_FD(-fd - 1) : (int)fd;
+            if (op[0] == 'c')
+                s->op = SFS_OP_CLOSE;
+            else if (op[0] == 'w')
+            {
+                s->op = SFS_OP_WRITE;
+                // sfs_write does not modify the buffer.
+                s->buf = (char *)batch_string(L, li, "data", &s->len);
+            }
+            else
+            {
+                s->op = SFS_OP_READ;
+                lua_Integer len = batch_integer(L, li, "len");
+                if (len < 0 || (size_t)len > (size_t)SSIZE_MAX - total)
+                    return luaL_error(L, "disk.batch: op %d: bad len",
+                                      (int)li);
+                s->len = (size_t)len;
+                total += s->len;
+            }
+        }
+        else
+            return luaL_error(L, "disk.batch: op %d: unknown op '%s'",
+                              (int)li, op);
+        lua_pop(L, 1);
+    }
+
+    // All the read buffers are carved out of one userdata.
+    char *data = lua_newuserdatauv(L, total, 0);
+    size_t off = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (sqes[i].op == SFS_OP_READ)
+        {
+            sqes[i].buf = data + off;
+            off += sqes[i].len;
+        }
+    }
+    ssize_t *results = lua_newuserdatauv(L, n * sizeof *results, 0);
+    sfs_cqe *cqes = lua_newuserdatauv(L, n * sizeof *cqes, 0);
+    lua_createtable(L, (int)n, 0);
+
+    // Nothing after this point may raise an error until every
+    // completion has been collected, because the workers are using
+    // the buffers above and the strings in 'ops'.
+    sfs_queue *queue = batch_get_queue(L, n);
+    int err = sfs_queue_submit(queue, sqes, n);
+    if (err < 0)
+        return luaL_ioerror(L, -err);
+    for (unsigned int done = 0; done < n;)
+    {
+        unsigned int got = sfs_queue_poll(queue, cqes, n - done, 1);
+        for (unsigned int i = 0; i < got; i++)
+            results[cqes[i].user_data] = cqes[i].result;
+        done += got;
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (sqes[i].op == SFS_OP_READ && results[i] >= 0)
+            lua_pushlstring(L, sqes[i].buf, (size_t)results[i]);
+        else
+            lua_pushinteger(L, results[i]);
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    return 1;
+}
+
+// disk.fsync(fd) returns an unspecified truthy value on success or a
+// failure tuple on error.
+static int disk_fsync(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    int result = sfs_fsync(fd);
+    if (result != 0)
+        return luaL_ioerror(L, -result);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// disk.ftruncate(fd, len) sets the size of the file open on 'fd' to
+// 'len' bytes, zero-filling if it grows.  Returns an unspecified
+// truthy value on success or a failure tuple on error.
+static int disk_ftruncate(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    size_t len = luaL_checksize(L, 2);
+    int result = sfs_ftruncate(fd, len);
+    if (result != 0)
+        return luaL_ioerror(L, -result);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// disk.fallocate(fd, len) reserves room for the file open on 'fd' to
+// grow to 'len' bytes without changing its size.  Returns an
+// unspecified truthy value on success or a failure tuple on error.
+static int disk_fallocate(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    size_t len = luaL_checksize(L, 2);
+    int result = sfs_fallocate(fd, len);
+    if (result != 0)
+        return luaL_ioerror(L, -result);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// disk.fstat(fd) returns a table with the size, block count and
+// reserved block count of the file open on 'fd' (see sfs_file_stat in
+// sfs-api.h), or a failure tuple on error.
+static int disk_fstat(lua_State *L)
+{
+    int fd = luaL_checkfd(L, 1);
+    sfs_file_stat stat;
+    int result = sfs_fstat(fd, &stat);
+    if (result != 0)
+        return luaL_ioerror(L, -result);
+
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, (lua_Integer)stat.size);
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, (lua_Integer)stat.blocks);
+    lua_setfield(L, -2, "blocks");
+    lua_pushinteger(L, (lua_Integer)stat.reserved_blocks);
+    lua_setfield(L, -2, "reserved_blocks");
+    return 1;
+}
+
+// disk.sync() returns an unspecified truthy value on success or a
+// failure tuple on error.
+static int disk_sync(lua_State *L)
+{
+    int result = sfs_sync();
+    if (result != 0)
+        return luaL_ioerror(L, -result);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// disk.stats() returns a table of the counters kept by sfs-disk.c
+// (see sfs_stats in sfs-api.h), keyed by field name, on success, or a
+// failure tuple on error.
+static int disk_stats(lua_State *L)
+{
+    sfs_stats stats;
+    int result = sfs_get_stats(&stats);
+    if (result != 0)
+        return luaL_ioerror(L, -result);
+
+    const struct
+    {
+        const char *name;
+        uint64_t value;
+    } fields[] = {
+        {"chain_hops", stats.chain_hops},
+        {"bytes_read", stats.bytes_read},
+        {"bytes_written", stats.bytes_written},
+        {"allocations", stats.allocations},
+        {"blocks_allocated", stats.blocks_allocated},
+        {"allocation_failures", stats.allocation_failures},
+        {"blocks_freed", stats.blocks_freed},
+        {"lookups", stats.lookups},
+        {"lookup_probes", stats.lookup_probes},
+        {"readahead_blocks", stats.readahead_blocks},
+        {"checksum_failures", stats.checksum_failures},
+        {"frames_decoded", stats.frames_decoded},
+        {"frame_cache_hits", stats.frame_cache_hits},
+        {"open_fds", stats.open_fds},
+        {"fd_limit", stats.fd_limit},
+    };
+    size_t n_fields = sizeof fields / sizeof fields[0];
+    lua_createtable(L, 0, (int)n_fields);
+    for (size_t i = 0; i < n_fields; i++)
+    {
+        lua_pushinteger(L, (lua_Integer)fields[i].value);
+        lua_setfield(L, -2, fields[i].name);
+    }
+    return 1;
+}
+
+// Push a table of the fields of *STATS, keyed by field name.
+static void push_frag_stats(lua_State *L, const sfs_frag_stats *stats)
+{
+    const struct
+    {
+        const char *name;
+        uint32_t value;
+    } fields[] = {
+        {"files", stats->files},
+        {"file_blocks", stats->file_blocks},
+        {"breaks", stats->breaks},
+        {"fragmented_files", stats->fragmented_files},
+        {"free_blocks", stats->free_blocks},
+        {"free_runs", stats->free_runs},
+    };
+    size_t n_fields = sizeof fields / sizeof fields[0];
+    lua_createtable(L, 0, (int)n_fields);
+    for (size_t i = 0; i < n_fields; i++)
+    {
+        lua_pushinteger(L, (lua_Integer)fields[i].value);
+        lua_setfield(L, -2, fields[i].name);
+    }
+}
+
+// disk.fragstats() returns a table of how fragmented the mounted disk
+// is (see sfs_frag_stats in sfs-api.h), keyed by field name, on
+// success, or a failure tuple on error.
+static int disk_fragstats(lua_State *L)
+{
+    sfs_frag_stats stats;
+    int result = sfs_get_frag_stats(&stats);
+    if (result != 0)
+        return luaL_ioerror(L, -result);
+    push_frag_stats(L, &stats);
+    return 1;
+}
+
+// disk.defrag() defragments the mounted disk, and returns the number
+// of files moved and tables, as from disk.fragstats(), from before and
+// after, on success, or a failure tuple on error.
+static int disk_defrag(lua_State *L)
+{
+    sfs_frag_stats before, after;
+    int result = sfs_defrag(&before, &after);
+    if (result < 0)
+        return luaL_ioerror(L, -result);
+    lua_pushinteger(L, result);
+    push_frag_stats(L, &before);
+    push_frag_stats(L, &after);
+    return 3;
+}
+
 // disk.seek(fd, delta) returns the new seek position on success, or a
 // failure tuple.  note that delta is signed and interpreted relative
 // to the current seek position.
@@ -274,8 +882,8 @@ static int disk_rename(lua_State *L)
         lua_pushboolean(L, 1);
         return 1;
     }
-    // This is the only place where we need to report *two*
-    // names in the error message.
+    // This and disk_clone are the only places where we need to report
+    // *two* names in the error message.
     luaL_pushfail(L);
     lua_pushfstring(L, "rename(%s -> %s): %s", oldname, newname,
                     strerror(-result));
@@ -283,6 +891,26 @@ static int disk_rename(lua_State *L)
     return 3;
 }
 
+// disk.clone(srcname, dstname) returns an unspecified truthy value on
+// success or a failure tuple on error.
+static int disk_clone(lua_State *L)
+{
+    const char *srcname = luaL_checklstring_strict(L, 1, NULL);
+    const char *dstname = luaL_checklstring_strict(L, 2, NULL);
+
+    int result = sfs_clone(srcname, dstname);
+    if (result == 0)
+    {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    luaL_pushfail(L);
+    lua_pushfstring(L, "clone(%s -> %s): %s", srcname, dstname,
+                    strerror(-result));
+    lua_pushinteger(L, -result);
+    return 3;
+}
+
 // disk.list() returns an array of strings on success, or a
 // failure tuple on error.  (Done this way mainly because I do not
 // presently have the time to learn how the Lua iterator protocol
@@ -332,20 +960,389 @@ static const luaL_Reg disk_fns[] = {
     {"close", disk_close},
     {"read", disk_read},
     {"write", disk_write},
+    {"pread", disk_pread},
+    {"pwrite", disk_pwrite},
+    {"readv", disk_readv},
+    {"writev", disk_writev},
+    {"spans", disk_spans},
+    {"batch", disk_batch},
+    {"fsync", disk_fsync},
+    {"ftruncate", disk_ftruncate},
+    {"fallocate", disk_fallocate},
+    {"fstat", disk_fstat},
+    {"sync", disk_sync},
+    {"stats", disk_stats},
+    {"fragstats", disk_fragstats},
+    {"defrag", disk_defrag},
     {"seek", disk_seek},
     {"getPos", disk_getpos},
     {"remove", disk_remove},
     {"rename", disk_rename},
+    {"clone", disk_clone},
     {"list", disk_list},
     {0, 0},
 };
 
+//
+// Benchmark mode (--bench).  Each function in disk_fns is wrapped in a
+// closure that times it with the monotonic clock and adds the time to
+// a latency histogram for that function.  The counters are atomic, so
+// that functions called from several lanes at once are all counted.
+// Only the C function itself is timed, not the Lua code calling it; a
+// call that raises a Lua error (for instance, because of a bad
+// argument) is not counted at all.
+//
+
+#define NUM_DISK_FNS (sizeof disk_fns / sizeof disk_fns[0] - 1)
+
+/// Latencies are counted in buckets that are exact below
+/// BENCH_SUB_BUCKETS nanoseconds, and above that split each power of
+/// two into BENCH_SUB_BUCKETS evenly spaced buckets, so that every
+/// reported latency is within 1/BENCH_SUB_BUCKETS of the truth.
+#define BENCH_SUB_BITS 4
+#define BENCH_SUB_BUCKETS (1u << BENCH_SUB_BITS)
+#define BENCH_BUCKETS ((64 - BENCH_SUB_BITS + 1) * BENCH_SUB_BUCKETS)
+
+/// Counters for one function in disk_fns.  'bytes' is the amount of
+/// file data read or written, for the functions that do that.
+struct bench_counters
+{
+    atomic_uint_fast64_t calls;
+    atomic_uint_fast64_t failures;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t buckets[BENCH_BUCKETS];
+};
+
+static int bench_enabled;
+static FILE *bench_output;
+static uint64_t bench_start_ns;
+static struct bench_counters bench_counters[NUM_DISK_FNS];
+static pthread_mutex_t bench_report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/// Helper: The histogram bucket that a latency of NS nanoseconds goes in.
+static unsigned int bench_bucket(uint64_t ns)
+{
+    if (ns < BENCH_SUB_BUCKETS)
+        return (unsigned int)ns;
+    unsigned int log2 = 63 - (unsigned int)__builtin_clzll(ns);
+    unsigned int sub = (unsigned int)(ns >> (log2 - BENCH_SUB_BITS)) &
+                       (BENCH_SUB_BUCKETS - 1);
+    return (log2 - BENCH_SUB_BITS + 1) * BENCH_SUB_BUCKETS + sub;
+}
+
+/// Helper: The smallest latency that goes in bucket B.
+static uint64_t bench_bucket_floor(unsigned int b)
+{
+    if (b < BENCH_SUB_BUCKETS)
+        return b;
+    unsigned int log2 = b / BENCH_SUB_BUCKETS + BENCH_SUB_BITS - 1;
+    uint64_t mantissa = BENCH_SUB_BUCKETS + b % BENCH_SUB_BUCKETS;
+    return mantissa << (log2 - BENCH_SUB_BITS);
+}
+
+/// Helper: The largest latency that goes in bucket B.
+static uint64_t bench_bucket_ceiling(unsigned int b)
+{
+    return b + 1 < BENCH_BUCKETS ? bench_bucket_floor(b + 1) - 1 : UINT64_MAX;
+}
+
+/// Helper: Whether the function called NAME reads or writes file data,
+/// and so counts bytes.  Those functions return the data read, as a
+/// string or an array of strings, or the number of bytes written.
+static int bench_counts_bytes(const char *name)
+{
+    static const char *const data_fns[] = {
+        "read", "write", "pread", "pwrite", "readv", "writev", NULL};
+    for (int i = 0; data_fns[i]; i++)
+    {
+        if (!strcmp(name, data_fns[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/// Helper: The number of bytes of file data described by the value at
+/// INDEX, which was returned by a function that counts bytes.
+static uint64_t bench_bytes(lua_State *L, int index)
+{
+    switch (lua_type(L, index))
+    {
+    case LUA_TSTRING:
+        return lua_rawlen(L, index);
+    case LUA_TNUMBER:
+    {
+        lua_Integer n = lua_tointeger(L, index);
+        return n > 0 ? (uint64_t)n : 0;
+    }
+    case LUA_TTABLE:
+    {
+        uint64_t total = 0;
+        lua_Integer n = (lua_Integer)lua_rawlen(L, index);
+        for (lua_Integer i = 1; i <= n; i++)
+        {
+            if (lua_rawgeti(L, index, i) == LUA_TSTRING)
+                total += lua_rawlen(L, -1);
+            lua_pop(L, 1);
+        }
+        return total;
+    }
+    default:
+        return 0;
+    }
+}
+
+/// Helper: Call function I of disk_fns, and count the call in its
+/// benchmark counters.  Returns what the function returns.
+static int bench_timed_call(lua_State *L, size_t i)
+{
+    uint64_t start = monotonic_ns();
+    int nresults = disk_fns[i].func(L);
+    uint64_t ns = monotonic_ns() - start;
+
+    struct bench_counters *c = &bench_counters[i];
+    int first = lua_gettop(L) - nresults + 1;
+    atomic_fetch_add_explicit(&c->calls, 1, memory_order_relaxed);
+    // Every failure is reported with a failure tuple.
+    if (nresults > 1 && lua_isnil(L, first))
+        atomic_fetch_add_explicit(&c->failures, 1, memory_order_relaxed);
+    else if (nresults > 0 && bench_counts_bytes(disk_fns[i].name))
+        atomic_fetch_add_explicit(&c->bytes, bench_bytes(L, first),
+                                  memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->buckets[bench_bucket(ns)], 1,
+                              memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&c->max_ns, memory_order_relaxed);
+    while (ns > max &&
+           !atomic_compare_exchange_weak_explicit(
+               &c->max_ns, &max, ns, memory_order_relaxed,
+               memory_order_relaxed))
+        ;
+    return nresults;
+}
+
+/// The closure that stands in for a function in disk_fns in benchmark
+/// mode.  Upvalue 1 is the function's index in disk_fns.
+static int bench_call(lua_State *L)
+{
+    return bench_timed_call(L, (size_t)lua_tointeger(L, lua_upvalueindex(1)));
+}
+
+/// Helper: The latency that at least FRACTION of the CALLS calls whose
+/// histogram is BUCKETS took no longer than.
+static uint64_t bench_percentile(const uint64_t *buckets, uint64_t calls,
+                                 double fraction)
+{
+    uint64_t wanted = (uint64_t)(fraction * (double)calls);
+    if (wanted == 0)
+        wanted = 1;
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < BENCH_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen >= wanted)
+            return bench_bucket_ceiling(b);
+    }
+    return UINT64_MAX;
+}
+
+/// Write the counters for every function that has been called so far,
+/// as CSV, to the benchmark output.  The counts are all since the
+/// program started, so the last report covers the whole run.  The
+/// header is written before the first report.
+static void bench_report(void)
+{
+    static int header_written;
+    static uint64_t buckets[BENCH_BUCKETS];
+
+    pthread_mutex_lock(&bench_report_lock);
+    double elapsed = (double)(monotonic_ns() - bench_start_ns) / 1e9;
+    if (!header_written)
+    {
+        fputs("elapsed_s,op,calls,failures,ops_per_s,bytes,mb_per_s,"
+              "mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n",
+              bench_output);
+        header_written = 1;
+    }
+    for (size_t i = 0; i < NUM_DISK_FNS; i++)
+    {
+        struct bench_counters *c = &bench_counters[i];
+        // Read the histogram first, so that 'calls' is never less than
+        // its total.
+        uint64_t in_buckets = 0;
+        for (unsigned int b = 0; b < BENCH_BUCKETS; b++)
+        {
+            buckets[b] = atomic_load_explicit(&c->buckets[b],
+                                              memory_order_relaxed);
+            in_buckets += buckets[b];
+        }
+        if (in_buckets == 0)
+            continue;
+        uint64_t calls = atomic_load_explicit(&c->calls, memory_order_relaxed);
+        uint64_t bytes = atomic_load_explicit(&c->bytes, memory_order_relaxed);
+        uint64_t total_ns =
+            atomic_load_explicit(&c->total_ns, memory_order_relaxed);
+        fprintf(bench_output,
+                "%.3f,%s,%" PRIu64 ",%" PRIu64 ",%.1f,%" PRIu64 ",%.3f,"
+                "%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                "\n",
+                elapsed, disk_fns[i].name, calls,
+                (uint64_t)atomic_load_explicit(&c->failures,
+                                               memory_order_relaxed),
+                elapsed > 0 ? (double)calls / elapsed : 0.0, bytes,
+                elapsed > 0 ? (double)bytes / 1e6 / elapsed : 0.0,
+                total_ns / calls,
+                bench_percentile(buckets, in_buckets, 0.5),
+                bench_percentile(buckets, in_buckets, 0.99),
+                bench_percentile(buckets, in_buckets, 0.999),
+                (uint64_t)atomic_load_explicit(&c->max_ns,
+                                               memory_order_relaxed));
+    }
+    fflush(bench_output);
+    pthread_mutex_unlock(&bench_report_lock);
+}
+
+//
+// Record mode (--record).  Each function in disk_fns that sfs-trace.h
+// has an op for is wrapped in a closure that calls it, timed as in
+// benchmark mode if that is on too, and then appends a record of the
+// call, its arguments and its result to the trace, for sfs-replay to
+// play back.  As in benchmark mode, a call that raises a Lua error is
+// not recorded.
+//
+
+static sfs_trace_writer *record_writer;
+
+/// Helper: Encode argument INDEX, of the NARGS that a recorded function
+/// was called with, into BUF, as an argument of kind KIND (see
+/// sfs_trace_op_args).  The call has returned, so the argument is of
+/// the type the function wanted, or missing if it is optional.  Nothing
+/// past NARGS may be looked at, because the function's results are
+/// there now.
+static void record_arg(lua_State *L, int index, int nargs, char kind,
+                       sfs_trace_buf *buf)
+{
+    int type = index <= nargs ? lua_type(L, index) : LUA_TNONE;
+    switch (kind)
+    {
+    case 'n':
+    case 'd':
+    {
+        size_t len = 0;
+        const char *str = "";
+        if (type == LUA_TSTRING)
+            str = lua_tolstring(L, index, &len);
+        if (kind == 'n')
+            sfs_trace_put_string(buf, str, len);
+        else
+            sfs_trace_put_uint(buf, len);
+        break;
+    }
+    case 'b':
+        sfs_trace_put_uint(buf, type != LUA_TNONE && lua_toboolean(L, index));
+        break;
+    case 'o':
+        sfs_trace_put_uint(buf, type == LUA_TNUMBER
+                                    ? (uint64_t)lua_tointeger(L, index) + 1
+                                    : 0);
+        break;
+    case 's':
+        sfs_trace_put_int(buf, lua_tointeger(L, index));
+        break;
+    case 'l':
+    case 'v':
+    {
+        lua_Integer n = (lua_Integer)lua_rawlen(L, index);
+        sfs_trace_put_uint(buf, (uint64_t)n);
+        for (lua_Integer i = 1; i <= n; i++)
+        {
+            lua_rawgeti(L, index, i);
+            sfs_trace_put_uint(buf, kind == 'l'
+                                        ? (uint64_t)lua_tointeger(L, -1)
+                                        : lua_rawlen(L, -1));
+            lua_pop(L, 1);
+        }
+        break;
+    }
+    default:
+        sfs_trace_put_uint(buf, (uint64_t)lua_tointeger(L, index));
+        break;
+    }
+}
+
+/// The closure that stands in for a recorded function in disk_fns in
+/// record mode.  Upvalue 1 is the function's index in disk_fns, and
+/// upvalue 2 its op in sfs-trace.h.
+static int record_call(lua_State *L)
+{
+    size_t i = (size_t)lua_tointeger(L, lua_upvalueindex(1));
+    sfs_trace_op op = (sfs_trace_op)lua_tointeger(L, lua_upvalueindex(2));
+    int nargs = lua_gettop(L);
+
+    uint64_t start = monotonic_ns();
+    int nresults = bench_enabled ? bench_timed_call(L, i) : disk_fns[i].func(L);
+    uint64_t ns = monotonic_ns() - start;
+
+    // The result is counted the same way as bytes are in benchmark
+    // mode, which gives the integer returned, or the total length of
+    // the strings; see sfs_trace_record.
+    int first = lua_gettop(L) - nresults + 1;
+    int64_t result = 0;
+    if (nresults > 1 && lua_isnil(L, first))
+        result = -(int64_t)lua_tointeger(L, first + 2);
+    else if (nresults > 0)
+        result = (int64_t)bench_bytes(L, first);
+
+    sfs_trace_buf args;
+    sfs_trace_buf_init(&args);
+    const char *kinds = sfs_trace_op_args[op];
+    for (int a = 0; kinds[a]; a++)
+        record_arg(L, a + 1, nargs, kinds[a], &args);
+    sfs_trace_append(record_writer, op, start, ns, result, &args);
+    sfs_trace_buf_free(&args);
+    return nresults;
+}
+
 // This must be separate from init_lua so that we can make the "disk"
 // table available via "require", which is necessary for it to be
-// available in lane functions.
+// available in lane functions.  In benchmark mode, the table holds
+// bench_call closures instead of the functions themselves, and in
+// record mode, record_call closures for the functions that are
+// recorded.
 static int luaopen_disk(lua_State *L)
 {
-    luaL_newlib(L, disk_fns);
+    if (!bench_enabled && !record_writer)
+    {
+        luaL_newlib(L, disk_fns);
+        return 1;
+    }
+    lua_createtable(L, 0, (int)NUM_DISK_FNS);
+    for (size_t i = 0; i < NUM_DISK_FNS; i++)
+    {
+        int op = record_writer ? sfs_trace_op_by_name(disk_fns[i].name) : -1;
+        if (op >= 0)
+        {
+            lua_pushinteger(L, (lua_Integer)i);
+            lua_pushinteger(L, op);
+            lua_pushcclosure(L, record_call, 2);
+        }
+        else if (bench_enabled)
+        {
+            lua_pushinteger(L, (lua_Integer)i);
+            lua_pushcclosure(L, bench_call, 1);
+        }
+        else
+            lua_pushcfunction(L, disk_fns[i].func);
+        lua_setfield(L, -2, disk_fns[i].name);
+    }
     return 1;
 }
 
@@ -370,6 +1367,9 @@ static void init_lua(lua_State *L)
     // load the disk functions
     luaL_requiref(L, "disk", luaopen_disk, 1);
 
+    // load the stress-test driver, which uses them; see sfs-stress.c
+    luaL_requiref(L, "stress", luaopen_stress, 1);
+
     // Restart the garbage collector and enable generational collection.
     // (It was stopped in main, immediately after invoking luaL_newstate.)
     lua_gc(L, LUA_GCRESTART);
@@ -580,6 +1580,10 @@ struct command_line_args
     unsigned int verbose;
     const char *trace;
     const char *logfile;
+    int bench;
+    const char *bench_file;
+    unsigned int bench_interval;
+    const char *record_file;
 };
 
 // Main body of interpreter, called by main via lua_pcall.  Arguments
@@ -646,6 +1650,15 @@ static const struct argp_option command_line_options[] = {
     {"verbose", 'v', 0, 0,
      "Describe progress of the trace (repeat for even more detail)", 0},
     {"logfile", 'l', "LOG", 0, "Writes standard error to logfile", 0},
+    {"bench", 'b', "FILE", OPTION_ARG_OPTIONAL,
+     "Time every disk.* call and write a CSV report of throughput and"
+     " latency to FILE (default: standard error) when the trace ends",
+     0},
+    {"bench-interval", 'B', "SECONDS", 0,
+     "With --bench, also write a report every SECONDS seconds", 0},
+    {"record", 'r', "FILE", 0,
+     "Write a binary trace of every disk.* call to FILE, for sfs-replay",
+     0},
     {0, 0, 0, 0, 0, 0}};
 
 static int command_line_parse_1(int key, char *arg, struct argp_state *state)
@@ -676,6 +1689,24 @@ static int command_line_parse_1(int key, char *arg, struct argp_state *state)
     case 'l':
         pargs->logfile = arg;
         return 0;
+    case 'b':
+        pargs->bench = 1;
+        pargs->bench_file = arg;
+        return 0;
+    case 'B':
+    {
+        char *endp;
+        unsigned long val = strtoul(arg, &endp, 10);
+        if (val == 0 || val > UINT_MAX || endp == arg || *endp)
+        {
+            argp_error(state, "invalid report interval '%s'", arg);
+        }
+        pargs->bench_interval = (unsigned int)val;
+        return 0;
+    }
+    case 'r':
+        pargs->record_file = arg;
+        return 0;
     case ARGP_KEY_ARG:
         if (pargs->trace)
         {
@@ -684,6 +1715,10 @@ static int command_line_parse_1(int key, char *arg, struct argp_state *state)
         pargs->trace = arg;
         return 0;
     case ARGP_KEY_END:
+        if (pargs->bench_interval && !pargs->bench)
+        {
+            argp_error(state, "--bench-interval requires --bench");
+        }
         if (pargs->trace == NULL)
         {
             // If we're running an interactive interpreter, turn off
@@ -725,6 +1760,10 @@ static void command_line_parse(struct command_line_args *args, int argc,
     args->verbose = 0;    // quiet
     args->trace = NULL;   // backstop
     args->logfile = NULL; // backstop
+    args->bench = 0;          // no benchmarking
+    args->bench_file = NULL;  // standard error
+    args->bench_interval = 0; // report only at the end
+    args->record_file = NULL; // no recording
 
     int err = argp_parse(&command_line_spec, argc, argv, 0, 0, args);
     if (err)
@@ -758,6 +1797,7 @@ struct signal_thread_args
 {
     sigset_t exit_signals;
     unsigned int test_timeout;
+    unsigned int report_interval;
 };
 
 /// The signal-handling thread procedure.  The sole purpose of this
@@ -770,32 +1810,53 @@ struct signal_thread_args
 /// figure out a sane way to do that.  (I do not trust Lanes'
 /// cancellation mechanism, I think it might be playing fast and loose
 /// with the rules for pthreads.)
+///
+/// In benchmark mode, this thread also writes the periodic reports
+/// asked for with --bench-interval, and a last report before giving
+/// up on the test.
 static void *signal_threadproc(void *argp)
 {
     struct signal_thread_args *args = argp;
     pthread_detach(pthread_self());
 
+    uint64_t now = monotonic_ns();
+    uint64_t deadline = now + args->test_timeout * (uint64_t)1000000000u;
+    uint64_t interval = args->report_interval * (uint64_t)1000000000u;
+    uint64_t next_report = now + interval;
+
     int sig;
-    struct timespec timeout;
-    struct timespec *timeoutp;
-    if (args->test_timeout)
-    {
-        timeout.tv_sec = args->test_timeout;
-        timeout.tv_nsec = 0;
-        timeoutp = &timeout;
-    }
-    else
+    for (;;)
     {
-        timeoutp = NULL;
-    }
+        struct timespec timeout;
+        struct timespec *timeoutp = NULL;
+        uint64_t wake = args->test_timeout ? deadline : UINT64_MAX;
+        int reporting = interval && next_report < wake;
+        if (reporting)
+            wake = next_report;
+        if (wake != UINT64_MAX)
+        {
+            now = monotonic_ns();
+            uint64_t wait = wake > now ? wake - now : 0;
+            timeout.tv_sec = (time_t)(wait / 1000000000u);
+            timeout.tv_nsec = (long)(wait % 1000000000u);
+            timeoutp = &timeout;
+        }
 
-    // This loop is needed because ptrace-generated SIGTRAPs will
-    // cause sigtimedwait to return -1/EINTR.  Without it, the program
-    // would crash immediately upon continuing from a gdb breakpoint.
-    do
-    {
         sig = sigtimedwait(&args->exit_signals, NULL, timeoutp);
-    } while (sig == -1 && errno == EINTR);
+        // This check is needed because ptrace-generated SIGTRAPs will
+        // cause sigtimedwait to return -1/EINTR.  Without it, the
+        // program would crash immediately upon continuing from a gdb
+        // breakpoint.
+        if (sig == -1 && errno == EINTR)
+            continue;
+        if (sig == -1 && errno == EAGAIN && reporting)
+        {
+            bench_report();
+            next_report += interval;
+            continue;
+        }
+        break;
+    }
 
     if (sig == -1 && errno == EAGAIN)
     {
@@ -810,6 +1871,12 @@ static void *signal_threadproc(void *argp)
         fprintf(stderr, "Received signal (%s).", strsignal(sig));
     }
     fputs("  Abandoning test.\n", stderr);
+    if (bench_enabled)
+        bench_report();
+    // exit() would flush the trace's stream too, but not say whether
+    // that worked.
+    if (record_writer && sfs_trace_flush(record_writer) < 0)
+        fputs("The trace could not be written.\n", stderr);
 
     exit(19);
 }
@@ -820,10 +1887,12 @@ static void *signal_threadproc(void *argp)
 /// first call to any Lua API function.
 ///
 /// The 'test_timeout' argument is how long, in seconds, to allow
-/// the test to run before giving up on it.
+/// the test to run before giving up on it, and 'report_interval' is
+/// how often, in seconds, to write a benchmark report, or 0.
 ///
 /// If any error occurs during setup, the process will be terminated.
-static void init_signals(unsigned int test_timeout)
+static void init_signals(unsigned int test_timeout,
+                         unsigned int report_interval)
 {
     // We must not block any of the _synchronous_ signals, nor any
     // of the blockable signals that stop the entire process.
@@ -877,6 +1946,7 @@ static void init_signals(unsigned int test_timeout)
         exit(1);
     }
     args->test_timeout = test_timeout;
+    args->report_interval = report_interval;
     sigemptyset(&args->exit_signals);
     for (int i = 0; clean_shutdown_signals[i]; i++)
     {
@@ -908,7 +1978,28 @@ int ct_orig_main(int argc, char **argv)
 {
     struct command_line_args args;
     command_line_parse(&args, argc, argv);
-    init_signals(args.timeout);
+    if (args.bench)
+    {
+        bench_output = stderr;
+        if (args.bench_file && !(bench_output = fopen(args.bench_file, "w")))
+        {
+            perror(args.bench_file);
+            return 1;
+        }
+        bench_enabled = 1;
+        bench_start_ns = monotonic_ns();
+    }
+    if (args.record_file)
+    {
+        int err = sfs_trace_create(&record_writer, args.record_file,
+                                   monotonic_ns());
+        if (err < 0)
+        {
+            fprintf(stderr, "%s: %s\n", args.record_file, strerror(-err));
+            return 1;
+        }
+    }
+    init_signals(args.timeout, args.bench_interval);
 
     lua_State *L = luaL_newstate();
     if (!L)
@@ -926,6 +2017,18 @@ int ct_orig_main(int argc, char **argv)
         fprintf(stderr, "%s: %s\n", argv[0], msg);
         lua_pop(L, 1);
     }
+    if (bench_enabled)
+        bench_report();
     lua_close(L);
+    // Lanes may make calls until lua_close has waited for them.
+    if (record_writer)
+    {
+        int err = sfs_trace_close(record_writer);
+        if (err < 0)
+        {
+            fprintf(stderr, "%s: %s\n", args.record_file, strerror(-err));
+            status = LUA_ERRRUN;
+        }
+    }
     return (status == LUA_OK) ? 0 : 1;
 }
@@ -0,0 +1,498 @@
+//
+// SFS Trace - writing and reading the binary traces of sfs-tester
+//
+// The format is described in sfs-trace.h.  A writer holds a stdio
+//   stream with a large buffer and a lock; each thread encodes the
+//   arguments of its call into a buffer of its own, and then, holding
+//   the lock, encodes the fixed part of the record and writes both, so
+//   that records are never interleaved and the file is in the order
+//   that the calls were appended.  Threads are numbered under the same
+//   lock, the first time each appends, so that a thread's number is
+//   never greater than the number of threads seen before it.
+//
+// Loading reads the whole file into memory and decodes it in two
+//   passes: the first only checks it and counts the records, arguments
+//   and array entries, so that the second can decode into arrays of
+//   exactly the right size, which are then never moved.  Strings are
+//   left where they are in the file, which has a NUL after each.
+//
+
+#include "sfs-trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/** The first bytes of every trace.  */
+static const char traceMagic[8] = {'S', 'F', 'S', 'T', 'R', 'A', 'C', 'E'};
+
+/** How much the writer buffers before writing to the file.  */
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+const char *const sfs_trace_op_names[SFS_TRACE_N_OPS] = {
+    [SFS_TRACE_FORMAT] = "format",   [SFS_TRACE_MOUNT] = "mount",
+    [SFS_TRACE_UNMOUNT] = "unmount", [SFS_TRACE_OPEN] = "open",
+    [SFS_TRACE_CLOSE] = "close",     [SFS_TRACE_READ] = "read",
+    [SFS_TRACE_WRITE] = "write",     [SFS_TRACE_PREAD] = "pread",
+    [SFS_TRACE_PWRITE] = "pwrite",   [SFS_TRACE_READV] = "readv",
+    [SFS_TRACE_WRITEV] = "writev",   [SFS_TRACE_FSYNC] = "fsync",
+    [SFS_TRACE_FTRUNCATE] = "ftruncate",
+    [SFS_TRACE_FALLOCATE] = "fallocate",
+    [SFS_TRACE_FSTAT] = "fstat",     [SFS_TRACE_SYNC] = "sync",
+    [SFS_TRACE_DEFRAG] = "defrag",   [SFS_TRACE_SEEK] = "seek",
+    [SFS_TRACE_GETPOS] = "getPos",   [SFS_TRACE_REMOVE] = "remove",
+    [SFS_TRACE_RENAME] = "rename",   [SFS_TRACE_CLONE] = "clone",
+    [SFS_TRACE_LIST] = "list",
+};
+
+const char *const sfs_trace_op_args[SFS_TRACE_N_OPS] = {
+    [SFS_TRACE_FORMAT] = "nuoobobbb", [SFS_TRACE_MOUNT] = "nob",
+    [SFS_TRACE_UNMOUNT] = "",         [SFS_TRACE_OPEN] = "nn",
+    [SFS_TRACE_CLOSE] = "f",          [SFS_TRACE_READ] = "fo",
+    [SFS_TRACE_WRITE] = "fd",         [SFS_TRACE_PREAD] = "fuu",
+    [SFS_TRACE_PWRITE] = "fdu",       [SFS_TRACE_READV] = "fl",
+    [SFS_TRACE_WRITEV] = "fv",        [SFS_TRACE_FSYNC] = "f",
+    [SFS_TRACE_FTRUNCATE] = "fu",     [SFS_TRACE_FALLOCATE] = "fu",
+    [SFS_TRACE_FSTAT] = "f",          [SFS_TRACE_SYNC] = "",
+    [SFS_TRACE_DEFRAG] = "",          [SFS_TRACE_SEEK] = "fs",
+    [SFS_TRACE_GETPOS] = "f",         [SFS_TRACE_REMOVE] = "n",
+    [SFS_TRACE_RENAME] = "nn",        [SFS_TRACE_CLONE] = "nn",
+    [SFS_TRACE_LIST] = "",
+};
+
+int sfs_trace_op_by_name(const char *name)
+{
+    for (int op = 0; op < SFS_TRACE_N_OPS; op++)
+    {
+        if (!strcmp(name, sfs_trace_op_names[op]))
+            return op;
+    }
+    return -1;
+}
+
+void sfs_trace_buf_init(sfs_trace_buf *buf)
+{
+    buf->data = buf->inline_data;
+    buf->len = 0;
+    buf->cap = sizeof buf->inline_data;
+    buf->failed = 0;
+}
+
+void sfs_trace_buf_free(sfs_trace_buf *buf)
+{
+    if (buf->data != buf->inline_data)
+        free(buf->data);
+    sfs_trace_buf_init(buf);
+}
+
+/** Make room in BUF for N more bytes.  Returns 0, or -1 if there is no
+    memory for them, in which case BUF is marked as failed.  */
+static int reserveBytes(sfs_trace_buf *buf, size_t n)
+{
+    if (buf->failed)
+        return -1;
+    if (buf->cap - buf->len >= n)
+        return 0;
+    size_t cap = buf->cap;
+    while (cap - buf->len < n)
+    {
+        if (cap > SIZE_MAX / 2)
+        {
+            buf->failed = 1;
+            return -1;
+        }
+        cap *= 2;
+    }
+    unsigned char *data = malloc(cap);
+    if (data == NULL)
+    {
+        buf->failed = 1;
+        return -1;
+    }
+    memcpy(data, buf->data, buf->len);
+    if (buf->data != buf->inline_data)
+        free(buf->data);
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+void sfs_trace_put_uint(sfs_trace_buf *buf, uint64_t value)
+{
+    // A 64-bit number takes at most ten bytes.
+    if (reserveBytes(buf, 10) < 0)
+        return;
+    while (value >= 0x80)
+    {
+        buf->data[buf->len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf->data[buf->len++] = (unsigned char)value;
+}
+
+void sfs_trace_put_int(sfs_trace_buf *buf, int64_t value)
+{
+    uint64_t zigzag = (uint64_t)value << 1;
+    sfs_trace_put_uint(buf, value < 0 ? ~zigzag : zigzag);
+}
+
+void sfs_trace_put_string(sfs_trace_buf *buf, const char *str, size_t len)
+{
+    sfs_trace_put_uint(buf, len);
+    if (len == SIZE_MAX || reserveBytes(buf, len + 1) < 0)
+        return;
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len++] = '\0';
+}
+
+struct sfs_trace_writer
+{
+    FILE *file;
+    char *file_buffer;
+    uint64_t start_ns;
+    unsigned int n_threads;
+    int error; /**< the first error, or 0 */
+    pthread_mutex_t lock;
+};
+
+/** The calling thread's number, plus one so that zero means it has not
+    appended yet, and when its last call started.  */
+static _Thread_local unsigned int threadNumber;
+static _Thread_local uint64_t threadLastStart;
+
+int sfs_trace_create(sfs_trace_writer **writer_out, const char *path,
+                     uint64_t start_ns)
+{
+    sfs_trace_writer *w = malloc(sizeof *w);
+    char *file_buffer = malloc(WRITE_BUFFER_SIZE);
+    if (w == NULL || file_buffer == NULL)
+    {
+        free(w);
+        free(file_buffer);
+        return -ENOMEM;
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        int err = errno;
+        free(w);
+        free(file_buffer);
+        return -err;
+    }
+    setvbuf(file, file_buffer, _IOFBF, WRITE_BUFFER_SIZE);
+
+    sfs_trace_buf head;
+    sfs_trace_buf_init(&head);
+    memcpy(head.data, traceMagic, sizeof traceMagic);
+    head.len = sizeof traceMagic;
+    sfs_trace_put_uint(&head, SFS_TRACE_VERSION);
+    fwrite(head.data, 1, head.len, file);
+
+    w->file = file;
+    w->file_buffer = file_buffer;
+    w->start_ns = start_ns;
+    w->n_threads = 0;
+    w->error = 0;
+    pthread_mutex_init(&w->lock, NULL);
+    *writer_out = w;
+    return 0;
+}
+
+void sfs_trace_append(sfs_trace_writer *writer, sfs_trace_op op,
+                      uint64_t start_ns, uint64_t duration_ns,
+                      int64_t result, const sfs_trace_buf *args)
+{
+    pthread_mutex_lock(&writer->lock);
+    if (args->failed)
+    {
+        if (writer->error == 0)
+            writer->error = -ENOMEM;
+        pthread_mutex_unlock(&writer->lock);
+        return;
+    }
+    if (threadNumber == 0)
+    {
+        threadNumber = ++writer->n_threads;
+        threadLastStart = writer->start_ns;
+    }
+    // A call that started before the trace did counts as starting
+    // with it.
+    uint64_t last = threadLastStart;
+    if (start_ns < last)
+        start_ns = last;
+    threadLastStart = start_ns;
+
+    sfs_trace_buf head;
+    sfs_trace_buf_init(&head);
+    head.data[head.len++] = (unsigned char)op;
+    sfs_trace_put_uint(&head, threadNumber - 1);
+    sfs_trace_put_uint(&head, start_ns - last);
+    sfs_trace_put_uint(&head, duration_ns);
+    sfs_trace_put_int(&head, result);
+    fwrite(head.data, 1, head.len, writer->file);
+    fwrite(args->data, 1, args->len, writer->file);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+int sfs_trace_flush(sfs_trace_writer *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    if (fflush(writer->file) != 0 || ferror(writer->file))
+    {
+        if (writer->error == 0)
+            writer->error = errno ? -errno : -EIO;
+    }
+    int err = writer->error;
+    pthread_mutex_unlock(&writer->lock);
+    return err;
+}
+
+int sfs_trace_close(sfs_trace_writer *writer)
+{
+    int err = sfs_trace_flush(writer);
+    if (fclose(writer->file) != 0 && err == 0)
+        err = -errno;
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->file_buffer);
+    free(writer);
+    return err;
+}
+
+/** The state of decoding a trace.  'bad' is set, and everything after
+    reads as zero, once anything runs past the end.  When 'filling' is
+    false, records are only checked and counted.  */
+typedef struct sfs_trace_decoder_t
+{
+    const unsigned char *p;
+    const unsigned char *end;
+    int bad;
+    int filling;
+    sfs_trace *trace;
+    uint64_t *last_start; /**< per thread */
+    unsigned int n_threads;
+    size_t n_records;
+    size_t n_args;
+    size_t n_lists;
+} sfs_trace_decoder_t;
+
+static uint64_t getUint(sfs_trace_decoder_t *d)
+{
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+        if (d->p == d->end)
+            break;
+        unsigned char b = *d->p++;
+        value |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return value;
+    }
+    d->bad = 1;
+    return 0;
+}
+
+static int64_t getInt(sfs_trace_decoder_t *d)
+{
+    uint64_t zigzag = getUint(d);
+    return (int64_t)((zigzag >> 1) ^ -(zigzag & 1));
+}
+
+/** Decode a string, and return it, or NULL if it is damaged.  */
+static const char *getString(sfs_trace_decoder_t *d, int64_t *len)
+{
+    uint64_t n = getUint(d);
+    if (d->bad || n >= (uint64_t)(d->end - d->p) || d->p[n] != '\0')
+    {
+        d->bad = 1;
+        return NULL;
+    }
+    const char *str = (const char *)d->p;
+    d->p += n + 1;
+    *len = (int64_t)n;
+    return str;
+}
+
+/** Decode an argument of kind KIND (see sfs_trace_op_args) into *A.
+    Returns 0, or -EBADMSG if it is damaged.  */
+static int decodeArg(sfs_trace_decoder_t *d, char kind, sfs_trace_arg *a)
+{
+    uint64_t n;
+    a->present = 1;
+    switch (kind)
+    {
+    case 'o':
+        n = getUint(d);
+        a->present = n != 0;
+        a->value = n != 0 ? (int64_t)(n - 1) : 0;
+        break;
+    case 's':
+        a->value = getInt(d);
+        break;
+    case 'n':
+        a->str = getString(d, &a->value);
+        break;
+    case 'l':
+    case 'v':
+        n = getUint(d);
+        // Every entry takes at least a byte.
+        if (n > (uint64_t)(d->end - d->p))
+            return -EBADMSG;
+        a->value = (int64_t)n;
+        if (d->filling)
+            a->list = &d->trace->lists[d->n_lists];
+        for (uint64_t i = 0; i < n; i++)
+        {
+            uint64_t v = getUint(d);
+            if (v > SIZE_MAX)
+                return -EBADMSG;
+            if (d->filling)
+                d->trace->lists[d->n_lists + i] = (size_t)v;
+        }
+        d->n_lists += (size_t)n;
+        break;
+    default:
+        a->value = (int64_t)getUint(d);
+        break;
+    }
+    return d->bad ? -EBADMSG : 0;
+}
+
+/** Decode the next record.  Returns 0, or a negative error code:
+    -EBADMSG if it is damaged.  */
+static int decodeRecord(sfs_trace_decoder_t *d)
+{
+    sfs_trace_record r;
+    r.op = (sfs_trace_op)*d->p++;
+    if (r.op >= SFS_TRACE_N_OPS)
+        return -EBADMSG;
+    uint64_t thread = getUint(d);
+    if (thread > d->n_threads)
+        return -EBADMSG;
+    if (thread == d->n_threads)
+    {
+        // Thread numbers only ever go up by one, so this is also the
+        // only check needed for them to fit in an int.
+        uint64_t *grown = realloc(d->last_start, (d->n_threads + 1) *
+                                                     sizeof *d->last_start);
+        if (grown == NULL)
+            return -ENOMEM;
+        d->last_start = grown;
+        d->last_start[d->n_threads++] = 0;
+    }
+    r.thread = (unsigned int)thread;
+    d->last_start[thread] += getUint(d);
+    r.start_ns = d->last_start[thread];
+    r.duration_ns = getUint(d);
+    r.result = getInt(d);
+    r.args = d->filling ? &d->trace->args[d->n_args] : NULL;
+
+    for (const char *kind = sfs_trace_op_args[r.op]; *kind; kind++)
+    {
+        sfs_trace_arg a = {0, 1, NULL, NULL};
+        int err = decodeArg(d, *kind, &a);
+        if (err < 0)
+            return err;
+        if (d->filling)
+            d->trace->args[d->n_args] = a;
+        d->n_args++;
+    }
+    if (d->bad)
+        return -EBADMSG;
+    if (d->filling)
+        d->trace->records[d->n_records] = r;
+    d->n_records++;
+    return 0;
+}
+
+/** Decode the records from P to END into TRACE, or, if TRACE->records
+    is NULL, only check them and count the records, arguments and
+    array entries into TRACE->n_records, *N_ARGS and *N_LISTS.
+    Returns 0, or a negative error code.  */
+static int decodeRecords(const unsigned char *p, const unsigned char *end,
+                         sfs_trace *trace, size_t *n_args, size_t *n_lists)
+{
+    sfs_trace_decoder_t d = {p, end, 0, trace->records != NULL, trace,
+                             NULL, 0, 0, 0, 0};
+    int err = 0;
+    while (err == 0 && d.p != d.end)
+        err = decodeRecord(&d);
+    free(d.last_start);
+    if (err == 0 && !d.filling)
+    {
+        trace->n_records = d.n_records;
+        *n_args = d.n_args;
+        *n_lists = d.n_lists;
+    }
+    trace->n_threads = d.n_threads;
+    return err;
+}
+
+int sfs_trace_load(sfs_trace *trace, const char *path)
+{
+    memset(trace, 0, sizeof *trace);
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return -errno;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0)
+    {
+        int err = -errno;
+        fclose(file);
+        return err;
+    }
+    size_t size = (size_t)st.st_size;
+    trace->data = malloc(size ? size : 1);
+    if (trace->data == NULL)
+    {
+        fclose(file);
+        return -ENOMEM;
+    }
+    size_t got = fread(trace->data, 1, size, file);
+    int read_error = ferror(file);
+    fclose(file);
+    if (read_error)
+    {
+        sfs_trace_free(trace);
+        return -EIO;
+    }
+
+    // The version is small enough to take one byte.
+    const unsigned char *p = trace->data + sizeof traceMagic + 1;
+    const unsigned char *end = trace->data + got;
+    if (got < sizeof traceMagic + 1 ||
+        memcmp(trace->data, traceMagic, sizeof traceMagic) != 0 ||
+        p[-1] != SFS_TRACE_VERSION)
+    {
+        sfs_trace_free(trace);
+        return -EBADMSG;
+    }
+
+    size_t n_args, n_lists;
+    int err = decodeRecords(p, end, trace, &n_args, &n_lists);
+    if (err == 0)
+    {
+        trace->records = calloc(trace->n_records + 1, sizeof *trace->records);
+        trace->args = calloc(n_args + 1, sizeof *trace->args);
+        trace->lists = calloc(n_lists + 1, sizeof *trace->lists);
+        if (!trace->records || !trace->args || !trace->lists)
+            err = -ENOMEM;
+    }
+    if (err == 0)
+        err = decodeRecords(p, end, trace, &n_args, &n_lists);
+    if (err != 0)
+        sfs_trace_free(trace);
+    return err;
+}
+
+void sfs_trace_free(sfs_trace *trace)
+{
+    free(trace->records);
+    free(trace->args);
+    free(trace->lists);
+    free(trace->data);
+    memset(trace, 0, sizeof *trace);
+}
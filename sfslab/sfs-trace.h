@@ -0,0 +1,192 @@
+/** This file defines the binary trace format in which sfs-tester
+    --record writes down every disk.* call a Lua trace makes, and which
+    sfs-replay plays back against sfs-api.h without going through Lua.
+
+    A trace file is the eight bytes "SFSTRACE", a format version, and
+    then one record per call, in the order the calls returned.  Every
+    number is written as a variable-length integer: seven bits per
+    byte, least significant first, with the top bit set on every byte
+    but the last.  Signed numbers are zigzag encoded first (0, -1, 1,
+    -2, ... become 0, 1, 2, 3, ...), so that small negative numbers
+    stay short.  A record is:
+
+      op          one byte, an sfs_trace_op
+      thread      which thread made the call, numbered from 0 in the
+                  order of their first records
+      start       when the call started, in nanoseconds since the
+                  thread's previous call started, or since the trace
+                  began for its first call
+      duration    how long the call took, in nanoseconds
+      result      signed; see sfs_trace_record
+      arguments   as listed for the op in sfs_trace_op_args
+
+    The data written by write, pwrite and writev is not recorded, only
+    its length, so that a trace stays small however much I/O it
+    describes.  */
+
+#ifndef SFS_TRACE_H_
+#define SFS_TRACE_H_ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** The format version written after the magic number.  */
+#define SFS_TRACE_VERSION 1
+
+/** The disk.* functions that are recorded, one per op.  disk.spans,
+    disk.batch, disk.stats and disk.fragstats are not; the first two
+    would need their own record formats, and the last two do nothing
+    worth replaying.  */
+typedef enum sfs_trace_op
+{
+    SFS_TRACE_FORMAT,
+    SFS_TRACE_MOUNT,
+    SFS_TRACE_UNMOUNT,
+    SFS_TRACE_OPEN,
+    SFS_TRACE_CLOSE,
+    SFS_TRACE_READ,
+    SFS_TRACE_WRITE,
+    SFS_TRACE_PREAD,
+    SFS_TRACE_PWRITE,
+    SFS_TRACE_READV,
+    SFS_TRACE_WRITEV,
+    SFS_TRACE_FSYNC,
+    SFS_TRACE_FTRUNCATE,
+    SFS_TRACE_FALLOCATE,
+    SFS_TRACE_FSTAT,
+    SFS_TRACE_SYNC,
+    SFS_TRACE_DEFRAG,
+    SFS_TRACE_SEEK,
+    SFS_TRACE_GETPOS,
+    SFS_TRACE_REMOVE,
+    SFS_TRACE_RENAME,
+    SFS_TRACE_CLONE,
+    SFS_TRACE_LIST,
+    SFS_TRACE_N_OPS
+} sfs_trace_op;
+
+/** The name of the disk.* function each op records.  */
+extern const char *const sfs_trace_op_names[SFS_TRACE_N_OPS];
+
+/** The arguments each op records, in the order the disk.* function
+    takes them, one character per argument:
+
+      f   a file descriptor, as it was numbered when recorded
+      u   an integer
+      o   an optional integer, which may be absent
+      s   a signed integer
+      b   a boolean, as 0 or 1
+      n   a string: a name, or an open mode
+      d   a string of data, of which only the length is recorded
+      l   an array of integers: its length, then each integer
+      v   an array of strings of data: its length, then the length of
+          each string
+
+    Strings are written as their length, their bytes, and a NUL.  An
+    optional integer is written as 0 if it is absent, or one more than
+    its value.  */
+extern const char *const sfs_trace_op_args[SFS_TRACE_N_OPS];
+
+/** The op that records the disk.* function called NAME, or -1 if it is
+    not recorded.  */
+int sfs_trace_op_by_name(const char *name);
+
+/** A buffer that arguments are encoded into, for sfs_trace_append.  It
+    starts out using the storage inside it, and moves to the heap only
+    for records that do not fit.  */
+typedef struct sfs_trace_buf
+{
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    int failed; /**< set if memory ran out; the record is then dropped */
+    unsigned char inline_data[256];
+} sfs_trace_buf;
+
+void sfs_trace_buf_init(sfs_trace_buf *buf);
+void sfs_trace_buf_free(sfs_trace_buf *buf);
+
+/** Encode an unsigned integer, a signed integer, or a string of LEN
+    bytes, into BUF.  */
+void sfs_trace_put_uint(sfs_trace_buf *buf, uint64_t value);
+void sfs_trace_put_int(sfs_trace_buf *buf, int64_t value);
+void sfs_trace_put_string(sfs_trace_buf *buf, const char *str, size_t len);
+
+/** An opaque trace being written.  */
+typedef struct sfs_trace_writer sfs_trace_writer;
+
+/** Create the trace file PATH, replacing any file of that name, and
+    store a writer for it in *WRITER_OUT.  START_NS, on the
+    CLOCK_MONOTONIC clock, is when the trace begins.  Returns 0 on
+    success, or a negative error code.  */
+int sfs_trace_create(sfs_trace_writer **writer_out, const char *path,
+                     uint64_t start_ns);
+
+/** Append a record of a call to OP, made by the calling thread, that
+    started at START_NS on the CLOCK_MONOTONIC clock, took DURATION_NS,
+    and had RESULT, with the arguments encoded in ARGS.  Records are
+    written whole even when several threads append at once.  Thread
+    numbers and start times are kept per thread, not per writer, so
+    there may be only one writer in a process.  */
+void sfs_trace_append(sfs_trace_writer *writer, sfs_trace_op op,
+                      uint64_t start_ns, uint64_t duration_ns,
+                      int64_t result, const sfs_trace_buf *args);
+
+/** Write out any records still buffered.  Returns 0 on success, or a
+    negative error code if anything appended so far could not be
+    written, or was dropped.  */
+int sfs_trace_flush(sfs_trace_writer *writer);
+
+/** Flush and close the trace, and free the writer.  Returns what
+    sfs_trace_flush would, or the error from closing the file.  */
+int sfs_trace_close(sfs_trace_writer *writer);
+
+/** One argument of a recorded call.  'value' is the integer, boolean,
+    or file descriptor; the length of a string; or the length of an
+    array.  */
+typedef struct sfs_trace_arg
+{
+    int64_t value;
+    int present;        /**< for 'o' */
+    const char *str;    /**< for 'n'; NUL-terminated */
+    const size_t *list; /**< for 'l' and 'v'; 'value' entries long */
+} sfs_trace_arg;
+
+/** One recorded call.  'result' is, for a call that failed, minus the
+    error code in its failure tuple; otherwise the integer it returned
+    (a file descriptor, a count of bytes written, a position, or a
+    count of files moved), or the total length of the string or array
+    of strings it returned (the data read, or the names listed), or 0
+    if it returned anything else.  'start_ns' is since the trace
+    began.  'args' has one entry for each character of the op's
+    sfs_trace_op_args.  */
+typedef struct sfs_trace_record
+{
+    sfs_trace_op op;
+    unsigned int thread;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    int64_t result;
+    sfs_trace_arg *args;
+} sfs_trace_record;
+
+/** A whole trace, read into memory.  */
+typedef struct sfs_trace
+{
+    sfs_trace_record *records;
+    size_t n_records;
+    unsigned int n_threads;
+    unsigned char *data; /**< the file, which the strings point into */
+    sfs_trace_arg *args; /**< storage for the records' arguments */
+    size_t *lists;       /**< storage for the arrays */
+} sfs_trace;
+
+/** Read the trace file PATH into *TRACE.  Returns 0 on success, or a
+    negative error code: -EBADMSG if the file is not a trace of this
+    version, or is damaged or cut short.  */
+int sfs_trace_load(sfs_trace *trace, const char *path);
+
+/** Free what sfs_trace_load allocated.  */
+void sfs_trace_free(sfs_trace *trace);
+
+#endif
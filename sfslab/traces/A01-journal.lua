@@ -0,0 +1,80 @@
+-- Make, change and remove files on an image whose journal is small
+-- enough to be checkpointed over and over, and check that all of it
+-- is still there after remounting, which replays whatever is left in
+-- the log.  What happens when a process dies part way through is
+-- tested by sfs-crashtest.
+
+local img = "A01-journal.img"
+assert(disk.format(img, 4 * 1024 * 1024, 512, 8192))
+
+local expected = {}
+
+local function put(name, data)
+    local fd = assert(disk.open(name))
+    assert(disk.write(fd, data) == #data)
+    disk.close(fd)
+    expected[name] = data
+end
+
+local function check()
+    local count = 0
+    for _, name in ipairs(assert(disk.list())) do
+        assert(expected[name], "unexpected file " .. name)
+        count = count + 1
+    end
+    for name, data in pairs(expected) do
+        local fd = assert(disk.open(name))
+        assert(assert(disk.read(fd, #data + 1)) == data, name)
+        disk.close(fd)
+        count = count - 1
+    end
+    assert(count == 0, "files are missing")
+end
+
+for i = 1, 200 do
+    put("file" .. i, string.rep(string.char(65 + i % 26), i * 37 % 3000))
+end
+for i = 1, 200, 3 do
+    assert(disk.remove("file" .. i))
+    expected["file" .. i] = nil
+end
+for i = 2, 200, 3 do
+    assert(disk.rename("file" .. i, "moved" .. i))
+    expected["moved" .. i] = expected["file" .. i]
+    expected["file" .. i] = nil
+end
+check()
+
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+
+-- The blocks that were freed must be usable again.
+for i = 1, 200, 3 do
+    put("again" .. i, string.rep("z", 2000))
+end
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+
+-- Two files appended to in turn have chains of many separate runs,
+-- more than fit in one small group of journal records.  Removing one
+-- must give all of its blocks back, the same as without a journal.
+local a = assert(disk.open("runs-a"))
+local b = assert(disk.open("runs-b"))
+for i = 1, 40 do
+    assert(disk.write(a, string.rep("a", 500)) == 500)
+    assert(disk.write(b, string.rep("b", 500)) == 500)
+end
+disk.close(a)
+disk.close(b)
+expected["runs-b"] = string.rep("b", 40 * 500)
+assert(disk.unmount())
+assert(disk.mount(img))
+local free = assert(disk.fragstats()).free_blocks
+assert(disk.remove("runs-a"))
+assert(disk.unmount())
+assert(disk.mount(img))
+assert(assert(disk.fragstats()).free_blocks == free + 40)
+check()
+assert(disk.unmount())
@@ -0,0 +1,47 @@
+-- Use an image with a change summary across several mounts.  Every
+-- change marks and flushes the summary before it is made, and a clean
+-- unmount clears it; none of that may get in the way of the files.
+-- 'sfs-fsck --incremental A02-change-summary.img' can be run on the
+-- image this leaves behind.
+
+local img = "A02-change-summary.img"
+assert(disk.format(img, 4 * 1024 * 1024, 512, 65536, true))
+
+local expected = {}
+
+local function put(name, data)
+    local fd = assert(disk.open(name))
+    assert(disk.write(fd, data) == #data)
+    disk.close(fd)
+    expected[name] = data
+end
+
+local function check()
+    for name, data in pairs(expected) do
+        local fd = assert(disk.open(name))
+        assert(assert(disk.read(fd, #data + 1)) == data, name)
+        disk.close(fd)
+    end
+end
+
+for i = 1, 50 do
+    put("first" .. i, string.rep("a", i * 97))
+end
+assert(disk.unmount())
+
+-- Touch a few files in a second mount, so that only part of the image
+-- is marked as changed.
+assert(disk.mount(img))
+check()
+for i = 1, 50, 10 do
+    assert(disk.remove("first" .. i))
+    expected["first" .. i] = nil
+    put("second" .. i, string.rep("b", 3000))
+end
+assert(disk.sync())
+check()
+assert(disk.unmount())
+
+assert(disk.mount(img))
+check()
+assert(disk.unmount())
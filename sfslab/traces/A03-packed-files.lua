@@ -0,0 +1,57 @@
+-- Keep small files in packed blocks: many of them share a block, one
+-- that grows past a cell moves into blocks of its own, and the cells
+-- of removed files are reused.
+
+local img = "A03-packed-files.img"
+assert(disk.format(img, 1024 * 1024, 512, 65536, nil, nil, true))
+
+local expected = {}
+
+-- Add DATA to the end of file NAME, creating it if need be.
+local function put(name, data)
+    local old = expected[name] or ""
+    local fd = assert(disk.open(name))
+    assert(disk.pwrite(fd, data, #old) == #data)
+    disk.close(fd)
+    expected[name] = old .. data
+end
+
+local function check()
+    for name, data in pairs(expected) do
+        local fd = assert(disk.open(name))
+        assert(assert(disk.read(fd, #data + 1)) == data, name)
+        disk.close(fd)
+    end
+end
+
+-- 400 files of up to 120 bytes would take 400 blocks without packing;
+-- packed four to a block they take 100.
+for i = 1, 400 do
+    put("small" .. i, string.rep(string.char(97 + i % 26), i % 121))
+end
+local fd = assert(disk.open("empty"))
+disk.close(fd)
+expected["empty"] = ""
+check()
+
+-- Grow some of the files out of their cells, a little at a time.
+for i = 1, 400, 7 do
+    put("small" .. i, string.rep("+", 100))
+    put("small" .. i, string.rep("-", 1000))
+end
+check()
+
+-- Free cells, and fill them again.
+for i = 2, 400, 3 do
+    assert(disk.remove("small" .. i))
+    expected["small" .. i] = nil
+end
+for i = 1, 200 do
+    put("again" .. i, "tiny " .. i)
+end
+check()
+
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+assert(disk.unmount())
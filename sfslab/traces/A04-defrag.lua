@@ -0,0 +1,60 @@
+-- Build files up a little at a time, interleaved, so that their blocks
+-- are scattered, then defragment the disk and check that every file
+-- ends up in one run of blocks with its contents intact.
+
+local img = "A04-defrag.img"
+assert(disk.format(img, 2 * 1024 * 1024, 512, 65536))
+
+local N = 8
+local fds, expected = {}, {}
+for i = 1, N do
+    fds[i] = assert(disk.open("file" .. i))
+    expected[i] = {}
+end
+for round = 1, 40 do
+    for i = 1, N do
+        local data = string.rep(string.char(64 + i), 300 + round)
+        assert(disk.write(fds[i], data) == #data)
+        expected[i][round] = data
+    end
+end
+for i = 1, N do
+    disk.close(fds[i])
+    expected[i] = table.concat(expected[i])
+end
+
+local function check()
+    for i = 1, N do
+        local fd = assert(disk.open("file" .. i))
+        assert(assert(disk.read(fd, #expected[i] + 1)) == expected[i])
+        disk.close(fd)
+    end
+end
+
+local frag = assert(disk.fragstats())
+assert(frag.files == N)
+assert(frag.fragmented_files == N, "files are not fragmented to start with")
+
+local moved, before, after = assert(disk.defrag())
+assert(moved >= N, moved)
+assert(before.fragmented_files == N)
+assert(after.fragmented_files == 0)
+assert(after.breaks == 0, after.breaks)
+assert(after.file_blocks == before.file_blocks)
+check()
+
+-- The first pass had to put the files after the blocks they were in;
+-- a second one moves them down into the room that left, and after
+-- that there is nothing to do.
+moved, before, after = assert(disk.defrag())
+assert(after.fragmented_files == 0)
+check()
+moved = assert(disk.defrag())
+assert(moved == 0, moved)
+
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+frag = assert(disk.fragstats())
+assert(frag.fragmented_files == 0)
+assert(disk.unmount())
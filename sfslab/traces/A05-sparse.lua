@@ -0,0 +1,72 @@
+-- Format a large image sparsely, so that only the blocks at its start
+-- are written, and fill part of it.  Blocks past the high-water mark
+-- are set up as they are first allocated, and the mark is found again
+-- when the image is mounted.  A sparse image may also pack small
+-- files.
+
+local img = "A05-sparse.img"
+
+assert(disk.format(img, 256 * 1024 * 1024, 4096, 65536, nil, nil, nil,
+                   true))
+
+local expected = {}
+
+local function put(name, data)
+    local fd = assert(disk.open(name))
+    assert(disk.write(fd, data) == #data)
+    disk.close(fd)
+    expected[name] = data
+end
+
+local function check()
+    for name, data in pairs(expected) do
+        local fd = assert(disk.open(name))
+        assert(assert(disk.fstat(fd)).size == #data, name)
+        assert(assert(disk.read(fd, #data + 1)) == data, name)
+        disk.close(fd)
+    end
+end
+
+for i = 1, 20 do
+    put("file" .. i, string.rep(string.char(96 + i), i * 5000))
+end
+check()
+assert(disk.unmount())
+
+-- Allocate past the mark again after it has been found by mounting.
+assert(disk.mount(img))
+check()
+put("big", string.rep("x", 8 * 1024 * 1024))
+for i = 1, 20, 2 do
+    assert(disk.remove("file" .. i))
+    expected["file" .. i] = nil
+end
+put("bigger", string.rep("y", 16 * 1024 * 1024))
+check()
+assert(disk.unmount())
+
+assert(disk.mount(img))
+check()
+assert(disk.unmount())
+
+-- Packed blocks are allocated past the mark like any others.
+assert(disk.format(img, 64 * 1024 * 1024, 512, 65536, nil, nil, true, true))
+expected = {}
+for i = 1, 300 do
+    put("small" .. i, string.rep(string.char(96 + i % 26), i % 121))
+end
+put("large", string.rep("z", 3 * 1024 * 1024))
+for i = 1, 300, 3 do
+    assert(disk.remove("small" .. i))
+    expected["small" .. i] = nil
+end
+check()
+assert(disk.unmount())
+
+assert(disk.mount(img))
+check()
+for i = 1, 300, 3 do
+    put("again" .. i, string.rep("q", i % 121))
+end
+check()
+assert(disk.unmount())
@@ -0,0 +1,94 @@
+-- Clone files, and change clones and originals independently.  A
+-- clone shares its original's blocks until one of them is written,
+-- truncated or given more room, and the blocks are freed only when
+-- the last file sharing them is removed.
+
+local img = "A06-clone.img"
+assert(disk.format(img, 4 * 1024 * 1024, 512, 65536))
+
+local expected = {}
+
+local function put(name, data, pos)
+    local fd = assert(disk.open(name))
+    assert(disk.pwrite(fd, data, pos or 0) == #data)
+    disk.close(fd)
+    local old = expected[name] or ""
+    pos = pos or 0
+    expected[name] = old:sub(1, pos) .. data .. old:sub(pos + #data + 1)
+end
+
+local function check()
+    for name, data in pairs(expected) do
+        local fd = assert(disk.open(name))
+        assert(assert(disk.read(fd, #data + 1)) == data, name)
+        disk.close(fd)
+    end
+end
+
+local function free_blocks()
+    return assert(disk.fragstats()).free_blocks
+end
+
+local data = {}
+for i = 1, 2000 do
+    data[i] = string.format("%07d\n", i)
+end
+put("orig", table.concat(data))
+
+-- A clone costs no blocks.
+local free = free_blocks()
+assert(disk.clone("orig", "copy"))
+expected["copy"] = expected["orig"]
+assert(free_blocks() == free)
+check()
+
+-- Writing to either file gives it blocks of its own.
+put("copy", "written to the copy", 5000)
+check()
+assert(free_blocks() < free)
+put("orig", "written to the original", 9000)
+check()
+
+-- So do truncating and reserving room.  Truncating only copies the
+-- blocks that are kept, two 500-byte blocks here.
+assert(disk.clone("orig", "short"))
+expected["short"] = expected["orig"]
+local allocated = assert(disk.stats()).blocks_allocated
+local fd = assert(disk.open("short"))
+assert(disk.ftruncate(fd, 1000))
+disk.close(fd)
+expected["short"] = expected["short"]:sub(1, 1000)
+assert(assert(disk.stats()).blocks_allocated == allocated + 2)
+assert(disk.clone("copy", "roomy"))
+expected["roomy"] = expected["copy"]
+fd = assert(disk.open("roomy"))
+assert(disk.fallocate(fd, 40000))
+disk.close(fd)
+check()
+
+-- Removing a file leaves its clones alone.
+assert(disk.clone("copy", "copy2"))
+expected["copy2"] = expected["copy"]
+assert(disk.remove("copy"))
+expected["copy"] = nil
+check()
+
+-- Cloning onto an existing name, or from one that does not exist,
+-- fails.
+assert(not disk.clone("orig", "copy2"))
+assert(not disk.clone("nosuch", "other"))
+
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+
+-- Once every sharer is gone, the blocks are free again.
+for name in pairs(expected) do
+    assert(disk.remove(name))
+end
+expected = {}
+put("tiny", "x")
+local empty = free_blocks()
+assert(disk.remove("tiny"))
+assert(free_blocks() == empty + 1)
+assert(disk.unmount())
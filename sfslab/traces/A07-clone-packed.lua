@@ -0,0 +1,31 @@
+-- Clone more small files than one packed block holds, so that some of
+-- the clones need a packed block that is made for them.
+
+local img = "A07-clone-packed.img"
+assert(disk.format(img, 1024 * 1024, 512, nil, nil, nil, true))
+
+local N = 40
+local function contents(i)
+    return string.rep(string.char(string.byte("A") + i % 26), 100)
+end
+
+for i = 1, N do
+    local fd = assert(disk.open("small" .. i))
+    assert(disk.write(fd, contents(i)) == 100)
+    disk.close(fd)
+    assert(disk.clone("small" .. i, "clone" .. i))
+end
+
+local function check()
+    for i = 1, N do
+        local fd = assert(disk.open("clone" .. i))
+        assert(assert(disk.read(fd, 101)) == contents(i))
+        disk.close(fd)
+    end
+end
+
+check()
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+assert(disk.unmount())
@@ -0,0 +1,73 @@
+-- Use an image with block checksums: writes of whole blocks, of parts
+-- of blocks and across blocks all keep the checksums right, and a byte
+-- changed behind the file system's back is caught when it is read.
+
+local img = "A08-checksums.img"
+assert(disk.format(img, 4 * 1024 * 1024, 512, 65536, nil, nil, nil, nil,
+                   true))
+
+local expected = {}
+
+local function put(name, data, pos)
+    local fd = assert(disk.open(name))
+    assert(disk.pwrite(fd, data, pos or 0) == #data)
+    disk.close(fd)
+    local old = expected[name] or ""
+    pos = pos or 0
+    expected[name] = old:sub(1, pos) .. data .. old:sub(pos + #data + 1)
+end
+
+local function check()
+    for name, data in pairs(expected) do
+        local fd = assert(disk.open(name))
+        assert(assert(disk.read(fd, #data + 1)) == data, name)
+        for pos = 0, #data - 1, 777 do
+            assert(assert(disk.pread(fd, 300, pos)) ==
+                   data:sub(pos + 1, pos + 300), name)
+        end
+        disk.close(fd)
+    end
+end
+
+local data = {}
+for i = 1, 3000 do
+    data[i] = string.format("%09d\n", i * 7919)
+end
+put("file", table.concat(data))
+put("file", string.rep("#", 500), 1500)
+put("file", "x", 777)
+put("file", string.rep("-", 1200), 2900)
+put("file", "at the end", #expected["file"])
+put("other", string.rep("o", 100000))
+assert(disk.clone("file", "copy"))
+expected["copy"] = expected["file"]
+put("copy", "copied on write", 10000)
+assert(disk.defrag())
+check()
+assert(assert(disk.stats()).checksum_failures == 0)
+assert(disk.unmount())
+
+-- Damage one byte of the data of "other", which no other file holds.
+local marker = "the damaged block"
+assert(disk.mount(img))
+put("other", marker, 50000)
+assert(disk.unmount())
+local f = assert(io.open(img, "r+b"))
+local image = f:read("a")
+local at = assert(image:find(marker, 1, true), "data not found")
+assert(not image:find(marker, at + 1, true))
+f:seek("set", at - 1)
+f:write("T")
+f:close()
+
+assert(disk.mount(img))
+local fd = assert(disk.open("other"))
+assert(assert(disk.pread(fd, 1000, 0)) == expected["other"]:sub(1, 1000))
+local got, msg, err = disk.pread(fd, 100, 49990)
+assert(got == nil and err == 5, "damage not detected")
+disk.close(fd)
+local failures = assert(disk.stats()).checksum_failures
+assert(failures > 0)
+expected["other"] = nil
+check()
+assert(disk.unmount())
@@ -0,0 +1,107 @@
+-- Keep files compressed: a file opened with "z" is compressed at its
+-- last close if that saves room, is read back a frame at a time, goes
+-- back into ordinary blocks when it is written, and is compressed
+-- again at its next last close.
+
+local img = "A09-compression.img"
+assert(disk.format(img, 4 * 1024 * 1024, 512, 65536))
+
+local expected = {}
+
+local function put(name, data, mode)
+    local fd = assert(disk.open(name, mode))
+    assert(disk.write(fd, data) == #data)
+    disk.close(fd)
+    expected[name] = data
+end
+
+local function blocks(name)
+    local fd = assert(disk.open(name))
+    local st = assert(disk.fstat(fd))
+    disk.close(fd)
+    assert(st.size == #expected[name], name)
+    return st.blocks
+end
+
+local function check()
+    for name, data in pairs(expected) do
+        local fd = assert(disk.open(name))
+        assert(assert(disk.read(fd, #data + 1)) == data, name)
+        for pos = 0, #data - 1, 5000 do
+            assert(assert(disk.pread(fd, 700, pos)) ==
+                   data:sub(pos + 1, pos + 700), name)
+        end
+        disk.close(fd)
+    end
+end
+
+local lines = {}
+for i = 1, 20000 do
+    lines[i] = "line " .. i % 100 .. " of the log\n"
+end
+local text = table.concat(lines)
+local plain = (#text + 499) // 500
+
+put("log", text, "z")
+assert(blocks("log") < plain // 4, "the file was not compressed")
+
+-- Data that does not compress is left as it is.
+local noise = {}
+local x = 12345
+for i = 1, 20000 do
+    x = (x * 1103515245 + 12345) % 2147483648
+    noise[i] = string.char(x // 65536 % 256)
+end
+put("noise", table.concat(noise), "z")
+assert(blocks("noise") == (20000 + 499) // 500)
+
+local before = assert(disk.stats()).frames_decoded
+check()
+assert(assert(disk.stats()).frames_decoded > before)
+
+-- A write moves the file back into ordinary blocks, and its last close
+-- compresses it again, with the change.
+local fd = assert(disk.open("log"))
+assert(disk.pwrite(fd, "CHANGED", 123456) == 7)
+assert(assert(disk.fstat(fd)).blocks == plain)
+disk.close(fd)
+expected["log"] = text:sub(1, 123456) .. "CHANGED" .. text:sub(123464)
+assert(blocks("log") < plain // 4)
+check()
+
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+
+-- The stream is put together in a free run as long as the file less a
+-- block, and the blocks it does not need are freed again.
+local function free_blocks()
+    return assert(disk.fragstats()).free_blocks
+end
+local free = free_blocks()
+put("copy", text, "z")
+assert(free_blocks() == free - blocks("copy"))
+check()
+assert(disk.unmount())
+
+-- With no free run that long, the longest one is used instead.
+assert(disk.format(img, 1024 * 1024, 512, 65536))
+expected = {}
+local hole = string.rep("h", 40 * 500)
+local n = 0
+while free_blocks() >= 40 do
+    n = n + 1
+    put("hole" .. n, hole)
+end
+for i = 1, n, 2 do
+    assert(disk.remove("hole" .. i))
+    expected["hole" .. i] = nil
+end
+local short = text:sub(1, 100 * 500)
+put("short", short, "z")
+assert(blocks("short") < 40, "the file was not compressed")
+check()
+assert(disk.unmount())
+assert(disk.mount(img))
+check()
+assert(disk.unmount())
@@ -0,0 +1,41 @@
+-- Seek around in a file that is compressed on the disk, and read and
+-- write at the new positions.  A compressed file holds fewer blocks
+-- than its length needs, so seeking must not look for the block a
+-- position would be in.
+
+local img = "A10-seek-compressed.img"
+assert(disk.format(img, 1024 * 1024))
+
+local data = {}
+for i = 0, 9999 do
+    data[#data + 1] = string.char(string.byte("a") + (i // 37) % 5)
+end
+data = table.concat(data)
+
+local fd = assert(disk.open("file", "z"))
+assert(disk.write(fd, data) == #data)
+disk.close(fd)
+
+fd = assert(disk.open("file"))
+local st = assert(disk.fstat(fd))
+assert(st.blocks < #data // 500, "file was not compressed")
+
+assert(disk.seek(fd, 5000) == 5000)
+assert(assert(disk.read(fd, 3000)) == data:sub(5001, 8000))
+assert(disk.seek(fd, -7000) == 1000)
+assert(assert(disk.read(fd, 100)) == data:sub(1001, 1100))
+assert(disk.seek(fd, 20000) == #data)
+assert(assert(disk.read(fd, 10)) == "")
+
+-- Writing moves the file into ordinary blocks; seeking still works.
+assert(disk.seek(fd, -3000) == 7000)
+assert(disk.write(fd, "XYZ") == 3)
+data = data:sub(1, 7000) .. "XYZ" .. data:sub(7004)
+assert(disk.seek(fd, -5003) == 2000)
+assert(assert(disk.read(fd, 6000)) == data:sub(2001, 8000))
+disk.close(fd)
+
+fd = assert(disk.open("file"))
+assert(assert(disk.read(fd, #data + 1)) == data)
+disk.close(fd)
+assert(disk.unmount())